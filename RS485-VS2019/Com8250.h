@@ -63,11 +63,13 @@
 #define TX_REGISTER_8250        0       // 8250 Transmit Buffer Register
 #define IER_8250                1       // 8250 Interrupt Enable Register
 #define IIR_8250                2       // 8250 Interrupt Id Register
+#define FCR_8250                2       // 16550 FIFO Control Register (write only)
 #define LCR_8250                3       // 8250 Line Control Register
 #define MCR_8250                4       // 8250 Modem Control Register
 #define LSR_8250                5       // 8250 Line Status Register
 #define MSR_8250                6       // 8250 Modem Status Register
-#define DIVISOR_REGISTER_8250   0       // 8250 16-bit Baud Rate Divisor
+#define DIVISOR_REGISTER_8250   0       // 8250 16-bit Baud Rate Divisor (DLL, low byte)
+#define DIVISOR_HIGH_8250       1       // 8250 Baud Rate Divisor high byte (DLM)
 
 
 //***************************************************************************
@@ -113,9 +115,10 @@
 // Interrupt ID Register -- IIR defines
 //
 
-#define IIR_INTERRUPT_MASK              0x07    // Masks off 3 interrupt pending
+#define IIR_INTERRUPT_MASK              0x0F    // Masks off 4 interrupt pending
                                                 // bits when And'd with the
-                                                // IIR
+                                                // IIR (bit 3 is only ever set
+                                                // by a 16550 in FIFO mode)
 
 #define IIR_NO_INTERRUPT_PENDING        0x01    // This defines the Interrupt
                                                 // Identification register
@@ -134,6 +137,57 @@
 #define IIR_RX_ERROR_IRQ_PENDING        0x06    // Interrupt pending pattern for
                                                 // Receiver Line Status
 
+#define IIR_RX_TIMEOUT_IRQ_PENDING      0x0C    // Interrupt pending pattern for
+                                                // 16550 Character Timeout
+                                                // (data below the trigger level
+                                                // has sat in the RX FIFO for 4
+                                                // character times)
+
+#define IIR_FIFO_MASK                   0xC0    // Masks off the 2 FIFO status
+                                                // bits when And'd with the
+                                                // IIR
+
+#define IIR_FIFO_ENABLED                0xC0    // FIFO status pattern for a
+                                                // working 16550A FIFO. A
+                                                // buggy 16550 reports 0x80,
+                                                // an 8250/16450 reports 0x00
+
+#define IIR_64_BYTE_FIFO                0x20    // Set by a 16750 when its
+                                                // 64 byte FIFO is enabled
+
+
+//***************************************************************************
+//
+// FIFO Control Register -- FCR defines (16550 and later only)
+//
+
+#define FCR_DISABLE_FIFO                0x00    // Disables the FIFOs (8250
+                                                // compatible mode)
+
+#define FCR_ENABLE_FIFO                 0x01    // Enables the RX and TX FIFOs
+
+#define FCR_CLEAR_RX_FIFO               0x02    // Clears the RX FIFO, self
+                                                // clearing
+
+#define FCR_CLEAR_TX_FIFO               0x04    // Clears the TX FIFO, self
+                                                // clearing
+
+#define FCR_ENABLE_64_BYTE_FIFO         0x20    // Enables the 16750 64 byte
+                                                // FIFOs, only writable with
+                                                // the divisor latch enabled
+
+#define FCR_RX_TRIGGER_1                0x00    // RX interrupt at 1 byte
+
+#define FCR_RX_TRIGGER_4                0x40    // RX interrupt at 4 bytes
+
+#define FCR_RX_TRIGGER_8                0x80    // RX interrupt at 8 bytes
+
+#define FCR_RX_TRIGGER_14               0xC0    // RX interrupt at 14 bytes
+
+#define FIFO_DEPTH_16550                16      // 16550A RX and TX FIFO size
+
+#define FIFO_DEPTH_16750                64      // 16750 RX and TX FIFO size
+
 
 //***************************************************************************
 //
@@ -246,6 +300,9 @@
 
 #define LSR_RX_BREAK_DETECTED 0x10          // This bit signals a break char
 
+#define LSR_RX_ERROR_MASK 0x1E              // Masks off the 4 receive error
+                                            // bits when And'd with the LSR
+
 #define LSR_TX_BUFFER_EMPTY 0x20            // This bit signals the transmit
                                             // buffer is empty
 
@@ -277,7 +334,7 @@
 
 
 //
-// Communication system BAUD rate defines.
+// Communication system BAUD rate defines (1.8432 MHz clock).
 //
 
 #define BAUD_RATE_DIVISOR_1200      0x60    // 1200 baud
@@ -296,6 +353,13 @@
 
 #define BAUD_RATE_DIVISOR_115200    0x01    // 152000 baud
 
+//
+// The divisor latch divides the UART clock by 16 * divisor
+//
+#define UART_CLOCK_1_8432_MHZ       1843200
+#define UART_CLOCK_DIVIDE           16
+#define UART_DIVISOR_MAX            0xFFFF
+
 //
 // Communication port type definition
 //
@@ -305,11 +369,13 @@ typedef struct _COMPORT {
     PUCHAR TBR;     // Transmitter Buffer reg.
     PUCHAR IER;     // Interrupt Enable reg.
     PUCHAR IIR;     // Interrupt ID reg.
+    PUCHAR FCR;     // FIFO Control reg. (write only, shares IIR address)
     PUCHAR LCR;     // Line Control register.
     PUCHAR MCR;     // Modem Control register.
     PUCHAR LSR;     // Line Status register.
     PUCHAR MSR;     // Modem Status register.
     PUCHAR BAUD;    // Baud Rate Divisor.
+    PUCHAR BAUDHI;  // Baud Rate Divisor, high byte.
 } COMPORT, *PCOM_PORT;
 
 #endif // _COMINC
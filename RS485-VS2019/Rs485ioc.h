@@ -70,4 +70,297 @@
 #define IOCTL_RS485NT_HELLO CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_RS485NT_GET_RCV_COUNT CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+1, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_RS485NT_LAST_RCVD_TIME CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+2, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_GET_RCV_STATUS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+3, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_SET_TIMEOUTS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+4, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_GET_TIMEOUTS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+5, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_GET_FRAME_STATUS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+6, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_TRANSACT CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+7, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_SET_LINE_SETTINGS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+8, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_GET_LINE_SETTINGS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+9, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_MAP_RINGS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+10, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_UNMAP_RINGS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+11, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_RING_DOORBELL CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+12, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_GET_STATS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+13, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_GET_LATENCY CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+14, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_READ_TIMESTAMPED CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+15, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_SELF_TEST CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+16, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_SET_PROCESSORS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+17, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_GET_PROCESSORS CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+18, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RS485NT_GET_LOAD_SELF_TEST CTL_CODE(FILE_DEVICE_RS485DRV, RS485DRV_IOCTL_INDEX+19, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+//
+// IOCTL_RS485NT_GET_RCV_STATUS output buffer
+//
+typedef struct _RS485NT_RCV_STATUS {
+    ULONG   RcvCount;       // Bytes waiting in the receive buffer
+    ULONG   RcvOverflow;    // Bytes dropped because the receive buffer was full
+    ULONG   RcvError;       // Overrun, parity, framing and break errors
+} RS485NT_RCV_STATUS, *PRS485NT_RCV_STATUS;
+
+//
+// IOCTL_RS485NT_GET_FRAME_STATUS output buffer (Frame Mode only)
+//
+typedef struct _RS485NT_FRAME_STATUS {
+    ULONG   FrameCount;     // Frames delimited by a t3.5 silence
+    ULONG   GapErrors;      // t1.5 intra-frame gaps (frame may be corrupt)
+    ULONG   FrameOverflow;  // Frame ends lost with the frame queue full
+} RS485NT_FRAME_STATUS, *PRS485NT_FRAME_STATUS;
+
+//
+// IOCTL_RS485NT_SET_TIMEOUTS input / IOCTL_RS485NT_GET_TIMEOUTS output buffer.
+// Read timeouts in milliseconds, same rules as the Win32 COMMTIMEOUTS:
+//
+//  ReadIntervalTimeout = MAXULONG, both totals 0
+//      ReadFile returns immediately with whatever has been received (default)
+//  ReadIntervalTimeout = MAXULONG, ReadTotalTimeoutMultiplier = MAXULONG,
+//  0 < ReadTotalTimeoutConstant < MAXULONG
+//      ReadFile returns as soon as any data is received, or after
+//      ReadTotalTimeoutConstant with nothing
+//  Otherwise ReadFile returns when the requested length is received, when
+//  ReadIntervalTimeout passes between two characters (0 = not used), or
+//  when ReadTotalTimeoutMultiplier * length + ReadTotalTimeoutConstant
+//  passes (0 = not used). All zero waits for the full length.
+//
+typedef struct _RS485NT_TIMEOUTS {
+    ULONG   ReadIntervalTimeout;
+    ULONG   ReadTotalTimeoutMultiplier;
+    ULONG   ReadTotalTimeoutConstant;
+} RS485NT_TIMEOUTS, *PRS485NT_TIMEOUTS;
+
+
+//
+// IOCTL_RS485NT_TRANSACT input buffer. Transmits Request, then returns the
+// response in the output buffer (up to the output buffer length) as if
+// read with ResponseTimeouts. Receive starts exactly when RTS is released
+// and the bus is held (no other writes) until the response is complete.
+//
+typedef struct _RS485NT_TRANSACT {
+    RS485NT_TIMEOUTS ResponseTimeouts;
+    ULONG   RequestLength;          // Bytes in Request
+    UCHAR   Request[1];             // Request frame, RequestLength bytes
+} RS485NT_TRANSACT, *PRS485NT_TRANSACT;
+
+//
+// RS485NT_LINE_SETTINGS Parity values
+//
+#define RS485NT_PARITY_NONE     0
+#define RS485NT_PARITY_ODD      1
+#define RS485NT_PARITY_EVEN     2
+#define RS485NT_PARITY_MARK     3
+#define RS485NT_PARITY_SPACE    4
+
+//
+// IOCTL_RS485NT_SET_LINE_SETTINGS input / IOCTL_RS485NT_GET_LINE_SETTINGS
+// output buffer. SET waits for queued writes to finish, then changes the
+// line in place. Data received with the old settings is discarded.
+// SET also returns the new settings if the output buffer is big enough.
+//
+typedef struct _RS485NT_LINE_SETTINGS {
+    ULONG   BaudRate;
+    ULONG   DataBits;       // 5 - 8
+    ULONG   Parity;         // RS485NT_PARITY_xxx
+    ULONG   StopBits;       // 1 or 2
+    ULONG   BufferSize;     // Receive buffer size / write limit, SET: 0 = unchanged, 16 - 1MB
+    ULONG   ActualBaudRate; // Out: the rate the UART clock really gives
+    LONG    BaudError;      // Out: ActualBaudRate error in ppm
+} RS485NT_LINE_SETTINGS, *PRS485NT_LINE_SETTINGS;
+
+//
+// IOCTL_RS485NT_MAP_RINGS input. Ring sizes are rounded up to a power of
+// two, 0 = the "Buffer Size" registry value.
+//
+typedef struct _RS485NT_MAP_RINGS {
+    ULONG   RxSize;
+    ULONG   TxSize;
+} RS485NT_MAP_RINGS, *PRS485NT_MAP_RINGS;
+
+//
+// IOCTL_RS485NT_MAP_RINGS output
+//
+typedef struct _RS485NT_RING_MAPPING {
+    ULONGLONG Address;      // RS485NT_RING_HEADER in the caller's address space
+    ULONG   Length;         // Header plus both rings
+} RS485NT_RING_MAPPING, *PRS485NT_RING_MAPPING;
+
+//
+// Start of the memory mapped by IOCTL_RS485NT_MAP_RINGS. The RX and TX
+// data follow at RxOffset / TxOffset. Indexes are free running, a ring
+// holds Head - Tail bytes, the byte for index i is at i & (Size - 1).
+//
+// RX: the ISR stores received bytes and then moves RxHead. The caller
+// reads up to RxHead and then moves RxTail. Our own transmitted bytes
+// (the RS-485 echo) are not stored.
+//
+// TX: the caller stores bytes and then moves TxHead. The driver sends
+// everything up to TxHead with RTS asserted and moves TxTail as the bytes
+// go into the UART. After moving TxHead (and a full memory barrier) the
+// caller checks TxIdle and only then calls IOCTL_RS485NT_RING_DOORBELL.
+//
+// ReadFile, WriteFile and the other queued requests fail with
+// STATUS_DEVICE_BUSY while the rings are mapped. Closing the handle
+// unmaps them.
+//
+typedef struct _RS485NT_RING_HEADER {
+    volatile ULONG RxHead;      // Driver
+    volatile ULONG RxTail;      // Caller
+    ULONG   RxSize;
+    ULONG   RxOffset;
+    volatile ULONG TxHead;      // Caller
+    volatile ULONG TxTail;      // Driver
+    ULONG   TxSize;
+    ULONG   TxOffset;
+    volatile ULONG TxIdle;      // Driver: nothing being sent, ring the doorbell
+    volatile ULONG RxOverflow;  // Driver: bytes lost with the RX ring full
+} RS485NT_RING_HEADER, *PRS485NT_RING_HEADER;
+
+//
+// IOCTL_RS485NT_GET_STATS optional input (ULONG flags)
+//
+#define RS485NT_STATS_RESET     0x00000001  // Zero the counters after reading them
+
+//
+// IOCTL_RS485NT_GET_STATS output buffer. Counts since the driver loaded
+// or the last RS485NT_STATS_RESET.
+//
+typedef struct _RS485NT_STATS {
+    ULONGLONG   RxBytes;            // Read from the UART, including dropped bytes
+    ULONGLONG   TxBytes;            // Loaded into the UART
+    ULONGLONG   RxFrames;           // Frame Mode frames
+    ULONGLONG   TxFrames;           // Transmissions (RTS asserted to released)
+    ULONGLONG   Interrupts;         // ISR calls that found our UART interrupting
+    ULONGLONG   RxErrorInterrupts;  // Interrupts by IIR cause
+    ULONGLONG   RxDataInterrupts;
+    ULONGLONG   RxTimeoutInterrupts;
+    ULONGLONG   TxEmptyInterrupts;
+    ULONGLONG   ModemStatusInterrupts;
+    ULONGLONG   OverrunErrors;      // LSR receive errors
+    ULONGLONG   ParityErrors;
+    ULONGLONG   FramingErrors;
+    ULONGLONG   BreakErrors;
+    ULONGLONG   RingFullDrops;      // Bytes lost with the receive ring full
+    ULONGLONG   RxHighWater;        // Most bytes ever waiting in the receive ring
+    ULONGLONG   WriteIrps;
+    ULONGLONG   ReadIrps;
+    ULONGLONG   TransactIrps;
+    ULONGLONG   EchoBytes;          // "Echo Mode": own bytes read back and dropped
+    ULONGLONG   EchoMismatches;     // Bytes read while sending that weren't ours (verify)
+    ULONGLONG   EchoMissing;        // Bytes sent that never came back (verify)
+    ULONGLONG   Collisions;         // Transmissions with a mismatch or receive error (verify)
+    ULONGLONG   BusDeferrals;       // "Bus Idle Chars": transmissions that waited for the bus
+    ULONGLONG   BackoffRetries;     // Transmissions sent again after a collision
+    ULONGLONG   ExcessiveCollisions; // Writes failed after RS485_BACKOFF_LIMIT attempts
+    ULONGLONG   BusTimeouts;        // Writes failed waiting RS485_BUS_WAIT_LIMIT for the bus
+    ULONGLONG   PollEntries;        // "Rx Poll Mode": switches from interrupts to polling
+    ULONGLONG   Polls;
+    ULONGLONG   PolledBytes;        // Read by a poll rather than an interrupt
+    ULONGLONG   InterruptsSaved;    // Receive interrupts the polled bytes would have taken
+    ULONGLONG   PollDelayTotal;     // Estimated extra wait of the oldest polled byte, us
+    ULONGLONG   PollDelayMax;
+    ULONGLONG   DpcRuns;            // DPC calls, each handles all events queued since the last
+} RS485NT_STATS, *PRS485NT_STATS;
+
+//
+// IOCTL_RS485NT_GET_LATENCY optional input (ULONG flags)
+//
+#define RS485NT_LATENCY_RESET   0x00000001  // Zero the histograms after reading them
+
+//
+// Latency histogram in microseconds. Bucket[0] counts 0 - 1us, Bucket[n]
+// counts 2^n - 2^(n+1)-1 us, the last bucket everything longer.
+//
+#define RS485NT_LATENCY_BUCKETS 32
+
+typedef struct _RS485NT_HISTOGRAM {
+    ULONG       Bucket[RS485NT_LATENCY_BUCKETS];
+    ULONGLONG   Count;
+    ULONGLONG   TotalMicroseconds;  // Sum, for the mean
+    ULONGLONG   MaxMicroseconds;
+} RS485NT_HISTOGRAM, *PRS485NT_HISTOGRAM;
+
+//
+// IOCTL_RS485NT_GET_LATENCY output buffer
+//
+typedef struct _RS485NT_LATENCY {
+    RS485NT_HISTOGRAM IsrToDpc;     // ISR entry to the DPC it queued running
+    RS485NT_HISTOGRAM WriteToWire;  // WriteFile arriving to its first byte going out
+    RS485NT_HISTOGRAM WriteService; // WriteFile arriving to its completion (RTS released)
+} RS485NT_LATENCY, *PRS485NT_LATENCY;
+
+//
+// IOCTL_RS485NT_READ_TIMESTAMPED output buffer ("Timestamp Mode" only).
+// Returns the bytes waiting in the receive buffer (as many as fit, 5 bytes
+// each) without waiting. Delta[i] is the time in performance counter
+// ticks from byte i-1 to byte i, Delta[0] is 0. The Count data bytes
+// follow Delta[Count - 1], see RS485NT_TIMESTAMPED_DATA.
+//
+typedef struct _RS485NT_TIMESTAMPED_READ {
+    ULONG       Count;          // Bytes returned
+    ULONG       Reserved;
+    LONGLONG    FirstTime;      // KeQueryPerformanceCounter when byte 0 was received
+    LONGLONG    Frequency;      // Performance counter ticks per second
+    ULONG       Delta[1];
+} RS485NT_TIMESTAMPED_READ, *PRS485NT_TIMESTAMPED_READ;
+
+#define RS485NT_TIMESTAMPED_DATA(Read)  ((PUCHAR)&(Read)->Delta[(Read)->Count])
+
+//
+// IOCTL_RS485NT_SELF_TEST optional input buffer. The test waits its turn
+// behind queued writes, then sends ByteCount bytes through the UART in
+// internal loopback at the current line settings. Nothing goes out on
+// the bus and nothing is received from it meanwhile.
+//
+#define RS485NT_SELF_TEST_DEFAULT_BYTES 256
+#define RS485NT_SELF_TEST_MAX_BYTES     65536
+
+typedef struct _RS485NT_SELF_TEST {
+    ULONG   ByteCount;          // 0 = RS485NT_SELF_TEST_DEFAULT_BYTES
+} RS485NT_SELF_TEST, *PRS485NT_SELF_TEST;
+
+//
+// IOCTL_RS485NT_SELF_TEST and IOCTL_RS485NT_GET_LOAD_SELF_TEST (the
+// "Self Test" run when the port was created) output buffer. Times are in microseconds,
+// latency is from a byte's write to the THR to its read from the RBR.
+// Full line rate with nothing lost or corrupt means the PC and the UART
+// keep up, so a problem on the line is in the bus wiring.
+//
+typedef struct _RS485NT_SELF_TEST_RESULT {
+    ULONG   BytesSent;
+    ULONG   BytesReceived;
+    ULONG   BytesLost;          // Sent, never came back
+    ULONG   BytesCorrupt;       // Came back wrong or with a parity/framing/break error
+    ULONG   OverrunErrors;      // Receiver overruns seen
+    ULONG   ElapsedTime;        // First byte sent to last byte received
+    ULONG   BytesPerSecond;     // Achieved
+    ULONG   LineBytesPerSecond; // What the line settings allow
+    ULONG   LatencyMin;
+    ULONG   LatencyAverage;
+    ULONG   LatencyMax;
+} RS485NT_SELF_TEST_RESULT, *PRS485NT_SELF_TEST_RESULT;
+
+//
+// RS485NT_PROCESSORS DpcProcessor and DpcImportance values. The
+// importances are the kernel's KDPC_IMPORTANCE.
+//
+#define RS485NT_MAX_PROCESSORS          64  // Bits in a KAFFINITY on x64
+#define RS485NT_DPC_ANY_PROCESSOR       0xFFFFFFFF  // Where the ISR ran
+
+#define RS485NT_DPC_IMPORTANCE_LOW          0
+#define RS485NT_DPC_IMPORTANCE_MEDIUM       1
+#define RS485NT_DPC_IMPORTANCE_HIGH         2
+#define RS485NT_DPC_IMPORTANCE_MEDIUM_HIGH  3
+
+//
+// IOCTL_RS485NT_SET_PROCESSORS input / IOCTL_RS485NT_GET_PROCESSORS
+// output buffer. SET moves the DPC right away and also returns the new
+// settings if the output buffer is big enough. The interrupt affinity
+// is only set by the "Interrupt Affinity" registry value at load, and
+// is shared by all ports on the IRQ line.
+//
+typedef struct _RS485NT_PROCESSORS {
+    ULONGLONG   InterruptAffinity;  // Out: processors the ISR runs on
+    ULONG       DpcProcessor;       // Processor number or RS485NT_DPC_ANY_PROCESSOR
+    ULONG       DpcImportance;      // RS485NT_DPC_IMPORTANCE_xxx
+    ULONG       ActiveProcessors;   // Out: processors in the system
+    ULONG       Reserved;
+    ULONGLONG   DpcRuns[RS485NT_MAX_PROCESSORS]; // Out: DPC runs by processor, reset with the stats
+} RS485NT_PROCESSORS, *PRS485NT_PROCESSORS;
@@ -54,11 +54,42 @@
 // CreateFile () - Establishes an open channel to this driver
 // WriteFile ()  - Transmits a buffer of Data via RS485 by asserting
 //                 RTS during trasnmit and deasserting RTS upon
-//                 transmitt complete of the final character
+//                 transmitt complete of the final character. Writes
+//                 are queued and complete asynchronously (overlapped
+//                 I/O and completion ports work). The UART is fed
+//                 straight from the write's buffer, with "Direct IO" set
+//                 that is the caller's own (locked) pages.
 //
 //                 *CAUTION* WriteFile discards unread receive buffer contents!
 //
-// ReadFile ()   - Returns the current received character buffer
+// ReadFile ()   - Returns up to the requested number of received
+//                 characters. Unread characters stay buffered. By default
+//                 a read returns immediately, IOCTL_RS485NT_SET_TIMEOUTS
+//                 makes reads wait for data (COMMTIMEOUTS rules). In Modbus
+//                 RTU frame mode each read returns one whole frame.
+//                 With "Timestamp Mode" set, IOCTL_RS485NT_READ_TIMESTAMPED
+//                 returns the bytes with their performance counter times.
+//
+// DeviceIoControl (IOCTL_RS485NT_TRANSACT)
+//               - Writes a request and returns the response in one call.
+//                 Receive starts at RTS release and the bus is held until
+//                 the response is complete.
+//
+// DeviceIoControl (IOCTL_RS485NT_SET_LINE_SETTINGS)
+//               - Changes baud rate, data format and buffer size without
+//                 reloading the driver. Waits for queued writes first and
+//                 discards unread receive data.
+//
+// DeviceIoControl (IOCTL_RS485NT_MAP_RINGS)
+//               - Maps a receive and a transmit ring into the caller, the
+//                 ISR fills the receive ring and data is polled with plain
+//                 memory loads. IOCTL_RS485NT_RING_DOORBELL starts the
+//                 transmitter when it is idle.
+//
+// DeviceIoControl (IOCTL_RS485NT_SELF_TEST)
+//               - Sends a pattern through the UART in internal loopback at
+//                 the configured rate and reports throughput, lost bytes
+//                 and latency, telling a PC/UART problem from a bus one.
 //
 // See the sample User mode API in Q_TEST.C
 //
@@ -73,8 +104,8 @@
 //
 #include "NTDDK.H"
 #include "COM8250.H"
-#include "RS485NT.H"
 #include "RS485IOC.H"
+#include "RS485NT.H"
 
 //-------------------------------------------------------------------------------------------------
 //
@@ -83,7 +114,14 @@
 #define NT_DEVICE_NAME	    L"\\Device\\RS485NT"
 #define DOS_DEVICE_NAME     L"\\DosDevices\\RS485NT"
 
-#define RS_DbgPrint(a) DbgPrint(a)
+//
+// Trace output is for checked builds only, some of it is in the ISR
+//
+#if DBG
+#define RS_DbgPrint(...) DbgPrint(__VA_ARGS__)
+#else
+#define RS_DbgPrint(...)
+#endif
 
 #if DBG
 const char sBldStr[] = "RS485NT DEBUG Device driver built: " __DATE__ " " __TIME__ "\r\n";
@@ -92,6 +130,12 @@ const char sBldStr[] = "RS485NT RELEASE Device Driver";
 // Note that macros __DATE__  __TIME__ don't work in Release mode VS 2019. WTF?
 #endif
 
+//
+// One interrupt object per IRQ line, shared by all ports on it
+//
+RS485NT_INTERRUPT_GROUP InterruptGroups[RS485_MAX_PORTS];
+ULONG InterruptGroupCount = 0;
+
 const char sCopyright[] = "Copyright  2022 Anthony A. Kempka. All rights reserved.";
 
 //-------------------------------------------------------------------------------------------------
@@ -103,6 +147,7 @@ DRIVER_INITIALIZE DriverEntry;
 
 __drv_dispatchType(IRP_MJ_CREATE)
 __drv_dispatchType(IRP_MJ_CLOSE)
+__drv_dispatchType(IRP_MJ_CLEANUP)
 __drv_dispatchType(IRP_MJ_READ)
 __drv_dispatchType(IRP_MJ_WRITE)
 __drv_dispatchType(IRP_MJ_DEVICE_CONTROL)
@@ -110,17 +155,125 @@ DRIVER_DISPATCH  DispatchRoutine;
 
 DRIVER_UNLOAD  UnloadDriver;
 
+DRIVER_STARTIO  RS485_StartIo;
+
+DRIVER_CANCEL  RS485_CancelQueuedIrp;
+DRIVER_CANCEL  RS485_CancelRead;
+
+KDEFERRED_ROUTINE RS485_ReadTimerDpc;
+
 KSERVICE_ROUTINE RS485_Isr;
 
 IO_DPC_ROUTINE RS485_Dpc_Routine;
 
+KSYNCHRONIZE_ROUTINE RS485_StartXmit;
+KSYNCHRONIZE_ROUTINE RS485_StartXmitIdle;
+KSYNCHRONIZE_ROUTINE RS485_PollStart;
+KSYNCHRONIZE_ROUTINE RS485_Poll;
+KSYNCHRONIZE_ROUTINE RS485_EnableInterrupts;
+KSYNCHRONIZE_ROUTINE RS485_ProgramLine;
+KSYNCHRONIZE_ROUTINE RS485_SwapLine;
+KSYNCHRONIZE_ROUTINE RS485_ReleaseRts;
+KSYNCHRONIZE_ROUTINE RS485_TxTurnaround;
+KSYNCHRONIZE_ROUTINE RS485_RingAttach;
+KSYNCHRONIZE_ROUTINE RS485_RingDetach;
+KSYNCHRONIZE_ROUTINE RS485_RingKick;
+KSYNCHRONIZE_ROUTINE RS485_SnapshotStats;
+KSYNCHRONIZE_ROUTINE RS485_SelfTestBegin;
+KSYNCHRONIZE_ROUTINE RS485_SelfTestPoll;
+KSYNCHRONIZE_ROUTINE RS485_SelfTestEnd;
+KSYNCHRONIZE_ROUTINE RS485_TargetDpc;
+
+EXT_CALLBACK RS485_TurnaroundTimer;
+EXT_CALLBACK RS485_BusTimer;
+EXT_CALLBACK RS485_PollTimer;
+EXT_CALLBACK RS485_FrameTimer;
+EXT_CALLBACK RS485_SelfTestTimer;
+
+BOOLEAN RS485_ServicePort (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+ULONG RS485_RxDrain (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN LARGE_INTEGER IsrTime);
+VOID RS485_TxEmpty (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN LARGE_INTEGER IsrTime);
+VOID RS485_LineStatus (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN UCHAR Lsr);
+VOID RS485_XmitFill (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_EchoByte (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN UCHAR Data);
+VOID RS485_EchoEnd (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_BusStart (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+NTSTATUS RS485_BusCollision (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_PollCheck (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+LONGLONG RS485_PollInterval (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_StartTurnaround (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_FrameByte (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                      IN ULONG Index, IN LARGE_INTEGER Now);
+VOID RS485_FrameMark (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN ULONG Index);
+BOOLEAN RS485_FrameTimeout (IN PVOID Context);
+NTSTATUS RS485_FrameRead (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                          OUT PUCHAR Buffer, IN ULONG Length, OUT PULONG Count);
+LONGLONG RS485_ElapsedTime (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                            IN LARGE_INTEGER StartTime);
+VOID RS485_RecordLatency (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                          IN PRS485NT_HISTOGRAM Histogram, IN LONGLONG Ticks);
+ULONGLONG RS485_TakeCount (IN volatile LONGLONG *Count, IN BOOLEAN Reset);
+
+NTSTATUS RS485_CreatePort (IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING RegistryPath,
+                           IN ULONG Port);
+VOID RS485_DeletePort (IN PDEVICE_OBJECT DeviceObject);
+VOID RS485_ConnectInterrupts (IN PDRIVER_OBJECT DriverObject);
+NTSTATUS RS485_SetProcessors (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp);
+VOID RS485_GetProcessors (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                          OUT PRS485NT_PROCESSORS Processors);
+VOID RS485_PortName (OUT PUNICODE_STRING Name, IN PWCHAR Buffer, IN USHORT BufferSize,
+                     IN PCWSTR Prefix, IN ULONG Port);
 NTSTATUS GetConfiguration (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
-                           IN PUNICODE_STRING RegistryPath);
+                           IN PUNICODE_STRING RegistryPath, IN ULONG Port);
 
 NTSTATUS Initialize_RS485 (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_BaudDivisor (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_ComputeTimings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+NTSTATUS RS485_SetLineSettings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp);
+VOID RS485_ChangeLine (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp);
+VOID RS485_GetLineSettings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                            OUT PRS485NT_LINE_SETTINGS Settings);
+
+NTSTATUS RS485_SelfTestRequest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp);
+PRS485NT_SELF_TEST_STATE RS485_AllocateSelfTest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                                                 IN ULONG ByteCount);
+LONGLONG RS485_SelfTestPollTime (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_StartSelfTest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp);
+VOID RS485_FinishSelfTest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_LoadSelfTest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_SelfTestResult (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                           IN PRS485NT_SELF_TEST_STATE State,
+                           OUT PRS485NT_SELF_TEST_RESULT Result);
 
 NTSTATUS RS485_Write (IN PRS485NT_DEVICE_EXTENSION  deviceExtension, IN PIRP Irp);
 NTSTATUS RS485_Read (IN PRS485NT_DEVICE_EXTENSION  deviceExtension, IN PIRP Irp);
+PUCHAR RS485_IrpBuffer (IN PIRP Irp);
+NTSTATUS RS485_Transact (IN PRS485NT_DEVICE_EXTENSION  deviceExtension, IN PIRP Irp);
+BOOLEAN RS485_IsTransact (IN PIRP Irp);
+VOID RS485_StartResponse (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp);
+ULONG RS485_ReadLength (IN PIRP Irp);
+VOID RS485_CompleteRead (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                         IN PIRP Irp, IN CCHAR PriorityBoost);
+
+VOID RS485_ProcessReads (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+PIRP RS485_ServiceRead (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_FlushReads (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+
+NTSTATUS RS485_MapRings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp);
+NTSTATUS RS485_UnmapRings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                           IN PFILE_OBJECT FileObject);
+VOID RS485_FreeRings (IN PMDL Mdl, IN PUCHAR Base, IN PVOID UserBase, IN PEPROCESS Process);
+NTSTATUS RS485_RingDoorbell (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+VOID RS485_RingXmitDone (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+BOOLEAN RS485_RingLoad (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+ULONG RS485_RingSize (IN ULONG Requested, IN ULONG Default);
+
+ULONG RS485_RcvCount (IN PRS485NT_DEVICE_EXTENSION DeviceExtension);
+ULONG RS485_RcvRead (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                     OUT PUCHAR Buffer, IN ULONG Length);
+ULONG RS485_RcvReadStamped (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                            OUT PUCHAR Buffer, OUT PULONG Stamps, IN ULONG Length);
+NTSTATUS RS485_ReadTimestamped (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp);
 
 BOOLEAN ReportUsage (IN PDRIVER_OBJECT DriverObject,
                      IN PDEVICE_OBJECT DeviceObject,
@@ -138,7 +291,8 @@ BOOLEAN ReportUsage (IN PDRIVER_OBJECT DriverObject,
 // DriverEntry
 //
 // Description:
-//  NT device Driver Entry point
+//  NT device Driver Entry point. Starts one device per configured port
+//  (Parameters\Port0..N in the registry).
 //
 // Arguments:
 //      DriverObject    - Pointer to this device's driver object
@@ -148,11 +302,120 @@ BOOLEAN ReportUsage (IN PDRIVER_OBJECT DriverObject,
 //      NTSTATUS
 //
 NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING RegistryPath)
+{
+    NTSTATUS status;
+    ULONG Port;
+
+    RS_DbgPrint ("RS485NT: Enter the driver!\n");
+
+    //
+    // Create dispatch points for create/open, close, unload, and ioctl
+    //
+    DriverObject->MajorFunction[IRP_MJ_CREATE] = DispatchRoutine;
+    DriverObject->MajorFunction[IRP_MJ_CLOSE] = DispatchRoutine;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = DispatchRoutine;
+    DriverObject->MajorFunction[IRP_MJ_READ] = DispatchRoutine;
+    DriverObject->MajorFunction[IRP_MJ_WRITE] = DispatchRoutine;
+    DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DispatchRoutine;
+    DriverObject->DriverStartIo = RS485_StartIo;
+    DriverObject->DriverUnload = UnloadDriver;
+
+    //
+    // Each port gets its own device, interrupt, DPC and buffers, so the
+    // buses run in parallel. Stop at the first port without a subkey, a
+    // port that fails to start doesn't stop the others.
+    //
+    for (Port = 0; Port < RS485_MAX_PORTS; Port++) {
+
+        status = RS485_CreatePort (DriverObject, RegistryPath, Port);
+
+        if (status == STATUS_NO_MORE_ENTRIES) {
+            break;
+        }
+
+        if (!NT_SUCCESS (status)) {
+            RS_DbgPrint("RS485NT: Port failed to start\n");
+        }
+    }
+
+    //
+    // Now that all ports are known, connect one interrupt per IRQ line
+    //
+    RS485_ConnectInterrupts (DriverObject);
+
+    if (DriverObject->DeviceObject == NULL) {
+        RS_DbgPrint("RS485NT: No ports started\n");
+        return STATUS_NO_SUCH_DEVICE;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_PortName
+//
+// Description:
+//  Builds a per port name, Prefix followed by the port number.
+//
+// Arguments:
+//      Name            - Returns the name, in Buffer
+//      Buffer          - Storage for the name
+//      BufferSize      - Size of Buffer in bytes
+//      Prefix          - NT_DEVICE_NAME or DOS_DEVICE_NAME
+//      Port            - Port number
+//
+// Return Value:
+//      none
+//
+VOID RS485_PortName (OUT PUNICODE_STRING Name, IN PWCHAR Buffer, IN USHORT BufferSize,
+                     IN PCWSTR Prefix, IN ULONG Port)
+{
+    WCHAR           NumberBuffer[12];
+    UNICODE_STRING  Number;
+
+    RtlZeroMemory (Buffer, BufferSize);
+
+    Name->Buffer = Buffer;
+    Name->Length = 0;
+    Name->MaximumLength = BufferSize - sizeof(WCHAR);
+
+    Number.Buffer = NumberBuffer;
+    Number.Length = 0;
+    Number.MaximumLength = sizeof(NumberBuffer);
+
+    RtlIntegerToUnicodeString (Port, 10, &Number);
+
+    RtlAppendUnicodeToString (Name, Prefix);
+    RtlAppendUnicodeStringToString (Name, &Number);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_CreatePort
+//
+// Description:
+//  Creates and starts the device for one port: \Device\RS485NTn with the
+//  Win32 name \\.\RS485NTn. Port 0 is also \\.\RS485NT, the name
+//  applications used before there were several ports.
+//
+// Arguments:
+//      DriverObject    - Pointer to this device's driver object
+//      RegistryPath    - Pointer to the Unicode regsitry path name
+//      Port            - Port number
+//
+// Return Value:
+//      STATUS_NO_MORE_ENTRIES  - The port isn't configured
+//      NTSTATUS
+//
+NTSTATUS RS485_CreatePort (IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING RegistryPath,
+                           IN ULONG Port)
 {
     PDEVICE_OBJECT deviceObject = NULL;
-    NTSTATUS status, ioConnectStatus;
+    NTSTATUS status;
     UNICODE_STRING uniNtNameString;
     UNICODE_STRING uniWin32NameString;
+    WCHAR ntNameBuffer[RS485_NAME_LENGTH];
     KIRQL irql = DEF_IRQ_LINE;
     KAFFINITY Affinity;
     ULONG MappedVector, AddressSpace = 1;
@@ -160,12 +423,11 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING Registry
     // TODO: BOOLEAN ResourceConflict;
     PHYSICAL_ADDRESS InPortAddr, OutPortAddr;
 
-    RS_DbgPrint ("RS485NT: Enter the driver!\n");
-
     //
     // Create counted string version of our device name.
     //
-    RtlInitUnicodeString(&uniNtNameString, NT_DEVICE_NAME);
+    RS485_PortName (&uniNtNameString, ntNameBuffer, sizeof(ntNameBuffer),
+                    NT_DEVICE_NAME, Port);
 
     //
     // Create the device object, single-thread access (TRUE)
@@ -178,22 +440,25 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING Registry
         RS_DbgPrint("RS485NT: IoCreateDevice failed\n");
         return status;
     }
-    //
-    // Set the FLAGS field
-    //
-    deviceObject->Flags |= DO_BUFFERED_IO;
-
     //
     // Get the configuration information from the Registry
     //
-    status = GetConfiguration (deviceObject->DeviceExtension, RegistryPath);
+    status = GetConfiguration (deviceObject->DeviceExtension, RegistryPath, Port);
 
     if (!NT_SUCCESS (status) ) {
         RS_DbgPrint("RS485NT: GetConfiguration failed\n");
+        IoDeleteDevice (deviceObject);
         return status;
     }
 
     extension = (PRS485NT_DEVICE_EXTENSION) deviceObject->DeviceExtension;
+    extension->PortNumber = Port;
+
+    //
+    // Set the FLAGS field. Direct I/O hands us the caller's pages (MDL)
+    // instead of a copy in a system buffer.
+    //
+    deviceObject->Flags |= extension->DirectIo ? DO_DIRECT_IO : DO_BUFFERED_IO;
 
     //
     // This call will map our IRQ to a system vector. It will also fill
@@ -218,6 +483,7 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING Registry
     //
     if (MappedVector == 0) {
         RS_DbgPrint("RS485NT: HalGetInterruptVector failed\n");
+        IoDeleteDevice (deviceObject);
         return (STATUS_INVALID_PARAMETER);
     }
 
@@ -236,21 +502,12 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING Registry
     if (!HalTranslateBusAddress(Isa, 0, InPortAddr, &AddressSpace, 
                                 &OutPortAddr)) {
         RS_DbgPrint("RS485NT: HalTranslateBusAddress failed\n");
+        IoDeleteDevice (deviceObject);
         return STATUS_SOME_NOT_MAPPED;
     }
 
 
     if ( NT_SUCCESS(status) ) {
-        //
-        // Create dispatch points for create/open, close, unload, and ioctl
-        //
-        DriverObject->MajorFunction[IRP_MJ_CREATE] = DispatchRoutine;
-        DriverObject->MajorFunction[IRP_MJ_CLOSE] = DispatchRoutine;
-        DriverObject->MajorFunction[IRP_MJ_READ] = DispatchRoutine;
-        DriverObject->MajorFunction[IRP_MJ_WRITE] = DispatchRoutine;
-        DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DispatchRoutine;
-        DriverObject->DriverUnload = UnloadDriver;
-
         //
         // check if resources (ports and interrupt) are available.
         // 
@@ -279,52 +536,80 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING Registry
         extension->PortAddress = (PVOID)OutPortAddr.LowPart;
 
         //
-        // connect the device driver to the IRQ
+        // The interrupt is connected later by RS485_ConnectInterrupts, it
+        // may be shared with other ports
         //
-        ioConnectStatus = IoConnectInterrupt(&extension->InterruptObject,
-                                             RS485_Isr,
-                                             extension->DeviceObject,
-                                             NULL,
-                                             MappedVector,
-                                             irql,
-                                             irql,
-                                             Latched,
-                                             FALSE,
-                                             Affinity,
-                                             FALSE);
+        extension->InterruptVector = MappedVector;
+        extension->Affinity = Affinity;
 
-        if ( !NT_SUCCESS (ioConnectStatus) ) {
-            RS_DbgPrint("RS485NT: Couldn't connect interrupt\n");
-            IoDeleteDevice(deviceObject);
-            return ioConnectStatus;
+        //
+        // Board interrupt status register, if there is one
+        //
+        if (extension->StatusPort != NULL) {
+            InPortAddr.LowPart = (ULONG)extension->StatusPort;
+            InPortAddr.HighPart = 0;
+            AddressSpace = 1;
+            if (HalTranslateBusAddress(Isa, 0, InPortAddr, &AddressSpace, &OutPortAddr)) {
+                extension->StatusPort = (PVOID)OutPortAddr.LowPart;
+            } else {
+                RS_DbgPrint("RS485NT: HalTranslateBusAddress failed for the status register\n");
+                extension->StatusPort = NULL;
+            }
         }
 
         RS_DbgPrint("RS485NT: just about ready!\n");
 
         //
-        // Create counted string version of our Win32 device name.
+        // Create counted string version of our Win32 device name. Unload
+        // needs it again, so it lives in the extension.
         //
-        RtlInitUnicodeString( &uniWin32NameString, DOS_DEVICE_NAME);
+        RS485_PortName (&extension->LinkName, extension->LinkNameBuffer,
+                        sizeof(extension->LinkNameBuffer), DOS_DEVICE_NAME, Port);
     
         //
         // Create a link from our device name to a name in the Win32 namespace.
         //
-        status = IoCreateSymbolicLink( &uniWin32NameString, &uniNtNameString );
+        status = IoCreateSymbolicLink( &extension->LinkName, &uniNtNameString );
 
         if (!NT_SUCCESS(status)) {
             RS_DbgPrint("RS485NT: Couldn't create the symbolic link\n");
-            IoDeleteDevice (DriverObject->DeviceObject);
+            IoDeleteDevice (deviceObject);
         } else {
 
             //
-            // Setup the Dpc for ISR routine
+            // Port 0 keeps the single port name
             //
-            IoInitializeDpcRequest (DriverObject->DeviceObject, RS485_Dpc_Routine);
+            if (Port == 0) {
+                RtlInitUnicodeString( &uniWin32NameString, DOS_DEVICE_NAME);
+                extension->LegacyLink =
+                    NT_SUCCESS (IoCreateSymbolicLink( &uniWin32NameString, &uniNtNameString ));
+            }
+
+            //
+            // Setup the Dpc for ISR routine, and a second one that is
+            // pinned to "Dpc Processor"
+            //
+            IoInitializeDpcRequest (deviceObject, RS485_Dpc_Routine);
+            KeInitializeDpc (&extension->TargetedDpc,
+                             (PKDEFERRED_ROUTINE)RS485_Dpc_Routine, deviceObject);
+            extension->IsrDpc = &deviceObject->Dpc;
+            RS485_TargetDpc (extension);
 
             //
-            // Initialize the device (enable IRQ's, hit the hardware)
+            // Initialize the device (hit the hardware, IRQ's are enabled
+            // once the interrupt is connected)
             //
-            Initialize_RS485 (extension);
+            status = Initialize_RS485 (extension);
+
+            if (!NT_SUCCESS (status)) {
+                RS_DbgPrint("RS485NT: Couldn't initialize the device\n");
+                RS485_DeletePort (deviceObject);
+                return status;
+            }
+
+            if (extension->SelfTestBytes) {
+                RS485_LoadSelfTest (extension);
+            }
 
             RS_DbgPrint("RS485NT: All initialized!\n");
         }
@@ -340,136 +625,130 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING Registry
 // RS485_Isr
 //
 // Description:
-//  This is our 'C' Isr routine to handle RS485 transmit and recieve
+//  This is our 'C' Isr routine to handle RS485 transmit and recieve. One
+//  interrupt serves every port on the IRQ line (an interrupt group), so
+//  walk all of them until a full pass finds nothing pending. On an edge
+//  triggered (ISA) line a UART left pending would never interrupt again.
+//  With a board interrupt status register only the flagged UARTs are read.
 //
 // Arguments:
 //      Interrupt   - Pointer to our interrupt object
-//      Context     - Pointer to our device object
+//      Context     - Pointer to our interrupt group
 //
 // Return Value:
-//      TRUE        - If this was our ISR (assumed)
+//      TRUE        - One of our UARTs was interrupting
+//      FALSE       - Not ours (shared vector)
 //
 BOOLEAN RS485_Isr (IN PKINTERRUPT Interrupt, IN OUT PVOID Context)
 {
-    PDEVICE_OBJECT DeviceObject;
+    PRS485NT_INTERRUPT_GROUP Group = Context;
     PRS485NT_DEVICE_EXTENSION DeviceExtension;
-    UCHAR   ch;
+    BOOLEAN Ours = FALSE;
+    BOOLEAN Serviced;
+    UCHAR   Status;
+    ULONG   i;
 
     UNREFERENCED_PARAMETER(Interrupt);
 
+    do {
+        Serviced = FALSE;
+
+        Status = 0xFF;
+        if (Group->StatusPort != NULL) {
+            Status = READ_PORT_UCHAR (Group->StatusPort);
+        }
+
+        for (i = 0; i < Group->PortCount; i++) {
+            DeviceExtension = Group->Ports[i];
+
+            if ((Status & DeviceExtension->StatusMask) &&
+                RS485_ServicePort (DeviceExtension)) {
+                Serviced = TRUE;
+            }
+        }
+
+        Ours |= Serviced;
+
+    } while (Serviced);
+
+    return Ours;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ServicePort
+//
+// Description:
+//  Handles all pending interrupts of one UART. Called from RS485_Isr.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE        - The UART had an interrupt pending
+//      FALSE       - Nothing pending
+//
+BOOLEAN RS485_ServicePort (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    UCHAR   ch;
+    LARGE_INTEGER IsrTime;
+
     //
-    // Get the Device Object and obtain our Extension
+    // For the 8250 series UART, we must spin and handle ALL interrupts
+    // before returning
     //
-    DeviceObject = Context;
-    DeviceExtension = DeviceObject->DeviceExtension;
+    ch = READ_PORT_UCHAR (DeviceExtension->ComPort.IIR);
+
+    if ((ch & IIR_INTERRUPT_MASK) == IIR_NO_INTERRUPT_PENDING) {
+        return FALSE;
+    }
 
     //
     // Bump the interrupt count
     //
     DeviceExtension->InterruptCount++;
+    DeviceExtension->Stats.Interrupts++;
+
+    IsrTime = KeQueryPerformanceCounter (NULL);
     
     RS_DbgPrint ("RS485NT: ISR!\n");
 
-    //
-    // For the 8250 series UART, we must spin and handle ALL interrupts
-    // before returning
-    //
-    ch = READ_PORT_UCHAR (DeviceExtension->ComPort.IIR);
-
     while ((ch & IIR_INTERRUPT_MASK) != IIR_NO_INTERRUPT_PENDING) {
         switch (ch & IIR_INTERRUPT_MASK) {
 
             case IIR_RX_ERROR_IRQ_PENDING:      // 1st priority interrupt
                 RS_DbgPrint ("RS485NT: ISR RX Error!\n");
+                DeviceExtension->Stats.RxErrorInterrupts++;
                 ch = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
-                DeviceExtension->RcvError++;
+                RS485_LineStatus (DeviceExtension, ch);
                 break;
 
             case IIR_RX_DATA_READY_IRQ_PENDING: // 2nd priority int
+            case IIR_RX_TIMEOUT_IRQ_PENDING:    // 2nd priority int (16550 FIFO)
 
                 RS_DbgPrint ("RS485NT: ISR RX Data!\n");
 
-                //
-                // Read the UART receive register and stuff byte into buffer
-                //
-                ch = READ_PORT_UCHAR (DeviceExtension->ComPort.RBR);
-
-                //
-                // Check for end of buffer
-                //
-                if (DeviceExtension->RcvBufferPosition+1 < 
-                    DeviceExtension->RcvBufferEnd) {
-
-                   *DeviceExtension->RcvBufferPosition = ch;
-                    DeviceExtension->RcvBufferPosition++;
-                    DeviceExtension->RcvBufferCount++;
+                if ((ch & IIR_INTERRUPT_MASK) == IIR_RX_TIMEOUT_IRQ_PENDING) {
+                    DeviceExtension->Stats.RxTimeoutInterrupts++;
+                } else {
+                    DeviceExtension->Stats.RxDataInterrupts++;
                 }
+                DeviceExtension->PollWindowInterrupts++;
 
-                //
-                // Get the current system time
-                //
-                KeQuerySystemTime (&DeviceExtension->LastQuerySystemTime);
-
+                RS485_RxDrain (DeviceExtension, IsrTime);
                 break;
-            
+
             case IIR_TX_HBE_IRQ_PENDING:        // 3rd priority interrupt
 
                 RS_DbgPrint ("RS485NT: ISR TX Data!\n");
+                DeviceExtension->Stats.TxEmptyInterrupts++;
 
-                //
-                // Is this the last byte sent?
-                //
-                if (DeviceExtension->XmitBufferCount == 0) {
-
-                    //
-                    // Wait for the entire character to be sent out the UART
-                    //
-                    ch = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
-
-                    while ( (ch & LSR_TX_BOTH_EMPTY) != LSR_TX_BOTH_EMPTY) {
-                        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
-                    }
-
-                    //
-                    // De-assert RTS
-                    //
-                    ch = READ_PORT_UCHAR (DeviceExtension->ComPort.MCR) & 
-                         MCR_DEACTIVATE_RTS;
-                    WRITE_PORT_UCHAR (DeviceExtension->ComPort.MCR, ch);
-
-                    //
-                    // Clear the Rcv buffer info, a reply is emminent
-                    //
-                    DeviceExtension->RcvBufferCount = 0;
-                    DeviceExtension->RcvBufferPosition = DeviceExtension->RcvBuffer;
-
-                    //
-                    // Schedule the DPC (where the Xmit done event is set)
-                    //
-                    IoRequestDpc (DeviceObject, DeviceObject->CurrentIrp, NULL);
-
-                } else {
-
-                    //
-                    // Send the next byte
-                    //
-
-                    WRITE_PORT_UCHAR (DeviceExtension->ComPort.TBR,
-                                      *DeviceExtension->XmitBufferPosition);
-
-                    DeviceExtension->XmitBufferPosition++;
-                    DeviceExtension->XmitBufferCount--;
-                }
-
-                //
-                // Get the current system time
-                //
-                KeQuerySystemTime (&DeviceExtension->LastQuerySystemTime);
-
+                RS485_TxEmpty (DeviceExtension, IsrTime);
                 break;
 
             case IIR_MODEM_STATUS_IRQ_PENDING:  // 4th priority interrupt
                 RS_DbgPrint ("RS485NT: ISR Modem Status!\n");
+                DeviceExtension->Stats.ModemStatusInterrupts++;
                 ch = READ_PORT_UCHAR (DeviceExtension->ComPort.MSR);
                 break;
 
@@ -480,858 +759,5924 @@ BOOLEAN RS485_Isr (IN PKINTERRUPT Interrupt, IN OUT PVOID Context)
     }
 
     //
-    // Return TRUE to signify this was our interrupt and we serviced it.
+    // If the DPC has work, time how long it takes to get to it. Only the
+    // first ISR counts until the DPC runs.
+    //
+    if (DeviceExtension->DpcEvents) {
+        InterlockedCompareExchange64 (&DeviceExtension->DpcIsrTime, IsrTime.QuadPart, 0);
+    }
+
+    //
+    // Return TRUE to signify this UART interrupted and we serviced it.
     //
     return TRUE;
 }
 
 
 //---------------------------------------------------------------------------
-// RS485_Dpc_Routine
+// RS485_RxDrain
 //
 // Description:
-//  This DPC for ISR is issued by RS485_Isr to complete Transmit processing
-//  by setting the XmitDone event.
+//  Drains the receiver into the receive ring and hands the new bytes to
+//  the DPC. Called from RS485_Isr on a receive interrupt, or by the
+//  receive poll (synchronized with the ISR) once the LSR shows data.
 //
 // Arguments:
-//      Dpc             - not used
-//      DeviceObject    - Pointer to the Device object
-//      Irp             - not used
-//      Context         - not used
+//      DeviceExtension - Pointer to the device extension.
+//      IsrTime         - Performance counter at the ISR (or poll)
 //
 // Return Value:
-//      none
+//      Bytes read from the UART
 //
-VOID RS485_Dpc_Routine (IN PKDPC Dpc, IN PDEVICE_OBJECT DeviceObject, 
-                        IN PIRP Irp, IN PVOID Context)
+ULONG RS485_RxDrain (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN LARGE_INTEGER IsrTime)
 {
-    PRS485NT_DEVICE_EXTENSION DeviceExtension;
+    UCHAR   ch, lsr;
+    ULONG   Head, Tail;
+    ULONG   Count = 0;
 
-    UNREFERENCED_PARAMETER(Context);
-    UNREFERENCED_PARAMETER(Irp);
-    UNREFERENCED_PARAMETER(Dpc);
+    //
+    // In FIFO mode there are RxTriggerLevel bytes waiting (or fewer on a
+    // character timeout), so keep reading while the LSR says there is
+    // data. The ring is single producer (us) single consumer
+    // (RS485_RcvRead): we only ever write RcvHead. With the rings mapped
+    // the consumer is the application.
+    //
+    Head = DeviceExtension->RcvHead;
 
-    DeviceExtension = DeviceObject->DeviceExtension;
+    if (DeviceExtension->RingHeader != NULL) {
+        Tail = DeviceExtension->RingHeader->RxTail;
+    } else {
+        Tail = DeviceExtension->RcvTail;
+
+        if ((LONG)(DeviceExtension->RcvDiscard - Tail) > 0) {
+            Tail = DeviceExtension->RcvDiscard;
+        }
+    }
+
+    do {
+        //
+        // Read the UART receive register and stuff byte into the
+        // ring, or count it as lost if the ring is full
+        //
+        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.RBR);
+        DeviceExtension->Stats.RxBytes++;
+        Count++;
+
+        //
+        // Frame mode: look at the gap since the last byte. The
+        // FIFO drain takes microseconds, so the ISR timestamp
+        // does for every byte of it. Our own echo is discarded
+        // anyway.
+        //
+        if ((DeviceExtension->FrameMode != FRAME_MODE_NONE) &&
+            !DeviceExtension->XmitActive) {
+            RS485_FrameByte (DeviceExtension, Head, IsrTime);
+        }
+
+        if (DeviceExtension->XmitActive &&
+            (DeviceExtension->EchoMode != ECHO_MODE_BUFFER)) {
+            //
+            // Echo Mode: checked and dropped here, not stored
+            // for RS485_ReleaseRts to discard
+            //
+            RS485_EchoByte (DeviceExtension, ch);
+        } else if ((DeviceExtension->RingHeader != NULL) &&
+                   DeviceExtension->XmitActive) {
+            //
+            // Our own echo, the mapped ring has no discard index
+            //
+        } else if (Head - Tail < DeviceExtension->RcvBufferSize) {
+            DeviceExtension->RcvBuffer[Head & (DeviceExtension->RcvBufferSize - 1)] = ch;
+
+            //
+            // Timestamp Mode: one sample per ISR (per FIFO drain)
+            //
+            if ((DeviceExtension->RcvStamp != NULL) &&
+                (DeviceExtension->RingHeader == NULL)) {
+                DeviceExtension->RcvStamp[Head & (DeviceExtension->RcvBufferSize - 1)] =
+                    IsrTime.LowPart;
+            }
+            Head++;
+        } else {
+            DeviceExtension->RcvOverflow++;
+            DeviceExtension->Stats.RingFullDrops++;
+        }
+
+        //
+        // Reading the LSR clears the error bits of the next
+        // character in the FIFO, so count them here.
+        //
+        lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+        RS485_LineStatus (DeviceExtension, lsr);
+
+    } while (lsr & LSR_RX_DATA_READY);
 
     //
-    // Set the Xmit Done event
+    // Listen before talk: the bus was busy up to now
     //
-    KeSetEvent (&DeviceExtension->XmitDone, 0, FALSE);
+    DeviceExtension->BusLastActivity = IsrTime;
+    DeviceExtension->LastActivityTime = IsrTime;
 
-    RS_DbgPrint ("RS485NT: Dpc Routine KeSetEvent\n");
-    return;
+    if (Head - Tail > DeviceExtension->Stats.RxHighWater) {
+        DeviceExtension->Stats.RxHighWater = Head - Tail;
+    }
+
+    //
+    // Publish the new bytes to the read path, data first, and
+    // let the DPC feed any pending read
+    //
+    KeMemoryBarrier ();
+    DeviceExtension->RcvHead = Head;
+
+    if (DeviceExtension->RingHeader != NULL) {
+        DeviceExtension->RingHeader->RxHead = Head;
+        DeviceExtension->RingHeader->RxOverflow = DeviceExtension->RcvOverflow;
+    }
+
+    InterlockedOr (&DeviceExtension->DpcEvents, RS485_DPC_RX_DATA);
+    KeInsertQueueDpc (DeviceExtension->IsrDpc, DeviceExtension->DeviceObject->CurrentIrp, NULL);
+
+    return Count;
 }
 
 
 //---------------------------------------------------------------------------
-// ReportUsage
+// RS485_TxEmpty
 //
 // Description:
-//  This routine registers (reports) the I/O and IRQ usage for this driver.
+//  The transmitter wants more: loads the next burst, or once the last
+//  byte is in the shift register starts the RTS turnaround. Called from
+//  RS485_Isr on a THRE interrupt, or by the poll in Rx Poll Mode 2.
 //
 // Arguments:
-//      DriverObject    - Pointer to the driver object
-//      DeviceObject    - Pointer to the Device object
-//      PortAddress     - Address of I/O port used
-//      ConflictDetected - TRUE if a resource conflict was detected.
+//      DeviceExtension - Pointer to the device extension.
+//      IsrTime         - Performance counter at the ISR (or poll)
 //
 // Return Value:
-//      TRUE    - If a Resource conflict was detected
-//      FALSE   - If no conflict was detected
+//      none
 //
-BOOLEAN ReportUsage(IN PDRIVER_OBJECT DriverObject,
-                    IN PDEVICE_OBJECT DeviceObject,
-                    IN PHYSICAL_ADDRESS PortAddress,
-                    IN BOOLEAN *ConflictDetected)
+VOID RS485_TxEmpty (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN LARGE_INTEGER IsrTime)
 {
-    PRS485NT_DEVICE_EXTENSION extension;
-
-    ULONG sizeOfResourceList;
-    PCM_RESOURCE_LIST resourceList;
-    PCM_FULL_RESOURCE_DESCRIPTOR nextFrd;
-    PCM_PARTIAL_RESOURCE_DESCRIPTOR partial;
-
-    extension = (PRS485NT_DEVICE_EXTENSION) DeviceObject->DeviceExtension;
+    UCHAR   lsr;
 
     //
-    // The size of the resource list is going to be one full descriptor
-    // which already has one partial descriptor included, plus another
-    // partial descriptor. One partial descriptor will be for the
-    // interrupt, and the other for the port addresses.
+    // Is this the last byte sent? (With the rings mapped, not
+    // while the application keeps queueing bytes.)
     //
-    sizeOfResourceList = sizeof(CM_FULL_RESOURCE_DESCRIPTOR);
+    if ((DeviceExtension->XmitBufferCount == 0) &&
+        !(DeviceExtension->XmitActive &&
+          !DeviceExtension->TurnaroundPending &&
+          (DeviceExtension->RingHeader != NULL) &&
+          RS485_RingLoad (DeviceExtension))) {
 
-    //
-    // The full resource descriptor already contains one
-    // partial.	Make room for one more.
-    //
-    // It will hold the irq "prd", and the port "prd".
-    //    ("prd" = partial resource descriptor)
-    //
-    sizeOfResourceList += sizeof(CM_PARTIAL_RESOURCE_DESCRIPTOR);
+        //
+        // The last byte has moved into the shift register. Don't
+        // spin here at device IRQL waiting for it to go out,
+        // hand RTS release to the turnaround engine in the DPC.
+        // (Ignore the THRE interrupt we get when IER is set up.)
+        //
+        if (DeviceExtension->XmitActive &&
+            !DeviceExtension->TurnaroundPending) {
 
-    //
-    // Now we increment the length of the resource list by field offset
-    // of the first frd.   This will give us the length of what preceeds
-    // the first frd in the resource list.
-    //   (frd = full resource descriptor)
-    //
-    sizeOfResourceList += FIELD_OFFSET(CM_RESOURCE_LIST, List[0]);
+            lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
 
-    resourceList = ExAllocatePoolWithTag(PagedPool, sizeOfResourceList, MEMORY_TAG);
+            if (lsr & LSR_TX_BOTH_EMPTY) {
+                RS485_ReleaseRts (DeviceExtension);
+            } else {
+                DeviceExtension->XmitEmptyTime = KeQueryPerformanceCounter (NULL);
+                DeviceExtension->TurnaroundPending = TRUE;
 
-    if (!resourceList) {
-        return FALSE;
+                InterlockedOr (&DeviceExtension->DpcEvents, RS485_DPC_XMIT_EMPTY);
+                KeInsertQueueDpc (DeviceExtension->IsrDpc, DeviceExtension->DeviceObject->CurrentIrp, NULL);
+            }
+        }
+
+    } else {
+
+        //
+        // Send the next burst of bytes
+        //
+        RS485_XmitFill (DeviceExtension);
     }
 
     //
-    // Zero out the list
+    // IOCTL_RS485NT_LAST_RCVD_TIME turns this into milliseconds
     //
-    RtlZeroMemory(resourceList, sizeOfResourceList);
+    DeviceExtension->LastActivityTime = IsrTime;
+}
 
-    resourceList->Count = 1;
-    nextFrd = &resourceList->List[0];
 
-    nextFrd->InterfaceType = Isa;
-    nextFrd->BusNumber = 0;
+//---------------------------------------------------------------------------
+// RS485_LineStatus
+//
+// Description:
+//  Counts the receive errors in a Line Status Register value. Reading
+//  the LSR clears them, so every LSR read goes through here. Called from
+//  RS485_Isr or synchronized with it.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      Lsr             - The LSR value
+//
+// Return Value:
+//      none
+//
+VOID RS485_LineStatus (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN UCHAR Lsr)
+{
+    if ((Lsr & LSR_RX_ERROR_MASK) == 0) {
+        return;
+    }
 
-    //
-    // We are going to report port addresses and interrupt
-    //
-    nextFrd->PartialResourceList.Count = 2;
+    DeviceExtension->RcvError++;
+
+    if (Lsr & LSR_RX_OVERRUN_ERROR) {
+        DeviceExtension->Stats.OverrunErrors++;
+    }
+    if (Lsr & LSR_RX_PARITY_ERROR) {
+        DeviceExtension->Stats.ParityErrors++;
+    }
+    if (Lsr & LSR_RX_FRAMING_ERROR) {
+        DeviceExtension->Stats.FramingErrors++;
+    }
+    if (Lsr & LSR_RX_BREAK_DETECTED) {
+        DeviceExtension->Stats.BreakErrors++;
+    }
 
     //
-    // Now fill in the port data.  We don't wish to share
-    // this port range with anyone.
-    //
-    // Note: the port address we pass in is the one we got
-    // back from HalTranslateBusAddress.
+    // Our own echo doesn't come back garbled, someone else was sending
     //
-    partial = &nextFrd->PartialResourceList.PartialDescriptors[0];
+    if (DeviceExtension->XmitActive &&
+        (DeviceExtension->EchoMode == ECHO_MODE_VERIFY)) {
+        DeviceExtension->EchoCollision = TRUE;
+    }
+}
 
-    partial->Type = CmResourceTypePort;
-    partial->ShareDisposition = CmResourceShareDriverExclusive;
-    partial->Flags = CM_RESOURCE_PORT_IO;
-    partial->u.Port.Start = PortAddress;
-    partial->u.Port.Length = DEF_PORT_RANGE;
 
-    partial++;
+//---------------------------------------------------------------------------
+// RS485_EchoByte
+//
+// Description:
+//  Handles a byte received while we transmit, in ECHO_MODE_GATE or
+//  ECHO_MODE_VERIFY. Verify compares it with the oldest byte sent and not
+//  yet echoed: anything else means another station drove the bus too.
+//  Below 8 data bits the UART zeroes the high bits, so only the data
+//  bits are compared. The byte is dropped either way, it's not part of any reply. Called
+//  from RS485_Isr or synchronized with it.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      Data            - The byte
+//
+// Return Value:
+//      none
+//
+VOID RS485_EchoByte (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN UCHAR Data)
+{
+    UCHAR   Mask = (UCHAR)((1 << DeviceExtension->DataBits) - 1);
+
+    if (DeviceExtension->EchoMode == ECHO_MODE_VERIFY) {
+
+        if ((DeviceExtension->EchoHead == DeviceExtension->EchoTail) ||
+            ((DeviceExtension->EchoBuffer[DeviceExtension->EchoTail & (RS485_ECHO_BUFFER - 1)] & Mask) !=
+             (Data & Mask))) {
+
+            DeviceExtension->Stats.EchoMismatches++;
+            DeviceExtension->EchoCollision = TRUE;
+
+            //
+            // Take it as the next byte, garbled
+            //
+            if (DeviceExtension->EchoHead != DeviceExtension->EchoTail) {
+                DeviceExtension->EchoTail++;
+            }
+            return;
+        }
+
+        DeviceExtension->EchoTail++;
+    }
+
+    DeviceExtension->Stats.EchoBytes++;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_EchoEnd
+//
+// Description:
+//  Ends echo handling for a transmission, RTS is already off. The last
+//  echoed bytes can still be below the RX FIFO trigger level, so drain
+//  the receiver before a reply can arrive, count what never came back
+//  and let the receive interrupts back on. Called from RS485_ReleaseRts.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_EchoEnd (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    ULONG   i;
+    UCHAR   ch, lsr;
+
+    if (DeviceExtension->EchoMode == ECHO_MODE_BUFFER) {
+        return;
+    }
+
+    lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+
+    for (i = 0; (i < RS485_ECHO_BUFFER) && (lsr & LSR_RX_DATA_READY); i++) {
+        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.RBR);
+        DeviceExtension->Stats.RxBytes++;
+        RS485_EchoByte (DeviceExtension, ch);
+
+        //
+        // Gated, the FIFO overran on our own bytes: not a receive error
+        //
+        lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+        if (DeviceExtension->EchoMode == ECHO_MODE_VERIFY) {
+            RS485_LineStatus (DeviceExtension, lsr);
+        }
+    }
+
+    if (DeviceExtension->EchoMode == ECHO_MODE_VERIFY) {
+        DeviceExtension->Stats.EchoMissing += DeviceExtension->EchoHead - DeviceExtension->EchoTail;
+        DeviceExtension->EchoTail = DeviceExtension->EchoHead;
+
+        if (DeviceExtension->EchoCollision) {
+            DeviceExtension->Stats.Collisions++;
+        }
+    } else if (!DeviceExtension->PollActive) {
+        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.IER) |
+             IER_ENABLE_RX_DATA_READY_IRQ | IER_ENABLE_RX_ERROR_IRQ;
+        WRITE_PORT_UCHAR (DeviceExtension->ComPort.IER, ch);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_TakeCount
+//
+// Description:
+//  Reads a counter kept with InterlockedIncrement64, zeroing it in the same
+//  operation if asked so no increment falls between the read and the reset.
+//
+// Arguments:
+//      Count - The counter.
+//      Reset - TRUE to zero it.
+//
+// Return Value:
+//      The count before any reset
+//
+ULONGLONG RS485_TakeCount (IN volatile LONGLONG *Count, IN BOOLEAN Reset)
+{
+    if (Reset) {
+        return (ULONGLONG)InterlockedExchange64 (Count, 0);
+    }
+
+    return (ULONGLONG)InterlockedCompareExchange64 (Count, 0, 0);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SnapshotStats
+//
+// Description:
+//  Copies (and optionally zeroes) the IOCTL_RS485NT_GET_STATS counters.
+//  Synchronized with RS485_Isr, which updates most of them. The IRP and
+//  DPC counts are bumped at DISPATCH_LEVEL with interlocked increments
+//  that the interrupt lock doesn't hold off, so they live outside Stats
+//  and are read and cleared with interlocked operations.
+//
+// Arguments:
+//      Context - Pointer to an RS485NT_STATS_SNAPSHOT.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_SnapshotStats (IN PVOID Context)
+{
+    PRS485NT_STATS_SNAPSHOT Snapshot = Context;
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Snapshot->DeviceExtension;
+    ULONG   i;
+
+    RtlMoveMemory (Snapshot->Stats, &DeviceExtension->Stats, sizeof(RS485NT_STATS));
+
+    Snapshot->Stats->WriteIrps = RS485_TakeCount (&DeviceExtension->WriteIrps, Snapshot->Reset);
+    Snapshot->Stats->ReadIrps = RS485_TakeCount (&DeviceExtension->ReadIrps, Snapshot->Reset);
+    Snapshot->Stats->TransactIrps = RS485_TakeCount (&DeviceExtension->TransactIrps, Snapshot->Reset);
+    Snapshot->Stats->DpcRuns = RS485_TakeCount (&DeviceExtension->DpcRuns, Snapshot->Reset);
+
+    if (Snapshot->Reset) {
+        RtlZeroMemory (&DeviceExtension->Stats, sizeof(RS485NT_STATS));
+        for (i = 0; i < RS485NT_MAX_PROCESSORS; i++) {
+            InterlockedExchange64 ((volatile LONGLONG *)&DeviceExtension->DpcProcessorRuns[i], 0);
+        }
+    }
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_XmitFill
+//
+// Description:
+//  Loads the transmitter with as many bytes from XmitBufferPosition as
+//  the TX FIFO holds (a single byte in 8250 mode). Only called when the
+//  transmitter is empty, either from RS485_Isr or synchronized with it.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_XmitFill (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    ULONG   Count;
+
+    Count = DeviceExtension->FifoDepth;
+
+    if (Count > DeviceExtension->XmitBufferCount) {
+        Count = DeviceExtension->XmitBufferCount;
+    }
+
+    DeviceExtension->Stats.TxBytes += Count;
+
+    while (Count--) {
+        WRITE_PORT_UCHAR (DeviceExtension->ComPort.TBR,
+                          *DeviceExtension->XmitBufferPosition);
+
+        //
+        // Echo Mode verify: remember it until it comes back. If the
+        // receiver falls that far behind, the oldest was never echoed.
+        //
+        if (DeviceExtension->EchoMode == ECHO_MODE_VERIFY) {
+            if (DeviceExtension->EchoHead - DeviceExtension->EchoTail == RS485_ECHO_BUFFER) {
+                DeviceExtension->EchoTail++;
+                DeviceExtension->Stats.EchoMissing++;
+            }
+            DeviceExtension->EchoBuffer[DeviceExtension->EchoHead & (RS485_ECHO_BUFFER - 1)] =
+                *DeviceExtension->XmitBufferPosition;
+            DeviceExtension->EchoHead++;
+        }
+
+        DeviceExtension->XmitBufferPosition++;
+        DeviceExtension->XmitBufferCount--;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_StartXmit
+//
+// Description:
+//  Asserts RTS and kick starts the UART with the first burst of the
+//  transmit buffer. Runs synchronized with RS485_Isr (KeSynchronizeExecution)
+//  so the first transmit interrupt can't race the buffer pointers.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_StartXmit (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    UCHAR   ch;
+
+    DeviceExtension->XmitActive = TRUE;
+    DeviceExtension->XmitStartTime = KeQueryPerformanceCounter (NULL).QuadPart;
+    DeviceExtension->EchoCollision = FALSE;
+    DeviceExtension->EchoTail = DeviceExtension->EchoHead;
 
     //
-    // Now fill in the irq stuff.
-    //
-    // Note: for IoReportResourceUsage, the Interrupt.Level and
-    // Interrupt.Vector are bus-specific level and vector, just
-    // as we passed in to HalGetInterruptVector, not the mapped
-    // system vector we got back from HalGetInterruptVector.
+    // Echo Mode gate: no receive interrupts for our own bytes
     //
-    partial->Type = CmResourceTypeInterrupt;
-    partial->u.Interrupt.Level = extension->IRQLine;
-    partial->u.Interrupt.Vector = extension->IRQLine;
-    partial->ShareDisposition = CmResourceShareDriverExclusive;
-    partial->Flags = CM_RESOURCE_INTERRUPT_LATCHED;
+    if (DeviceExtension->EchoMode == ECHO_MODE_GATE) {
+        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.IER) &
+             IER_DISABLE_RX_DATA_READY_IRQ & IER_DISABLE_RX_ERROR_IRQ;
+        WRITE_PORT_UCHAR (DeviceExtension->ComPort.IER, ch);
+    }
 
-    IoReportResourceForDetection (
-        DriverObject,
-        resourceList,
-        sizeOfResourceList,
-        NULL,
-        NULL,
-        0,
-        ConflictDetected);
+    //
+    // Assert RTS
+    //
+    ch = READ_PORT_UCHAR (DeviceExtension->ComPort.MCR) | MCR_ACTIVATE_RTS;
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.MCR, ch);
 
     //
-    // The above routine sets the BOOLEAN parameter ConflictDetected
-    // to TRUE if a conflict was detected.
+    // Kick start the UART by filling the transmitter
     //
-    ExFreePool(resourceList);
+    RS485_XmitFill (DeviceExtension);
 
-    return (*ConflictDetected);
+    return TRUE;
 }
 
 
 //---------------------------------------------------------------------------
+// RS485_ReleaseRts
 //
+// Description:
+//  Ends a transmission: drops RTS (the RS-485 transceiver goes back to
+//  receive), discards the receive buffer because a reply is imminent and
+//  schedules the DPC to signal transmit done. Called from RS485_Isr or
+//  synchronized with it.
 //
-// Routine Description:
-// 
-//     Process the IRPs sent to this device.
-// 
 // Arguments:
-// 
-//     DeviceObject - pointer to a device object
-// 
-//     Irp          - pointer to an I/O Request Packet
-// 
+//      Context - Pointer to the device extension.
+//
 // Return Value:
-// 
-// 
-NTSTATUS DispatchRoutine (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
+//      TRUE
+//
+BOOLEAN RS485_ReleaseRts (IN PVOID Context)
 {
-    PIO_STACK_LOCATION  irpStack;
-    PRS485NT_DEVICE_EXTENSION   deviceExtension;
-    PVOID               ioBuffer;
-    ULONG               inputBufferLength;
-    ULONG               outputBufferLength;
-    ULONG               ioControlCode;
-    NTSTATUS            ntStatus;
-
-    LARGE_INTEGER       CurrentSystemTime;
-    LARGE_INTEGER       ElapsedTime;
-    
-    Irp->IoStatus.Status      = STATUS_SUCCESS;
-    Irp->IoStatus.Information = 0;
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    UCHAR   ch;
 
     //
-    // Get a pointer to the current location in the Irp. This is where
-    //     the function codes and parameters are located.
+    // De-assert RTS
     //
+    ch = READ_PORT_UCHAR (DeviceExtension->ComPort.MCR) & MCR_DEACTIVATE_RTS;
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.MCR, ch);
 
-    irpStack = IoGetCurrentIrpStackLocation (Irp);
+    RS485_EchoEnd (DeviceExtension);
 
     //
-    // Get a pointer to the device extension
+    // The end of our echo can still be in the RX FIFO, below the trigger
+    // level or waiting for the next poll. Take it in before the discard.
     //
+    if (DeviceExtension->EchoMode == ECHO_MODE_BUFFER) {
+        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+        RS485_LineStatus (DeviceExtension, ch);
 
-    deviceExtension = DeviceObject->DeviceExtension;
+        if (ch & LSR_RX_DATA_READY) {
+            RS485_RxDrain (DeviceExtension, KeQueryPerformanceCounter (NULL));
+        }
+    }
 
     //
-    // Get the pointer to the input/output buffer and it's length
+    // Our own frame counts as bus activity too
     //
+    if (DeviceExtension->BusIdleChars) {
+        DeviceExtension->BusLastActivity = KeQueryPerformanceCounter (NULL);
+    }
 
-    ioBuffer           = Irp->AssociatedIrp.SystemBuffer;
-    inputBufferLength  = irpStack->Parameters.DeviceIoControl.InputBufferLength;
-    outputBufferLength = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    //
+    // Discard the Rcv buffer contents, a reply is emminent. Only the reader
+    // may move RcvTail, so just tell it where the fresh data starts.
+    //
+    DeviceExtension->RcvDiscard = DeviceExtension->RcvHead;
 
-    switch (irpStack->MajorFunction) {
-        case IRP_MJ_CREATE:
-        {    
-            RS_DbgPrint ("RS485NT: IRP_MJ_CREATE\n");
-            break;
-        }
+    DeviceExtension->XmitActive = FALSE;
+    DeviceExtension->TurnaroundPending = FALSE;
+    DeviceExtension->FrameOpen = FALSE;
+    DeviceExtension->Stats.TxFrames++;
 
-        case IRP_MJ_CLOSE:
-        {
-            RS_DbgPrint ("RS485NT: IRP_MJ_CLOSE\n");
-            break;
+    //
+    // Schedule the DPC (where the Xmit done event is set)
+    //
+    InterlockedOr (&DeviceExtension->DpcEvents, RS485_DPC_XMIT_DONE);
+    KeInsertQueueDpc (DeviceExtension->IsrDpc, NULL, NULL);
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_TxTurnaround
+//
+// Description:
+//  Releases RTS if the last character has completely left the UART (both
+//  the holding and shift registers are empty). Synchronized with RS485_Isr
+//  because reading the LSR clears the receive error bits.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE    - RTS was released
+//      FALSE   - The UART is still shifting out the last character
+//
+BOOLEAN RS485_TxTurnaround (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    UCHAR   lsr;
+
+    if (!DeviceExtension->TurnaroundPending) {
+        return TRUE;
+    }
+
+    lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+    RS485_LineStatus (DeviceExtension, lsr);
+
+    if ((lsr & LSR_TX_BOTH_EMPTY) != LSR_TX_BOTH_EMPTY) {
+        return FALSE;
+    }
+
+    return RS485_ReleaseRts (DeviceExtension);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_RecordLatency
+//
+// Description:
+//  Adds a latency to a log2 histogram (IOCTL_RS485NT_GET_LATENCY). Called
+//  at or below DISPATCH_LEVEL.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      Histogram       - One of the DeviceExtension->Latency histograms
+//      Ticks           - The latency in performance counter ticks
+//
+// Return Value:
+//      none
+//
+VOID RS485_RecordLatency (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                          IN PRS485NT_HISTOGRAM Histogram, IN LONGLONG Ticks)
+{
+    ULONGLONG   Microseconds;
+    ULONG       Bucket;
+    KIRQL       OldIrql;
+
+    if (Ticks < 0) {
+        Ticks = 0;
+    }
+
+    Microseconds = (ULONGLONG)Ticks * 1000000 / DeviceExtension->PerfFrequency.QuadPart;
+
+    Bucket = 0;
+    while ((Bucket < RS485NT_LATENCY_BUCKETS - 1) && (Microseconds >> (Bucket + 1))) {
+        Bucket++;
+    }
+
+    KeAcquireSpinLock (&DeviceExtension->LatencyLock, &OldIrql);
+
+    Histogram->Bucket[Bucket]++;
+    Histogram->Count++;
+    Histogram->TotalMicroseconds += Microseconds;
+
+    if (Microseconds > Histogram->MaxMicroseconds) {
+        Histogram->MaxMicroseconds = Microseconds;
+    }
+
+    KeReleaseSpinLock (&DeviceExtension->LatencyLock, OldIrql);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ElapsedTime
+//
+// Description:
+//  Returns the time since a KeQueryPerformanceCounter sample in 100ns units.
+//  Whole seconds and the rest are converted apart: the tick count of a
+//  long interval times 10000000 overflows (after about a day at 10MHz).
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      StartTime       - Performance counter sample
+//
+// Return Value:
+//      Elapsed time in 100ns units
+//
+LONGLONG RS485_ElapsedTime (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                            IN LARGE_INTEGER StartTime)
+{
+    LARGE_INTEGER   Now;
+    LONGLONG        Ticks, Frequency;
+
+    Now = KeQueryPerformanceCounter (NULL);
+    Ticks = Now.QuadPart - StartTime.QuadPart;
+    Frequency = DeviceExtension->PerfFrequency.QuadPart;
+
+    return (Ticks / Frequency) * 10000000 + ((Ticks % Frequency) * 10000000) / Frequency;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_StartTurnaround
+//
+// Description:
+//  RTS turnaround engine. Called from the DPC once the last byte has moved
+//  into the shift register. The remaining shift time is one character time
+//  (from BaudRate and the frame format) less the DPC latency, so arm the
+//  high resolution timer to drop RTS just as the stop bit goes out. In
+//  RTS_TURNAROUND_POLL mode, or without a high resolution timer, poll the
+//  LSR here at DISPATCH_LEVEL instead, bounded by RTS_TURNAROUND_LIMIT.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_StartTurnaround (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    LONGLONG    Remaining;
+    LONGLONG    Limit;
+
+    if ((DeviceExtension->RtsTurnaround == RTS_TURNAROUND_TIMER) &&
+        (DeviceExtension->TurnaroundTimer != NULL)) {
+
+        Remaining = DeviceExtension->CharTime -
+                    RS485_ElapsedTime (DeviceExtension, DeviceExtension->XmitEmptyTime);
+
+        if (Remaining > 0) {
+            //
+            // Negative due time is relative
+            //
+            ExSetTimer (DeviceExtension->TurnaroundTimer, -Remaining, 0, NULL);
+            return;
         }
+    }
 
-        case IRP_MJ_READ:
-        {
-            RS_DbgPrint ("RS485NT: IRP_MJ_READ\n");
-            RS485_Read (deviceExtension, Irp);
+    //
+    // Bounded poll
+    //
+    Limit = DeviceExtension->CharTime * RTS_TURNAROUND_LIMIT;
+
+    while (!KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                    RS485_TxTurnaround, DeviceExtension)) {
+
+        if (RS485_ElapsedTime (DeviceExtension, DeviceExtension->XmitEmptyTime) > Limit) {
+            RS_DbgPrint ("RS485NT: TX empty never seen, forcing RTS off\n");
+            KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                    RS485_ReleaseRts, DeviceExtension);
             break;
         }
 
-        case IRP_MJ_WRITE:
-        {
-            RS_DbgPrint ("RS485NT: IRP_MJ_WRITE\n");
-            RS485_Write (deviceExtension, Irp);
-            break;
+        KeStallExecutionProcessor (1);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_TurnaroundTimer
+//
+// Description:
+//  High resolution timer callback armed by RS485_StartTurnaround. Drops RTS
+//  if the last stop bit is out, otherwise (the timer fired a little early)
+//  re-arms itself for a fraction of a character time. RTS is forced off
+//  after RTS_TURNAROUND_LIMIT character times.
+//
+// Arguments:
+//      Timer   - The turnaround timer
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_TurnaroundTimer (IN PEX_TIMER Timer, IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    LONGLONG    Limit;
+
+    if (KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_TxTurnaround, DeviceExtension)) {
+        return;
+    }
+
+    Limit = DeviceExtension->CharTime * RTS_TURNAROUND_LIMIT;
+
+    if (RS485_ElapsedTime (DeviceExtension, DeviceExtension->XmitEmptyTime) > Limit) {
+        RS_DbgPrint ("RS485NT: TX empty never seen, forcing RTS off\n");
+        KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_ReleaseRts, DeviceExtension);
+    } else {
+        ExSetTimer (Timer, -(LONGLONG)(DeviceExtension->CharTime / 8 + 1), 0, NULL);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_BusStart
+//
+// Description:
+//  Starts the transmission set up in XmitBufferPosition. With "Bus Idle
+//  Chars" set (listen before talk) it waits for the bus to be idle that
+//  long, and for any collision backoff, from the bus timer.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_BusStart (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    if ((DeviceExtension->BusIdleChars == 0) || (DeviceExtension->BusTimer == NULL)) {
+        KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_StartXmit, DeviceExtension);
+        return;
+    }
+
+    if (!KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                 RS485_StartXmitIdle, DeviceExtension)) {
+        ExSetTimer (DeviceExtension->BusTimer, -DeviceExtension->BusWait, 0, NULL);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_StartXmitIdle
+//
+// Description:
+//  Listen before talk: starts the transmission if nothing has been heard
+//  for Bus Idle Chars character times, the receiver is empty and any
+//  backoff is over. Otherwise leaves the time to wait in BusWait.
+//  Synchronized with RS485_Isr, which keeps BusLastActivity. Compared in
+//  performance counter ticks, counter values scaled to 100ns overflow.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE    - Transmission started
+//      FALSE   - Bus busy, try again in BusWait
+//
+BOOLEAN RS485_StartXmitIdle (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    LONGLONG    Idle, Wait, Now, Frequency;
+    UCHAR       lsr;
+
+    Frequency = DeviceExtension->PerfFrequency.QuadPart;
+    Now = KeQueryPerformanceCounter (NULL).QuadPart;
+
+    Idle = ((LONGLONG)DeviceExtension->BusIdleChars * DeviceExtension->CharTime * Frequency) /
+           10000000;
+
+    Wait = Idle - (Now - DeviceExtension->BusLastActivity.QuadPart);
+
+    //
+    // A backoff, unless there is none or it is over
+    //
+    if ((DeviceExtension->BusHoldoff.QuadPart != 0) &&
+        (DeviceExtension->BusHoldoff.QuadPart - Now > Wait)) {
+        Wait = DeviceExtension->BusHoldoff.QuadPart - Now;
+    }
+
+    //
+    // Bytes below the RX FIFO trigger level haven't interrupted yet
+    //
+    lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+    RS485_LineStatus (DeviceExtension, lsr);
+
+    if ((lsr & LSR_RX_DATA_READY) && (Wait < Idle)) {
+        Wait = Idle;
+    }
+
+    if (Wait > 0) {
+        if (!DeviceExtension->BusDeferred) {
+            DeviceExtension->BusDeferred = TRUE;
+            DeviceExtension->BusDeferTime.QuadPart = Now;
+            DeviceExtension->Stats.BusDeferrals++;
         }
+        DeviceExtension->BusWait = (Wait * 10000000 + Frequency - 1) / Frequency;
+        return FALSE;
+    }
 
-        case IRP_MJ_DEVICE_CONTROL:
-        {
-            RS_DbgPrint ("RS485NT: IRP_MJ_DEVICE_CONTROL - ");
-    
-            ioControlCode = irpStack->Parameters.DeviceIoControl.IoControlCode;
-    
-            switch (ioControlCode)
-            {
-                case IOCTL_RS485NT_HELLO:
-                {
-                    RS_DbgPrint ("HELLO\n");
-                            
-                    //
-                    // Some app is saying hello
-                    //
+    DeviceExtension->BusDeferred = FALSE;
+
+    return RS485_StartXmit (DeviceExtension);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_BusTimer
+//
+// Description:
+//  High resolution timer callback armed by RS485_BusStart. Starts the
+//  deferred transmission once the bus is idle, otherwise re-arms itself.
+//  StartIo took the write's cancel routine, so after RS485_BUS_WAIT_LIMIT
+//  it fails the write with STATUS_IO_TIMEOUT instead of waiting on.
+//
+// Arguments:
+//      Timer   - The bus timer
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_BusTimer (IN PEX_TIMER Timer, IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    PDEVICE_OBJECT  DeviceObject = DeviceExtension->DeviceObject;
+    PIRP            CurrentIrp;
+
+    if (KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_StartXmitIdle, DeviceExtension)) {
+        return;
+    }
+
+    CurrentIrp = DeviceObject->CurrentIrp;
+
+    if ((CurrentIrp != NULL) &&
+        (RS485_ElapsedTime (DeviceExtension, DeviceExtension->BusDeferTime) >
+         RS485_BUS_WAIT_LIMIT)) {
+        RS_DbgPrint ("RS485NT: Bus busy too long, write failed\n");
+        DeviceExtension->BusDeferred = FALSE;
+        DeviceExtension->Stats.BusTimeouts++;
+
+        CurrentIrp->IoStatus.Status = STATUS_IO_TIMEOUT;
+        CurrentIrp->IoStatus.Information = 0;
+
+        IoStartNextPacket (DeviceObject, TRUE);
+        IoCompleteRequest (CurrentIrp, IO_NO_INCREMENT);
+        return;
+    }
+
+    ExSetTimer (Timer, -DeviceExtension->BusWait, 0, NULL);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_BusCollision
+//
+// Description:
+//  Called from the DPC once a write or transaction request is on the
+//  wire. With listen before talk, a collision seen in the echo sends it
+//  again after a random exponential backoff.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      STATUS_SUCCESS          - Sent, carry on
+//      STATUS_PENDING          - Collided, being sent again
+//      STATUS_IO_DEVICE_ERROR  - Collided RS485_BACKOFF_LIMIT times
+//
+NTSTATUS RS485_BusCollision (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    LONGLONG    Backoff;
+    ULONG       Exponent;
+    ULONG       Random;
+
+    if ((DeviceExtension->BusIdleChars == 0) || (DeviceExtension->BusTimer == NULL) ||
+        !DeviceExtension->EchoCollision) {
+        return STATUS_SUCCESS;
+    }
+
+    DeviceExtension->BusAttempts++;
+
+    if (DeviceExtension->BusAttempts >= RS485_BACKOFF_LIMIT) {
+        RS_DbgPrint ("RS485NT: Excessive collisions, write failed\n");
+        DeviceExtension->Stats.ExcessiveCollisions++;
+        return STATUS_IO_DEVICE_ERROR;
+    }
+
+    //
+    // xorshift32, good enough to keep two stations apart
+    //
+    Random = DeviceExtension->BusRandom;
+    Random ^= Random << 13;
+    Random ^= Random >> 17;
+    Random ^= Random << 5;
+    DeviceExtension->BusRandom = Random;
+
+    Exponent = DeviceExtension->BusAttempts;
+    if (Exponent > RS485_BACKOFF_MAX_EXP) {
+        Exponent = RS485_BACKOFF_MAX_EXP;
+    }
+
+    //
+    // Slots to performance counter ticks
+    //
+    Backoff = (LONGLONG)(Random & ((1 << Exponent) - 1)) *
+              DeviceExtension->BusIdleChars * DeviceExtension->CharTime;
+    DeviceExtension->BusHoldoff.QuadPart = KeQueryPerformanceCounter (NULL).QuadPart +
+        (Backoff * DeviceExtension->PerfFrequency.QuadPart) / 10000000;
+
+    DeviceExtension->XmitBufferPosition = DeviceExtension->XmitBufferStart;
+    DeviceExtension->XmitBufferCount = DeviceExtension->XmitLength;
+    DeviceExtension->Stats.BackoffRetries++;
+
+    RS485_BusStart (DeviceExtension);
+
+    return STATUS_PENDING;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_PollCheck
+//
+// Description:
+//  Rx Poll Mode 1: called from the DPC on new receive data. Once the
+//  receive interrupt rate over the last RS485_POLL_WINDOW is above Rx Poll
+//  Threshold, masks the receive interrupts and starts the poll timer.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_PollCheck (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    LONGLONG    Elapsed, Now, Frequency;
+    LONGLONG    Rate;
+
+    if ((DeviceExtension->PollMode != POLL_MODE_ADAPTIVE) ||
+        (DeviceExtension->PollTimer == NULL) || DeviceExtension->PollActive) {
+        return;
+    }
+
+    //
+    // The window in performance counter ticks
+    //
+    Frequency = DeviceExtension->PerfFrequency.QuadPart;
+    Now = KeQueryPerformanceCounter (NULL).QuadPart;
+
+    Elapsed = Now - DeviceExtension->PollWindowStart.QuadPart;
+    if (Elapsed < (RS485_POLL_WINDOW * Frequency) / 10000000) {
+        return;
+    }
+
+    Rate = (InterlockedExchange (&DeviceExtension->PollWindowInterrupts, 0) * Frequency) /
+           Elapsed;
+    DeviceExtension->PollWindowStart.QuadPart = Now;
+
+    if (Rate > DeviceExtension->PollThreshold) {
+        RS_DbgPrint ("RS485NT: Receive polling on\n");
+        KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_PollStart, DeviceExtension);
+        ExSetTimer (DeviceExtension->PollTimer, -RS485_PollInterval (DeviceExtension), 0, NULL);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_PollInterval
+//
+// Description:
+//  Time between polls in 100ns units: Rx Poll Interval, or by default
+//  the time to half fill the RX FIFO (at least one character time), so
+//  the FIFO can't overrun between polls.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      Poll interval
+//
+LONGLONG RS485_PollInterval (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    ULONG   Chars;
+
+    if (DeviceExtension->PollIntervalSetting) {
+        return (LONGLONG)DeviceExtension->PollIntervalSetting * 10;
+    }
+
+    Chars = DeviceExtension->FifoEnabled ? DeviceExtension->FifoDepth / 2 : 1;
+
+    return (LONGLONG)DeviceExtension->CharTime * (Chars ? Chars : 1);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_PollStart
+//
+// Description:
+//  Masks the receive interrupts, the poll timer drains the receiver from
+//  now on. Synchronized with RS485_Isr.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_PollStart (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    UCHAR   ch;
+
+    DeviceExtension->PollActive = TRUE;
+    DeviceExtension->PollIdle = 0;
+    DeviceExtension->Stats.PollEntries++;
+
+    ch = READ_PORT_UCHAR (DeviceExtension->ComPort.IER) &
+         IER_DISABLE_RX_DATA_READY_IRQ & IER_DISABLE_RX_ERROR_IRQ;
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.IER, ch);
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_Poll
+//
+// Description:
+//  One receive poll: drains the receiver like the ISR would and keeps the
+//  Rx Poll Mode counters. The interrupts saved are those the RX FIFO
+//  trigger level would have taken for the bytes read. The added delay is
+//  an estimate: the oldest byte has waited about one character time per
+//  byte read, the interrupt would have come after the trigger level. In
+//  Rx Poll Mode 2 it also refills the transmitter. In mode 1, after
+//  RS485_POLL_IDLE empty polls, lets the receive interrupts back on.
+//  Synchronized with RS485_Isr.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE    - Keep polling
+//      FALSE   - Back on interrupts
+//
+BOOLEAN RS485_Poll (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    LARGE_INTEGER   Now;
+    ULONGLONG   Delay;
+    ULONG   Count, Trigger;
+    UCHAR   lsr, ch;
+
+    //
+    // The loopback self test has the UART
+    //
+    if (DeviceExtension->SelfTest != NULL) {
+        return TRUE;
+    }
+
+    Now = KeQueryPerformanceCounter (NULL);
+    DeviceExtension->Stats.Polls++;
+
+    lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+    RS485_LineStatus (DeviceExtension, lsr);
+
+    Count = 0;
+    if (lsr & LSR_RX_DATA_READY) {
+        Count = RS485_RxDrain (DeviceExtension, Now);
+    }
+
+    if (Count) {
+        Trigger = DeviceExtension->FifoEnabled ? DeviceExtension->RxTriggerLevel : 1;
+        if (Trigger == 0) {
+            Trigger = 1;
+        }
+
+        DeviceExtension->PollIdle = 0;
+        DeviceExtension->Stats.PolledBytes += Count;
+        DeviceExtension->Stats.InterruptsSaved += (Count + Trigger - 1) / Trigger;
+
+        Delay = 0;
+        if (Count > Trigger) {
+            Delay = ((ULONGLONG)(Count - Trigger) * DeviceExtension->CharTime) / 10;
+        }
+        DeviceExtension->Stats.PollDelayTotal += Delay;
+        if (Delay > DeviceExtension->Stats.PollDelayMax) {
+            DeviceExtension->Stats.PollDelayMax = Delay;
+        }
+    } else {
+        DeviceExtension->PollIdle++;
+    }
+
+    if (DeviceExtension->PollMode == POLL_MODE_ALWAYS) {
+        if (DeviceExtension->XmitActive && (lsr & LSR_TX_BUFFER_EMPTY)) {
+            RS485_TxEmpty (DeviceExtension, Now);
+        }
+        return TRUE;
+    }
+
+    if (DeviceExtension->PollIdle < RS485_POLL_IDLE) {
+        return TRUE;
+    }
+
+    //
+    // Quiet again. Gated Echo Mode turns them on when RTS drops.
+    //
+    DeviceExtension->PollActive = FALSE;
+    DeviceExtension->PollWindowStart = Now;
+    DeviceExtension->PollWindowInterrupts = 0;
+
+    if (!(DeviceExtension->XmitActive && (DeviceExtension->EchoMode == ECHO_MODE_GATE))) {
+        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.IER) |
+             IER_ENABLE_RX_DATA_READY_IRQ | IER_ENABLE_RX_ERROR_IRQ;
+        WRITE_PORT_UCHAR (DeviceExtension->ComPort.IER, ch);
+    }
+
+    return FALSE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_PollTimer
+//
+// Description:
+//  High resolution timer callback, polls the UART every RS485_PollInterval
+//  while receive polling is on (always in Rx Poll Mode 2).
+//
+// Arguments:
+//      Timer   - The poll timer
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_PollTimer (IN PEX_TIMER Timer, IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+
+    if (KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_Poll, DeviceExtension)) {
+        ExSetTimer (Timer, -RS485_PollInterval (DeviceExtension), 0, NULL);
+    } else {
+        RS_DbgPrint ("RS485NT: Receive polling off\n");
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_FrameByte
+//
+// Description:
+//  Modbus RTU framing, called from RS485_Isr for every received byte with
+//  its performance counter timestamp. A silence longer than t3.5 before
+//  the byte ends the previous frame (in case RS485_FrameTimer hasn't
+//  already), a gap longer than t1.5 inside a frame is counted as a
+//  violation.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      Index           - Receive ring index the byte goes to
+//      Now             - Performance counter when the byte was read
+//
+// Return Value:
+//      none
+//
+VOID RS485_FrameByte (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                      IN ULONG Index, IN LARGE_INTEGER Now)
+{
+    LONGLONG    Gap;
+
+    if (DeviceExtension->FrameOpen) {
+
+        Gap = Now.QuadPart - DeviceExtension->FrameLastRxTime.QuadPart;
+
+        if (Gap > DeviceExtension->FrameT35) {
+            RS485_FrameMark (DeviceExtension, Index);
+        } else if (Gap > DeviceExtension->FrameT15) {
+            DeviceExtension->FrameGapErrors++;
+        }
+    }
+
+    DeviceExtension->FrameOpen = TRUE;
+    DeviceExtension->FrameLastRxTime = Now;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_FrameMark
+//
+// Description:
+//  Ends the open frame at receive ring index Index and queues the frame
+//  end for the read path. Called from RS485_Isr or synchronized with it.
+//  The reader waits for RcvHead to cover the frame before using it.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      Index           - Receive ring index just past the last frame byte
+//
+// Return Value:
+//      none
+//
+VOID RS485_FrameMark (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN ULONG Index)
+{
+    ULONG   Head;
+
+    Head = DeviceExtension->FrameHead;
+
+    if (Head - DeviceExtension->FrameTail < RS485_FRAME_QUEUE) {
+        DeviceExtension->FrameEnd[Head & (RS485_FRAME_QUEUE - 1)] = Index;
+        KeMemoryBarrier ();
+        DeviceExtension->FrameHead = Head + 1;
+        DeviceExtension->FrameCount++;
+        DeviceExtension->Stats.RxFrames++;
+    } else {
+        //
+        // The frame merges with the next one
+        //
+        DeviceExtension->FrameOverflow++;
+    }
+
+    DeviceExtension->FrameOpen = FALSE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_FrameTimeout
+//
+// Description:
+//  Ends the open frame once the line has been silent for t3.5. Leaves it
+//  open if the receiver still holds data, the ISR is about to see it.
+//  Synchronized with RS485_Isr.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE    - No frame open (any more)
+//      FALSE   - The frame is still open, check again later
+//
+BOOLEAN RS485_FrameTimeout (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    UCHAR   lsr;
+
+    if (!DeviceExtension->FrameOpen) {
+        return TRUE;
+    }
+
+    if (RS485_ElapsedTime (DeviceExtension, DeviceExtension->FrameLastRxTime) <
+        DeviceExtension->FrameSilence) {
+        return FALSE;
+    }
+
+    //
+    // This read clears any receive error the ISR hasn't seen yet
+    //
+    lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+    RS485_LineStatus (DeviceExtension, lsr);
+
+    if (lsr & LSR_RX_DATA_READY) {
+        return FALSE;
+    }
+
+    RS485_FrameMark (DeviceExtension, DeviceExtension->RcvHead);
+
+    //
+    // Let the DPC complete the read waiting for this frame
+    //
+    InterlockedOr (&DeviceExtension->DpcEvents, RS485_DPC_RX_DATA);
+    KeInsertQueueDpc (DeviceExtension->IsrDpc, NULL, NULL);
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_FrameTimer
+//
+// Description:
+//  High resolution timer callback, armed by the DPC for t3.5 after the last
+//  received byte. Ends the frame if the line is still silent, otherwise
+//  re-arms itself for the rest of the silence time.
+//
+// Arguments:
+//      Timer   - The frame timer
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_FrameTimer (IN PEX_TIMER Timer, IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    LONGLONG    Remaining;
+
+    if (KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_FrameTimeout, DeviceExtension)) {
+        return;
+    }
+
+    Remaining = DeviceExtension->FrameSilence -
+                RS485_ElapsedTime (DeviceExtension, DeviceExtension->FrameLastRxTime);
+
+    if (Remaining <= 0) {
+        //
+        // Silent long enough but the receiver has data, give the ISR a
+        // fraction of a character time
+        //
+        Remaining = DeviceExtension->CharTime / 8 + 1;
+    }
+
+    ExSetTimer (Timer, -Remaining, 0, NULL);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_Dpc_Routine
+//
+// Description:
+//  This DPC for ISR is issued by RS485_Isr to complete Transmit processing.
+//  It starts the RTS turnaround once the last byte is in the shift register
+//  and, once RTS has been released, completes the current write IRP and
+//  starts the next queued one. New receive data is handed to any pending
+//  read.
+//
+// Arguments:
+//      Dpc             - not used
+//      DeviceObject    - Pointer to the Device object
+//      Irp             - not used
+//      Context         - not used
+//
+// Return Value:
+//      none
+//
+VOID RS485_Dpc_Routine (IN PKDPC Dpc, IN PDEVICE_OBJECT DeviceObject, 
+                        IN PIRP Irp, IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension;
+    PIRP    CurrentIrp;
+    NTSTATUS Status;
+    LONG    Events;
+    LONGLONG Remaining;
+    LONGLONG Now, IsrTime, Arrival;
+    ULONG   Processor;
+
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Irp);
+    UNREFERENCED_PARAMETER(Dpc);
+
+    DeviceExtension = DeviceObject->DeviceExtension;
+    //
+    // Right after RS485_SetProcessors retargets the ISR, the old and the new
+    // DPC object can both be running, so the run counters are interlocked
+    //
+    InterlockedIncrement64 (&DeviceExtension->DpcRuns);
+
+    Processor = KeGetCurrentProcessorNumber ();
+    if (Processor < RS485NT_MAX_PROCESSORS) {
+        InterlockedIncrement64 ((volatile LONGLONG *)&DeviceExtension->DpcProcessorRuns[Processor]);
+    }
+
+    Now = KeQueryPerformanceCounter (NULL).QuadPart;
+
+    IsrTime = InterlockedExchange64 (&DeviceExtension->DpcIsrTime, 0);
+    if (IsrTime) {
+        RS485_RecordLatency (DeviceExtension, &DeviceExtension->Latency.IsrToDpc,
+                             Now - IsrTime);
+    }
+
+    Events = InterlockedExchange (&DeviceExtension->DpcEvents, 0);
+
+    if (Events & RS485_DPC_XMIT_EMPTY) {
+        RS485_StartTurnaround (DeviceExtension);
+    }
+
+    if (Events & RS485_DPC_XMIT_DONE) {
+
+        CurrentIrp = DeviceObject->CurrentIrp;
+
+        Status = STATUS_SUCCESS;
+        if (CurrentIrp != NULL) {
+            Status = RS485_BusCollision (DeviceExtension);
+        }
+
+        if (Status == STATUS_PENDING) {
+            //
+            // Collided, going out again after the backoff
+            //
+        } else if (!NT_SUCCESS (Status)) {
+            CurrentIrp->IoStatus.Status = Status;
+            CurrentIrp->IoStatus.Information = 0;
+
+            IoStartNextPacket (DeviceObject, TRUE);
+            IoCompleteRequest (CurrentIrp, IO_NO_INCREMENT);
+
+        } else if ((CurrentIrp != NULL) && RS485_IsTransact (CurrentIrp)) {
+            //
+            // The request is on the wire, keep the bus and hand the
+            // transaction to the read engine for the response
+            //
+            RS485_StartResponse (DeviceExtension, CurrentIrp);
+
+        } else if (CurrentIrp != NULL) {
+            //
+            // The write is on the wire, complete it and start the next one
+            //
+            CurrentIrp->IoStatus.Status = STATUS_SUCCESS;
+            CurrentIrp->IoStatus.Information =
+                IoGetCurrentIrpStackLocation(CurrentIrp)->Parameters.Write.Length;
+
+            Arrival = IoGetCurrentIrpStackLocation(CurrentIrp)->Parameters.Write.ByteOffset.QuadPart;
+            RS485_RecordLatency (DeviceExtension, &DeviceExtension->Latency.WriteToWire,
+                                 DeviceExtension->XmitStartTime - Arrival);
+            RS485_RecordLatency (DeviceExtension, &DeviceExtension->Latency.WriteService,
+                                 Now - Arrival);
+
+            IoStartNextPacket (DeviceObject, TRUE);
+            IoCompleteRequest (CurrentIrp, IO_SERIAL_INCREMENT);
+
+            RS_DbgPrint ("RS485NT: Dpc Routine write complete\n");
+
+        } else {
+            //
+            // Sent from the mapped TX ring, send whatever was queued since
+            //
+            RS485_RingXmitDone (DeviceExtension);
+        }
+    }
+
+    if (Events & RS485_DPC_RX_DATA) {
+
+        RS485_PollCheck (DeviceExtension);
+
+        //
+        // Frame mode: (re)start the t3.5 silence timer from the last byte
+        //
+        if (DeviceExtension->FrameOpen && (DeviceExtension->FrameTimer != NULL)) {
+
+            Remaining = DeviceExtension->FrameSilence -
+                        RS485_ElapsedTime (DeviceExtension, DeviceExtension->FrameLastRxTime);
+
+            ExSetTimer (DeviceExtension->FrameTimer,
+                        -((Remaining > 0) ? Remaining : 1), 0, NULL);
+        }
+
+        RS485_ProcessReads (DeviceExtension);
+    }
+    return;
+}
+
+
+//---------------------------------------------------------------------------
+// ReportUsage
+//
+// Description:
+//  This routine registers (reports) the I/O and IRQ usage for this driver.
+//
+// Arguments:
+//      DriverObject    - Pointer to the driver object
+//      DeviceObject    - Pointer to the Device object
+//      PortAddress     - Address of I/O port used
+//      ConflictDetected - TRUE if a resource conflict was detected.
+//
+// Return Value:
+//      TRUE    - If a Resource conflict was detected
+//      FALSE   - If no conflict was detected
+//
+BOOLEAN ReportUsage(IN PDRIVER_OBJECT DriverObject,
+                    IN PDEVICE_OBJECT DeviceObject,
+                    IN PHYSICAL_ADDRESS PortAddress,
+                    IN BOOLEAN *ConflictDetected)
+{
+    PRS485NT_DEVICE_EXTENSION extension;
+
+    ULONG sizeOfResourceList;
+    PCM_RESOURCE_LIST resourceList;
+    PCM_FULL_RESOURCE_DESCRIPTOR nextFrd;
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR partial;
+
+    extension = (PRS485NT_DEVICE_EXTENSION) DeviceObject->DeviceExtension;
+
+    //
+    // The size of the resource list is going to be one full descriptor
+    // which already has one partial descriptor included, plus another
+    // partial descriptor. One partial descriptor will be for the
+    // interrupt, and the other for the port addresses.
+    //
+    sizeOfResourceList = sizeof(CM_FULL_RESOURCE_DESCRIPTOR);
+
+    //
+    // The full resource descriptor already contains one
+    // partial.	Make room for one more.
+    //
+    // It will hold the irq "prd", and the port "prd".
+    //    ("prd" = partial resource descriptor)
+    //
+    sizeOfResourceList += sizeof(CM_PARTIAL_RESOURCE_DESCRIPTOR);
+
+    //
+    // Now we increment the length of the resource list by field offset
+    // of the first frd.   This will give us the length of what preceeds
+    // the first frd in the resource list.
+    //   (frd = full resource descriptor)
+    //
+    sizeOfResourceList += FIELD_OFFSET(CM_RESOURCE_LIST, List[0]);
+
+    resourceList = ExAllocatePoolWithTag(PagedPool, sizeOfResourceList, MEMORY_TAG);
+
+    if (!resourceList) {
+        return FALSE;
+    }
+
+    //
+    // Zero out the list
+    //
+    RtlZeroMemory(resourceList, sizeOfResourceList);
+
+    resourceList->Count = 1;
+    nextFrd = &resourceList->List[0];
+
+    nextFrd->InterfaceType = Isa;
+    nextFrd->BusNumber = 0;
+
+    //
+    // We are going to report port addresses and interrupt
+    //
+    nextFrd->PartialResourceList.Count = 2;
+
+    //
+    // Now fill in the port data.  We don't wish to share
+    // this port range with anyone.
+    //
+    // Note: the port address we pass in is the one we got
+    // back from HalTranslateBusAddress.
+    //
+    partial = &nextFrd->PartialResourceList.PartialDescriptors[0];
+
+    partial->Type = CmResourceTypePort;
+    partial->ShareDisposition = CmResourceShareDriverExclusive;
+    partial->Flags = CM_RESOURCE_PORT_IO;
+    partial->u.Port.Start = PortAddress;
+    partial->u.Port.Length = DEF_PORT_RANGE;
+
+    partial++;
+
+    //
+    // Now fill in the irq stuff.
+    //
+    // Note: for IoReportResourceUsage, the Interrupt.Level and
+    // Interrupt.Vector are bus-specific level and vector, just
+    // as we passed in to HalGetInterruptVector, not the mapped
+    // system vector we got back from HalGetInterruptVector.
+    //
+    partial->Type = CmResourceTypeInterrupt;
+    partial->u.Interrupt.Level = extension->IRQLine;
+    partial->u.Interrupt.Vector = extension->IRQLine;
+    partial->ShareDisposition = CmResourceShareDriverExclusive;
+    partial->Flags = CM_RESOURCE_INTERRUPT_LATCHED;
+
+    IoReportResourceForDetection (
+        DriverObject,
+        resourceList,
+        sizeOfResourceList,
+        NULL,
+        NULL,
+        0,
+        ConflictDetected);
+
+    //
+    // The above routine sets the BOOLEAN parameter ConflictDetected
+    // to TRUE if a conflict was detected.
+    //
+    ExFreePool(resourceList);
+
+    return (*ConflictDetected);
+}
+
+
+//---------------------------------------------------------------------------
+//
+//
+// Routine Description:
+// 
+//     Process the IRPs sent to this device.
+// 
+// Arguments:
+// 
+//     DeviceObject - pointer to a device object
+// 
+//     Irp          - pointer to an I/O Request Packet
+// 
+// Return Value:
+// 
+// 
+NTSTATUS DispatchRoutine (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
+{
+    PIO_STACK_LOCATION  irpStack;
+    PRS485NT_DEVICE_EXTENSION   deviceExtension;
+    PVOID               ioBuffer;
+    ULONG               inputBufferLength;
+    ULONG               outputBufferLength;
+    ULONG               ioControlCode;
+    NTSTATUS            ntStatus;
+
+    LARGE_INTEGER       ElapsedTime;
+    
+    Irp->IoStatus.Status      = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+
+    //
+    // Get a pointer to the current location in the Irp. This is where
+    //     the function codes and parameters are located.
+    //
+
+    irpStack = IoGetCurrentIrpStackLocation (Irp);
+
+    //
+    // Get a pointer to the device extension
+    //
+
+    deviceExtension = DeviceObject->DeviceExtension;
+
+    //
+    // Get the pointer to the input/output buffer and it's length
+    //
+
+    ioBuffer           = Irp->AssociatedIrp.SystemBuffer;
+    inputBufferLength  = irpStack->Parameters.DeviceIoControl.InputBufferLength;
+    outputBufferLength = irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+
+    switch (irpStack->MajorFunction) {
+        case IRP_MJ_CREATE:
+        {    
+            RS_DbgPrint ("RS485NT: IRP_MJ_CREATE\n");
+            break;
+        }
+
+        case IRP_MJ_CLOSE:
+        {
+            RS_DbgPrint ("RS485NT: IRP_MJ_CLOSE\n");
+            break;
+        }
+
+        case IRP_MJ_CLEANUP:
+        {
+            //
+            // The handle is closing, don't leave reads waiting for data.
+            // The rings go with the handle that mapped them.
+            //
+            RS_DbgPrint ("RS485NT: IRP_MJ_CLEANUP\n");
+            RS485_FlushReads (deviceExtension);
+            RS485_UnmapRings (deviceExtension, irpStack->FileObject);
+            break;
+        }
+
+        case IRP_MJ_READ:
+        {
+            RS_DbgPrint ("RS485NT: IRP_MJ_READ\n");
+            if (RS485_Read (deviceExtension, Irp) == STATUS_PENDING) {
+                //
+                // Queued, completed when the data (or a timeout) arrives
+                //
+                return STATUS_PENDING;
+            }
+            break;
+        }
+
+        case IRP_MJ_WRITE:
+        {
+            RS_DbgPrint ("RS485NT: IRP_MJ_WRITE\n");
+            if (RS485_Write (deviceExtension, Irp) == STATUS_PENDING) {
+                //
+                // Queued for RS485_StartIo, RS485_Dpc_Routine completes it
+                //
+                return STATUS_PENDING;
+            }
+            break;
+        }
+
+        case IRP_MJ_DEVICE_CONTROL:
+        {
+            RS_DbgPrint ("RS485NT: IRP_MJ_DEVICE_CONTROL - ");
+    
+            ioControlCode = irpStack->Parameters.DeviceIoControl.IoControlCode;
+    
+            switch (ioControlCode)
+            {
+                case IOCTL_RS485NT_HELLO:
+                {
+                    RS_DbgPrint ("HELLO\n");
+                            
+                    //
+                    // Some app is saying hello
+                    //
+
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_RCV_COUNT:
+                {
+                    RS_DbgPrint ("GET_RCV_COUNT\n");
+                    if (outputBufferLength >= 4) {
+                        //
+                        // Return the current receive buffer count
+                        //
+
+                        *(ULONG *)ioBuffer = RS485_RcvCount (deviceExtension);
+
+                        Irp->IoStatus.Information = 4;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_LAST_RCVD_TIME:
+                {
+                    RS_DbgPrint ("LAST_RCVD_TIME\n");
+                    if (outputBufferLength >= 8) {
+
+                        //
+                        // The ISR only keeps the raw performance counter,
+                        // convert to Milliseconds here. Ticks are divided
+                        // down, scaled up first they overflow after a day.
+                        //
+                        ElapsedTime = KeQueryPerformanceCounter (NULL);
+                        ElapsedTime.QuadPart = (ElapsedTime.QuadPart -
+                                                deviceExtension->LastActivityTime.QuadPart) /
+                                               (deviceExtension->PerfFrequency.QuadPart / 1000);
+
+                        RtlMoveMemory (ioBuffer, &ElapsedTime, 8);
+                        Irp->IoStatus.Information = 8;
+                    }
+
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_RCV_STATUS:
+                {
+                    PRS485NT_RCV_STATUS RcvStatus = ioBuffer;
+
+                    RS_DbgPrint ("GET_RCV_STATUS\n");
+                    if (outputBufferLength >= sizeof(RS485NT_RCV_STATUS)) {
+
+                        RcvStatus->RcvCount = RS485_RcvCount (deviceExtension);
+                        RcvStatus->RcvOverflow = deviceExtension->RcvOverflow;
+                        RcvStatus->RcvError = deviceExtension->RcvError;
+
+                        Irp->IoStatus.Information = sizeof(RS485NT_RCV_STATUS);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_STATS:
+                {
+                    RS485NT_STATS_SNAPSHOT Snapshot;
+
+                    RS_DbgPrint ("GET_STATS\n");
+                    if (outputBufferLength >= sizeof(RS485NT_STATS)) {
+
+                        //
+                        // The flags share the buffer with the result
+                        //
+                        Snapshot.DeviceExtension = deviceExtension;
+                        Snapshot.Stats = ioBuffer;
+                        Snapshot.Reset = (inputBufferLength >= sizeof(ULONG)) &&
+                                         (*(ULONG *)ioBuffer & RS485NT_STATS_RESET);
+
+                        KeSynchronizeExecution (deviceExtension->InterruptObject,
+                                                RS485_SnapshotStats, &Snapshot);
+
+                        Irp->IoStatus.Information = sizeof(RS485NT_STATS);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_LATENCY:
+                {
+                    KIRQL OldIrql;
+                    BOOLEAN Reset;
+
+                    RS_DbgPrint ("GET_LATENCY\n");
+                    if (outputBufferLength >= sizeof(RS485NT_LATENCY)) {
+
+                        //
+                        // The flags share the buffer with the result
+                        //
+                        Reset = (inputBufferLength >= sizeof(ULONG)) &&
+                                (*(ULONG *)ioBuffer & RS485NT_LATENCY_RESET);
+
+                        KeAcquireSpinLock (&deviceExtension->LatencyLock, &OldIrql);
+                        RtlMoveMemory (ioBuffer, &deviceExtension->Latency,
+                                       sizeof(RS485NT_LATENCY));
+                        if (Reset) {
+                            RtlZeroMemory (&deviceExtension->Latency, sizeof(RS485NT_LATENCY));
+                        }
+                        KeReleaseSpinLock (&deviceExtension->LatencyLock, OldIrql);
+
+                        Irp->IoStatus.Information = sizeof(RS485NT_LATENCY);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_READ_TIMESTAMPED:
+                {
+                    RS_DbgPrint ("READ_TIMESTAMPED\n");
+                    Irp->IoStatus.Status = RS485_ReadTimestamped (deviceExtension, Irp);
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_FRAME_STATUS:
+                {
+                    PRS485NT_FRAME_STATUS FrameStatus = ioBuffer;
+
+                    RS_DbgPrint ("GET_FRAME_STATUS\n");
+                    if (outputBufferLength >= sizeof(RS485NT_FRAME_STATUS)) {
+
+                        FrameStatus->FrameCount = deviceExtension->FrameCount;
+                        FrameStatus->GapErrors = deviceExtension->FrameGapErrors;
+                        FrameStatus->FrameOverflow = deviceExtension->FrameOverflow;
+
+                        Irp->IoStatus.Information = sizeof(RS485NT_FRAME_STATUS);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_SET_LINE_SETTINGS:
+                {
+                    RS_DbgPrint ("SET_LINE_SETTINGS\n");
+                    if (RS485_SetLineSettings (deviceExtension, Irp) == STATUS_PENDING) {
+                        //
+                        // Queued behind the writes, RS485_StartIo applies it
+                        //
+                        return STATUS_PENDING;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_SELF_TEST:
+                {
+                    RS_DbgPrint ("SELF_TEST\n");
+                    if (RS485_SelfTestRequest (deviceExtension, Irp) == STATUS_PENDING) {
+                        //
+                        // Queued behind the writes, RS485_StartIo runs it
+                        //
+                        return STATUS_PENDING;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_LOAD_SELF_TEST:
+                {
+                    RS_DbgPrint ("GET_LOAD_SELF_TEST\n");
+                    if (!deviceExtension->LoadSelfTestDone) {
+                        Irp->IoStatus.Status = STATUS_INVALID_DEVICE_STATE;
+                    } else if (outputBufferLength >= sizeof(RS485NT_SELF_TEST_RESULT)) {
+                        RtlMoveMemory (ioBuffer, &deviceExtension->LoadSelfTest,
+                                       sizeof(RS485NT_SELF_TEST_RESULT));
+                        Irp->IoStatus.Information = sizeof(RS485NT_SELF_TEST_RESULT);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_SET_PROCESSORS:
+                {
+                    RS_DbgPrint ("SET_PROCESSORS\n");
+                    Irp->IoStatus.Status = RS485_SetProcessors (deviceExtension, Irp);
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_PROCESSORS:
+                {
+                    RS_DbgPrint ("GET_PROCESSORS\n");
+                    if (outputBufferLength >= sizeof(RS485NT_PROCESSORS)) {
+                        RS485_GetProcessors (deviceExtension, ioBuffer);
+                        Irp->IoStatus.Information = sizeof(RS485NT_PROCESSORS);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_LINE_SETTINGS:
+                {
+                    RS_DbgPrint ("GET_LINE_SETTINGS\n");
+                    if (outputBufferLength >= sizeof(RS485NT_LINE_SETTINGS)) {
+                        RS485_GetLineSettings (deviceExtension, ioBuffer);
+                        Irp->IoStatus.Information = sizeof(RS485NT_LINE_SETTINGS);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_MAP_RINGS:
+                {
+                    RS_DbgPrint ("MAP_RINGS\n");
+                    Irp->IoStatus.Status = RS485_MapRings (deviceExtension, Irp);
+                    break;
+                }
+
+                case IOCTL_RS485NT_UNMAP_RINGS:
+                {
+                    RS_DbgPrint ("UNMAP_RINGS\n");
+                    Irp->IoStatus.Status = RS485_UnmapRings (deviceExtension,
+                                                             irpStack->FileObject);
+                    break;
+                }
+
+                case IOCTL_RS485NT_RING_DOORBELL:
+                {
+                    Irp->IoStatus.Status = RS485_RingDoorbell (deviceExtension);
+                    break;
+                }
+
+                case IOCTL_RS485NT_TRANSACT:
+                {
+                    RS_DbgPrint ("TRANSACT\n");
+                    if (RS485_Transact (deviceExtension, Irp) == STATUS_PENDING) {
+                        //
+                        // Queued for RS485_StartIo, the read engine completes it
+                        //
+                        return STATUS_PENDING;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_SET_TIMEOUTS:
+                {
+                    KIRQL OldIrql;
+
+                    RS_DbgPrint ("SET_TIMEOUTS\n");
+                    if (inputBufferLength >= sizeof(RS485NT_TIMEOUTS)) {
+                        //
+                        // Applies to reads started from now on
+                        //
+                        KeAcquireSpinLock (&deviceExtension->RcvLock, &OldIrql);
+                        RtlMoveMemory (&deviceExtension->Timeouts, ioBuffer,
+                                       sizeof(RS485NT_TIMEOUTS));
+                        KeReleaseSpinLock (&deviceExtension->RcvLock, OldIrql);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                case IOCTL_RS485NT_GET_TIMEOUTS:
+                {
+                    RS_DbgPrint ("GET_TIMEOUTS\n");
+                    if (outputBufferLength >= sizeof(RS485NT_TIMEOUTS)) {
+                        RtlMoveMemory (ioBuffer, &deviceExtension->Timeouts,
+                                       sizeof(RS485NT_TIMEOUTS));
+                        Irp->IoStatus.Information = sizeof(RS485NT_TIMEOUTS);
+                    } else {
+                        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+                    }
+                    break;
+                }
+
+                default:
+                {
+                    RS_DbgPrint ("RS485NT: Unknown IRP_MJ_DEVICE_CONTROL\n");
+                    Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+                    break;
+                }
+    
+            }
+    
+            break;
+        }
+        default:
+        {
+            RS_DbgPrint ("RS485NT: Unhandled IRP_MJ function\n");
+            Irp->IoStatus.Status = STATUS_NOT_IMPLEMENTED;
+            break;
+        }
+    }
+
+    //
+    // DON'T get cute and try to use the status field of
+    // the irp in the return status.  That IRP IS GONE as
+    // soon as you call IoCompleteRequest.
+    //
+
+    ntStatus = Irp->IoStatus.Status;
+
+    IoCompleteRequest (Irp, IO_NO_INCREMENT);
+
+    RS_DbgPrint ("RS485NT: DisptachRoutine exit.\n");
+
+    //
+    // Pending operations returned above, so always return the status code.
+    //
+
+    return ntStatus;
+}
+
+
+//---------------------------------------------------------------------------
+// UnloadDriver
+//
+// Description:
+//     Free all the allocated resources, etc.
+//
+// Arguments:
+//     DriverObject - pointer to a driver object
+// 
+// Return Value:
+//      None
+// 
+VOID UnloadDriver (IN PDRIVER_OBJECT DriverObject)
+{
+    PDEVICE_OBJECT deviceObject;
+    PRS485NT_DEVICE_EXTENSION extension;
+    ULONG i;
+
+    //
+    // Quiet every UART before the interrupt, which they may share, goes.
+    // The timers synchronize with the interrupt and queue the DPC, so
+    // stop them all (waiting for running callbacks) and let any queued
+    // DPC finish before the interrupt and device extensions go away.
+    //
+    for (deviceObject = DriverObject->DeviceObject; deviceObject != NULL;
+         deviceObject = deviceObject->NextDevice) {
+
+        extension = deviceObject->DeviceExtension;
+
+        WRITE_PORT_UCHAR (extension->ComPort.IER, 0);
+        WRITE_PORT_UCHAR (extension->ComPort.MCR, MCR_DEACTIVATE_ALL);
+
+        if (extension->PollTimer) {
+            ExDeleteTimer (extension->PollTimer, TRUE, TRUE, NULL);
+            extension->PollTimer = NULL;
+        }
+
+        if (extension->TurnaroundTimer) {
+            ExDeleteTimer (extension->TurnaroundTimer, TRUE, TRUE, NULL);
+            extension->TurnaroundTimer = NULL;
+        }
+
+        if (extension->FrameTimer) {
+            ExDeleteTimer (extension->FrameTimer, TRUE, TRUE, NULL);
+            extension->FrameTimer = NULL;
+        }
+
+        if (extension->SelfTestTimer) {
+            ExDeleteTimer (extension->SelfTestTimer, TRUE, TRUE, NULL);
+            extension->SelfTestTimer = NULL;
+        }
+
+        if (extension->BusTimer) {
+            ExDeleteTimer (extension->BusTimer, TRUE, TRUE, NULL);
+            extension->BusTimer = NULL;
+        }
+
+        KeCancelTimer (&extension->ReadTimer);
+    }
+
+    KeFlushQueuedDpcs ();
+
+    for (i = 0; i < InterruptGroupCount; i++) {
+        if (InterruptGroups[i].InterruptObject != NULL) {
+            IoDisconnectInterrupt (InterruptGroups[i].InterruptObject);
+            InterruptGroups[i].InterruptObject = NULL;
+        }
+    }
+    InterruptGroupCount = 0;
+
+    //
+    // IoDeleteDevice takes each port off the driver's device list
+    //
+    while (DriverObject->DeviceObject != NULL) {
+        RS485_DeletePort (DriverObject->DeviceObject);
+    }
+
+    RS_DbgPrint ("RS485NT: Unloaded\n");
+    return;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_DeletePort
+//
+// Description:
+//     Stops one port and frees its resources and device object.
+//
+// Arguments:
+//     DeviceObject - The port's device object
+// 
+// Return Value:
+//      None
+// 
+VOID RS485_DeletePort (IN PDEVICE_OBJECT DeviceObject)
+{
+    WCHAR                  deviceLinkBuffer[]  = L"\\DosDevices\\RS485NT";
+    UNICODE_STRING         deviceLinkUnicodeString;
+    PRS485NT_DEVICE_EXTENSION extension;
+
+    extension = DeviceObject->DeviceExtension;
+
+    //
+    // Deactivate all of the MCR interrupt sources.
+    //
+    WRITE_PORT_UCHAR (extension->ComPort.MCR, MCR_DEACTIVATE_ALL);
+
+    //
+    // Leave the UART the way we found it, FIFOs off.
+    //
+    WRITE_PORT_UCHAR (extension->ComPort.FCR, FCR_DISABLE_FIFO);
+
+    //
+    // Free any resources. The interrupt belongs to the port's group.
+    //
+    KeCancelTimer (&extension->ReadTimer);
+
+    if (extension->TurnaroundTimer) {
+        ExDeleteTimer (extension->TurnaroundTimer, TRUE, TRUE, NULL);
+    }
+
+    if (extension->FrameTimer) {
+        ExDeleteTimer (extension->FrameTimer, TRUE, TRUE, NULL);
+    }
+
+    if (extension->SelfTestTimer) {
+        ExDeleteTimer (extension->SelfTestTimer, TRUE, TRUE, NULL);
+    }
+
+    if (extension->BusTimer) {
+        ExDeleteTimer (extension->BusTimer, TRUE, TRUE, NULL);
+    }
+
+    if (extension->PollTimer) {
+        ExDeleteTimer (extension->PollTimer, TRUE, TRUE, NULL);
+    }
+
+    //
+    // Rings no handle cleanup took away. The receive buffer is the
+    // mapped RX ring then, put the port's own back first.
+    //
+    if (extension->RingMdl) {
+        if (extension->RingHeader != NULL) {
+            RS485_RingDetach (extension);
+        }
+        RS485_FreeRings (extension->RingMdl, extension->RingBase,
+                         extension->RingUserBase, extension->RingProcess);
+        extension->RingMdl = NULL;
+        extension->RingBase = NULL;
+    }
+
+    if (extension->RcvBuffer) {
+        ExFreePool (extension->RcvBuffer);
+    }
+
+    if (extension->RcvStamp) {
+        ExFreePool (extension->RcvStamp);
+    }
+
+    //
+    // Delete the symbolic link(s)
+    //
+    IoDeleteSymbolicLink (&extension->LinkName);
+
+    if (extension->LegacyLink) {
+        RtlInitUnicodeString (&deviceLinkUnicodeString, deviceLinkBuffer);
+
+        IoDeleteSymbolicLink (&deviceLinkUnicodeString);
+    }
+
+    //
+    // Delete the device object
+    //
+    IoDeleteDevice (DeviceObject);
+}
+
+
+//---------------------------------------------------------------------------
+//  GetConfiguration
+//
+// Description:
+//      Obtains driver configuration information from the Registry.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      RegistryPath    - Pointer to the null-terminated Unicode name of the
+//                        registry path for this driver.
+//      Port            - Port number, selects the Parameters\PortN subkey
+//
+// Return Value:
+//      STATUS_NO_MORE_ENTRIES  - There is no such port
+//      NTSTATUS
+// 
+NTSTATUS GetConfiguration(IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                          IN PUNICODE_STRING RegistryPath, IN ULONG Port)
+{
+    PRTL_QUERY_REGISTRY_TABLE parameters = NULL;
+    UNICODE_STRING parametersPath = { 0 };
+
+    ULONG notThereDefault = 1234567;
+    ULONG PortAddressDefault = 0;
+    ULONG IRQLineDefault = 0;
+    ULONG BaudRateDefault = 0;
+    ULONG BufferSizeDefault = 0;
+    ULONG RxTriggerLevelDefault = 0;
+    ULONG TxFifoDepthDefault = 0;
+    ULONG RtsTurnaroundDefault = 0;
+    ULONG FrameModeDefault = 0;
+    ULONG StatusPortDefault = 0;
+    ULONG StatusBitDefault = 0;
+    ULONG ShareInterruptDefault = 0;
+    ULONG ClockRateDefault = 0;
+    ULONG DirectIoDefault = 0;
+    ULONG TimestampModeDefault = 0;
+    ULONG SelfTestDefault = 0;
+    ULONG EchoModeDefault = 0;
+    ULONG BusIdleCharsDefault = 0;
+    ULONG PollModeDefault = 0;
+    ULONG PollThresholdDefault = 0;
+    ULONG PollIntervalDefault = 0;
+    LONGLONG notThereAffinity = 1234567;
+    LARGE_INTEGER InterruptAffinityDefault = { 0 };
+    ULONG DpcProcessorDefault = 0;
+    ULONG DpcImportanceDefault = 0;
+
+    NTSTATUS status = STATUS_SUCCESS;
+    PWSTR path = NULL;
+    USHORT queriesPlusOne = 24;
+    USHORT parametersLength;
+    WCHAR portNumberBuffer[12];
+    UNICODE_STRING portNumber;
+
+    parametersPath.Buffer = NULL;
+
+    //
+    // Registry path is already null-terminated, so just use it.
+    //
+    path = RegistryPath->Buffer;
+
+    //
+    // Allocate the Rtl query table.
+    //
+    parameters = ExAllocatePoolWithTag (PagedPool, (sizeof(RTL_QUERY_REGISTRY_TABLE) * queriesPlusOne), MEMORY_TAG);
+
+    if (!parameters) {
+        RS_DbgPrint("RS485NT: ExAllocatePool failed for Rtl in GetConfiguration\n");
+        status = STATUS_UNSUCCESSFUL;
+    } else {
+
+        RtlZeroMemory(parameters, sizeof(RTL_QUERY_REGISTRY_TABLE) * queriesPlusOne);
+
+        //
+        // Form a path to this driver's Parameters subkey.
+        //
+        RtlInitUnicodeString(&parametersPath, NULL);
+
+        parametersPath.MaximumLength = RegistryPath->Length + sizeof(L"\\Parameters\\Port") +
+                                       sizeof(portNumberBuffer);
+
+        parametersPath.Buffer = ExAllocatePoolWithTag (PagedPool, parametersPath.MaximumLength, MEMORY_TAG);
+
+        if (!parametersPath.Buffer) {
+            RS_DbgPrint("RS485NT: ExAllocatePool failed for Path in GetConfiguration\n");
+            status = STATUS_UNSUCCESSFUL;
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+
+        //
+        // Form the parameters path.
+        //
+        RtlZeroMemory(parametersPath.Buffer, parametersPath.MaximumLength);
+        RtlAppendUnicodeToString(&parametersPath, path);
+        RtlAppendUnicodeToString(&parametersPath, L"\\Parameters");
+
+        //
+        // Each port has its own Parameters\PortN subkey. A single port
+        // configuration can keep its values in Parameters itself.
+        //
+        parametersLength = parametersPath.Length;
+
+        portNumber.Buffer = portNumberBuffer;
+        portNumber.Length = 0;
+        portNumber.MaximumLength = sizeof(portNumberBuffer);
+        RtlIntegerToUnicodeString(Port, 10, &portNumber);
+
+        RtlAppendUnicodeToString(&parametersPath, L"\\Port");
+        RtlAppendUnicodeStringToString(&parametersPath, &portNumber);
+
+        if (!NT_SUCCESS(RtlCheckRegistryKey(RTL_REGISTRY_ABSOLUTE, parametersPath.Buffer))) {
+            if (Port == 0) {
+                parametersPath.Length = parametersLength;
+                parametersPath.Buffer[parametersLength / sizeof(WCHAR)] = UNICODE_NULL;
+            } else {
+                status = STATUS_NO_MORE_ENTRIES;
+            }
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+
+        //
+        // Gather all of the "user specified" information from
+        // the registry.
+        //
+        parameters[0].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[0].Name = L"Port Address";
+        parameters[0].EntryContext =  &PortAddressDefault;
+        parameters[0].DefaultType = REG_DWORD;
+        parameters[0].DefaultData = &notThereDefault;
+        parameters[0].DefaultLength = sizeof(ULONG);
+
+        parameters[1].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[1].Name = L"IRQ Line";
+        parameters[1].EntryContext = &IRQLineDefault;
+        parameters[1].DefaultType = REG_DWORD;
+        parameters[1].DefaultData = &notThereDefault;
+        parameters[1].DefaultLength = sizeof(ULONG);
+
+        parameters[2].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[2].Name = L"Baud Rate";
+        parameters[2].EntryContext = &BaudRateDefault;
+        parameters[2].DefaultType = REG_DWORD;
+        parameters[2].DefaultData = &notThereDefault;
+        parameters[2].DefaultLength = sizeof(ULONG);
+
+        parameters[3].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[3].Name = L"Buffer Size";
+        parameters[3].EntryContext = &BufferSizeDefault;
+        parameters[3].DefaultType = REG_DWORD;
+        parameters[3].DefaultData = &notThereDefault;
+        parameters[3].DefaultLength = sizeof(ULONG);
+
+        parameters[4].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[4].Name = L"Rx Trigger Level";
+        parameters[4].EntryContext = &RxTriggerLevelDefault;
+        parameters[4].DefaultType = REG_DWORD;
+        parameters[4].DefaultData = &notThereDefault;
+        parameters[4].DefaultLength = sizeof(ULONG);
+
+        parameters[5].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[5].Name = L"Tx Fifo Depth";
+        parameters[5].EntryContext = &TxFifoDepthDefault;
+        parameters[5].DefaultType = REG_DWORD;
+        parameters[5].DefaultData = &notThereDefault;
+        parameters[5].DefaultLength = sizeof(ULONG);
+
+        parameters[6].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[6].Name = L"Rts Turnaround";
+        parameters[6].EntryContext = &RtsTurnaroundDefault;
+        parameters[6].DefaultType = REG_DWORD;
+        parameters[6].DefaultData = &notThereDefault;
+        parameters[6].DefaultLength = sizeof(ULONG);
+
+        parameters[7].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[7].Name = L"Frame Mode";
+        parameters[7].EntryContext = &FrameModeDefault;
+        parameters[7].DefaultType = REG_DWORD;
+        parameters[7].DefaultData = &notThereDefault;
+        parameters[7].DefaultLength = sizeof(ULONG);
+
+        parameters[8].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[8].Name = L"Interrupt Status Port";
+        parameters[8].EntryContext = &StatusPortDefault;
+        parameters[8].DefaultType = REG_DWORD;
+        parameters[8].DefaultData = &notThereDefault;
+        parameters[8].DefaultLength = sizeof(ULONG);
+
+        parameters[9].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[9].Name = L"Interrupt Status Bit";
+        parameters[9].EntryContext = &StatusBitDefault;
+        parameters[9].DefaultType = REG_DWORD;
+        parameters[9].DefaultData = &notThereDefault;
+        parameters[9].DefaultLength = sizeof(ULONG);
+
+        parameters[10].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[10].Name = L"Share Interrupt";
+        parameters[10].EntryContext = &ShareInterruptDefault;
+        parameters[10].DefaultType = REG_DWORD;
+        parameters[10].DefaultData = &notThereDefault;
+        parameters[10].DefaultLength = sizeof(ULONG);
+
+        parameters[11].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[11].Name = L"Clock Rate";
+        parameters[11].EntryContext = &ClockRateDefault;
+        parameters[11].DefaultType = REG_DWORD;
+        parameters[11].DefaultData = &notThereDefault;
+        parameters[11].DefaultLength = sizeof(ULONG);
+
+        parameters[12].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[12].Name = L"Direct IO";
+        parameters[12].EntryContext = &DirectIoDefault;
+        parameters[12].DefaultType = REG_DWORD;
+        parameters[12].DefaultData = &notThereDefault;
+        parameters[12].DefaultLength = sizeof(ULONG);
+
+        parameters[13].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[13].Name = L"Timestamp Mode";
+        parameters[13].EntryContext = &TimestampModeDefault;
+        parameters[13].DefaultType = REG_DWORD;
+        parameters[13].DefaultData = &notThereDefault;
+        parameters[13].DefaultLength = sizeof(ULONG);
+
+        parameters[14].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[14].Name = L"Self Test";
+        parameters[14].EntryContext = &SelfTestDefault;
+        parameters[14].DefaultType = REG_DWORD;
+        parameters[14].DefaultData = &notThereDefault;
+        parameters[14].DefaultLength = sizeof(ULONG);
+
+        parameters[15].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[15].Name = L"Echo Mode";
+        parameters[15].EntryContext = &EchoModeDefault;
+        parameters[15].DefaultType = REG_DWORD;
+        parameters[15].DefaultData = &notThereDefault;
+        parameters[15].DefaultLength = sizeof(ULONG);
+
+        parameters[16].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[16].Name = L"Bus Idle Chars";
+        parameters[16].EntryContext = &BusIdleCharsDefault;
+        parameters[16].DefaultType = REG_DWORD;
+        parameters[16].DefaultData = &notThereDefault;
+        parameters[16].DefaultLength = sizeof(ULONG);
+
+        parameters[17].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[17].Name = L"Rx Poll Mode";
+        parameters[17].EntryContext = &PollModeDefault;
+        parameters[17].DefaultType = REG_DWORD;
+        parameters[17].DefaultData = &notThereDefault;
+        parameters[17].DefaultLength = sizeof(ULONG);
+
+        parameters[18].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[18].Name = L"Rx Poll Threshold";
+        parameters[18].EntryContext = &PollThresholdDefault;
+        parameters[18].DefaultType = REG_DWORD;
+        parameters[18].DefaultData = &notThereDefault;
+        parameters[18].DefaultLength = sizeof(ULONG);
+
+        parameters[19].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[19].Name = L"Rx Poll Interval";
+        parameters[19].EntryContext = &PollIntervalDefault;
+        parameters[19].DefaultType = REG_DWORD;
+        parameters[19].DefaultData = &notThereDefault;
+        parameters[19].DefaultLength = sizeof(ULONG);
+
+        //
+        // A processor mask is 64 bits on x64, so it can be a REG_QWORD.
+        // That is bigger than a ULONG, so the buffer starts with its
+        // negated size and the high half left 0 takes a REG_DWORD as well.
+        //
+        InterruptAffinityDefault.LowPart = (ULONG)-(LONG)sizeof(LONGLONG);
+        parameters[20].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[20].Name = L"Interrupt Affinity";
+        parameters[20].EntryContext = &InterruptAffinityDefault;
+        parameters[20].DefaultType = REG_QWORD;
+        parameters[20].DefaultData = &notThereAffinity;
+        parameters[20].DefaultLength = sizeof(LONGLONG);
+
+        parameters[21].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[21].Name = L"Dpc Processor";
+        parameters[21].EntryContext = &DpcProcessorDefault;
+        parameters[21].DefaultType = REG_DWORD;
+        parameters[21].DefaultData = &notThereDefault;
+        parameters[21].DefaultLength = sizeof(ULONG);
+
+        parameters[22].Flags = RTL_QUERY_REGISTRY_DIRECT;
+        parameters[22].Name = L"Dpc Importance";
+        parameters[22].EntryContext = &DpcImportanceDefault;
+        parameters[22].DefaultType = REG_DWORD;
+        parameters[22].DefaultData = &notThereDefault;
+        parameters[22].DefaultLength = sizeof(ULONG);
+
+        status = RtlQueryRegistryValues(
+                     RTL_REGISTRY_ABSOLUTE | RTL_REGISTRY_OPTIONAL,
+                     parametersPath.Buffer,
+                     parameters,
+                     NULL,
+                     NULL);
+
+        if (!NT_SUCCESS(status)) {
+            RS_DbgPrint("RS485NT: RtlQueryRegistryValues failed\n");
+        }
+
+        status = STATUS_SUCCESS;
+    }
+
+    if (status == STATUS_NO_MORE_ENTRIES) {
+        if (parametersPath.Buffer)
+            ExFreePool(parametersPath.Buffer);
+        if (parameters)
+            ExFreePool(parameters);
+        return (status);
+    }
+
+    //
+    // Go ahead and assign driver defaults.
+    //
+    if (PortAddressDefault == notThereDefault) {
+        DeviceExtension->PortAddress = (PUCHAR) DEF_PORT_ADDRESS;
+    } else {
+        DeviceExtension->PortAddress = (PVOID) PortAddressDefault;
+    }
+
+    if (IRQLineDefault == notThereDefault) {
+        DeviceExtension->IRQLine = DEF_IRQ_LINE;
+    } else {
+        DeviceExtension->IRQLine = (KIRQL) IRQLineDefault;
+    }
+
+    if (BaudRateDefault == notThereDefault) {
+        DeviceExtension->BaudRate = DEF_BAUD_RATE;
+    } else {
+        DeviceExtension->BaudRate = BaudRateDefault;
+    }
+
+    if ((ClockRateDefault == notThereDefault) || (ClockRateDefault == 0)) {
+        DeviceExtension->ClockRate = DEF_CLOCK_RATE;
+    } else {
+        DeviceExtension->ClockRate = ClockRateDefault;
+    }
+
+    if (BufferSizeDefault == notThereDefault) {
+        DeviceExtension->BufferSize = DEF_BUFFER_SIZE;
+    } else if (BufferSizeDefault > RS485_MAX_BUFFER_SIZE) {
+        RS_DbgPrint("RS485NT: Buffer Size too big, using the maximum\n");
+        DeviceExtension->BufferSize = RS485_MAX_BUFFER_SIZE;
+    } else {
+        DeviceExtension->BufferSize = BufferSizeDefault;
+    }
+
+    //
+    // The 16550 only supports RX trigger levels of 1, 4, 8 and 14 bytes.
+    // Zero turns the FIFO off (8250 compatible, one interrupt per byte).
+    //
+    switch (RxTriggerLevelDefault) {
+        case 0:
+        case 1:
+        case 4:
+        case 8:
+        case 14:
+            DeviceExtension->RxTriggerLevel = RxTriggerLevelDefault;
+            break;
+        default:
+            DeviceExtension->RxTriggerLevel = DEF_RX_TRIGGER_LEVEL;
+            break;
+    }
+
+    if (TxFifoDepthDefault == notThereDefault) {
+        DeviceExtension->TxFifoDepth = DEF_TX_FIFO_DEPTH;
+    } else {
+        DeviceExtension->TxFifoDepth = TxFifoDepthDefault;
+    }
+
+    if (RtsTurnaroundDefault == notThereDefault) {
+        DeviceExtension->RtsTurnaround = DEF_RTS_TURNAROUND;
+    } else {
+        DeviceExtension->RtsTurnaround = RtsTurnaroundDefault;
+    }
+
+    //
+    // Multi-port boards: the board interrupt status register (0 = none)
+    // and this UART's bit in it, by default the port number (modulo 8)
+    //
+    if ((StatusPortDefault == notThereDefault) || (StatusPortDefault == 0)) {
+        DeviceExtension->StatusPort = NULL;
+    } else {
+        DeviceExtension->StatusPort = (PVOID) StatusPortDefault;
+    }
+
+    if (StatusBitDefault == notThereDefault) {
+        DeviceExtension->StatusBit = Port & 7;
+    } else {
+        DeviceExtension->StatusBit = StatusBitDefault & 7;
+    }
+
+    if (ShareInterruptDefault == notThereDefault) {
+        DeviceExtension->ShareInterrupt = DEF_SHARE_INTERRUPT;
+    } else {
+        DeviceExtension->ShareInterrupt = (ShareInterruptDefault != 0);
+    }
+
+    if (DirectIoDefault == notThereDefault) {
+        DeviceExtension->DirectIo = DEF_DIRECT_IO;
+    } else {
+        DeviceExtension->DirectIo = (DirectIoDefault != 0);
+    }
+
+    if (TimestampModeDefault == notThereDefault) {
+        DeviceExtension->TimestampMode = DEF_TIMESTAMP_MODE;
+    } else {
+        DeviceExtension->TimestampMode = (TimestampModeDefault != 0);
+    }
+
+    if (SelfTestDefault == notThereDefault) {
+        DeviceExtension->SelfTestBytes = DEF_SELF_TEST;
+    } else {
+        DeviceExtension->SelfTestBytes = SelfTestDefault;
+    }
+
+    if ((EchoModeDefault == ECHO_MODE_GATE) || (EchoModeDefault == ECHO_MODE_VERIFY)) {
+        DeviceExtension->EchoMode = EchoModeDefault;
+    } else {
+        DeviceExtension->EchoMode = DEF_ECHO_MODE;
+    }
+
+    if (BusIdleCharsDefault == notThereDefault) {
+        DeviceExtension->BusIdleChars = DEF_BUS_IDLE_CHARS;
+    } else {
+        DeviceExtension->BusIdleChars = BusIdleCharsDefault;
+    }
+
+    if ((PollModeDefault == POLL_MODE_ADAPTIVE) || (PollModeDefault == POLL_MODE_ALWAYS)) {
+        DeviceExtension->PollMode = PollModeDefault;
+    } else {
+        DeviceExtension->PollMode = DEF_POLL_MODE;
+    }
+
+    if (PollThresholdDefault == notThereDefault) {
+        DeviceExtension->PollThreshold = DEF_POLL_THRESHOLD;
+    } else {
+        DeviceExtension->PollThreshold = PollThresholdDefault;
+    }
+
+    if (PollIntervalDefault == notThereDefault) {
+        DeviceExtension->PollIntervalSetting = DEF_POLL_INTERVAL;
+    } else {
+        DeviceExtension->PollIntervalSetting = PollIntervalDefault;
+    }
+
+    if (InterruptAffinityDefault.QuadPart == notThereAffinity) {
+        DeviceExtension->InterruptAffinity = DEF_INTERRUPT_AFFINITY;
+    } else {
+        DeviceExtension->InterruptAffinity = (KAFFINITY)InterruptAffinityDefault.QuadPart;
+    }
+
+    //
+    // A processor we don't have leaves the DPC where the ISR runs
+    //
+    if (RS485_PROCESSOR_ACTIVE (DpcProcessorDefault)) {
+        DeviceExtension->DpcProcessor = DpcProcessorDefault;
+    } else {
+        DeviceExtension->DpcProcessor = DEF_DPC_PROCESSOR;
+    }
+
+    if (DpcImportanceDefault <= RS485NT_DPC_IMPORTANCE_MEDIUM_HIGH) {
+        DeviceExtension->DpcImportance = DpcImportanceDefault;
+    } else {
+        DeviceExtension->DpcImportance = DEF_DPC_IMPORTANCE;
+    }
+
+    //
+    // Listen before talk finds collisions in the echo
+    //
+    if (DeviceExtension->BusIdleChars) {
+        DeviceExtension->EchoMode = ECHO_MODE_VERIFY;
+    }
+
+    if (FrameModeDefault == FRAME_MODE_MODBUS_RTU) {
+        DeviceExtension->FrameMode = FRAME_MODE_MODBUS_RTU;
+
+        //
+        // Framing needs a timestamp per byte, so interrupt on every byte
+        //
+        if (DeviceExtension->RxTriggerLevel > 1) {
+            DeviceExtension->RxTriggerLevel = 1;
+        }
+    } else {
+        DeviceExtension->FrameMode = DEF_FRAME_MODE;
+    }
+
+    //
+    // Free the allocated memory before returning.
+    //
+
+    if (parametersPath.Buffer)
+        ExFreePool(parametersPath.Buffer);
+    if (parameters)
+        ExFreePool(parameters);
+    return (status);
+}
+
+
+//---------------------------------------------------------------------------
+// Initialize_RS485
+//
+// Description:
+//  Initializes all data structures and hardware necessary for
+//  driver execution
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      NSTATUS
+//  
+NTSTATUS Initialize_RS485 (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    UCHAR       ch, Fcr, Lcr;
+    NTSTATUS    status = STATUS_SUCCESS;
+
+    //
+    // Initialize all of the 8250 register addresses
+    //
+    DeviceExtension->ComPort.RBR = DeviceExtension->PortAddress + RX_REGISTER_8250;
+    DeviceExtension->ComPort.TBR = DeviceExtension->PortAddress + TX_REGISTER_8250;
+    DeviceExtension->ComPort.IER = DeviceExtension->PortAddress + IER_8250;
+    DeviceExtension->ComPort.IIR = DeviceExtension->PortAddress + IIR_8250;
+    DeviceExtension->ComPort.FCR = DeviceExtension->PortAddress + FCR_8250;
+    DeviceExtension->ComPort.LCR = DeviceExtension->PortAddress + LCR_8250;
+    DeviceExtension->ComPort.MCR = DeviceExtension->PortAddress + MCR_8250;
+    DeviceExtension->ComPort.LSR = DeviceExtension->PortAddress + LSR_8250;
+    DeviceExtension->ComPort.MSR = DeviceExtension->PortAddress + MSR_8250;
+    DeviceExtension->ComPort.BAUD = DeviceExtension->PortAddress + DIVISOR_REGISTER_8250;
+    DeviceExtension->ComPort.BAUDHI = DeviceExtension->PortAddress + DIVISOR_HIGH_8250;
+
+    //
+    // Allocate memory for the Transmit and Receive data buffers. The receive
+    // ring is rounded up to a power of two so the indexes can free run.
+    //
+    KeInitializeSpinLock (&DeviceExtension->RcvLock);
+
+    //
+    // Setup the read engine. Reads return immediately until the application
+    // sets timeouts, which is how the driver always behaved.
+    //
+    InitializeListHead (&DeviceExtension->ReadQueue);
+    DeviceExtension->CurrentReadIrp = NULL;
+    DeviceExtension->Timeouts.ReadIntervalTimeout = MAXULONG;
+    DeviceExtension->Timeouts.ReadTotalTimeoutMultiplier = 0;
+    DeviceExtension->Timeouts.ReadTotalTimeoutConstant = 0;
+    KeInitializeTimer (&DeviceExtension->ReadTimer);
+    KeInitializeDpc (&DeviceExtension->ReadTimerDpc, RS485_ReadTimerDpc, DeviceExtension);
+
+    DeviceExtension->RcvBufferSize = 1;
+    while (DeviceExtension->RcvBufferSize < DeviceExtension->BufferSize) {
+        DeviceExtension->RcvBufferSize <<= 1;
+    }
+
+    DeviceExtension->RcvBuffer = ExAllocatePoolWithTag (NonPagedPool, DeviceExtension->RcvBufferSize, MEMORY_TAG);
+
+    if (DeviceExtension->RcvBuffer == NULL) {
+        RS_DbgPrint("RS485NT: ExAllocatePool failed for RcvBuffer\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    } else {
+
+        //
+        // Setup ring indexes and counts
+        //
+        DeviceExtension->RcvHead = 0;
+        DeviceExtension->RcvTail = 0;
+        DeviceExtension->RcvDiscard = 0;
+        DeviceExtension->RcvOverflow = 0;
+    }
+
+    //
+    // Timestamp Mode: a receive time for every byte in the ring
+    //
+    if (NT_SUCCESS(status) && DeviceExtension->TimestampMode) {
+        DeviceExtension->RcvStamp = ExAllocatePoolWithTag (NonPagedPool,
+                                                           DeviceExtension->RcvBufferSize * sizeof(ULONG),
+                                                           MEMORY_TAG);
+        if (DeviceExtension->RcvStamp == NULL) {
+            RS_DbgPrint("RS485NT: ExAllocatePool failed for RcvStamp\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    //
+    // Nothing to transmit. Writes are sent straight out of the IRP.
+    //
+    DeviceExtension->XmitBufferPosition = NULL;
+    DeviceExtension->XmitBufferCount = 0;
+
+    //
+    // Clear the interrupt/error Count and get current system time
+    //
+    DeviceExtension->InterruptCount = 0;
+    DeviceExtension->RcvError = 0;
+    RtlZeroMemory (&DeviceExtension->Stats, sizeof(RS485NT_STATS));
+    DeviceExtension->WriteIrps = 0;
+    DeviceExtension->ReadIrps = 0;
+    DeviceExtension->TransactIrps = 0;
+    DeviceExtension->DpcRuns = 0;
+    RtlZeroMemory (DeviceExtension->DpcProcessorRuns, sizeof(DeviceExtension->DpcProcessorRuns));
+
+    KeInitializeSpinLock (&DeviceExtension->LatencyLock);
+    RtlZeroMemory (&DeviceExtension->Latency, sizeof(RS485NT_LATENCY));
+    DeviceExtension->DpcIsrTime = 0;
+    DeviceExtension->LastActivityTime = KeQueryPerformanceCounter (NULL);
+
+    //
+    // Setup the RTS turnaround engine. Without a high resolution timer we
+    // fall back to polling the LSR from the DPC.
+    //
+    DeviceExtension->DpcEvents = 0;
+    DeviceExtension->XmitActive = FALSE;
+    DeviceExtension->TurnaroundPending = FALSE;
+    KeQueryPerformanceCounter (&DeviceExtension->PerfFrequency);
+
+    if (DeviceExtension->RtsTurnaround == RTS_TURNAROUND_TIMER) {
+        DeviceExtension->TurnaroundTimer = ExAllocateTimer (RS485_TurnaroundTimer,
+                                                            DeviceExtension,
+                                                            EX_TIMER_HIGH_RESOLUTION);
+        if (DeviceExtension->TurnaroundTimer == NULL) {
+            RS_DbgPrint("RS485NT: ExAllocateTimer failed, polling for RTS turnaround\n");
+        }
+    }
+
+    //
+    // Setup Modbus RTU framing. Without the silence timer a frame is only
+    // seen to end when the next one starts.
+    //
+    DeviceExtension->FrameOpen = FALSE;
+    DeviceExtension->FrameHead = 0;
+    DeviceExtension->FrameTail = 0;
+    DeviceExtension->FrameCount = 0;
+    DeviceExtension->FrameGapErrors = 0;
+    DeviceExtension->FrameOverflow = 0;
+
+    if (DeviceExtension->FrameMode != FRAME_MODE_NONE) {
+        DeviceExtension->FrameTimer = ExAllocateTimer (RS485_FrameTimer,
+                                                       DeviceExtension,
+                                                       EX_TIMER_HIGH_RESOLUTION);
+        if (DeviceExtension->FrameTimer == NULL) {
+            RS_DbgPrint("RS485NT: ExAllocateTimer failed, no frame silence timer\n");
+        }
+    }
+
+    //
+    // Listen before talk waits for the bus on a timer. Without it we
+    // transmit right away.
+    //
+    DeviceExtension->BusLastActivity = KeQueryPerformanceCounter (NULL);
+    DeviceExtension->BusHoldoff.QuadPart = 0;
+    DeviceExtension->BusDeferred = FALSE;
+    DeviceExtension->BusRandom = (KeQueryPerformanceCounter (NULL).LowPart ^
+                                  (DeviceExtension->PortNumber * 0x9E3779B9)) | 1;
+
+    if (DeviceExtension->BusIdleChars) {
+        DeviceExtension->BusTimer = ExAllocateTimer (RS485_BusTimer,
+                                                     DeviceExtension,
+                                                     EX_TIMER_HIGH_RESOLUTION);
+        if (DeviceExtension->BusTimer == NULL) {
+            RS_DbgPrint("RS485NT: ExAllocateTimer failed, no listen before talk\n");
+        }
+    }
+
+    //
+    // Receive polling. Frame Mode needs a timestamp per byte, so it stays
+    // on interrupts.
+    //
+    DeviceExtension->PollActive = FALSE;
+    DeviceExtension->PollIdle = 0;
+    DeviceExtension->PollWindowStart = KeQueryPerformanceCounter (NULL);
+    DeviceExtension->PollWindowInterrupts = 0;
+
+    if (DeviceExtension->FrameMode != FRAME_MODE_NONE) {
+        DeviceExtension->PollMode = POLL_MODE_OFF;
+    }
+
+    if (DeviceExtension->PollMode != POLL_MODE_OFF) {
+        DeviceExtension->PollTimer = ExAllocateTimer (RS485_PollTimer,
+                                                      DeviceExtension,
+                                                      EX_TIMER_HIGH_RESOLUTION);
+        if (DeviceExtension->PollTimer == NULL) {
+            RS_DbgPrint("RS485NT: ExAllocateTimer failed, no receive polling\n");
+        }
+    }
+
+    //
+    // The loopback self test polls the UART from a timer of its own
+    //
+    DeviceExtension->SelfTest = NULL;
+    DeviceExtension->LoadSelfTestDone = FALSE;
+    DeviceExtension->SelfTestTimer = ExAllocateTimer (RS485_SelfTestTimer,
+                                                      DeviceExtension,
+                                                      EX_TIMER_HIGH_RESOLUTION);
+    if (DeviceExtension->SelfTestTimer == NULL) {
+        RS_DbgPrint("RS485NT: ExAllocateTimer failed, no self test\n");
+    }
+
+    //
+    // Determine the UART divisor value. The data format starts out as
+    // 1 start bit, 8 data bits, 1 stop bit, no parity.
+    //
+    DeviceExtension->DataBits = DEF_DATA_BITS;
+    DeviceExtension->Parity = DEF_PARITY;
+    DeviceExtension->StopBits = DEF_STOP_BITS;
+
+    RS485_BaudDivisor (DeviceExtension);
+    RS485_ComputeTimings (DeviceExtension);
+
+    //
+    // Set the baud rate and the data format. Nothing else touches the UART
+    // yet, no need to synchronize.
+    //
+    RS485_ProgramLine (DeviceExtension);
+
+    //
+    // Enable the 16550 FIFOs (if requested) with the configured RX trigger
+    // level. A working 16550A FIFO sets both FIFO bits in the IIR; anything
+    // else (8250, 16450, buggy 16550) is left in non-FIFO mode.
+    //
+    DeviceExtension->FifoEnabled = FALSE;
+    DeviceExtension->FifoDepth = 1;
+
+    if (DeviceExtension->RxTriggerLevel) {
+
+        switch (DeviceExtension->RxTriggerLevel) {
+            case 1:
+                ch = FCR_RX_TRIGGER_1;
+                break;
+            case 4:
+                ch = FCR_RX_TRIGGER_4;
+                break;
+            case 14:
+                ch = FCR_RX_TRIGGER_14;
+                break;
+            default:
+                ch = FCR_RX_TRIGGER_8;
+                break;
+        }
+
+        Fcr = ch | FCR_ENABLE_FIFO;
+        WRITE_PORT_UCHAR (DeviceExtension->ComPort.FCR,
+                          (UCHAR)(Fcr | FCR_CLEAR_RX_FIFO | FCR_CLEAR_TX_FIFO));
+
+        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.IIR);
+
+        if ((ch & IIR_FIFO_MASK) == IIR_FIFO_ENABLED) {
+            DeviceExtension->FifoEnabled = TRUE;
+            DeviceExtension->FifoDepth = FIFO_DEPTH_16550;
+            RS_DbgPrint("RS485NT: 16550 FIFO enabled\n");
+
+            //
+            // A 16750 only turns on its 64 byte FIFO if the enable bit is
+            // written with the divisor latch set, and then reports it in
+            // the IIR. Anything else ignores the bit.
+            //
+            Lcr = READ_PORT_UCHAR (DeviceExtension->ComPort.LCR);
+            WRITE_PORT_UCHAR (DeviceExtension->ComPort.LCR,
+                              (UCHAR)(Lcr | LCR_ENABLE_DIVISOR_LATCH));
+            WRITE_PORT_UCHAR (DeviceExtension->ComPort.FCR,
+                              (UCHAR)(Fcr | FCR_ENABLE_64_BYTE_FIFO));
+            WRITE_PORT_UCHAR (DeviceExtension->ComPort.LCR, Lcr);
+
+            ch = READ_PORT_UCHAR (DeviceExtension->ComPort.IIR);
+
+            if (ch & IIR_64_BYTE_FIFO) {
+                DeviceExtension->FifoDepth = FIFO_DEPTH_16750;
+                RS_DbgPrint("RS485NT: 16750 64 byte FIFO enabled\n");
+            } else {
+                WRITE_PORT_UCHAR (DeviceExtension->ComPort.FCR, Fcr);
+            }
+
+            //
+            // Newer parts (16950, 16C1050, ...) have deeper FIFOs that
+            // can't be probed this way. Let the registry override the TX
+            // burst size for them.
+            //
+            if (DeviceExtension->TxFifoDepth) {
+                DeviceExtension->FifoDepth = DeviceExtension->TxFifoDepth;
+            }
+        } else {
+            RS_DbgPrint("RS485NT: No working FIFO, using 8250 mode\n");
+        }
+    }
+
+    if (!DeviceExtension->FifoEnabled) {
+        WRITE_PORT_UCHAR (DeviceExtension->ComPort.FCR, FCR_DISABLE_FIFO);
+    }
+
+    return status;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ComputeTimings
+//
+// Description:
+//  Works out everything that depends on the line speed and data format:
+//  the character time used by the RTS turnaround and the Modbus RTU frame
+//  timing. Call after RS485_BaudDivisor.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_ComputeTimings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    LONGLONG    T15;
+
+    //
+    // Character time (start + data + parity + stop bits), rounded up, in
+    // 100ns units.
+    //
+    DeviceExtension->BitsPerChar = 1 + DeviceExtension->DataBits +
+                                   ((DeviceExtension->Parity != RS485NT_PARITY_NONE) ? 1 : 0) +
+                                   DeviceExtension->StopBits;
+    DeviceExtension->CharTime = (DeviceExtension->BitsPerChar * 10000000 +
+                                 DeviceExtension->ActualBaudRate - 1) /
+                                DeviceExtension->ActualBaudRate;
+
+    //
+    // Modbus RTU frame timing: t1.5 and t3.5 character times, fixed at
+    // 750us / 1750us above 19200 baud. The ISR compares performance counter
+    // ticks, the silence timer wants 100ns units.
+    //
+    if (DeviceExtension->BaudRate > FRAME_MODBUS_FIXED_BAUD) {
+        T15 = FRAME_MODBUS_FIXED_T15;
+        DeviceExtension->FrameSilence = FRAME_MODBUS_FIXED_T35;
+    } else {
+        T15 = (DeviceExtension->CharTime * 3 + 1) / 2;
+        DeviceExtension->FrameSilence = (DeviceExtension->CharTime * 7 + 1) / 2;
+    }
+
+    DeviceExtension->FrameT35 = DeviceExtension->FrameSilence *
+                                DeviceExtension->PerfFrequency.QuadPart / 10000000;
+    DeviceExtension->FrameT15 = T15 *
+                                DeviceExtension->PerfFrequency.QuadPart / 10000000;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ProgramLine
+//
+// Description:
+//  Writes the divisor latch (both bytes) and the data format into the
+//  UART. Synchronized with RS485_Isr once the interrupt is connected, the
+//  divisor latch hides the IER.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_ProgramLine (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    UCHAR   ch;
+
+    //
+    // Set the baud rate to the divisor value, both bytes.
+    //
+    ch = ((READ_PORT_UCHAR (DeviceExtension->ComPort.LCR)) | LCR_ENABLE_DIVISOR_LATCH);
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.LCR, ch);
+
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.BAUD, (UCHAR)(DeviceExtension->Divisor & 0xFF));
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.BAUDHI, (UCHAR)(DeviceExtension->Divisor >> 8));
+
+    ch = ((READ_PORT_UCHAR (DeviceExtension->ComPort.LCR)) & LCR_DISABLE_DIVISOR_LATCH);
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.LCR, ch);
+
+    //
+    // The data format, 5 - 8 data bits (0 - 3 in the LCR)
+    //
+    ch = (UCHAR)(DeviceExtension->DataBits - 5);
+
+    ch |= (DeviceExtension->StopBits == 2) ? LCR_TWO_STOP_BITS : LCR_ONE_STOP_BIT;
+
+    switch (DeviceExtension->Parity) {
+        case RS485NT_PARITY_ODD:
+            ch |= LCR_ODD_PARITY;
+            break;
+        case RS485NT_PARITY_EVEN:
+            ch |= LCR_EVEN_PARITY;
+            break;
+        case RS485NT_PARITY_MARK:
+            ch |= LCR_MARK_PARITY;
+            break;
+        case RS485NT_PARITY_SPACE:
+            ch |= LCR_SPACE_PARITY;
+            break;
+        default:
+            ch |= LCR_NO_PARITY;
+            break;
+    }
+
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.LCR, ch);
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_BaudDivisor
+//
+// Description:
+//  Works out the 16 bit divisor latch value for BaudRate from the UART
+//  input clock (ClockRate / (16 * Divisor)), rounded to the nearest, and
+//  the baud rate and error that actually results. A rate the clock can't
+//  make falls back to the default rate.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_BaudDivisor (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    ULONGLONG   Divisor;
+
+    if ((DeviceExtension->BaudRate == 0) ||
+        (DeviceExtension->BaudRate > DeviceExtension->ClockRate / UART_CLOCK_DIVIDE)) {
+        RS_DbgPrint ("RS485NT: %lu baud not possible with a %lu Hz clock, using %lu\n",
+                     DeviceExtension->BaudRate, DeviceExtension->ClockRate, DEF_BAUD_RATE);
+        DeviceExtension->BaudRate = DEF_BAUD_RATE;
+    }
+
+    Divisor = ((ULONGLONG)DeviceExtension->ClockRate +
+               (ULONGLONG)DeviceExtension->BaudRate * (UART_CLOCK_DIVIDE / 2)) /
+              ((ULONGLONG)DeviceExtension->BaudRate * UART_CLOCK_DIVIDE);
+
+    if (Divisor == 0) {
+        Divisor = 1;
+    } else if (Divisor > UART_DIVISOR_MAX) {
+        Divisor = UART_DIVISOR_MAX;
+    }
+
+    DeviceExtension->Divisor = (ULONG)Divisor;
+    DeviceExtension->ActualBaudRate = DeviceExtension->ClockRate /
+                                      (UART_CLOCK_DIVIDE * DeviceExtension->Divisor);
+    DeviceExtension->BaudError = (LONG)(((LONGLONG)DeviceExtension->ActualBaudRate -
+                                         (LONGLONG)DeviceExtension->BaudRate) * 1000000 /
+                                        (LONGLONG)DeviceExtension->BaudRate);
+
+    RS_DbgPrint ("RS485NT: %lu baud, divisor %lu, actual %lu baud (%ld ppm)\n",
+                 DeviceExtension->BaudRate, DeviceExtension->Divisor,
+                 DeviceExtension->ActualBaudRate, DeviceExtension->BaudError);
+
+    if ((DeviceExtension->BaudError > RS485_BAUD_ERROR_LIMIT) ||
+        (DeviceExtension->BaudError < -RS485_BAUD_ERROR_LIMIT)) {
+        RS_DbgPrint ("RS485NT: Baud rate error too large, check Clock Rate\n");
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_EnableInterrupts
+//
+// Description:
+//  Turns on the UART interrupts once the ISR is connected. Synchronized
+//  with RS485_Isr, other ports in the group may already be running.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_EnableInterrupts (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    UCHAR   ch;
+
+    //
+    // Enable all UART interrupts on the IBM PC by asserting the GP02 general
+    // purpose output. Clear all other MCR bits. Activate DTR for RS485 use.
+    //
+    ch = MCR_ACTIVATE_GP02 | MCR_ACTIVATE_DTR;
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.MCR, ch);
+
+    //
+    // Enable Specific Interrupts
+    //
+    ch = (IER_ENABLE_RX_DATA_READY_IRQ | IER_ENABLE_TX_BE_IRQ | IER_ENABLE_RX_ERROR_IRQ);
+
+    //
+    // Rx Poll Mode 2: none at all, the poll timer does the work
+    //
+    if ((DeviceExtension->PollMode == POLL_MODE_ALWAYS) &&
+        (DeviceExtension->PollTimer != NULL)) {
+        ch = 0;
+        DeviceExtension->PollActive = TRUE;
+    }
+
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.IER, ch);
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ConnectInterrupts
+//
+// Description:
+//  Groups the ports by IRQ line and connects one interrupt (RS485_Isr)
+//  per group, then enables the UART interrupts. The vector is shared with
+//  other drivers if any port in the group asks for it ("Share Interrupt").
+//  A group reads one status register, so a port naming a different one
+//  than the ports before it on its line is deleted, as are ports whose
+//  interrupt can't be connected.
+//
+// Arguments:
+//      DriverObject    - Pointer to this device's driver object
+//
+// Return Value:
+//      none
+//
+VOID RS485_ConnectInterrupts (IN PDRIVER_OBJECT DriverObject)
+{
+    PDEVICE_OBJECT deviceObject, nextObject;
+    PRS485NT_DEVICE_EXTENSION extension;
+    PRS485NT_INTERRUPT_GROUP group;
+    NTSTATUS status;
+    ULONG i, j;
+
+    for (deviceObject = DriverObject->DeviceObject; deviceObject != NULL;
+         deviceObject = nextObject) {
+
+        extension = deviceObject->DeviceExtension;
+        nextObject = deviceObject->NextDevice;
+
+        group = NULL;
+        for (i = 0; i < InterruptGroupCount; i++) {
+            if (InterruptGroups[i].IRQLine == extension->IRQLine) {
+                group = &InterruptGroups[i];
+                break;
+            }
+        }
+
+        if (group == NULL) {
+            group = &InterruptGroups[InterruptGroupCount++];
+            RtlZeroMemory (group, sizeof(RS485NT_INTERRUPT_GROUP));
+            group->IRQLine = extension->IRQLine;
+            group->InterruptVector = extension->InterruptVector;
+            group->Irql = extension->Irql;
+            group->Affinity = extension->Affinity;
+        }
+
+        if ((group->StatusPort != NULL) && (extension->StatusPort != NULL) &&
+            (group->StatusPort != extension->StatusPort)) {
+            RS_DbgPrint("RS485NT: Interrupt Status Port %p differs from %p on IRQ %u\n",
+                        extension->StatusPort, group->StatusPort, extension->IRQLine);
+            RS485_DeletePort (deviceObject);
+            continue;
+        }
+
+        //
+        // The ports on a line share the interrupt, so it runs where all
+        // of them allow. Ignore a mask with none of the HAL's processors.
+        //
+        if (extension->InterruptAffinity != 0) {
+            if (group->Affinity & extension->InterruptAffinity) {
+                group->Affinity &= extension->InterruptAffinity;
+            } else {
+                RS_DbgPrint("RS485NT: Interrupt Affinity has no usable processor\n");
+            }
+        }
+
+        if ((group->StatusPort == NULL) && (extension->StatusPort != NULL)) {
+            group->StatusPort = extension->StatusPort;
+        }
+
+        if (extension->ShareInterrupt) {
+            group->ShareVector = TRUE;
+        }
+
+        //
+        // Without a status register every port is looked at
+        //
+        extension->StatusMask = (UCHAR)(1 << (extension->StatusBit & 7));
+
+        group->Ports[group->PortCount++] = extension;
+    }
+
+    for (i = 0; i < InterruptGroupCount; i++) {
+
+        group = &InterruptGroups[i];
+
+        //
+        // Every driver on a shared vector has to connect it the same way,
+        // and a line shared with other devices is level triggered: while
+        // one of them holds it, another's edge would go unseen
+        //
+        group->InterruptMode = group->ShareVector ? LevelSensitive : Latched;
+
+        if (group->StatusPort == NULL) {
+            for (j = 0; j < group->PortCount; j++) {
+                group->Ports[j]->StatusMask = 0xFF;
+            }
+        }
+
+        status = IoConnectInterrupt(&group->InterruptObject,
+                                    RS485_Isr,
+                                    group,
+                                    NULL,
+                                    group->InterruptVector,
+                                    group->Irql,
+                                    group->Irql,
+                                    group->InterruptMode,
+                                    group->ShareVector,
+                                    group->Affinity,
+                                    FALSE);
+
+        if (!NT_SUCCESS (status)) {
+            RS_DbgPrint("RS485NT: Couldn't connect interrupt\n");
+            group->InterruptObject = NULL;
+
+            for (j = 0; j < group->PortCount; j++) {
+                RS485_DeletePort (group->Ports[j]->DeviceObject);
+            }
+            group->PortCount = 0;
+            continue;
+        }
+
+        for (j = 0; j < group->PortCount; j++) {
+            group->Ports[j]->InterruptObject = group->InterruptObject;
+            group->Ports[j]->Affinity = group->Affinity;
+            KeSynchronizeExecution (group->InterruptObject,
+                                    RS485_EnableInterrupts, group->Ports[j]);
+
+            if (group->Ports[j]->PollActive) {
+                ExSetTimer (group->Ports[j]->PollTimer,
+                            -RS485_PollInterval (group->Ports[j]), 0, NULL);
+            }
+        }
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_TargetDpc
+//
+// Description:
+//  Points the ISR at the DPC for DpcProcessor with DpcImportance: the
+//  device object's DPC for any processor, TargetedDpc otherwise. A DPC
+//  that is queued is taken off its processor's queue and the new one is
+//  queued instead. Every KeInsertQueueDpc of IsrDpc is synchronized with
+//  the ISR, so synchronized with it (or before the interrupt is
+//  connected) neither is queued meanwhile. Neither is reinitialized, one
+//  of them may be running.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_TargetDpc (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    PDEVICE_OBJECT DeviceObject = DeviceExtension->DeviceObject;
+    BOOLEAN Queued;
+
+    Queued = KeRemoveQueueDpc (DeviceExtension->IsrDpc);
+
+    KeSetImportanceDpc (&DeviceObject->Dpc, (KDPC_IMPORTANCE)DeviceExtension->DpcImportance);
+    KeSetImportanceDpc (&DeviceExtension->TargetedDpc, (KDPC_IMPORTANCE)DeviceExtension->DpcImportance);
+
+    //
+    // There is no call to untarget a DPC, so go back to the untargeted one
+    //
+    if (DeviceExtension->DpcProcessor != RS485NT_DPC_ANY_PROCESSOR) {
+        KeSetTargetProcessorDpc (&DeviceExtension->TargetedDpc, (CCHAR)DeviceExtension->DpcProcessor);
+        DeviceExtension->IsrDpc = &DeviceExtension->TargetedDpc;
+    } else {
+        DeviceExtension->IsrDpc = &DeviceObject->Dpc;
+    }
+
+    if (Queued) {
+        KeInsertQueueDpc (DeviceExtension->IsrDpc, NULL, NULL);
+    }
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SetProcessors
+//
+// Description:
+//  IOCTL_RS485NT_SET_PROCESSORS: moves the DPC to another processor
+//  and/or changes its importance. Applied right away, the DPC runs
+//  wherever it was queued until then.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The Irp associated with this IO
+//
+// Return Value:
+//      STATUS_SUCCESS
+//      STATUS_INVALID_PARAMETER - No such processor or importance
+//
+NTSTATUS RS485_SetProcessors (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp)
+{
+    PIO_STACK_LOCATION  irpStack = IoGetCurrentIrpStackLocation (Irp);
+    PRS485NT_PROCESSORS Processors = Irp->AssociatedIrp.SystemBuffer;
+
+    if ((irpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(RS485NT_PROCESSORS)) ||
+        ((Processors->DpcProcessor != RS485NT_DPC_ANY_PROCESSOR) &&
+         !RS485_PROCESSOR_ACTIVE (Processors->DpcProcessor)) ||
+        (Processors->DpcImportance > RS485NT_DPC_IMPORTANCE_MEDIUM_HIGH)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    DeviceExtension->DpcProcessor = Processors->DpcProcessor;
+    DeviceExtension->DpcImportance = Processors->DpcImportance;
+
+    KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                            RS485_TargetDpc, DeviceExtension);
+
+    if (irpStack->Parameters.DeviceIoControl.OutputBufferLength >= sizeof(RS485NT_PROCESSORS)) {
+        RS485_GetProcessors (DeviceExtension, Processors);
+        Irp->IoStatus.Information = sizeof(RS485NT_PROCESSORS);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_GetProcessors
+//
+// Description:
+//  Fills in where the ISR and DPC run, and where the DPC did run, for
+//  IOCTL_RS485NT_GET_PROCESSORS (and SET_PROCESSORS).
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Processors      - Returns the settings and DPC counts
+//
+// Return Value:
+//      none
+//
+VOID RS485_GetProcessors (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                          OUT PRS485NT_PROCESSORS Processors)
+{
+    Processors->InterruptAffinity = DeviceExtension->Affinity;
+    Processors->DpcProcessor = DeviceExtension->DpcProcessor;
+    Processors->DpcImportance = DeviceExtension->DpcImportance;
+    Processors->ActiveProcessors = KeQueryActiveProcessorCount (NULL);
+
+    RtlMoveMemory (Processors->DpcRuns, DeviceExtension->DpcProcessorRuns,
+                   sizeof(Processors->DpcRuns));
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_Write 
+//
+// Description:
+//  Called by DispatchRoutine in response to a Write request. Valid writes
+//  are marked pending and queued for RS485_StartIo, they are completed by
+//  RS485_Dpc_Routine once the last character is out and RTS is released.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The Irp associated with this IO
+//
+// Return Value:
+//      STATUS_PENDING  - The IRP was queued, don't complete it
+//      STATUS_SUCCESS  - Complete the IRP with Irp->IoStatus
+//
+NTSTATUS RS485_Write (IN PRS485NT_DEVICE_EXTENSION  DeviceExtension, IN PIRP Irp)
+{
+    ULONG   Length;
+
+    Length = IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Length;
+    Irp->IoStatus.Information = 0L;
+
+    InterlockedIncrement64 (&DeviceExtension->WriteIrps);
+
+    //
+    // Check for a zero length write.
+    //
+
+    if (Length) {
+
+        if (!DeviceExtension->DirectIo && (Length >= DeviceExtension->BufferSize)) {
+
+            //
+            // Not enough room in the buffer
+            //
+            Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
+
+        } else if (RS485_IrpBuffer (Irp) == NULL) {
+
+            //
+            // No system address for the caller's pages
+            //
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+
+        } else {
+
+            //
+            // Stamp the arrival time. The byte offset means nothing to a
+            // serial port, so it carries the time until the write completes.
+            //
+            IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.ByteOffset =
+                KeQueryPerformanceCounter (NULL);
+
+            //
+            // Queue it. RS485_StartIo runs now if the transmitter is idle.
+            //
+            IoMarkIrpPending (Irp);
+            IoStartPacket (DeviceExtension->DeviceObject, Irp, NULL,
+                           RS485_CancelQueuedIrp);
+
+            return STATUS_PENDING;
+        }
+
+    } else {
+        //
+        // Nothing to write, so return SUCCESS (and do nothing!)
+        //
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_StartIo
+//
+// Description:
+//  Starts the next queued write or transaction. Called by the I/O manager
+//  (IoStartPacket, IoStartNextPacket) at DISPATCH_LEVEL, one IRP at a time.
+//
+// Arguments:
+//      DeviceObject    - Pointer to the Device object
+//      Irp             - The write or transaction IRP to start
+//
+// Return Value:
+//      none
+//
+VOID RS485_StartIo (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    PRS485NT_TRANSACT Transact;
+    KIRQL   CancelIrql;
+    ULONG   Length;
+    PUCHAR  Buffer;
+
+    //
+    // Once the transmission starts the frame goes out in full, so take the
+    // cancel routine away. If the IRP was cancelled first, the cancel
+    // routine owns it.
+    //
+    IoAcquireCancelSpinLock (&CancelIrql);
+
+    if ((Irp != DeviceObject->CurrentIrp) || Irp->Cancel) {
+        IoReleaseCancelSpinLock (CancelIrql);
+        return;
+    }
+
+    IoSetCancelRoutine (Irp, NULL);
+    IoReleaseCancelSpinLock (CancelIrql);
+
+    //
+    // The mapped rings own the transmitter (and the receive ring)
+    //
+    if (DeviceExtension->RingMapped) {
+        Irp->IoStatus.Status = STATUS_DEVICE_BUSY;
+        Irp->IoStatus.Information = 0;
+        IoStartNextPacket (DeviceObject, TRUE);
+        IoCompleteRequest (Irp, IO_NO_INCREMENT);
+        return;
+    }
+
+    //
+    // Line changes wait their turn behind the writes, the line is idle now
+    //
+    if ((IoGetCurrentIrpStackLocation(Irp)->MajorFunction == IRP_MJ_DEVICE_CONTROL) &&
+        (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode ==
+         IOCTL_RS485NT_SET_LINE_SETTINGS)) {
+        RS485_ChangeLine (DeviceExtension, Irp);
+        return;
+    }
+
+    //
+    // So does the self test, it borrows the UART
+    //
+    if ((IoGetCurrentIrpStackLocation(Irp)->MajorFunction == IRP_MJ_DEVICE_CONTROL) &&
+        (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode ==
+         IOCTL_RS485NT_SELF_TEST)) {
+        RS485_StartSelfTest (DeviceExtension, Irp);
+        return;
+    }
+
+    //
+    // Copy the buffer into the DeviceExtension. The response of a
+    // transaction overwrites its request, so keep the response rules too.
+    //
+    if (RS485_IsTransact (Irp)) {
+        Transact = Irp->AssociatedIrp.SystemBuffer;
+        DeviceExtension->TransactTimeouts = Transact->ResponseTimeouts;
+        Length = Transact->RequestLength;
+        Buffer = Transact->Request;
+    } else {
+        Length = IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Length;
+        Buffer = RS485_IrpBuffer (Irp);
+    }
+
+    //
+    // Transmit straight out of the IRP's buffer, it is nonpaged (or locked
+    // down and mapped by RS485_Write) and stays put until we complete it.
+    //
+    DeviceExtension->XmitBufferCount = Length;
+    DeviceExtension->XmitBufferPosition = Buffer;
+    DeviceExtension->XmitLength = Length;
+    DeviceExtension->XmitBufferStart = Buffer;
+    DeviceExtension->BusAttempts = 0;
+
+    //
+    // Assert RTS and kick start the UART with the first burst, once the
+    // bus is idle with listen before talk
+    //
+    RS485_BusStart (DeviceExtension);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_CancelQueuedIrp
+//
+// Description:
+//  Cancel routine for IRPs queued with IoStartPacket. Called with the
+//  cancel spin lock held.
+//
+// Arguments:
+//      DeviceObject    - Pointer to the Device object
+//      Irp             - The IRP being cancelled
+//
+// Return Value:
+//      none
+//
+VOID RS485_CancelQueuedIrp (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
+{
+    if (Irp == DeviceObject->CurrentIrp) {
+        //
+        // Cancelled before RS485_StartIo got to it
+        //
+        IoReleaseCancelSpinLock (Irp->CancelIrql);
+        IoStartNextPacket (DeviceObject, TRUE);
+    } else {
+        KeRemoveEntryDeviceQueue (&DeviceObject->DeviceQueue,
+                                  &Irp->Tail.Overlay.DeviceQueueEntry);
+        IoReleaseCancelSpinLock (Irp->CancelIrql);
+    }
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest (Irp, IO_NO_INCREMENT);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_Read
+//
+// Description:
+//  Called by DispatchRoutine in response to a Read request. Reads are
+//  queued and filled from the receive ring, in order, by RS485_ServiceRead.
+//  They complete when the requested length arrives or a timeout expires,
+//  which may be right away.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The Irp associated with this IO
+//
+// Return Value:
+//      STATUS_PENDING  - The IRP was queued, don't complete it
+//      STATUS_SUCCESS  - Complete the IRP with Irp->IoStatus
+//
+NTSTATUS RS485_Read (IN PRS485NT_DEVICE_EXTENSION  DeviceExtension, IN PIRP Irp)
+{
+    ULONG   Length;
+    KIRQL   OldIrql;
+    
+    Length = RS485_ReadLength (Irp);
+    Irp->IoStatus.Information = 0L;
+
+    InterlockedIncrement64 (&DeviceExtension->ReadIrps);
+
+    //
+    // Check for a zero length read.
+    //
+    if (Length) {
+
+        //
+        // Map the caller's pages now, RS485_ServiceRead finds them mapped
+        //
+        if (RS485_IrpBuffer (Irp) == NULL) {
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+
+        if (DeviceExtension->RingMapped) {
+            //
+            // The application reads the mapped ring itself
+            //
+            KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+            Irp->IoStatus.Status = STATUS_DEVICE_BUSY;
+            return STATUS_DEVICE_BUSY;
+        }
+
+        IoSetCancelRoutine (Irp, RS485_CancelRead);
+
+        if (Irp->Cancel && IoSetCancelRoutine (Irp, NULL) != NULL) {
+            //
+            // Cancelled before we got it queued
+            //
+            KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+            Irp->IoStatus.Status = STATUS_CANCELLED;
+            return STATUS_CANCELLED;
+        }
+
+        IoMarkIrpPending (Irp);
+        InsertTailList (&DeviceExtension->ReadQueue, &Irp->Tail.Overlay.ListEntry);
+
+        KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+
+        //
+        // Fill it (and complete it) now if the data is already here
+        //
+        RS485_ProcessReads (DeviceExtension);
+
+        return STATUS_PENDING;
+
+    } else {
+        //
+        // Nothing to read, so return SUCCESS (and do nothing!)
+        //
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_IrpBuffer
+//
+// Description:
+//  Returns the data buffer of a read, write or transaction IRP: the
+//  system buffer, or with direct I/O a system address for the caller's
+//  locked pages. The first call (at PASSIVE_LEVEL in the dispatch path)
+//  maps the MDL, later calls get the same mapping.
+//
+// Arguments:
+//      Irp             - The Irp associated with this IO
+//
+// Return Value:
+//      The buffer, NULL if the pages could not be mapped
+//
+PUCHAR RS485_IrpBuffer (IN PIRP Irp)
+{
+    if (Irp->MdlAddress != NULL) {
+        return MmGetSystemAddressForMdlSafe (Irp->MdlAddress,
+                                             NormalPagePriority | MdlMappingNoExecute);
+    }
+
+    return Irp->AssociatedIrp.SystemBuffer;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_Transact
+//
+// Description:
+//  Called by DispatchRoutine for IOCTL_RS485NT_TRANSACT. The transaction
+//  is queued with the writes; RS485_StartIo transmits the request and
+//  RS485_StartResponse turns it into a read for the response.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The Irp associated with this IO
+//
+// Return Value:
+//      STATUS_PENDING  - The IRP was queued, don't complete it
+//      otherwise       - Complete the IRP with Irp->IoStatus
+//
+NTSTATUS RS485_Transact (IN PRS485NT_DEVICE_EXTENSION  DeviceExtension, IN PIRP Irp)
+{
+    PIO_STACK_LOCATION  irpStack = IoGetCurrentIrpStackLocation (Irp);
+    PRS485NT_TRANSACT   Transact = Irp->AssociatedIrp.SystemBuffer;
+    ULONG               InputLength;
+
+    InputLength = irpStack->Parameters.DeviceIoControl.InputBufferLength;
+
+    InterlockedIncrement64 (&DeviceExtension->TransactIrps);
+
+    if ((InputLength < FIELD_OFFSET(RS485NT_TRANSACT, Request)) ||
+        (Transact->RequestLength == 0) ||
+        (Transact->RequestLength > InputLength - FIELD_OFFSET(RS485NT_TRANSACT, Request)) ||
+        (irpStack->Parameters.DeviceIoControl.OutputBufferLength == 0)) {
+
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Transact->RequestLength >= DeviceExtension->BufferSize) {
+        //
+        // Not enough room in the buffer, same as a write
+        //
+        Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    IoMarkIrpPending (Irp);
+    IoStartPacket (DeviceExtension->DeviceObject, Irp, NULL,
+                   RS485_CancelQueuedIrp);
+
+    return STATUS_PENDING;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_IsTransact
+//
+// Description:
+//  Tells a transaction IRP from a read or write IRP.
+//
+// Arguments:
+//      Irp             - The IRP
+//
+// Return Value:
+//      TRUE for IOCTL_RS485NT_TRANSACT
+//
+BOOLEAN RS485_IsTransact (IN PIRP Irp)
+{
+    PIO_STACK_LOCATION  irpStack = IoGetCurrentIrpStackLocation (Irp);
+
+    return (irpStack->MajorFunction == IRP_MJ_DEVICE_CONTROL) &&
+           (irpStack->Parameters.DeviceIoControl.IoControlCode == IOCTL_RS485NT_TRANSACT);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ReadLength
+//
+// Description:
+//  Number of bytes a read (or the response of a transaction) asks for.
+//
+// Arguments:
+//      Irp             - The read or transaction IRP
+//
+// Return Value:
+//      Requested length in bytes
+//
+ULONG RS485_ReadLength (IN PIRP Irp)
+{
+    PIO_STACK_LOCATION  irpStack = IoGetCurrentIrpStackLocation (Irp);
+
+    if (irpStack->MajorFunction == IRP_MJ_DEVICE_CONTROL) {
+        return irpStack->Parameters.DeviceIoControl.OutputBufferLength;
+    }
+    return irpStack->Parameters.Read.Length;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_StartResponse
+//
+// Description:
+//  Called from the DPC once the request of a transaction is on the wire
+//  and RTS is released (the receive ring starts fresh from there). Puts
+//  the transaction at the head of the read queue, ahead of any read that
+//  was already waiting, so it gets the response. The transaction stays
+//  the current StartIo IRP, which holds the bus until it completes.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The transaction IRP
+//
+// Return Value:
+//      none
+//
+VOID RS485_StartResponse (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp)
+{
+    KIRQL   OldIrql;
+
+    Irp->IoStatus.Information = 0;
+
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+
+    IoSetCancelRoutine (Irp, RS485_CancelRead);
+
+    if (Irp->Cancel && IoSetCancelRoutine (Irp, NULL) != NULL) {
+        KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        RS485_CompleteRead (DeviceExtension, Irp, IO_NO_INCREMENT);
+        return;
+    }
+
+    //
+    // A read in progress waits behind the transaction (its timeouts
+    // restart when it resumes)
+    //
+    if (DeviceExtension->CurrentReadIrp != NULL) {
+        InsertHeadList (&DeviceExtension->ReadQueue,
+                        &DeviceExtension->CurrentReadIrp->Tail.Overlay.ListEntry);
+        DeviceExtension->CurrentReadIrp = NULL;
+    }
+
+    InsertHeadList (&DeviceExtension->ReadQueue, &Irp->Tail.Overlay.ListEntry);
+
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+
+    RS485_ProcessReads (DeviceExtension);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_CompleteRead
+//
+// Description:
+//  Completes a read or transaction IRP taken off the read engine. A
+//  transaction held the bus, so start the next write first.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The IRP, with IoStatus filled in
+//      PriorityBoost   - For IoCompleteRequest
+//
+// Return Value:
+//      none
+//
+VOID RS485_CompleteRead (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                         IN PIRP Irp, IN CCHAR PriorityBoost)
+{
+    KIRQL   OldIrql;
+
+    if (RS485_IsTransact (Irp)) {
+        KeRaiseIrql (DISPATCH_LEVEL, &OldIrql);
+        IoStartNextPacket (DeviceExtension->DeviceObject, TRUE);
+        KeLowerIrql (OldIrql);
+    }
+
+    IoCompleteRequest (Irp, PriorityBoost);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ProcessReads
+//
+// Description:
+//  Runs the read engine: fills the current read from the receive ring and
+//  completes every read that is done. Called whenever something changes,
+//  new data (DPC), a new read, a timeout or a cancel.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//
+// Return Value:
+//      none
+//
+VOID RS485_ProcessReads (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    KIRQL   OldIrql;
+    PIRP    Irp;
+
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+
+    while ((Irp = RS485_ServiceRead (DeviceExtension)) != NULL) {
+
+        //
+        // Don't hold the lock across IoCompleteRequest
+        //
+        KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+        RS485_CompleteRead (DeviceExtension, Irp, IO_SERIAL_INCREMENT);
+        KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+    }
+
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ServiceRead
+//
+// Description:
+//  Starts the next queued read if there is no current one, copies what the
+//  ring has into it and checks it against the timeouts. Called with
+//  RcvLock held. The current read keeps its cancel routine, so it can be
+//  cancelled while it waits.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//
+// Return Value:
+//      The read IRP to complete (Irp->IoStatus filled in), or NULL
+//
+PIRP RS485_ServiceRead (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    PIRP            Irp;
+    PUCHAR          Buffer;
+    ULONG           Length, Count;
+    NTSTATUS        FrameStatus;
+    ULONGLONG       Total;
+    LONGLONG        Now, Due;
+    LARGE_INTEGER   DueTime;
+    PRS485NT_TIMEOUTS Timeouts = &DeviceExtension->Timeouts;
+
+    Now = KeQueryInterruptTime ();
+    Irp = DeviceExtension->CurrentReadIrp;
+
+    if (Irp == NULL) {
+
+        if (IsListEmpty (&DeviceExtension->ReadQueue)) {
+            KeCancelTimer (&DeviceExtension->ReadTimer);
+            return NULL;
+        }
+
+        //
+        // Start the next read, working out its deadlines from the timeouts
+        //
+        Irp = CONTAINING_RECORD (RemoveHeadList (&DeviceExtension->ReadQueue),
+                                 IRP, Tail.Overlay.ListEntry);
+        DeviceExtension->CurrentReadIrp = Irp;
+
+        Length = RS485_ReadLength (Irp);
+
+        if (RS485_IsTransact (Irp)) {
+            Timeouts = &DeviceExtension->TransactTimeouts;
+        }
+
+        DeviceExtension->ReadReturnAny = FALSE;
+        DeviceExtension->ReadInterval = 0;
+        DeviceExtension->ReadTotalDeadline = 0;
+        DeviceExtension->ReadLastTime = Now;
+
+        if (Timeouts->ReadIntervalTimeout == MAXULONG) {
+
+            if ((Timeouts->ReadTotalTimeoutMultiplier == 0) &&
+                (Timeouts->ReadTotalTimeoutConstant == 0)) {
+                //
+                // Return immediately with what we have
+                //
+                DeviceExtension->ReadReturnAny = TRUE;
+                DeviceExtension->ReadTotalDeadline = Now;
+
+            } else if ((Timeouts->ReadTotalTimeoutMultiplier == MAXULONG) &&
+                       (Timeouts->ReadTotalTimeoutConstant != MAXULONG)) {
+                //
+                // Return on the first data, or after the constant
+                //
+                DeviceExtension->ReadReturnAny = TRUE;
+                DeviceExtension->ReadTotalDeadline = Now +
+                    (LONGLONG)Timeouts->ReadTotalTimeoutConstant * 10000;
+            }
+        }
+
+        if (!DeviceExtension->ReadReturnAny) {
+
+            if ((Timeouts->ReadIntervalTimeout != 0) &&
+                (Timeouts->ReadIntervalTimeout != MAXULONG)) {
+                DeviceExtension->ReadInterval =
+                    (LONGLONG)Timeouts->ReadIntervalTimeout * 10000;
+            }
+
+            Total = (ULONGLONG)Timeouts->ReadTotalTimeoutMultiplier * Length +
+                    Timeouts->ReadTotalTimeoutConstant;
+
+            if (Total) {
+                DeviceExtension->ReadTotalDeadline = Now + (LONGLONG)Total * 10000;
+            }
+        }
+    }
+
+    //
+    // If it is being cancelled, leave it to RS485_CancelRead
+    //
+    if (Irp->Cancel) {
+        return NULL;
+    }
+
+    //
+    // Move what we have from the ring into the read
+    //
+    Length = RS485_ReadLength (Irp);
+    Buffer = RS485_IrpBuffer (Irp);
+
+    FrameStatus = STATUS_PENDING;
+
+    if (DeviceExtension->FrameMode != FRAME_MODE_NONE) {
+        //
+        // One whole frame per read, or nothing
+        //
+        FrameStatus = RS485_FrameRead (DeviceExtension, Buffer, Length, &Count);
+        Irp->IoStatus.Information = Count;
+
+    } else {
+
+        Count = RS485_RcvRead (DeviceExtension,
+                               Buffer + Irp->IoStatus.Information,
+                               Length - (ULONG)Irp->IoStatus.Information);
+
+        if (Count) {
+            Irp->IoStatus.Information += Count;
+            DeviceExtension->ReadLastTime = Now;
+        }
+    }
+
+    //
+    // Done yet?
+    //
+    if (FrameStatus != STATUS_PENDING) {
+        Irp->IoStatus.Status = FrameStatus;
+
+    } else if (Irp->IoStatus.Information == Length) {
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+
+    } else if (DeviceExtension->ReadReturnAny && Irp->IoStatus.Information) {
+        Irp->IoStatus.Status = STATUS_SUCCESS;
+
+    } else if (DeviceExtension->ReadTotalDeadline &&
+               (Now >= DeviceExtension->ReadTotalDeadline)) {
+        Irp->IoStatus.Status = DeviceExtension->ReadReturnAny ? STATUS_SUCCESS : STATUS_TIMEOUT;
+
+    } else if (DeviceExtension->ReadInterval && Irp->IoStatus.Information &&
+               (Now >= DeviceExtension->ReadLastTime + DeviceExtension->ReadInterval)) {
+        Irp->IoStatus.Status = STATUS_TIMEOUT;
+
+    } else {
+        //
+        // Not yet, wake up at the nearest deadline (if there is one)
+        //
+        Due = 0;
+        if (DeviceExtension->ReadTotalDeadline) {
+            Due = DeviceExtension->ReadTotalDeadline;
+        }
+        if (DeviceExtension->ReadInterval && Irp->IoStatus.Information) {
+            if ((Due == 0) ||
+                (DeviceExtension->ReadLastTime + DeviceExtension->ReadInterval < Due)) {
+                Due = DeviceExtension->ReadLastTime + DeviceExtension->ReadInterval;
+            }
+        }
+        if (Due) {
+            DueTime.QuadPart = -(Due - Now);
+            KeSetTimer (&DeviceExtension->ReadTimer, DueTime, &DeviceExtension->ReadTimerDpc);
+        }
+        return NULL;
+    }
+
+    //
+    // Finished, unless it is being cancelled right now
+    //
+    if (IoSetCancelRoutine (Irp, NULL) == NULL) {
+        return NULL;
+    }
+
+    DeviceExtension->CurrentReadIrp = NULL;
+    return Irp;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ReadTimerDpc
+//
+// Description:
+//  Read timeout timer DPC, re-runs the read engine which completes the
+//  read if its deadline has passed.
+//
+// Arguments:
+//      Dpc             - not used
+//      DeferredContext - Pointer to the device extension
+//      SystemArgument1 - not used
+//      SystemArgument2 - not used
+//
+// Return Value:
+//      none
+//
+VOID RS485_ReadTimerDpc (IN PKDPC Dpc, IN PVOID DeferredContext,
+                         IN PVOID SystemArgument1, IN PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    RS485_ProcessReads (DeferredContext);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_CancelRead
+//
+// Description:
+//  Cancel routine for queued and current reads. Called with the cancel spin
+//  lock held. A cancelled current read returns the data it already has.
+//
+// Arguments:
+//      DeviceObject    - Pointer to the Device object
+//      Irp             - The IRP being cancelled
+//
+// Return Value:
+//      none
+//
+VOID RS485_CancelRead (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = DeviceObject->DeviceExtension;
+    KIRQL   OldIrql;
+
+    IoReleaseCancelSpinLock (Irp->CancelIrql);
+
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+
+    if (Irp == DeviceExtension->CurrentReadIrp) {
+        DeviceExtension->CurrentReadIrp = NULL;
+    } else {
+        RemoveEntryList (&Irp->Tail.Overlay.ListEntry);
+    }
+
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    RS485_CompleteRead (DeviceExtension, Irp, IO_NO_INCREMENT);
+
+    //
+    // Start the next read, if any
+    //
+    RS485_ProcessReads (DeviceExtension);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_FlushReads
+//
+// Description:
+//  Completes the current and all queued reads as cancelled. Called when
+//  the handle is closed (IRP_MJ_CLEANUP).
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//
+// Return Value:
+//      none
+//
+VOID RS485_FlushReads (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    KIRQL       OldIrql;
+    PIRP        Irp;
+    LIST_ENTRY  FlushList;
+
+    InitializeListHead (&FlushList);
+
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+
+    //
+    // Collect every read we can take the cancel routine from. The ones we
+    // can't are being cancelled and RS485_CancelRead will complete them.
+    //
+    Irp = DeviceExtension->CurrentReadIrp;
+    if ((Irp != NULL) && (IoSetCancelRoutine (Irp, NULL) != NULL)) {
+        DeviceExtension->CurrentReadIrp = NULL;
+        InsertTailList (&FlushList, &Irp->Tail.Overlay.ListEntry);
+    }
+
+    while (!IsListEmpty (&DeviceExtension->ReadQueue)) {
+        Irp = CONTAINING_RECORD (RemoveHeadList (&DeviceExtension->ReadQueue),
+                                 IRP, Tail.Overlay.ListEntry);
+
+        if (IoSetCancelRoutine (Irp, NULL) != NULL) {
+            InsertTailList (&FlushList, &Irp->Tail.Overlay.ListEntry);
+        } else {
+            //
+            // Make the cancel routine's RemoveEntryList harmless
+            //
+            InitializeListHead (&Irp->Tail.Overlay.ListEntry);
+        }
+    }
+
+    KeCancelTimer (&DeviceExtension->ReadTimer);
+
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+
+    while (!IsListEmpty (&FlushList)) {
+        Irp = CONTAINING_RECORD (RemoveHeadList (&FlushList),
+                                 IRP, Tail.Overlay.ListEntry);
+        Irp->IoStatus.Status = STATUS_CANCELLED;
+        RS485_CompleteRead (DeviceExtension, Irp, IO_NO_INCREMENT);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_RcvCount
+//
+// Description:
+//  Returns the number of unread bytes in the receive ring.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//
+// Return Value:
+//      Number of bytes waiting
+//
+ULONG RS485_RcvCount (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    ULONG   Head, Tail, Discard;
+
+    //
+    // Read RcvDiscard before RcvHead, it never gets ahead of RcvHead
+    //
+    Discard = DeviceExtension->RcvDiscard;
+    Head = DeviceExtension->RcvHead;
+    Tail = DeviceExtension->RcvTail;
+
+    if ((LONG)(Discard - Tail) > 0) {
+        Tail = Discard;
+    }
+
+    return Head - Tail;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_RcvRead
+//
+// Description:
+//  Consumer side of the receive ring. Copies up to Length bytes out of the
+//  ring and hands the space back to the ISR. Runs at any IRQL <= DISPATCH
+//  without synchronizing with the ISR, but only one reader at a time
+//  (callers hold RcvLock).
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Buffer          - Where to copy the data, NULL to just drop it
+//      Length          - Size of Buffer
+//
+// Return Value:
+//      Number of bytes copied
+//
+ULONG RS485_RcvRead (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                     OUT PUCHAR Buffer, IN ULONG Length)
+{
+    return RS485_RcvReadStamped (DeviceExtension, Buffer, NULL, Length);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_RcvReadStamped
+//
+// Description:
+//  RS485_RcvRead that also copies out the receive time of each byte
+//  (Timestamp Mode).
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Buffer          - Where to copy the data, NULL to just drop it
+//      Stamps          - Where to copy the times (low 32 bits of the
+//                        performance counter), NULL if not wanted
+//      Length          - Size of Buffer (and entries in Stamps)
+//
+// Return Value:
+//      Number of bytes copied
+//
+ULONG RS485_RcvReadStamped (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                            OUT PUCHAR Buffer, OUT PULONG Stamps, IN ULONG Length)
+{
+    ULONG   Head, Tail, Discard, Count, Offset, Chunk;
+
+    Discard = DeviceExtension->RcvDiscard;
+    Head = DeviceExtension->RcvHead;
+    Tail = DeviceExtension->RcvTail;
+
+    //
+    // Don't read the data before the head index that covers it
+    //
+    KeMemoryBarrier ();
+
+    //
+    // Skip anything received before the last transmission ended
+    //
+    if ((LONG)(Discard - Tail) > 0) {
+        Tail = Discard;
+    }
+
+    Count = Head - Tail;
+    if (Count > Length) {
+        Count = Length;
+    }
+
+    //
+    // Copy in (at most) two pieces around the end of the ring
+    //
+    Offset = Tail & (DeviceExtension->RcvBufferSize - 1);
+    Chunk = DeviceExtension->RcvBufferSize - Offset;
+    if (Chunk > Count) {
+        Chunk = Count;
+    }
+
+    if (Buffer != NULL) {
+        RtlCopyMemory (Buffer, DeviceExtension->RcvBuffer + Offset, Chunk);
+        RtlCopyMemory (Buffer + Chunk, DeviceExtension->RcvBuffer, Count - Chunk);
+    }
+
+    if ((Stamps != NULL) && (DeviceExtension->RcvStamp != NULL)) {
+        RtlCopyMemory (Stamps, DeviceExtension->RcvStamp + Offset, Chunk * sizeof(ULONG));
+        RtlCopyMemory (Stamps + Chunk, DeviceExtension->RcvStamp, (Count - Chunk) * sizeof(ULONG));
+    }
+
+    //
+    // Finish reading before handing the space back to the ISR
+    //
+    KeMemoryBarrier ();
+    DeviceExtension->RcvTail = Tail + Count;
+
+    return Count;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_FrameRead
+//
+// Description:
+//  Frame mode consumer. Copies the oldest complete frame out of the
+//  receive ring, dropping frames that ended before the last transmission
+//  (our own echo). A frame longer than Buffer is truncated and the rest of
+//  it dropped. Called with RcvLock held.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Buffer          - Where to copy the frame
+//      Length          - Size of Buffer
+//      Count           - Returns the number of bytes copied
+//
+// Return Value:
+//      STATUS_SUCCESS          - A frame was copied
+//      STATUS_BUFFER_OVERFLOW  - A frame was truncated to Length bytes
+//      STATUS_PENDING          - No complete frame yet
+//
+NTSTATUS RS485_FrameRead (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                          OUT PUCHAR Buffer, IN ULONG Length, OUT PULONG Count)
+{
+    ULONG   Head, Tail, Discard, Start, End, Size;
+
+    *Count = 0;
+
+    Discard = DeviceExtension->RcvDiscard;
+    Head = DeviceExtension->FrameHead;
+    Tail = DeviceExtension->FrameTail;
+
+    //
+    // Don't read the frame end before the head index that covers it
+    //
+    KeMemoryBarrier ();
+
+    for (;;) {
+        if (Tail == Head) {
+            DeviceExtension->FrameTail = Tail;
+            return STATUS_PENDING;
+        }
+
+        End = DeviceExtension->FrameEnd[Tail & (RS485_FRAME_QUEUE - 1)];
+
+        if ((LONG)(End - Discard) > 0) {
+            break;
+        }
+        Tail++;
+    }
+
+    //
+    // The ISR may not have published the last bytes of the frame yet, the
+    // RX DPC brings us back when it has
+    //
+    if ((LONG)(End - DeviceExtension->RcvHead) > 0) {
+        DeviceExtension->FrameTail = Tail;
+        return STATUS_PENDING;
+    }
+
+    Start = DeviceExtension->RcvTail;
+    if ((LONG)(Discard - Start) > 0) {
+        Start = Discard;
+    }
+
+    Size = End - Start;
+
+    if (Size > Length) {
+        *Count = RS485_RcvRead (DeviceExtension, Buffer, Length);
+        RS485_RcvRead (DeviceExtension, NULL, Size - Length);
+    } else {
+        *Count = RS485_RcvRead (DeviceExtension, Buffer, Size);
+    }
+
+    DeviceExtension->FrameTail = Tail + 1;
+
+    return (Size > Length) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_GetLineSettings
+//
+// Description:
+//  Fills in the current line settings for IOCTL_RS485NT_GET_LINE_SETTINGS
+//  (and SET_LINE_SETTINGS).
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Settings        - Returns the settings
+//
+// Return Value:
+//      none
+//
+VOID RS485_GetLineSettings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                            OUT PRS485NT_LINE_SETTINGS Settings)
+{
+    Settings->BaudRate = DeviceExtension->BaudRate;
+    Settings->DataBits = DeviceExtension->DataBits;
+    Settings->Parity = DeviceExtension->Parity;
+    Settings->StopBits = DeviceExtension->StopBits;
+    Settings->BufferSize = DeviceExtension->BufferSize;
+    Settings->ActualBaudRate = DeviceExtension->ActualBaudRate;
+    Settings->BaudError = DeviceExtension->BaudError;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SetLineSettings
+//
+// Description:
+//  Called by DispatchRoutine for IOCTL_RS485NT_SET_LINE_SETTINGS. Checks
+//  the new settings and queues the request behind the writes, so the line
+//  is idle when RS485_ChangeLine applies it.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The Irp associated with this IO
+//
+// Return Value:
+//      STATUS_PENDING  - The IRP was queued, don't complete it
+//      otherwise       - Complete the IRP with Irp->IoStatus
+//
+NTSTATUS RS485_SetLineSettings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp)
+{
+    PIO_STACK_LOCATION      irpStack = IoGetCurrentIrpStackLocation (Irp);
+    PRS485NT_LINE_SETTINGS  Settings = Irp->AssociatedIrp.SystemBuffer;
+
+    if ((irpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(RS485NT_LINE_SETTINGS)) ||
+        (Settings->BaudRate == 0) ||
+        (Settings->BaudRate > DeviceExtension->ClockRate / UART_CLOCK_DIVIDE) ||
+        (Settings->DataBits < 5) || (Settings->DataBits > 8) ||
+        (Settings->Parity > RS485NT_PARITY_SPACE) ||
+        (Settings->StopBits < 1) || (Settings->StopBits > 2) ||
+        (Settings->BufferSize && (Settings->BufferSize < RS485_MIN_BUFFER_SIZE)) ||
+        (Settings->BufferSize > RS485_MAX_BUFFER_SIZE)) {
+
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    IoMarkIrpPending (Irp);
+    IoStartPacket (DeviceExtension->DeviceObject, Irp, NULL,
+                   RS485_CancelQueuedIrp);
+
+    return STATUS_PENDING;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_ChangeLine
+//
+// Description:
+//  Applies IOCTL_RS485NT_SET_LINE_SETTINGS. Called from RS485_StartIo at
+//  DISPATCH_LEVEL, so no transmission (or transaction) is in progress.
+//  A new receive ring is allocated first; the switch happens under the
+//  read engine lock and synchronized with the ISR (RS485_SwapLine).
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The IRP, completed here
+//
+// Return Value:
+//      none
+//
+VOID RS485_ChangeLine (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp)
+{
+    PRS485NT_LINE_SETTINGS  Settings = Irp->AssociatedIrp.SystemBuffer;
+    RS485NT_LINE_CHANGE     Change;
+    NTSTATUS                status = STATUS_SUCCESS;
+
+    RtlZeroMemory (&Change, sizeof(Change));
+    Change.DeviceExtension = DeviceExtension;
+
+    if (Settings->BufferSize && (Settings->BufferSize != DeviceExtension->BufferSize)) {
+
+        Change.BufferSize = Settings->BufferSize;
+        Change.RcvBufferSize = 1;
+        while (Change.RcvBufferSize < Change.BufferSize) {
+            Change.RcvBufferSize <<= 1;
+        }
+
+        Change.RcvBuffer = ExAllocatePoolWithTag (NonPagedPool, Change.RcvBufferSize, MEMORY_TAG);
+
+        if (DeviceExtension->TimestampMode) {
+            Change.RcvStamp = ExAllocatePoolWithTag (NonPagedPool,
+                                                     Change.RcvBufferSize * sizeof(ULONG),
+                                                     MEMORY_TAG);
+        }
+
+        if ((Change.RcvBuffer == NULL) ||
+            (DeviceExtension->TimestampMode && (Change.RcvStamp == NULL))) {
+            RS_DbgPrint("RS485NT: ExAllocatePool failed for SET_LINE_SETTINGS\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+
+        KeAcquireSpinLockAtDpcLevel (&DeviceExtension->RcvLock);
+
+        DeviceExtension->BaudRate = Settings->BaudRate;
+        DeviceExtension->DataBits = Settings->DataBits;
+        DeviceExtension->Parity = Settings->Parity;
+        DeviceExtension->StopBits = Settings->StopBits;
+
+        RS485_BaudDivisor (DeviceExtension);
+        RS485_ComputeTimings (DeviceExtension);
+
+        KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_SwapLine, &Change);
+
+        KeReleaseSpinLockFromDpcLevel (&DeviceExtension->RcvLock);
+    }
+
+    //
+    // Free whatever isn't in use (the old ring, or the new one on failure)
+    //
+    if (Change.RcvBuffer) {
+        ExFreePool (Change.RcvBuffer);
+    }
+    if (Change.RcvStamp) {
+        ExFreePool (Change.RcvStamp);
+    }
+
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = 0;
+
+    if (NT_SUCCESS(status) &&
+        (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.OutputBufferLength >=
+         sizeof(RS485NT_LINE_SETTINGS))) {
+        RS485_GetLineSettings (DeviceExtension, Settings);
+        Irp->IoStatus.Information = sizeof(RS485NT_LINE_SETTINGS);
+    }
+
+    IoStartNextPacket (DeviceExtension->DeviceObject, TRUE);
+    IoCompleteRequest (Irp, IO_NO_INCREMENT);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SwapLine
+//
+// Description:
+//  Reprograms the UART and, if requested, swaps in the new receive ring.
+//  Anything received so far was received with the old settings and is
+//  discarded. Synchronized with RS485_Isr, called with RcvLock held.
+//
+// Arguments:
+//      Context - Pointer to the RS485NT_LINE_CHANGE, returns the old ring
+//                to free
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_SwapLine (IN PVOID Context)
+{
+    PRS485NT_LINE_CHANGE Change = Context;
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Change->DeviceExtension;
+    PUCHAR  Buffer;
+    PULONG  Stamp;
+    ULONG   Size;
+
+    RS485_ProgramLine (DeviceExtension);
+
+    if (Change->RcvBuffer != NULL) {
+
+        Buffer = DeviceExtension->RcvBuffer;
+        Size = DeviceExtension->RcvBufferSize;
+        DeviceExtension->RcvBuffer = Change->RcvBuffer;
+        DeviceExtension->RcvBufferSize = Change->RcvBufferSize;
+        Change->RcvBuffer = Buffer;
+        Change->RcvBufferSize = Size;
+
+        Stamp = DeviceExtension->RcvStamp;
+        DeviceExtension->RcvStamp = Change->RcvStamp;
+        Change->RcvStamp = Stamp;
+
+        DeviceExtension->RcvHead = 0;
+        DeviceExtension->RcvTail = 0;
+        DeviceExtension->RcvDiscard = 0;
+        DeviceExtension->FrameHead = 0;
+        DeviceExtension->FrameTail = 0;
+
+        DeviceExtension->BufferSize = Change->BufferSize;
+
+    } else {
+        DeviceExtension->RcvDiscard = DeviceExtension->RcvHead;
+    }
+
+    DeviceExtension->FrameOpen = FALSE;
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SelfTestRequest
+//
+// Description:
+//  Called by DispatchRoutine for IOCTL_RS485NT_SELF_TEST. Checks the
+//  request and queues it behind the writes, so the line is idle when
+//  RS485_StartSelfTest runs it.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The Irp associated with this IO
+//
+// Return Value:
+//      STATUS_PENDING  - The IRP was queued, don't complete it
+//      otherwise       - Complete the IRP with Irp->IoStatus
+//
+NTSTATUS RS485_SelfTestRequest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp)
+{
+    PIO_STACK_LOCATION  irpStack = IoGetCurrentIrpStackLocation (Irp);
+    PRS485NT_SELF_TEST  Request = Irp->AssociatedIrp.SystemBuffer;
+
+    if (irpStack->Parameters.DeviceIoControl.OutputBufferLength <
+        sizeof(RS485NT_SELF_TEST_RESULT)) {
+        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    if ((irpStack->Parameters.DeviceIoControl.InputBufferLength >= sizeof(RS485NT_SELF_TEST)) &&
+        (Request->ByteCount > RS485NT_SELF_TEST_MAX_BYTES)) {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (DeviceExtension->SelfTestTimer == NULL) {
+        Irp->IoStatus.Status = STATUS_NOT_SUPPORTED;
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    IoMarkIrpPending (Irp);
+    IoStartPacket (DeviceExtension->DeviceObject, Irp, NULL,
+                   RS485_CancelQueuedIrp);
+
+    return STATUS_PENDING;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_AllocateSelfTest
+//
+// Description:
+//  Allocates and sets up the state of a loopback self test.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      ByteCount       - Bytes to send, 0 = RS485NT_SELF_TEST_DEFAULT_BYTES
+//
+// Return Value:
+//      The state, NULL if out of memory
+//
+PRS485NT_SELF_TEST_STATE RS485_AllocateSelfTest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                                                 IN ULONG ByteCount)
+{
+    PRS485NT_SELF_TEST_STATE State;
+    LONGLONG    Idle;
+
+    State = ExAllocatePoolWithTag (NonPagedPool, sizeof(RS485NT_SELF_TEST_STATE), MEMORY_TAG);
+    if (State == NULL) {
+        RS_DbgPrint("RS485NT: ExAllocatePool failed for the self test\n");
+        return NULL;
+    }
+
+    RtlZeroMemory (State, sizeof(RS485NT_SELF_TEST_STATE));
+
+    if (ByteCount == 0) {
+        ByteCount = RS485NT_SELF_TEST_DEFAULT_BYTES;
+    }
+    if (ByteCount > RS485NT_SELF_TEST_MAX_BYTES) {
+        ByteCount = RS485NT_SELF_TEST_MAX_BYTES;
+    }
+    State->ByteCount = ByteCount;
+
+    //
+    // 100ns units to performance counter ticks
+    //
+    Idle = (LONGLONG)DeviceExtension->CharTime * RS485_SELF_TEST_IDLE;
+    if (Idle < RS485_SELF_TEST_IDLE_MIN) {
+        Idle = RS485_SELF_TEST_IDLE_MIN;
+    }
+    State->IdleLimit = (Idle * DeviceExtension->PerfFrequency.QuadPart) / 10000000;
+
+    return State;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SelfTestPollTime
+//
+// Description:
+//  How often the self test polls the UART, in 100ns units: often enough
+//  that the transmitter never runs dry and the receiver never overruns.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      Poll interval
+//
+LONGLONG RS485_SelfTestPollTime (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    ULONG   Chars;
+
+    Chars = DeviceExtension->FifoDepth / RS485_SELF_TEST_POLL;
+
+    return (LONGLONG)DeviceExtension->CharTime * (Chars ? Chars : 1);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_StartSelfTest
+//
+// Description:
+//  Runs IOCTL_RS485NT_SELF_TEST. Called from RS485_StartIo at
+//  DISPATCH_LEVEL, so no transmission (or transaction) is in progress.
+//  On a PC the UART interrupt is gated by OUT2, which loopback
+//  disconnects, so the test is driven by polling from the self test
+//  timer. The IRP is completed by RS485_FinishSelfTest.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The IRP
+//
+// Return Value:
+//      none
+//
+VOID RS485_StartSelfTest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp)
+{
+    PRS485NT_SELF_TEST          Request = Irp->AssociatedIrp.SystemBuffer;
+    PRS485NT_SELF_TEST_STATE    State;
+    ULONG                       ByteCount = 0;
+
+    if (IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.InputBufferLength >=
+        sizeof(RS485NT_SELF_TEST)) {
+        ByteCount = Request->ByteCount;
+    }
+
+    State = RS485_AllocateSelfTest (DeviceExtension, ByteCount);
+
+    if (State == NULL) {
+        Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+        Irp->IoStatus.Information = 0;
+        IoStartNextPacket (DeviceExtension->DeviceObject, TRUE);
+        IoCompleteRequest (Irp, IO_NO_INCREMENT);
+        return;
+    }
+
+    State->Irp = Irp;
+    DeviceExtension->SelfTest = State;
+
+    KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                            RS485_SelfTestBegin, DeviceExtension);
+
+    ExSetTimer (DeviceExtension->SelfTestTimer,
+                -RS485_SelfTestPollTime (DeviceExtension), 0, NULL);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SelfTestTimer
+//
+// Description:
+//  High resolution timer callback armed by RS485_StartSelfTest. Polls the
+//  UART and re-arms itself until the test is over.
+//
+// Arguments:
+//      Timer   - The self test timer
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_SelfTestTimer (IN PEX_TIMER Timer, IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+
+    if (!KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                 RS485_SelfTestPoll, DeviceExtension)) {
+        ExSetTimer (Timer, -RS485_SelfTestPollTime (DeviceExtension), 0, NULL);
+        return;
+    }
+
+    RS485_FinishSelfTest (DeviceExtension);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_FinishSelfTest
+//
+// Description:
+//  Puts the UART back in normal mode and completes IOCTL_RS485NT_SELF_TEST
+//  with the results.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_FinishSelfTest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    PRS485NT_SELF_TEST_STATE State = DeviceExtension->SelfTest;
+    PIRP    Irp = State->Irp;
+
+    KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                            RS485_SelfTestEnd, DeviceExtension);
+
+    RS485_SelfTestResult (DeviceExtension, State, Irp->AssociatedIrp.SystemBuffer);
+    ExFreePool (State);
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = sizeof(RS485NT_SELF_TEST_RESULT);
+
+    IoStartNextPacket (DeviceExtension->DeviceObject, TRUE);
+    IoCompleteRequest (Irp, IO_NO_INCREMENT);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_LoadSelfTest
+//
+// Description:
+//  The "Self Test" registry value: runs the loopback self test when the
+//  port is created, before its interrupt is connected. Keeps the results
+//  for IOCTL_RS485NT_GET_LOAD_SELF_TEST and prints them. Polls with the
+//  processor stalled, so keep the byte count small at low baud rates.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      none
+//
+VOID RS485_LoadSelfTest (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    PRS485NT_SELF_TEST_STATE State;
+    PRS485NT_SELF_TEST_RESULT Result = &DeviceExtension->LoadSelfTest;
+
+    State = RS485_AllocateSelfTest (DeviceExtension, DeviceExtension->SelfTestBytes);
+    if (State == NULL) {
+        return;
+    }
+
+    DeviceExtension->SelfTest = State;
+
+    //
+    // Nothing else touches the UART yet, no need to synchronize
+    //
+    RS485_SelfTestBegin (DeviceExtension);
+
+    while (!RS485_SelfTestPoll (DeviceExtension)) {
+        KeStallExecutionProcessor (10);
+    }
+
+    RS485_SelfTestEnd (DeviceExtension);
+
+    RS485_SelfTestResult (DeviceExtension, State, Result);
+    ExFreePool (State);
+    DeviceExtension->LoadSelfTestDone = TRUE;
+
+    RS_DbgPrint ("RS485NT: Port %lu self test: %lu sent, %lu received, %lu lost, %lu corrupt, "
+                 "%lu overruns, %lu of %lu bytes/s, latency %lu/%lu/%lu us\n",
+                 DeviceExtension->PortNumber, Result->BytesSent, Result->BytesReceived,
+                 Result->BytesLost, Result->BytesCorrupt, Result->OverrunErrors,
+                 Result->BytesPerSecond, Result->LineBytesPerSecond,
+                 Result->LatencyMin, Result->LatencyAverage, Result->LatencyMax);
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SelfTestBegin
+//
+// Description:
+//  Puts the UART in internal loopback with its interrupts off, throws away
+//  anything left in the receiver and sends the first burst. RTS is off,
+//  loopback keeps the transmitter off the bus anyway. Synchronized with
+//  RS485_Isr once the interrupt is connected.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_SelfTestBegin (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    PRS485NT_SELF_TEST_STATE State = DeviceExtension->SelfTest;
+    ULONG   i;
+
+    State->Ier = READ_PORT_UCHAR (DeviceExtension->ComPort.IER);
+    State->Mcr = READ_PORT_UCHAR (DeviceExtension->ComPort.MCR);
+
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.IER, 0);
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.MCR,
+                      (UCHAR)((State->Mcr & MCR_DEACTIVATE_RTS) | MCR_ACTIVATE_LOOPBACK));
+
+    for (i = 0; (i < RS485_SELF_TEST_WINDOW) &&
+                (READ_PORT_UCHAR (DeviceExtension->ComPort.LSR) & LSR_RX_DATA_READY); i++) {
+        READ_PORT_UCHAR (DeviceExtension->ComPort.RBR);
+    }
+
+    State->Start = KeQueryPerformanceCounter (NULL).QuadPart;
+    State->LastProgress = State->Start;
+
+    RS485_SelfTestPoll (DeviceExtension);
+
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_SelfTestPoll
+//
+// Description:
+//  One self test poll: takes back what the receiver has and refills the
+//  transmitter. A byte that matches one sent after the byte expected means
+//  the ones in between were lost, a byte that matches nothing in flight is
+//  corrupt. Latency is measured to the poll that finds the byte.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE when the test is over: every byte came back, or nothing did
+//      for the idle limit
+//
+BOOLEAN RS485_SelfTestPoll (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    PRS485NT_SELF_TEST_STATE State = DeviceExtension->SelfTest;
+    LONGLONG    Now, Latency;
+    ULONG       Index, i;
+    UCHAR       lsr, ch, Mask;
 
-                    break;
-                }
+    Now = KeQueryPerformanceCounter (NULL).QuadPart;
 
-                case IOCTL_RS485NT_GET_RCV_COUNT:
-                {
-                    RS_DbgPrint ("GET_RCV_COUNT\n");
-                    if (outputBufferLength >= 4) {
-                        //
-                        // Return the current receive buffer count
-                        //
+    //
+    // With fewer than 8 data bits only the low bits go round
+    //
+    Mask = (UCHAR)((1 << DeviceExtension->DataBits) - 1);
 
-                        *(ULONG *)ioBuffer = deviceExtension->RcvBufferCount;
+    //
+    // Bounded, a missing UART reads back 0xFF (data always ready)
+    //
+    for (i = 0; i < RS485_SELF_TEST_WINDOW; i++) {
 
-                        Irp->IoStatus.Information = 4;
-                    }
-                    break;
-                }
+        lsr = READ_PORT_UCHAR (DeviceExtension->ComPort.LSR);
+        if (!(lsr & LSR_RX_DATA_READY)) {
+            break;
+        }
 
-                case IOCTL_RS485NT_LAST_RCVD_TIME:
-                {
-                    RS_DbgPrint ("LAST_RCVD_TIME\n");
-                    if (outputBufferLength >= 8) {
+        ch = READ_PORT_UCHAR (DeviceExtension->ComPort.RBR) & Mask;
+        State->Received++;
 
-                        //
-                        // Get the current system time and convert to Milliseconds
-                        //
+        if (lsr & LSR_RX_OVERRUN_ERROR) {
+            State->Overruns++;
+        }
 
-                        KeQuerySystemTime (&CurrentSystemTime);
-                        ElapsedTime.QuadPart = CurrentSystemTime.QuadPart - 
-                                               deviceExtension->LastQuerySystemTime.QuadPart;
-                        ElapsedTime.QuadPart /= 10000;
+        for (Index = State->Next;
+             (Index < State->Sent) && ((RS485_SELF_TEST_PATTERN(Index) & Mask) != ch);
+             Index++);
 
-                        RtlMoveMemory (ioBuffer, &ElapsedTime, 8);
-                        Irp->IoStatus.Information = 8;
-                    }
+        if (Index == State->Sent) {
+            //
+            // Take it as the next byte, garbled
+            //
+            State->Corrupt++;
+            if (State->Next < State->Sent) {
+                State->Next++;
+            }
+            continue;
+        }
 
-                    break;
-                }
+        if (lsr & (LSR_RX_PARITY_ERROR | LSR_RX_FRAMING_ERROR | LSR_RX_BREAK_DETECTED)) {
+            State->Corrupt++;
+        }
 
-                default:
-                {
-                    RS_DbgPrint ("RS485NT: Unknown IRP_MJ_DEVICE_CONTROL\n");
-                    Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
-                    break;
-                }
-    
-            }
-    
-            break;
+        State->Lost += Index - State->Next;
+        State->Next = Index + 1;
+
+        Latency = Now - State->SendTime[Index % RS485_SELF_TEST_WINDOW];
+
+        if ((State->Matched == 0) || (Latency < State->LatencyMin)) {
+            State->LatencyMin = Latency;
         }
-        default:
-        {
-            RS_DbgPrint ("RS485NT: Unhandled IRP_MJ function\n");
-            Irp->IoStatus.Status = STATUS_NOT_IMPLEMENTED;
-            break;
+        if (Latency > State->LatencyMax) {
+            State->LatencyMax = Latency;
         }
+        State->LatencyTotal += Latency;
+        State->Matched++;
+        State->LastProgress = Now;
     }
 
     //
-    // DON'T get cute and try to use the status field of
-    // the irp in the return status.  That IRP IS GONE as
-    // soon as you call IoCompleteRequest.
+    // Refill the transmitter once it's empty, a FIFO load at a time, and
+    // never more than the window ahead of the receiver
     //
+    if ((State->Sent < State->ByteCount) &&
+        (READ_PORT_UCHAR (DeviceExtension->ComPort.LSR) & LSR_TX_BUFFER_EMPTY)) {
 
-    ntStatus = Irp->IoStatus.Status;
-
-    IoCompleteRequest (Irp, IO_NO_INCREMENT);
+        for (i = 0; (i < DeviceExtension->FifoDepth) &&
+                    (State->Sent < State->ByteCount) &&
+                    (State->Sent - State->Next < RS485_SELF_TEST_WINDOW); i++) {
 
-    RS_DbgPrint ("RS485NT: DisptachRoutine exit.\n");
+            State->SendTime[State->Sent % RS485_SELF_TEST_WINDOW] = Now;
+            WRITE_PORT_UCHAR (DeviceExtension->ComPort.TBR,
+                              RS485_SELF_TEST_PATTERN(State->Sent) & Mask);
+            State->Sent++;
+        }
+    }
 
-    //
-    // We never have pending operation so always return the status code.
-    //
+    if (State->Next >= State->ByteCount) {
+        return TRUE;
+    }
 
-    return ntStatus;
+    return (Now - State->LastProgress > State->IdleLimit);
 }
 
 
 //---------------------------------------------------------------------------
-// UnloadDriver
+// RS485_SelfTestEnd
 //
 // Description:
-//     Free all the allocated resources, etc.
+//  Takes the UART out of loopback, drops what's left in the receiver and
+//  turns the interrupts back on. Synchronized with RS485_Isr once the
+//  interrupt is connected.
 //
 // Arguments:
-//     DriverObject - pointer to a driver object
-// 
+//      Context - Pointer to the device extension.
+//
 // Return Value:
-//      None
-// 
-VOID UnloadDriver (IN PDRIVER_OBJECT DriverObject)
+//      TRUE
+//
+BOOLEAN RS485_SelfTestEnd (IN PVOID Context)
 {
-    WCHAR                  deviceLinkBuffer[]  = L"\\DosDevices\\RS485NT";
-    UNICODE_STRING         deviceLinkUnicodeString;
-    PRS485NT_DEVICE_EXTENSION extension;
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
+    PRS485NT_SELF_TEST_STATE State = DeviceExtension->SelfTest;
+    ULONG   i;
 
-    extension = DriverObject->DeviceObject->DeviceExtension;
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.MCR, State->Mcr);
 
-    //
-    // Deactivate all of the MCR interrupt sources.
-    //
-    WRITE_PORT_UCHAR (extension->ComPort.MCR, MCR_DEACTIVATE_ALL);
+    for (i = 0; (i < RS485_SELF_TEST_WINDOW) &&
+                (READ_PORT_UCHAR (DeviceExtension->ComPort.LSR) & LSR_RX_DATA_READY); i++) {
+        READ_PORT_UCHAR (DeviceExtension->ComPort.RBR);
+    }
 
-    //
-    // Free any resources
-    //
-    IoDisconnectInterrupt (extension->InterruptObject);
+    WRITE_PORT_UCHAR (DeviceExtension->ComPort.IER, State->Ier);
 
-    //
-    // Delete the symbolic link
-    //
-    RtlInitUnicodeString (&deviceLinkUnicodeString, deviceLinkBuffer);
+    DeviceExtension->SelfTest = NULL;
 
-    IoDeleteSymbolicLink (&deviceLinkUnicodeString);
+    return TRUE;
+}
 
-    //
-    // Delete the device object
-    //
-    IoDeleteDevice (DriverObject->DeviceObject);
 
-    RS_DbgPrint ("RS485NT: Unloaded\n");
-    return;
+//---------------------------------------------------------------------------
+// RS485_SelfTestResult
+//
+// Description:
+//  Converts a finished self test to RS485NT_SELF_TEST_RESULT. Bytes still
+//  in flight at the end count as lost.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//      State           - The finished test
+//      Result          - Returns the results
+//
+// Return Value:
+//      none
+//
+VOID RS485_SelfTestResult (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                           IN PRS485NT_SELF_TEST_STATE State,
+                           OUT PRS485NT_SELF_TEST_RESULT Result)
+{
+    LONGLONG    Frequency = DeviceExtension->PerfFrequency.QuadPart;
+    LONGLONG    Elapsed = State->LastProgress - State->Start;
+
+    RtlZeroMemory (Result, sizeof(RS485NT_SELF_TEST_RESULT));
+
+    Result->BytesSent = State->Sent;
+    Result->BytesReceived = State->Received;
+    Result->BytesLost = State->Lost + (State->Sent - State->Next);
+    Result->BytesCorrupt = State->Corrupt;
+    Result->OverrunErrors = State->Overruns;
+    Result->ElapsedTime = (ULONG)((Elapsed * 1000000) / Frequency);
+    Result->LineBytesPerSecond = DeviceExtension->ActualBaudRate / DeviceExtension->BitsPerChar;
+
+    if (Elapsed > 0) {
+        Result->BytesPerSecond = (ULONG)((State->Received * Frequency) / Elapsed);
+    }
+
+    if (State->Matched) {
+        Result->LatencyMin = (ULONG)((State->LatencyMin * 1000000) / Frequency);
+        Result->LatencyAverage = (ULONG)((State->LatencyTotal / State->Matched * 1000000) /
+                                         Frequency);
+        Result->LatencyMax = (ULONG)((State->LatencyMax * 1000000) / Frequency);
+    }
 }
 
 
 //---------------------------------------------------------------------------
-//  GetConfiguration
+// RS485_RingSize
 //
 // Description:
-//      Obtains driver configuration information from the Registry.
+//  Rounds a requested IOCTL_RS485NT_MAP_RINGS ring size up to a power of
+//  two.
 //
 // Arguments:
-//      DeviceExtension - Pointer to the device extension.
-//      RegistryPath    - Pointer to the null-terminated Unicode name of the
-//                        registry path for this driver.
+//      Requested       - Size asked for, 0 = Default
+//      Default         - The port's buffer size
 //
 // Return Value:
-//      NTSTATUS
-// 
-NTSTATUS GetConfiguration(IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
-                          IN PUNICODE_STRING RegistryPath)
+//      The ring size, 0 if the request is too big
+//
+ULONG RS485_RingSize (IN ULONG Requested, IN ULONG Default)
 {
-    PRTL_QUERY_REGISTRY_TABLE parameters = NULL;
-    UNICODE_STRING parametersPath = { 0 };
+    ULONG   Size;
 
-    ULONG notThereDefault = 1234567;
-    ULONG PortAddressDefault = 0;
-    ULONG IRQLineDefault = 0;
-    ULONG BaudRateDefault = 0;
-    ULONG BufferSizeDefault = 0;
+    if (Requested == 0) {
+        Requested = Default;
+    }
 
-    NTSTATUS status = STATUS_SUCCESS;
-    PWSTR path = NULL;
-    USHORT queriesPlusOne = 5;
+    if (Requested > RS485_MAX_RING_SIZE) {
+        return 0;
+    }
 
-    parametersPath.Buffer = NULL;
+    Size = RS485_MIN_BUFFER_SIZE;
+    while (Size < Requested) {
+        Size <<= 1;
+    }
+
+    return Size;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_MapRings
+//
+// Description:
+//  IOCTL_RS485NT_MAP_RINGS. Allocates the shared header and the RX / TX
+//  rings from nonpaged pool, maps them into the calling process and hands
+//  the port over to them. Only while the port is idle: no queued writes
+//  or reads. Runs at PASSIVE_LEVEL in the caller's context.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      Irp             - The Irp associated with this IO
+//
+// Return Value:
+//      STATUS_SUCCESS, Irp->IoStatus.Information set
+//      STATUS_DEVICE_BUSY - Already mapped, or I/O in progress
+//      otherwise      - Invalid request or out of resources
+//
+NTSTATUS RS485_MapRings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp)
+{
+    PIO_STACK_LOCATION      irpStack = IoGetCurrentIrpStackLocation (Irp);
+    PRS485NT_MAP_RINGS      MapRings = Irp->AssociatedIrp.SystemBuffer;
+    PRS485NT_RING_MAPPING   Mapping = Irp->AssociatedIrp.SystemBuffer;
+    PRS485NT_RING_HEADER    Header;
+    NTSTATUS                status = STATUS_SUCCESS;
+    ULONG                   RxSize, TxSize;
+    KIRQL                   OldIrql;
+
+    if ((irpStack->Parameters.DeviceIoControl.InputBufferLength < sizeof(RS485NT_MAP_RINGS)) ||
+        (irpStack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(RS485NT_RING_MAPPING))) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
 
     //
-    // Registry path is already null-terminated, so just use it.
+    // The mapped ring is a plain byte stream
     //
-    path = RegistryPath->Buffer;
+    if (DeviceExtension->FrameMode != FRAME_MODE_NONE) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    RxSize = RS485_RingSize (MapRings->RxSize, DeviceExtension->BufferSize);
+    TxSize = RS485_RingSize (MapRings->TxSize, DeviceExtension->BufferSize);
+
+    if ((RxSize == 0) || (TxSize == 0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
 
     //
-    // Allocate the Rtl query table.
+    // Claim the port. From here on RS485_StartIo and RS485_Read turn
+    // new requests away.
     //
-    parameters = ExAllocatePoolWithTag (PagedPool, (sizeof(RTL_QUERY_REGISTRY_TABLE) * queriesPlusOne), MEMORY_TAG);
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
 
-    if (!parameters) {
-        RS_DbgPrint("RS485NT: ExAllocatePool failed for Rtl in GetConfiguration\n");
-        status = STATUS_UNSUCCESSFUL;
+    if (DeviceExtension->RingMapped ||
+        (DeviceExtension->DeviceObject->CurrentIrp != NULL) ||
+        (DeviceExtension->CurrentReadIrp != NULL) ||
+        !IsListEmpty (&DeviceExtension->ReadQueue)) {
+        status = STATUS_DEVICE_BUSY;
     } else {
+        DeviceExtension->RingMapped = TRUE;
+    }
 
-        RtlZeroMemory(parameters, sizeof(RTL_QUERY_REGISTRY_TABLE) * queriesPlusOne);
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
 
-        //
-        // Form a path to this driver's Parameters subkey.
-        //
-        RtlInitUnicodeString(&parametersPath, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
 
-        parametersPath.MaximumLength = RegistryPath->Length + sizeof(L"\\Parameters");
+    //
+    // Header page, RX ring, TX ring. Whole pages, zeroed, the caller sees
+    // all of it.
+    //
+    DeviceExtension->RingLength = (ULONG)ROUND_TO_PAGES (RS485_RING_HEADER_SIZE + RxSize + TxSize);
+    DeviceExtension->RingBase = ExAllocatePoolWithTag (NonPagedPool, DeviceExtension->RingLength, MEMORY_TAG);
 
-        parametersPath.Buffer = ExAllocatePoolWithTag (PagedPool, parametersPath.MaximumLength, MEMORY_TAG);
+    if (DeviceExtension->RingBase == NULL) {
+        RS_DbgPrint("RS485NT: ExAllocatePool failed for the mapped rings\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    } else {
+        RtlZeroMemory (DeviceExtension->RingBase, DeviceExtension->RingLength);
 
-        if (!parametersPath.Buffer) {
-            RS_DbgPrint("RS485NT: ExAllocatePool failed for Path in GetConfiguration\n");
-            status = STATUS_UNSUCCESSFUL;
+        DeviceExtension->RingMdl = IoAllocateMdl (DeviceExtension->RingBase,
+                                                  DeviceExtension->RingLength,
+                                                  FALSE, FALSE, NULL);
+        if (DeviceExtension->RingMdl == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
         }
     }
 
     if (NT_SUCCESS(status)) {
 
-        //
-        // Form the parameters path.
-        //
-        RtlZeroMemory(parametersPath.Buffer, parametersPath.MaximumLength);
-        RtlAppendUnicodeToString(&parametersPath, path);
-        RtlAppendUnicodeToString(&parametersPath, L"\\Parameters");
+        MmBuildMdlForNonPagedPool (DeviceExtension->RingMdl);
 
         //
-        // Gather all of the "user specified" information from
-        // the registry.
+        // Mapping into user mode raises an exception on failure
         //
-        parameters[0].Flags = RTL_QUERY_REGISTRY_DIRECT;
-        parameters[0].Name = L"Port Address";
-        parameters[0].EntryContext =  &PortAddressDefault;
-        parameters[0].DefaultType = REG_DWORD;
-        parameters[0].DefaultData = &notThereDefault;
-        parameters[0].DefaultLength = sizeof(ULONG);
-
-        parameters[1].Flags = RTL_QUERY_REGISTRY_DIRECT;
-        parameters[1].Name = L"IRQ Line";
-        parameters[1].EntryContext = &IRQLineDefault;
-        parameters[1].DefaultType = REG_DWORD;
-        parameters[1].DefaultData = &notThereDefault;
-        parameters[1].DefaultLength = sizeof(ULONG);
-
-        parameters[2].Flags = RTL_QUERY_REGISTRY_DIRECT;
-        parameters[2].Name = L"Baud Rate";
-        parameters[2].EntryContext = &BaudRateDefault;
-        parameters[2].DefaultType = REG_DWORD;
-        parameters[2].DefaultData = &notThereDefault;
-        parameters[2].DefaultLength = sizeof(ULONG);
+        __try {
+            DeviceExtension->RingUserBase =
+                MmMapLockedPagesSpecifyCache (DeviceExtension->RingMdl, UserMode, MmCached,
+                                              NULL, FALSE,
+                                              NormalPagePriority | MdlMappingNoExecute);
+        } __except (EXCEPTION_EXECUTE_HANDLER) {
+            DeviceExtension->RingUserBase = NULL;
+        }
 
-        parameters[3].Flags = RTL_QUERY_REGISTRY_DIRECT;
-        parameters[3].Name = L"Buffer Size";
-        parameters[3].EntryContext = &BufferSizeDefault;
-        parameters[3].DefaultType = REG_DWORD;
-        parameters[3].DefaultData = &notThereDefault;
-        parameters[3].DefaultLength = sizeof(ULONG);
+        if (DeviceExtension->RingUserBase == NULL) {
+            RS_DbgPrint("RS485NT: MmMapLockedPagesSpecifyCache failed\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
 
-        status = RtlQueryRegistryValues(
-                     RTL_REGISTRY_ABSOLUTE | RTL_REGISTRY_OPTIONAL,
-                     parametersPath.Buffer,
-                     parameters,
-                     NULL,
-                     NULL);
+    if (!NT_SUCCESS(status)) {
 
-        if (!NT_SUCCESS(status)) {
-            RS_DbgPrint("RS485NT: RtlQueryRegistryValues failed\n");
+        if (DeviceExtension->RingMdl) {
+            IoFreeMdl (DeviceExtension->RingMdl);
+            DeviceExtension->RingMdl = NULL;
+        }
+        if (DeviceExtension->RingBase) {
+            ExFreePool (DeviceExtension->RingBase);
+            DeviceExtension->RingBase = NULL;
         }
 
-        status = STATUS_SUCCESS;
+        KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+        DeviceExtension->RingMapped = FALSE;
+        KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+
+        return status;
     }
 
     //
-    // Go ahead and assign driver defaults.
+    // The handle may be closed from another process (inherited or
+    // duplicated), keep the process around to unmap from
     //
-    if (PortAddressDefault == notThereDefault) {
-        DeviceExtension->PortAddress = (PUCHAR) DEF_PORT_ADDRESS;
-    } else {
-        DeviceExtension->PortAddress = (PVOID) PortAddressDefault;
-    }
+    DeviceExtension->RingProcess = PsGetCurrentProcess ();
+    ObReferenceObject (DeviceExtension->RingProcess);
+    DeviceExtension->RingFileObject = irpStack->FileObject;
+
+    //
+    // The driver keeps its own copy of the sizes, the caller can write to
+    // the header
+    //
+    Header = (PRS485NT_RING_HEADER)DeviceExtension->RingBase;
+    Header->RxSize = RxSize;
+    Header->RxOffset = RS485_RING_HEADER_SIZE;
+    Header->TxSize = TxSize;
+    Header->TxOffset = RS485_RING_HEADER_SIZE + RxSize;
+    Header->TxIdle = 1;
+
+    DeviceExtension->RingRxSize = RxSize;
+    DeviceExtension->RingTxSize = TxSize;
+    DeviceExtension->RingTxData = DeviceExtension->RingBase + Header->TxOffset;
+    DeviceExtension->RingTxTail = 0;
+
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+    KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                            RS485_RingAttach, DeviceExtension);
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+
+    Mapping->Address = (ULONGLONG)(ULONG_PTR)DeviceExtension->RingUserBase;
+    Mapping->Length = DeviceExtension->RingLength;
+    Irp->IoStatus.Information = sizeof(RS485NT_RING_MAPPING);
+
+    return STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// RS485_UnmapRings
+//
+// Description:
+//  IOCTL_RS485NT_UNMAP_RINGS, also called when a handle closes
+//  (IRP_MJ_CLEANUP). Only the handle that mapped the rings can unmap
+//  them. Takes the rings away from the ISR, unmaps and frees them. A
+//  transmission from the TX ring stops after the bytes already in the
+//  UART; the port takes requests again once RS485_RingXmitDone has seen
+//  it finish.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//      FileObject      - The handle asking
+//
+// Return Value:
+//      STATUS_SUCCESS
+//      STATUS_INVALID_DEVICE_REQUEST - Not mapped
+//      STATUS_ACCESS_DENIED - Mapped through another handle
+//
+NTSTATUS RS485_UnmapRings (IN PRS485NT_DEVICE_EXTENSION DeviceExtension,
+                           IN PFILE_OBJECT FileObject)
+{
+    KIRQL   OldIrql;
+    PMDL    Mdl;
+    PUCHAR  Base;
+    PVOID   UserBase;
+    PEPROCESS Process;
 
-    if (IRQLineDefault == notThereDefault) {
-        DeviceExtension->IRQLine = DEF_IRQ_LINE;
-    } else {
-        DeviceExtension->IRQLine = (KIRQL) IRQLineDefault;
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
+
+    if (DeviceExtension->RingHeader == NULL) {
+        KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+        return STATUS_INVALID_DEVICE_REQUEST;
     }
 
-    if (BaudRateDefault == notThereDefault) {
-        DeviceExtension->BaudRate = DEF_BAUD_RATE;
-    } else {
-        DeviceExtension->BaudRate = BaudRateDefault;
+    if (DeviceExtension->RingFileObject != FileObject) {
+        KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+        return STATUS_ACCESS_DENIED;
     }
 
-    if (BufferSizeDefault == notThereDefault) {
-        DeviceExtension->BufferSize = DEF_BUFFER_SIZE;
-    } else {
-        DeviceExtension->BufferSize = BufferSizeDefault;
+    KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                            RS485_RingDetach, DeviceExtension);
+
+    Mdl = DeviceExtension->RingMdl;
+    Base = DeviceExtension->RingBase;
+    UserBase = DeviceExtension->RingUserBase;
+    Process = DeviceExtension->RingProcess;
+
+    DeviceExtension->RingMdl = NULL;
+    DeviceExtension->RingBase = NULL;
+    DeviceExtension->RingUserBase = NULL;
+    DeviceExtension->RingTxData = NULL;
+    DeviceExtension->RingProcess = NULL;
+    DeviceExtension->RingFileObject = NULL;
+
+    if (!DeviceExtension->RingXmitBusy) {
+        DeviceExtension->RingMapped = FALSE;
     }
 
-    //
-    // Free the allocated memory before returning.
-    //
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
 
-    if (parametersPath.Buffer)
-        ExFreePool(parametersPath.Buffer);
-    if (parameters)
-        ExFreePool(parameters);
-    return (status);
+    RS485_FreeRings (Mdl, Base, UserBase, Process);
+
+    return STATUS_SUCCESS;
 }
 
 
 //---------------------------------------------------------------------------
-// Initialize_RS485
+// RS485_FreeRings
 //
 // Description:
-//  Initializes all data structures and hardware necessary for
-//  driver execution
+//  Unmaps the rings from the process they were mapped into, attaching to
+//  it if the caller runs in another one, and frees them. The ISR must
+//  not be using them any more. Runs at PASSIVE_LEVEL.
 //
 // Arguments:
-//      DeviceExtension - Pointer to the device extension.
+//      Mdl             - The rings' MDL
+//      Base            - Their kernel address
+//      UserBase        - Their address in Process
+//      Process         - Where they are mapped, referenced by RS485_MapRings
 //
 // Return Value:
-//      NSTATUS
-//  
-NTSTATUS Initialize_RS485 (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+//      none
+//
+VOID RS485_FreeRings (IN PMDL Mdl, IN PUCHAR Base, IN PVOID UserBase, IN PEPROCESS Process)
 {
-    UCHAR       ch, Divisor;
-    NTSTATUS    status = STATUS_SUCCESS;
+    KAPC_STATE  ApcState;
 
-    //
-    // Initialize all of the 8250 register addresses
-    //
-    DeviceExtension->ComPort.RBR = DeviceExtension->PortAddress + RX_REGISTER_8250;
-    DeviceExtension->ComPort.TBR = DeviceExtension->PortAddress + TX_REGISTER_8250;
-    DeviceExtension->ComPort.IER = DeviceExtension->PortAddress + IER_8250;
-    DeviceExtension->ComPort.IIR = DeviceExtension->PortAddress + IIR_8250;
-    DeviceExtension->ComPort.LCR = DeviceExtension->PortAddress + LCR_8250;
-    DeviceExtension->ComPort.MCR = DeviceExtension->PortAddress + MCR_8250;
-    DeviceExtension->ComPort.LSR = DeviceExtension->PortAddress + LSR_8250;
-    DeviceExtension->ComPort.MSR = DeviceExtension->PortAddress + MSR_8250;
-    DeviceExtension->ComPort.BAUD = DeviceExtension->PortAddress + DIVISOR_REGISTER_8250;
+    if (Process != PsGetCurrentProcess ()) {
+        KeStackAttachProcess (Process, &ApcState);
+        MmUnmapLockedPages (UserBase, Mdl);
+        KeUnstackDetachProcess (&ApcState);
+    } else {
+        MmUnmapLockedPages (UserBase, Mdl);
+    }
 
-    //
-    // Initialize any Events
-    //
-    KeInitializeEvent (&DeviceExtension->XmitDone, SynchronizationEvent, FALSE);
+    ObDereferenceObject (Process);
+    IoFreeMdl (Mdl);
+    ExFreePool (Base);
+}
 
-    //
-    // Allocate memory for the Transmit and Receive data buffers
-    //
-    DeviceExtension->RcvBuffer = ExAllocatePoolWithTag (NonPagedPool, DeviceExtension->BufferSize, MEMORY_TAG);
 
-    if (DeviceExtension->RcvBuffer == NULL) {
-        RS_DbgPrint("RS485NT: ExAllocatePool failed for RcvBuffer\n");
-        status = STATUS_INSUFFICIENT_RESOURCES;
-    } else {
+//---------------------------------------------------------------------------
+// RS485_RingAttach
+//
+// Description:
+//  Makes the mapped RX ring the receive ring and lets the ISR at the TX
+//  ring. Synchronized with RS485_Isr, called with RcvLock held.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_RingAttach (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
 
-        //
-        // Setup buffer pointers and counts
-        //
+    DeviceExtension->RingSavedRcvBuffer = DeviceExtension->RcvBuffer;
+    DeviceExtension->RingSavedRcvBufferSize = DeviceExtension->RcvBufferSize;
 
-        DeviceExtension->RcvBufferPosition = DeviceExtension->RcvBuffer;
-        DeviceExtension->RcvBufferEnd = DeviceExtension->RcvBuffer + 
-                                        (DeviceExtension->BufferSize - 1);
-        DeviceExtension->RcvBufferCount = 0;
+    DeviceExtension->RcvBuffer = DeviceExtension->RingBase + RS485_RING_HEADER_SIZE;
+    DeviceExtension->RcvBufferSize = DeviceExtension->RingRxSize;
+    DeviceExtension->RcvHead = 0;
+    DeviceExtension->RcvTail = 0;
+    DeviceExtension->RcvDiscard = 0;
 
-    }
+    DeviceExtension->RingHeader = (PRS485NT_RING_HEADER)DeviceExtension->RingBase;
 
-    if (NT_SUCCESS(status)) {
-        DeviceExtension->XmitBuffer = ExAllocatePoolWithTag (NonPagedPool, DeviceExtension->BufferSize, MEMORY_TAG);
-        if (DeviceExtension->RcvBuffer == NULL) {
-            RS_DbgPrint("RS485NT: ExAllocatePool failed for XmitBuffer\n");
-            status = STATUS_INSUFFICIENT_RESOURCES;
-        } else {
+    return TRUE;
+}
 
-            //
-            // Setup buffer pointers and counts
-            //
-            DeviceExtension->XmitBufferPosition = DeviceExtension->XmitBuffer;
-            DeviceExtension->XmitBufferEnd = DeviceExtension->XmitBuffer + 
-                                            (DeviceExtension->BufferSize - 1);
-            DeviceExtension->XmitBufferCount = 0;
-        }
-    }
 
-    //
-    // Clear the interrupt/error Count and get current system time
-    //
-    DeviceExtension->InterruptCount = 0;
-    DeviceExtension->RcvError = 0;
-    KeQuerySystemTime (&DeviceExtension->LastQuerySystemTime);
+//---------------------------------------------------------------------------
+// RS485_RingDetach
+//
+// Description:
+//  Gives the port its own receive ring back. A transmission from the TX
+//  ring is cut short after what is already in the UART. Synchronized with
+//  RS485_Isr, called with RcvLock held.
+//
+// Arguments:
+//      Context - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE
+//
+BOOLEAN RS485_RingDetach (IN PVOID Context)
+{
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
 
-    //
-    // Determine the UART divisor value
-    //
-    switch (DeviceExtension->BaudRate) {
-        case 1200:
-            Divisor = BAUD_RATE_DIVISOR_1200;
-            break;
-        case 2400:
-            Divisor = BAUD_RATE_DIVISOR_2400;
-            break;
-        case 4800:
-            Divisor = BAUD_RATE_DIVISOR_4800;
-            break;
-        case 9600:
-            Divisor = BAUD_RATE_DIVISOR_9600;
-            break;
-        case 19200:
-            Divisor = BAUD_RATE_DIVISOR_19200;
-            break;
-        case 38400:
-            Divisor = BAUD_RATE_DIVISOR_38400;
-            break;
-        case 57600:
-            Divisor = BAUD_RATE_DIVISOR_57600;
-            break;
-        case 115200:
-            Divisor = BAUD_RATE_DIVISOR_115200;
-            break;
-        default:
-            Divisor = BAUD_RATE_DIVISOR_19200;
-            break;
-    }
+    DeviceExtension->RingHeader = NULL;
+    DeviceExtension->XmitBufferCount = 0;
+    DeviceExtension->XmitBufferPosition = NULL;
 
-    //
-    // Set the baud rate to the divisor value.
-    //
-    ch = ((READ_PORT_UCHAR (DeviceExtension->ComPort.LCR)) | LCR_ENABLE_DIVISOR_LATCH);
-    WRITE_PORT_UCHAR (DeviceExtension->ComPort.LCR, ch);
+    DeviceExtension->RcvBuffer = DeviceExtension->RingSavedRcvBuffer;
+    DeviceExtension->RcvBufferSize = DeviceExtension->RingSavedRcvBufferSize;
+    DeviceExtension->RcvHead = 0;
+    DeviceExtension->RcvTail = 0;
+    DeviceExtension->RcvDiscard = 0;
 
-    ch = READ_PORT_UCHAR (DeviceExtension->ComPort.LCR);
-    WRITE_PORT_UCHAR (DeviceExtension->ComPort.BAUD, Divisor);
+    return TRUE;
+}
 
-    ch = ((READ_PORT_UCHAR (DeviceExtension->ComPort.LCR)) & LCR_DISABLE_DIVISOR_LATCH);
-    WRITE_PORT_UCHAR (DeviceExtension->ComPort.LCR, ch);
 
-    //
-    // The data format = 1 start bit, 8 data bits, 1 stop bit, no parity.
-    //
-    ch = (LCR_EIGHT_BITS_PER_WORD | LCR_ONE_STOP_BIT | LCR_NO_PARITY);
-    WRITE_PORT_UCHAR (DeviceExtension->ComPort.LCR, ch);
+//---------------------------------------------------------------------------
+// RS485_RingLoad
+//
+// Description:
+//  Points XmitBufferPosition at the next contiguous run of bytes queued
+//  in the TX ring, and gives the bytes already in the UART back to the
+//  application (TxTail). Called from RS485_Isr or synchronized with it,
+//  with XmitBufferCount at 0.
+//
+// Arguments:
+//      DeviceExtension - Pointer to the device extension.
+//
+// Return Value:
+//      TRUE    - There is something to send
+//      FALSE   - The TX ring is empty
+//
+BOOLEAN RS485_RingLoad (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    PRS485NT_RING_HEADER Header = DeviceExtension->RingHeader;
+    ULONG   Head, Tail, Offset, Count;
 
-    //
-    // Enable all UART interrupts on the IBM PC by asserting the GP02 general
-    // purpose output. Clear all other MCR bits. Activate DTR for RS485 use.
-    //
-    ch = MCR_ACTIVATE_GP02 | MCR_ACTIVATE_DTR;
-    WRITE_PORT_UCHAR (DeviceExtension->ComPort.MCR, ch);
+    Tail = DeviceExtension->RingTxTail;
+    Header->TxTail = Tail;
+
+    Head = Header->TxHead;
+    KeMemoryBarrier ();
 
     //
-    // Enable Specific Interrupts
+    // Nothing queued, or an index that makes no sense
     //
-    ch = (IER_ENABLE_RX_DATA_READY_IRQ | IER_ENABLE_TX_BE_IRQ | IER_ENABLE_RX_ERROR_IRQ);
-    WRITE_PORT_UCHAR (DeviceExtension->ComPort.IER, ch);
+    Count = Head - Tail;
 
-    return status;
+    if ((Count == 0) || (Count > DeviceExtension->RingTxSize)) {
+        return FALSE;
+    }
+
+    Offset = Tail & (DeviceExtension->RingTxSize - 1);
+
+    if (Count > DeviceExtension->RingTxSize - Offset) {
+        Count = DeviceExtension->RingTxSize - Offset;
+    }
+
+    DeviceExtension->XmitBufferPosition = DeviceExtension->RingTxData + Offset;
+    DeviceExtension->XmitBufferCount = Count;
+    DeviceExtension->RingTxTail = Tail + Count;
+
+    return TRUE;
 }
 
 
 //---------------------------------------------------------------------------
-// RS485_Write 
+// RS485_RingKick
 //
 // Description:
-//  Called by DispatchRoutine in response to a Write request.
+//  Starts a transmission from the TX ring if the transmitter is idle and
+//  anything is queued, or marks it idle so the application rings the
+//  doorbell next time. TxIdle is set before TxHead is looked at, the
+//  application moves TxHead before it looks at TxIdle, so a queued byte is
+//  never left behind. Synchronized with RS485_Isr, called with RcvLock
+//  held.
 //
 // Arguments:
-//      DeviceExtension - The device extension strtucture
-//      Irp             - The Irp associated with this IO
+//      Context - Pointer to the device extension.
 //
 // Return Value:
-//      NTSTATUS
+//      TRUE
 //
-NTSTATUS RS485_Write (IN PRS485NT_DEVICE_EXTENSION  DeviceExtension, IN PIRP Irp)
+BOOLEAN RS485_RingKick (IN PVOID Context)
 {
-    ULONG   Length;
-    UCHAR   ch;
-
-    Length = IoGetCurrentIrpStackLocation(Irp)->Parameters.Write.Length;
-    Irp->IoStatus.Information = 0L;
+    PRS485NT_DEVICE_EXTENSION DeviceExtension = Context;
 
     //
-    // Check for a zero length write.
+    // Detached, or still sending (RS485_RingXmitDone looks again)
     //
+    if ((DeviceExtension->RingHeader == NULL) || DeviceExtension->XmitActive) {
+        return TRUE;
+    }
 
-    if (Length) {
+    DeviceExtension->RingHeader->TxIdle = 1;
+    KeMemoryBarrier ();
 
-        if (Length >= DeviceExtension->BufferSize) {
+    if (RS485_RingLoad (DeviceExtension)) {
+        DeviceExtension->RingHeader->TxIdle = 0;
+        DeviceExtension->RingXmitBusy = TRUE;
+        RS485_StartXmit (DeviceExtension);
+    }
 
-            //
-            // Not enough room in the buffer
-            //
-            Irp->IoStatus.Status = STATUS_UNSUCCESSFUL;
-        } else {
+    return TRUE;
+}
 
-            //
-            // Clear the Transmit complete event
-            //
-            KeClearEvent (&DeviceExtension->XmitDone);
 
-            //
-            // Copy the buffer into the DeviceExtension
-            //
-            RtlMoveMemory (DeviceExtension->XmitBuffer, 
-                           Irp->AssociatedIrp.SystemBuffer, Length);
+//---------------------------------------------------------------------------
+// RS485_RingDoorbell
+//
+// Description:
+//  IOCTL_RS485NT_RING_DOORBELL, the application queued bytes with the
+//  transmitter idle. Harmless if it is already sending.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//
+// Return Value:
+//      STATUS_SUCCESS
+//      STATUS_INVALID_DEVICE_REQUEST - The rings aren't mapped
+//
+NTSTATUS RS485_RingDoorbell (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    NTSTATUS    status = STATUS_SUCCESS;
+    KIRQL       OldIrql;
 
-            DeviceExtension->XmitBufferCount = Length;
-            DeviceExtension->XmitBufferPosition = DeviceExtension->XmitBuffer;
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
 
-            //
-            // Assert RTS
-            //
-            ch = READ_PORT_UCHAR (DeviceExtension->ComPort.MCR) | MCR_ACTIVATE_RTS;
-            WRITE_PORT_UCHAR (DeviceExtension->ComPort.MCR, ch);
+    if (DeviceExtension->RingHeader == NULL) {
+        status = STATUS_INVALID_DEVICE_REQUEST;
+    } else {
+        KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_RingKick, DeviceExtension);
+    }
 
-            //
-            // Kick start the UART by jamming one byte out
-            //
-            WRITE_PORT_UCHAR (DeviceExtension->ComPort.TBR, 
-                              *DeviceExtension->XmitBufferPosition);
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+
+    return status;
+}
 
-            DeviceExtension->XmitBufferPosition++;
-            DeviceExtension->XmitBufferCount--;
 
-            //
-            // Wait for the complete buffer to be sent
-            //
-            RS_DbgPrint ("RS485NT: Write KeWaitForSingleObject\n");
-            KeWaitForSingleObject (&DeviceExtension->XmitDone, Executive, KernelMode, FALSE, NULL);
+//---------------------------------------------------------------------------
+// RS485_RingXmitDone
+//
+// Description:
+//  Called by RS485_Dpc_Routine when a transmission from the TX ring is
+//  done (RTS released). Sends what was queued in the meantime, or, once
+//  the rings are unmapped, gives the port back to ReadFile / WriteFile.
+//
+// Arguments:
+//      DeviceExtension - The device extension strtucture
+//
+// Return Value:
+//      none
+//
+VOID RS485_RingXmitDone (IN PRS485NT_DEVICE_EXTENSION DeviceExtension)
+{
+    KeAcquireSpinLockAtDpcLevel (&DeviceExtension->RcvLock);
 
-            //
-            // Set the number of bytes written
-            //
-            Irp->IoStatus.Information = Length;
-        }
+    //
+    // A doorbell may have started the next one before we got here
+    //
+    if (!DeviceExtension->XmitActive) {
+        DeviceExtension->RingXmitBusy = FALSE;
+    }
 
+    if (DeviceExtension->RingHeader == NULL) {
+        if (!DeviceExtension->RingXmitBusy) {
+            DeviceExtension->RingMapped = FALSE;
+        }
     } else {
-        //
-        // Nothing to write, so return SUCCESS (and do nothing!)
-        //
-        Irp->IoStatus.Status = STATUS_SUCCESS;
+        KeSynchronizeExecution (DeviceExtension->InterruptObject,
+                                RS485_RingKick, DeviceExtension);
     }
 
-    return STATUS_SUCCESS;
+    KeReleaseSpinLockFromDpcLevel (&DeviceExtension->RcvLock);
 }
 
 
 //---------------------------------------------------------------------------
-// RS485_Read
+// RS485_ReadTimestamped
 //
 // Description:
-//  Called by DispatchRoutine in response to a Read request.
+//  IOCTL_RS485NT_READ_TIMESTAMPED. Takes what is waiting in the receive
+//  ring, with receive times, and never waits. The ring keeps the low 32
+//  bits of the performance counter; they are turned into the full first
+//  time and byte to byte deltas here, which is right for bytes received
+//  within 2^32 ticks (minutes) of the call.
 //
 // Arguments:
 //      DeviceExtension - The device extension strtucture
 //      Irp             - The Irp associated with this IO
 //
 // Return Value:
-//      NTSTATUS
+//      STATUS_SUCCESS, Irp->IoStatus.Information set
+//      otherwise       - Complete the IRP with this status
 //
-NTSTATUS RS485_Read (IN PRS485NT_DEVICE_EXTENSION  DeviceExtension, IN PIRP Irp)
+NTSTATUS RS485_ReadTimestamped (IN PRS485NT_DEVICE_EXTENSION DeviceExtension, IN PIRP Irp)
 {
-    ULONG   Length;
-    KIRQL   OldIrql;
-    
-    Length = IoGetCurrentIrpStackLocation(Irp)->Parameters.Read.Length;
-    Irp->IoStatus.Information = 0L;
+    PRS485NT_TIMESTAMPED_READ Read = Irp->AssociatedIrp.SystemBuffer;
+    ULONG           OutputLength;
+    ULONG           Length, Count, i, Previous;
+    LARGE_INTEGER   Now;
+    KIRQL           OldIrql;
+
+    OutputLength = IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.OutputBufferLength;
+
+    if (OutputLength < FIELD_OFFSET(RS485NT_TIMESTAMPED_READ, Delta)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
 
     //
-    // Check for a zero length read.
+    // Frames are read whole with ReadFile, the mapped rings by the
+    // application itself
     //
-    if (Length) {
+    if (!DeviceExtension->TimestampMode ||
+        (DeviceExtension->FrameMode != FRAME_MODE_NONE)) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
 
-        //
-        // Read in the minimum amount (User buffer or Device Extension buffer)
-        //
+    Length = (OutputLength - FIELD_OFFSET(RS485NT_TIMESTAMPED_READ, Delta)) /
+             (sizeof(ULONG) + sizeof(UCHAR));
 
-        if (Length > DeviceExtension->RcvBufferCount) {
-            Length = DeviceExtension->RcvBufferCount;
-        }
+    KeAcquireSpinLock (&DeviceExtension->RcvLock, &OldIrql);
 
-        //
-        // Synchronize - LOCK
-        //
-        KeRaiseIrql ((KIRQL)(DeviceExtension->Irql+1), &OldIrql);
+    if (DeviceExtension->RingMapped) {
+        KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
+        return STATUS_DEVICE_BUSY;
+    }
 
-        //
-        // Copy the buffer from the DeviceExtension
-        //
-        RtlMoveMemory (Irp->AssociatedIrp.SystemBuffer, 
-                       DeviceExtension->RcvBuffer, Length);
+    //
+    // The data goes after the times, so read the times first and pack the
+    // bytes down behind them
+    //
+    Count = RS485_RcvReadStamped (DeviceExtension,
+                                  (PUCHAR)&Read->Delta[Length], Read->Delta, Length);
 
-        //
-        // Clear the Rcv buffer info
-        //
-        DeviceExtension->RcvBufferCount = 0;
-        DeviceExtension->RcvBufferPosition = DeviceExtension->RcvBuffer;
+    Now = KeQueryPerformanceCounter (NULL);
 
-        //
-        // Synchronize - UNLOCK
-        //
-        KeLowerIrql (OldIrql);
+    KeReleaseSpinLock (&DeviceExtension->RcvLock, OldIrql);
 
-        //
-        // Set the number of bytes actually read
-        //
-        Irp->IoStatus.Information = Length;
+    RtlMoveMemory (&Read->Delta[Count], &Read->Delta[Length], Count);
 
-    } else {
+    Read->Count = Count;
+    Read->Reserved = 0;
+    Read->Frequency = DeviceExtension->PerfFrequency.QuadPart;
+    Read->FirstTime = 0;
+
+    if (Count) {
         //
-        // Nothing to read, so return SUCCESS (and do nothing!)
+        // Every byte is older than Now
         //
-        Irp->IoStatus.Status = STATUS_SUCCESS;
+        Read->FirstTime = Now.QuadPart - (ULONG)(Now.LowPart - Read->Delta[0]);
+
+        Previous = Read->Delta[0];
+        for (i = 0; i < Count; i++) {
+            ULONG Stamp = Read->Delta[i];
+
+            Read->Delta[i] = Stamp - Previous;
+            Previous = Stamp;
+        }
     }
 
+    Irp->IoStatus.Information = FIELD_OFFSET(RS485NT_TIMESTAMPED_READ, Delta) +
+                                Count * (sizeof(ULONG) + sizeof(UCHAR));
+
     return STATUS_SUCCESS;
 }
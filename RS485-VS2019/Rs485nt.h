@@ -49,7 +49,151 @@
 #define DEF_PORT_RANGE      0x07
 #define DEF_IRQ_LINE        0x03
 #define DEF_BAUD_RATE       19200
+#define DEF_CLOCK_RATE      UART_CLOCK_1_8432_MHZ   // UART input clock in Hz
 #define DEF_BUFFER_SIZE     2048
+#define DEF_RX_TRIGGER_LEVEL 8          // 16550 RX FIFO trigger (0 = FIFO off)
+#define DEF_TX_FIFO_DEPTH   0           // TX burst size (0 = detected depth)
+#define DEF_RTS_TURNAROUND  RTS_TURNAROUND_TIMER
+#define DEF_FRAME_MODE      FRAME_MODE_NONE
+#define DEF_SHARE_INTERRUPT FALSE
+#define DEF_DATA_BITS       8
+#define DEF_PARITY          RS485NT_PARITY_NONE
+#define DEF_STOP_BITS       1
+#define DEF_DIRECT_IO       FALSE
+#define DEF_TIMESTAMP_MODE  FALSE
+#define DEF_SELF_TEST       0           // Loopback test bytes at load (0 = off)
+#define DEF_ECHO_MODE       ECHO_MODE_BUFFER
+#define DEF_BUS_IDLE_CHARS  0           // Listen before talk silence (0 = off)
+#define DEF_POLL_MODE       POLL_MODE_OFF
+#define DEF_POLL_THRESHOLD  4000        // Receive interrupts per second
+#define DEF_POLL_INTERVAL   0           // us, 0 = half the RX FIFO
+#define DEF_INTERRUPT_AFFINITY 0        // Processor mask, 0 = what the HAL allows
+#define DEF_DPC_PROCESSOR   RS485NT_DPC_ANY_PROCESSOR
+#define DEF_DPC_IMPORTANCE  RS485NT_DPC_IMPORTANCE_MEDIUM
+
+//
+// TRUE if Processor is an active processor's number. The active set can
+// have gaps, so being below the processor count doesn't make it one.
+//
+#define RS485_PROCESSOR_ACTIVE(Processor)                   \
+    (((Processor) < sizeof(KAFFINITY) * 8) &&               \
+     ((KeQueryActiveProcessors () >> (Processor)) & 1))
+
+//
+// Smallest and largest buffer size IOCTL_RS485NT_SET_LINE_SETTINGS takes.
+// The receive ring is rounded up to a power of two, and with Timestamp
+// Mode a ULONG is kept per byte, so the maximum keeps both from overflowing.
+//
+#define RS485_MIN_BUFFER_SIZE   16
+#define RS485_MAX_BUFFER_SIZE   0x100000
+
+//
+// RTS turnaround modes ("Rts Turnaround" registry value)
+//
+#define RTS_TURNAROUND_TIMER    0       // Drop RTS from a high resolution timer
+#define RTS_TURNAROUND_POLL     1       // Bounded LSR poll in the DPC
+
+//
+// IOCTL_RS485NT_MAP_RINGS: the header gets a page of its own, the rings
+// follow it
+//
+#define RS485_RING_HEADER_SIZE  PAGE_SIZE
+#define RS485_MAX_RING_SIZE     0x100000
+
+//
+// Ports per driver (Parameters\Port0..N) and room for a per port name
+//
+#define RS485_MAX_PORTS         16
+#define RS485_NAME_LENGTH       64
+
+//
+// Receive framing modes ("Frame Mode" registry value)
+//
+#define FRAME_MODE_NONE         0       // Byte stream
+#define FRAME_MODE_MODBUS_RTU   1       // Frames delimited by a t3.5 silence
+
+//
+// What to do with our own bytes coming back while we send ("Echo Mode")
+//
+#define ECHO_MODE_BUFFER        0       // Receive them, discarded when RTS drops
+#define ECHO_MODE_GATE          1       // RX interrupts off while RTS is on
+#define ECHO_MODE_VERIFY        2       // Compare them with what was sent
+
+//
+// Bytes sent but not yet echoed, ECHO_MODE_VERIFY (power of two). Must
+// cover both FIFOs and the shift registers.
+//
+#define RS485_ECHO_BUFFER       256
+
+//
+// Receive polling ("Rx Poll Mode")
+//
+#define POLL_MODE_OFF           0       // Interrupts only
+#define POLL_MODE_ADAPTIVE      1       // Poll while the interrupt rate is high
+#define POLL_MODE_ALWAYS        2       // No UART interrupts, poll RX and TX
+
+//
+// Adaptive polling measures the receive interrupt rate over
+// RS485_POLL_WINDOW (100ns units) and goes back to interrupts after
+// RS485_POLL_IDLE polls in a row find nothing.
+//
+#define RS485_POLL_WINDOW       20000
+#define RS485_POLL_IDLE         8
+
+//
+// Listen before talk ("Bus Idle Chars"): after a collision, wait a random
+// number of slots (Bus Idle Chars character times each) out of 2^attempt,
+// capped at 2^RS485_BACKOFF_MAX_EXP. The write fails after
+// RS485_BACKOFF_LIMIT attempts. A write isn't cancelable once started,
+// so it fails if the bus stays busy for RS485_BUS_WAIT_LIMIT (100ns units).
+//
+#define RS485_BACKOFF_MAX_EXP   10
+#define RS485_BACKOFF_LIMIT     16
+#define RS485_BUS_WAIT_LIMIT    20000000
+
+//
+// Modbus RTU uses fixed t1.5 / t3.5 times above 19200 baud (100ns units)
+//
+#define FRAME_MODBUS_FIXED_BAUD 19200
+#define FRAME_MODBUS_FIXED_T15  7500    // 750us
+#define FRAME_MODBUS_FIXED_T35  17500   // 1750us
+
+//
+// Frame ends queued by the ISR for the read path (power of two)
+//
+#define RS485_FRAME_QUEUE       32
+
+//
+// Warn about baud rates the clock can't make within 2% (in ppm)
+//
+#define RS485_BAUD_ERROR_LIMIT  20000
+
+//
+// RTS is never held for more than this many character times after the
+// last byte left the TX FIFO, even if the UART never reports TX empty.
+//
+#define RTS_TURNAROUND_LIMIT    2
+
+//
+// Loopback self test. Bytes between the THR and the RBR are limited to
+// the window, so a send time is kept for each and a byte that comes back
+// can be told apart from every other one in flight. The UART is polled
+// every RS485_SELF_TEST_POLL FIFO depth (at least one character time) and
+// the test gives up when nothing comes back for RS485_SELF_TEST_IDLE
+// character times, or 10ms.
+//
+#define RS485_SELF_TEST_WINDOW  128     // Power of two, at most 256
+#define RS485_SELF_TEST_POLL    4       // Polls per FIFO depth
+#define RS485_SELF_TEST_IDLE    32
+#define RS485_SELF_TEST_IDLE_MIN 100000 // 100ns units
+#define RS485_SELF_TEST_PATTERN(Index)  ((UCHAR)((Index) * 0x4B + 0x35))
+
+//
+// DpcEvents bits, set by the ISR (or timer) and consumed by RS485_Dpc_Routine
+//
+#define RS485_DPC_XMIT_EMPTY    0x00000001  // Last byte is in the shift register
+#define RS485_DPC_XMIT_DONE     0x00000002  // Last bit is out, RTS released
+#define RS485_DPC_RX_DATA       0x00000004  // New bytes in the receive ring
 
 //---------------------------------------------------------------------------
 //
@@ -59,27 +203,204 @@
 
 typedef struct _RS485NT_DEVICE_EXTENSION {
     PDEVICE_OBJECT  DeviceObject;
-    PKINTERRUPT     InterruptObject;
+    ULONG           PortNumber;
+    UNICODE_STRING  LinkName;           // \DosDevices\RS485NTn
+    WCHAR           LinkNameBuffer[RS485_NAME_LENGTH];
+    BOOLEAN         LegacyLink;         // Port 0 is also \DosDevices\RS485NT
+    PKINTERRUPT     InterruptObject;    // The group's interrupt
     KIRQL           Irql;
+    ULONG           InterruptVector;
+    KAFFINITY       Affinity;           // The HAL's, then what the interrupt is connected with
+    KAFFINITY       InterruptAffinity;  // "Interrupt Affinity", 0 = the HAL's
+    ULONG           DpcProcessor;       // RS485NT_DPC_ANY_PROCESSOR = where the ISR ran
+    ULONG           DpcImportance;      // RS485NT_DPC_IMPORTANCE_xxx
+    KDPC            TargetedDpc;        // RS485_Dpc_Routine pinned to DpcProcessor
+    PKDPC           IsrDpc;             // What the ISR queues, DeviceObject->Dpc or TargetedDpc
+    ULONGLONG       DpcProcessorRuns[RS485NT_MAX_PROCESSORS];
+    BOOLEAN         ShareInterrupt;     // Share the vector with other drivers
+    PUCHAR          StatusPort;         // Board interrupt status register, NULL = none
+    ULONG           StatusBit;          // Our bit in StatusPort
+    UCHAR           StatusMask;         // Checked against StatusPort by the ISR
     ULONG           InterruptCount;
+    RS485NT_STATS   Stats;              // IOCTL_RS485NT_GET_STATS, under the interrupt lock
+    volatile LONGLONG WriteIrps;        // Stats counted outside the interrupt lock,
+    volatile LONGLONG ReadIrps;         //  kept apart so a reset can't zero them
+    volatile LONGLONG TransactIrps;     //  under an interlocked increment
+    volatile LONGLONG DpcRuns;
+    KSPIN_LOCK      LatencyLock;
+    RS485NT_LATENCY Latency;            // IOCTL_RS485NT_GET_LATENCY
+    volatile LONGLONG DpcIsrTime;       // Perf counter at the ISR that queued the DPC, 0 = none
+    LONGLONG        XmitStartTime;      // Perf counter at the first byte of the transmission
+    volatile LONG   DpcEvents;
     ULONG           RcvError;
-    LARGE_INTEGER   LastQuerySystemTime;
+    LARGE_INTEGER   LastActivityTime;   // Perf counter at the last RX/TX interrupt
     ULONG           ioCtlCode;
     PUCHAR          PortAddress;
     KIRQL           IRQLine;
     ULONG           BaudRate;
+    ULONG           ClockRate;          // UART input clock in Hz
+    ULONG           Divisor;            // Divisor latch (DLM:DLL)
+    ULONG           ActualBaudRate;     // ClockRate / (16 * Divisor)
+    LONG            BaudError;          // ActualBaudRate vs BaudRate, ppm
+    ULONG           DataBits;
+    ULONG           Parity;             // RS485NT_PARITY_xxx
+    ULONG           StopBits;
+    ULONG           RxTriggerLevel;
+    ULONG           TxFifoDepth;
+    BOOLEAN         FifoEnabled;
+    ULONG           FifoDepth;
     COMPORT         ComPort;
-    KEVENT          XmitDone;
+    BOOLEAN         XmitActive;
+    BOOLEAN         TurnaroundPending;
+    ULONG           EchoMode;           // ECHO_MODE_xxx
+    BOOLEAN         EchoCollision;      // Mismatch or receive error this transmission
+    UCHAR           EchoBuffer[RS485_ECHO_BUFFER]; // Sent bytes awaiting their echo
+    ULONG           EchoHead;           // Free running, only touched at device IRQL
+    ULONG           EchoTail;
+    ULONG           BusIdleChars;       // Listen before talk, 0 = off
+    LARGE_INTEGER   BusLastActivity;    // Performance counter at the last byte on the bus
+    LARGE_INTEGER   BusHoldoff;         // ... before which we don't transmit (backoff)
+    LONGLONG        BusWait;            // 100ns units until the bus may be idle
+    PEX_TIMER       BusTimer;           // Retries a deferred transmission
+    ULONG           BusAttempts;        // Transmissions of the current IRP
+    BOOLEAN         BusDeferred;        // Current transmission counted in BusDeferrals
+    LARGE_INTEGER   BusDeferTime;       // Performance counter when it was first deferred
+    ULONG           PollMode;           // POLL_MODE_xxx
+    ULONG           PollThreshold;      // Receive interrupts per second to start polling
+    ULONG           PollIntervalSetting; // "Rx Poll Interval" in us, 0 = from the FIFO
+    BOOLEAN         PollActive;         // RX interrupts masked, the poll timer drains
+    ULONG           PollIdle;           // Empty polls in a row
+    PEX_TIMER       PollTimer;
+    LARGE_INTEGER   PollWindowStart;    // Performance counter, interrupt rate window
+    volatile LONG   PollWindowInterrupts;
+    ULONG           BusRandom;          // xorshift state for the backoff
+    ULONG           RtsTurnaround;
+    ULONG           BitsPerChar;
+    ULONG           CharTime;           // One character time in 100ns units
+    LARGE_INTEGER   PerfFrequency;
+    LARGE_INTEGER   XmitEmptyTime;      // Performance counter at TX FIFO empty
+    PEX_TIMER       TurnaroundTimer;
+    BOOLEAN         DirectIo;           // DO_DIRECT_IO, reads/writes use the caller's pages
     ULONG           BufferSize;
-    PUCHAR          XmitBuffer;
-    PUCHAR          XmitBufferPosition;
-    PUCHAR          XmitBufferEnd;
+    PUCHAR          XmitBufferPosition; // Next byte to send, in the current IRP's buffer
     ULONG           XmitBufferCount;
-    PUCHAR          RcvBuffer;
-    PUCHAR          RcvBufferPosition;
-    PUCHAR          RcvBufferEnd;
-    ULONG           RcvBufferCount;
+    PUCHAR          XmitBufferStart;    // Whole buffer, to send it again after a collision
+    ULONG           XmitLength;
+    KSPIN_LOCK      RcvLock;            // Read engine lock, never taken by the ISR
+    LIST_ENTRY      ReadQueue;          // Pending read IRPs
+    PIRP            CurrentReadIrp;     // Read being filled, Information = count
+    RS485NT_TIMEOUTS Timeouts;
+    RS485NT_TIMEOUTS TransactTimeouts;  // Response rules of the transaction on the bus
+    BOOLEAN         ReadReturnAny;      // Complete the read on any data
+    LONGLONG        ReadTotalDeadline;  // KeQueryInterruptTime, 0 = none
+    LONGLONG        ReadInterval;       // 100ns units, 0 = none
+    LONGLONG        ReadLastTime;       // When the current read last got data
+    KTIMER          ReadTimer;
+    KDPC            ReadTimerDpc;
+    PUCHAR          RcvBuffer;          // Receive ring, RcvBufferSize bytes
+    ULONG           RcvBufferSize;      // Power of two
+    volatile ULONG  RcvHead;            // Free running, written only by the ISR
+    volatile ULONG  RcvTail;            // Free running, written only by readers
+    volatile ULONG  RcvDiscard;         // ISR: data before this index is stale
+    BOOLEAN         TimestampMode;      // Keep RcvStamp
+    PULONG          RcvStamp;           // Low 32 bits of the perf counter per RcvBuffer byte
+    ULONG           RcvOverflow;        // Bytes dropped with the ring full
+    ULONG           FrameMode;
+    LONGLONG        FrameT15;           // Intra-frame gap limit, perf counter ticks
+    LONGLONG        FrameT35;           // Inter-frame silence, perf counter ticks
+    LONGLONG        FrameSilence;       // Inter-frame silence in 100ns units
+    LARGE_INTEGER   FrameLastRxTime;    // Performance counter at the last byte
+    BOOLEAN         FrameOpen;          // Bytes received since the last frame end
+    PEX_TIMER       FrameTimer;
+    ULONG           FrameEnd[RS485_FRAME_QUEUE]; // Ring index after each frame
+    volatile ULONG  FrameHead;          // Free running, written only by the ISR
+    volatile ULONG  FrameTail;          // Free running, written only by readers
+    ULONG           FrameCount;
+    ULONG           FrameGapErrors;
+    ULONG           FrameOverflow;
+    BOOLEAN         RingMapped;         // IOCTL_RS485NT_MAP_RINGS owns the port
+    BOOLEAN         RingXmitBusy;       // Ring transmission not yet done in the DPC
+    PRS485NT_RING_HEADER RingHeader;    // Shared header, NULL = rings not attached
+    PUCHAR          RingBase;           // Kernel address of the mapped memory
+    ULONG           RingLength;
+    PMDL            RingMdl;
+    PVOID           RingUserBase;       // Caller's address of the mapped memory
+    PEPROCESS       RingProcess;        // Process the rings are mapped into, referenced
+    PFILE_OBJECT    RingFileObject;     // Handle that mapped them, the only one to unmap
+    ULONG           RingRxSize;
+    PUCHAR          RingTxData;
+    ULONG           RingTxSize;
+    ULONG           RingTxTail;         // Next TX ring byte to load
+    PUCHAR          RingSavedRcvBuffer; // Receive ring while the shared one is in use
+    ULONG           RingSavedRcvBufferSize;
+    ULONG           SelfTestBytes;      // "Self Test" at load, 0 = off
+    PEX_TIMER       SelfTestTimer;      // Polls the UART during IOCTL_RS485NT_SELF_TEST
+    struct _RS485NT_SELF_TEST_STATE *SelfTest;  // Test in progress, NULL = none
+    BOOLEAN         LoadSelfTestDone;   // LoadSelfTest holds the "Self Test" results
+    RS485NT_SELF_TEST_RESULT LoadSelfTest;  // IOCTL_RS485NT_GET_LOAD_SELF_TEST
 } RS485NT_DEVICE_EXTENSION, *PRS485NT_DEVICE_EXTENSION;
 
+//
+// All ports on one IRQ line share an interrupt object and RS485_Isr
+//
+typedef struct _RS485NT_INTERRUPT_GROUP {
+    PKINTERRUPT     InterruptObject;
+    KIRQL           IRQLine;
+    ULONG           InterruptVector;
+    KIRQL           Irql;
+    KAFFINITY       Affinity;
+    BOOLEAN         ShareVector;
+    KINTERRUPT_MODE InterruptMode;      // Latched, LevelSensitive if ShareVector
+    PUCHAR          StatusPort;         // Board interrupt status register, NULL = none
+    ULONG           PortCount;
+    PRS485NT_DEVICE_EXTENSION Ports[RS485_MAX_PORTS];
+} RS485NT_INTERRUPT_GROUP, *PRS485NT_INTERRUPT_GROUP;
+
+//
+// IOCTL_RS485NT_GET_STATS, read (and reset) synchronized with the ISR
+//
+typedef struct _RS485NT_STATS_SNAPSHOT {
+    PRS485NT_DEVICE_EXTENSION DeviceExtension;
+    PRS485NT_STATS  Stats;              // Copy of the counters
+    BOOLEAN         Reset;              // Zero them afterwards
+} RS485NT_STATS_SNAPSHOT, *PRS485NT_STATS_SNAPSHOT;
+
+//
+// IOCTL_RS485NT_SET_LINE_SETTINGS, what RS485_SwapLine installs and
+// what it hands back to be freed
+//
+typedef struct _RS485NT_LINE_CHANGE {
+    PRS485NT_DEVICE_EXTENSION DeviceExtension;
+    PUCHAR          RcvBuffer;
+    ULONG           RcvBufferSize;
+    PULONG          RcvStamp;
+    ULONG           BufferSize;
+} RS485NT_LINE_CHANGE, *PRS485NT_LINE_CHANGE;
+
+//
+// A loopback self test in progress, only touched synchronized with the
+// ISR (or before the interrupt is connected)
+//
+typedef struct _RS485NT_SELF_TEST_STATE {
+    PIRP            Irp;                // IOCTL_RS485NT_SELF_TEST, NULL at load
+    ULONG           ByteCount;
+    ULONG           Sent;               // Bytes written to the THR
+    ULONG           Next;               // Index of the next byte expected back
+    ULONG           Received;
+    ULONG           Matched;            // Came back in order (latency samples)
+    ULONG           Lost;
+    ULONG           Corrupt;
+    ULONG           Overruns;
+    UCHAR           Mcr;                // Restored afterwards
+    UCHAR           Ier;
+    LONGLONG        Start;              // Performance counter at the first byte
+    LONGLONG        LastProgress;       // ... at the last byte received (or the start)
+    LONGLONG        IdleLimit;          // Performance counter ticks
+    LONGLONG        LatencyMin;         // Performance counter ticks
+    LONGLONG        LatencyMax;
+    LONGLONG        LatencyTotal;
+    LONGLONG        SendTime[RS485_SELF_TEST_WINDOW];
+} RS485NT_SELF_TEST_STATE, *PRS485NT_SELF_TEST_STATE;
+
 // ExAllocatePoolWithTag() memory tag definition
 #define MEMORY_TAG  '584R'
\ No newline at end of file
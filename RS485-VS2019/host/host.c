@@ -0,0 +1,764 @@
+//-------------------------------------------------------------------------------------------------
+// HOST.C
+//
+// BSD 3-Clause License
+// 
+// Copyright (c) 2022, Anthony Kempka
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Description:
+// ------------
+// The simulated machine's side of host.h: UARTs and the registry, and the
+// I/O manager calls an application makes through CreateFile, ReadFile,
+// WriteFile and DeviceIoControl.
+//
+//-------------------------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hostddk.h"
+#include "../Com8250.h"
+#include "../Rs485ioc.h"
+#include "../Rs485nt.h"
+#include "host.h"
+
+#define HOST_MAX_STATUS_PORTS   4
+#define HOST_CALL_TIMEOUT       (10 * HOST_NS_PER_SECOND)
+
+typedef struct _HOST_PARAMETER {
+    ULONG       Port;
+    char        Name[48];
+    ULONG       Type;               // REG_DWORD or REG_QWORD
+    ULONGLONG   Value;
+} HOST_PARAMETER, *PHOST_PARAMETER;
+
+typedef struct _HOST_STATUS_PORT {
+    ULONG       Port;
+    PUART16550  Uarts[8];           // Bit n is Uarts[n] interrupting
+    ULONG       Count;
+} HOST_STATUS_PORT, *PHOST_STATUS_PORT;
+
+PDRIVER_OBJECT HostDriver;
+PUART16550 HostUarts[HOST_MAX_UARTS];
+ULONG HostUartCount;
+PUART_BUS HostBuses[HOST_MAX_UARTS];
+ULONG HostBusCount;
+
+static DRIVER_OBJECT HostDriverObject;
+static FILE_OBJECT HostFiles[HOST_MAX_HANDLES];
+static ULONG HostHandle;                // The caller's, index into HostFiles
+static HOST_PARAMETER HostParameters[HOST_MAX_PARAMETERS];
+static ULONG HostParameterCount;
+static HOST_STATUS_PORT HostStatusPorts[HOST_MAX_STATUS_PORTS];
+static ULONG HostStatusPortCount;
+
+static PIRP HostAllocateIrp (IN PDEVICE_OBJECT DeviceObject, IN UCHAR MajorFunction);
+static VOID HostDispatch (IN PIRP Irp);
+static BOOLEAN HostIrpDone (IN PVOID Context);
+
+
+//---------------------------------------------------------------------------
+// HostReset
+//
+// Description:
+//  Powers up a new machine with no UARTs, buses or registry values. The
+//  driver must not be loaded.
+//
+// Arguments:
+//      Config  - Machine behaviour, NULL for no latencies and the default
+//                clock tick
+//
+// Return Value:
+//      none
+//
+VOID HostReset (IN PHOST_CONFIG Config)
+{
+    ULONG   i;
+
+    if (HostDriver != NULL) {
+        HostBugCheck ("HostReset with the driver loaded");
+    }
+
+    for (i = 0; i < HostUartCount; i++) {
+        free (HostUarts[i]);
+    }
+
+    HostUartCount = 0;
+    HostBusCount = 0;
+    HostParameterCount = 0;
+    HostStatusPortCount = 0;
+
+    if (Config != NULL) {
+        HostConfig = *Config;
+    } else {
+        RtlZeroMemory (&HostConfig, sizeof(HOST_CONFIG));
+        HostConfig.ClockTick = HOST_CLOCK_TICK;
+    }
+
+    HostKernelReset ();
+    HostHandle = 0;
+}
+
+
+//---------------------------------------------------------------------------
+// HostAddUart
+//
+// Description:
+//  Plugs in a 16550 and connects it to an RS-485 bus.
+//
+// Arguments:
+//      Base    - First I/O address
+//      Irq     - ISA IRQ line
+//      Clock   - Input clock in Hz
+//      Bus     - Bus the transceiver is on, NULL for none
+//
+// Return Value:
+//      The UART
+//
+PUART16550 HostAddUart (IN ULONG Base, IN ULONG Irq, IN ULONG Clock, IN PUART_BUS Bus)
+{
+    PUART16550  Uart;
+    ULONG       i;
+
+    if (HostUartCount == HOST_MAX_UARTS) {
+        HostBugCheck ("too many UARTs");
+    }
+
+    Uart = malloc (sizeof(UART16550));
+    if (Uart == NULL) {
+        HostBugCheck ("out of memory");
+    }
+
+    Uart16550Initialize (Uart, Base, Irq, Clock);
+    HostUarts[HostUartCount++] = Uart;
+
+    if (Bus != NULL) {
+        UartBusAttach (Bus, Uart);
+
+        for (i = 0; (i < HostBusCount) && (HostBuses[i] != Bus); i++);
+        if (i == HostBusCount) {
+            HostBuses[HostBusCount++] = Bus;
+        }
+    }
+
+    return Uart;
+}
+
+
+//---------------------------------------------------------------------------
+// HostFindUart
+//
+// Description:
+//  Looks up the UART behind a driver port number, by its "Port Address".
+//
+// Arguments:
+//      Port    - Driver port number
+//
+// Return Value:
+//      The UART, NULL if there is none
+//
+PUART16550 HostFindUart (IN ULONG Port)
+{
+    ULONG   Address, i;
+
+    if (!HostGetParameter (Port, "Port Address", &Address)) {
+        Address = DEF_PORT_ADDRESS;
+    }
+
+    for (i = 0; i < HostUartCount; i++) {
+        if (HostUarts[i]->Base == Address) {
+            return HostUarts[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+//---------------------------------------------------------------------------
+// HostAddStatusPort / HostStatusPortRead
+//
+// Description:
+//  A multiport board's interrupt status register: bit n is set while
+//  UART n of the board is interrupting.
+//
+// Arguments:
+//      Port    - I/O address of the register
+//      Uarts   - The board's UARTs, in bit order
+//      Count   - Number of UARTs (8 at most)
+//      Found   - Returns whether Port is a status register
+//
+// Return Value:
+//      Register value (HostStatusPortRead)
+//
+VOID HostAddStatusPort (IN ULONG Port, IN PUART16550 *Uarts, IN ULONG Count)
+{
+    PHOST_STATUS_PORT Status;
+
+    if ((HostStatusPortCount == HOST_MAX_STATUS_PORTS) || (Count > 8)) {
+        HostBugCheck ("too many status ports");
+    }
+
+    Status = &HostStatusPorts[HostStatusPortCount++];
+    Status->Port = Port;
+    Status->Count = Count;
+    memcpy (Status->Uarts, Uarts, Count * sizeof(PUART16550));
+}
+
+UCHAR HostStatusPortRead (IN ULONG Port, OUT PBOOLEAN Found)
+{
+    PHOST_STATUS_PORT Status;
+    UCHAR   Value = 0;
+    ULONG   i, j;
+
+    for (i = 0; i < HostStatusPortCount; i++) {
+        Status = &HostStatusPorts[i];
+
+        if (Status->Port == Port) {
+            for (j = 0; j < Status->Count; j++) {
+                if ((Uart16550Iir (Status->Uarts[j]) & IIR_INTERRUPT_MASK) !=
+                    IIR_NO_INTERRUPT_PENDING) {
+                    Value |= (UCHAR)(1 << j);
+                }
+            }
+            *Found = TRUE;
+            return Value;
+        }
+    }
+
+    *Found = FALSE;
+    return 0;
+}
+
+
+//---------------------------------------------------------------------------
+// HostSetParameter / HostGetParameter / HostPortConfigured
+//
+// Description:
+//  REG_DWORD values under Services\Rs485nt\Parameters\PortN, or
+//  REG_QWORD ones with the Qword calls. Setting any value creates the
+//  PortN key. A value is only found with the calls for its type.
+//
+// Arguments:
+//      Port    - Port number
+//      Name    - Value name, as the driver spells it ("Baud Rate")
+//      Value   - The value
+//
+// Return Value:
+//      TRUE if the value (or the port's key) exists
+//
+static VOID HostStoreParameter (IN ULONG Port, IN const char *Name, IN ULONG Type,
+                                IN ULONGLONG Value)
+{
+    PHOST_PARAMETER Parameter;
+    ULONG   i;
+
+    for (i = 0; i < HostParameterCount; i++) {
+        Parameter = &HostParameters[i];
+        if ((Parameter->Port == Port) && !strcmp (Parameter->Name, Name)) {
+            Parameter->Type = Type;
+            Parameter->Value = Value;
+            return;
+        }
+    }
+
+    if ((HostParameterCount == HOST_MAX_PARAMETERS) ||
+        (strlen (Name) >= sizeof(HostParameters[0].Name))) {
+        HostBugCheck ("can't store registry value %s", Name);
+    }
+
+    Parameter = &HostParameters[HostParameterCount++];
+    Parameter->Port = Port;
+    strcpy (Parameter->Name, Name);
+    Parameter->Type = Type;
+    Parameter->Value = Value;
+}
+
+static PHOST_PARAMETER HostFindParameter (IN ULONG Port, IN const char *Name, IN ULONG Type)
+{
+    ULONG   i;
+
+    for (i = 0; i < HostParameterCount; i++) {
+        if ((HostParameters[i].Port == Port) && !strcmp (HostParameters[i].Name, Name)) {
+            return (HostParameters[i].Type == Type) ? &HostParameters[i] : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+VOID HostSetParameter (IN ULONG Port, IN const char *Name, IN ULONG Value)
+{
+    HostStoreParameter (Port, Name, REG_DWORD, Value);
+}
+
+VOID HostSetQwordParameter (IN ULONG Port, IN const char *Name, IN ULONGLONG Value)
+{
+    HostStoreParameter (Port, Name, REG_QWORD, Value);
+}
+
+BOOLEAN HostGetParameter (IN ULONG Port, IN const char *Name, OUT PULONG Value)
+{
+    PHOST_PARAMETER Parameter = HostFindParameter (Port, Name, REG_DWORD);
+
+    if (Parameter == NULL) {
+        return FALSE;
+    }
+
+    *Value = (ULONG)Parameter->Value;
+    return TRUE;
+}
+
+BOOLEAN HostGetQwordParameter (IN ULONG Port, IN const char *Name, OUT PULONGLONG Value)
+{
+    PHOST_PARAMETER Parameter = HostFindParameter (Port, Name, REG_QWORD);
+
+    if (Parameter == NULL) {
+        return FALSE;
+    }
+
+    *Value = Parameter->Value;
+    return TRUE;
+}
+
+BOOLEAN HostPortConfigured (IN ULONG Port)
+{
+    ULONG   i;
+
+    for (i = 0; i < HostParameterCount; i++) {
+        if (HostParameters[i].Port == Port) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+//---------------------------------------------------------------------------
+// HostLoadDriver / HostUnloadDriver
+//
+// Description:
+//  Calls DriverEntry with the service's registry path, and the driver's
+//  unload routine.
+//
+// Arguments:
+//      none
+//
+// Return Value:
+//      DriverEntry's status (HostLoadDriver)
+//
+NTSTATUS HostLoadDriver (VOID)
+{
+    static WCHAR    Path[] = HOST_SERVICE_PATH;
+    UNICODE_STRING  RegistryPath;
+    NTSTATUS        Status;
+
+    if (HostDriver != NULL) {
+        HostBugCheck ("driver already loaded");
+    }
+
+    RtlZeroMemory (&HostDriverObject, sizeof(DRIVER_OBJECT));
+    HostDriver = &HostDriverObject;
+
+    RtlInitUnicodeString (&RegistryPath, Path);
+
+    Status = DriverEntry (HostDriver, &RegistryPath);
+
+    if (!NT_SUCCESS (Status)) {
+        HostDriver = NULL;
+    }
+
+    return Status;
+}
+
+VOID HostUnloadDriver (VOID)
+{
+    if (HostDriver == NULL) {
+        return;
+    }
+
+    if (KeGetCurrentIrql () != PASSIVE_LEVEL) {
+        HostBugCheck ("unloading at IRQL %u", KeGetCurrentIrql ());
+    }
+
+    HostDriver->DriverUnload (HostDriver);
+    HostDriver = NULL;
+}
+
+
+//---------------------------------------------------------------------------
+// HostSetCaller
+//
+// Description:
+//  Picks the process the I/O calls below come from, and the handle they
+//  use. A handle is one file object per device, as if opened once and
+//  then inherited or duplicated into every process. Process 0, handle 0
+//  after HostReset.
+//
+// Arguments:
+//      Process - 0 to HOST_MAX_PROCESSES - 1
+//      Handle  - 0 to HOST_MAX_HANDLES - 1
+//
+// Return Value:
+//      none
+//
+VOID HostSetCaller (IN ULONG Process, IN ULONG Handle)
+{
+    if (Handle >= HOST_MAX_HANDLES) {
+        HostBugCheck ("handle %u doesn't exist", Handle);
+    }
+
+    HostSetProcess (Process);
+    HostHandle = Handle;
+}
+
+
+//---------------------------------------------------------------------------
+// HostOpenDevice / HostCloseDevice
+//
+// Description:
+//  CreateFile ("\\\\.\\RS485NTn") and CloseHandle: IRP_MJ_CREATE, and
+//  IRP_MJ_CLEANUP followed by IRP_MJ_CLOSE.
+//
+// Arguments:
+//      Port            - Port number
+//      DeviceObject    - The opened device
+//
+// Return Value:
+//      The device, NULL if it doesn't exist or won't open (HostOpenDevice)
+//
+PDEVICE_OBJECT HostOpenDevice (IN ULONG Port)
+{
+    char            Ascii[64];
+    WCHAR           Name[64];
+    PDEVICE_OBJECT  DeviceObject;
+    PIRP            Irp;
+    ULONG           i;
+
+    snprintf (Ascii, sizeof(Ascii), "\\DosDevices\\RS485NT%u", Port);
+    for (i = 0; Ascii[i]; i++) {
+        Name[i] = (WCHAR)Ascii[i];
+    }
+    Name[i] = UNICODE_NULL;
+
+    DeviceObject = HostFindDevice (Name);
+    if (DeviceObject == NULL) {
+        return NULL;
+    }
+
+    Irp = HostAllocateIrp (DeviceObject, IRP_MJ_CREATE);
+    HostDispatch (Irp);
+
+    if (!NT_SUCCESS (HostCall (Irp, NULL))) {
+        return NULL;
+    }
+
+    return DeviceObject;
+}
+
+VOID HostCloseDevice (IN PDEVICE_OBJECT DeviceObject)
+{
+    PIRP    Irp;
+
+    Irp = HostAllocateIrp (DeviceObject, IRP_MJ_CLEANUP);
+    HostDispatch (Irp);
+    HostCall (Irp, NULL);
+
+    Irp = HostAllocateIrp (DeviceObject, IRP_MJ_CLOSE);
+    HostDispatch (Irp);
+    HostCall (Irp, NULL);
+}
+
+
+//---------------------------------------------------------------------------
+// HostWrite / HostRead / HostIoctl
+//
+// Description:
+//  WriteFile, ReadFile and DeviceIoControl (METHOD_BUFFERED), overlapped:
+//  the IRP goes to the driver and comes back, maybe still pending.
+//  Buffered I/O goes through a system buffer, direct I/O through an MDL
+//  over the caller's buffer. Data comes back to the caller's buffer when
+//  the IRP completes.
+//
+// Arguments:
+//      DeviceObject    - An opened device
+//      Buffer          - Caller's data buffer, and its length
+//      IoControlCode   - IOCTL_RS485NT_xxx
+//      InputBuffer     - IOCTL input, and its length
+//      OutputBuffer    - IOCTL output, and its length
+//
+// Return Value:
+//      The IRP, to HostWait on and free with HostFreeIrp
+//
+PIRP HostWrite (IN PDEVICE_OBJECT DeviceObject, IN const VOID *Buffer, IN ULONG Length)
+{
+    PIRP    Irp;
+
+    Irp = HostAllocateIrp (DeviceObject, IRP_MJ_WRITE);
+    Irp->HostStack.Parameters.Write.Length = Length;
+
+    if (DeviceObject->Flags & DO_DIRECT_IO) {
+        if (Length) {
+            IoAllocateMdl ((PVOID)Buffer, Length, FALSE, FALSE, Irp);
+        }
+    } else if (Length) {
+        Irp->AssociatedIrp.SystemBuffer = malloc (Length);
+        memcpy (Irp->AssociatedIrp.SystemBuffer, Buffer, Length);
+    }
+
+    HostDispatch (Irp);
+    return Irp;
+}
+
+PIRP HostRead (IN PDEVICE_OBJECT DeviceObject, OUT PVOID Buffer, IN ULONG Length)
+{
+    PIRP    Irp;
+
+    Irp = HostAllocateIrp (DeviceObject, IRP_MJ_READ);
+    Irp->HostStack.Parameters.Read.Length = Length;
+
+    if (DeviceObject->Flags & DO_DIRECT_IO) {
+        if (Length) {
+            IoAllocateMdl (Buffer, Length, FALSE, FALSE, Irp);
+        }
+    } else if (Length) {
+        Irp->AssociatedIrp.SystemBuffer = malloc (Length);
+        memset (Irp->AssociatedIrp.SystemBuffer, 0xA5, Length);
+        Irp->UserBuffer = Buffer;
+        Irp->HostUserLength = Length;
+    }
+
+    HostDispatch (Irp);
+    return Irp;
+}
+
+PIRP HostIoctl (IN PDEVICE_OBJECT DeviceObject, IN ULONG IoControlCode,
+                IN const VOID *InputBuffer, IN ULONG InputLength,
+                OUT PVOID OutputBuffer, IN ULONG OutputLength)
+{
+    PIRP    Irp;
+    ULONG   Length;
+
+    if ((IoControlCode & 3) != METHOD_BUFFERED) {
+        HostBugCheck ("IOCTL %08x isn't METHOD_BUFFERED", IoControlCode);
+    }
+
+    Irp = HostAllocateIrp (DeviceObject, IRP_MJ_DEVICE_CONTROL);
+    Irp->HostStack.Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+    Irp->HostStack.Parameters.DeviceIoControl.InputBufferLength = InputLength;
+    Irp->HostStack.Parameters.DeviceIoControl.OutputBufferLength = OutputLength;
+
+    Length = (InputLength > OutputLength) ? InputLength : OutputLength;
+
+    if (Length) {
+        Irp->AssociatedIrp.SystemBuffer = malloc (Length);
+        memset (Irp->AssociatedIrp.SystemBuffer, 0xA5, Length);
+        if (InputLength) {
+            memcpy (Irp->AssociatedIrp.SystemBuffer, InputBuffer, InputLength);
+        }
+    }
+
+    Irp->UserBuffer = OutputBuffer;
+    Irp->HostUserLength = OutputLength;
+
+    HostDispatch (Irp);
+    return Irp;
+}
+
+
+//---------------------------------------------------------------------------
+// HostWait / HostCall
+//
+// Description:
+//  HostWait runs the machine until the IRP completes or Timeout passes.
+//  HostCall waits for an IRP to complete (cancelling it if it takes too
+//  long), and frees it.
+//
+// Arguments:
+//      Irp         - IRP from HostWrite, HostRead or HostIoctl
+//      Timeout     - Simulated ns
+//      Information - Returns Irp->IoStatus.Information, optional
+//
+// Return Value:
+//      The IRP's status, STATUS_PENDING if it hasn't completed
+//
+NTSTATUS HostWait (IN PIRP Irp, IN ULONGLONG Timeout)
+{
+    if (!HostRunUntil (HostTime () + Timeout, HostIrpDone, Irp)) {
+        return STATUS_PENDING;
+    }
+
+    return Irp->IoStatus.Status;
+}
+
+NTSTATUS HostCall (IN PIRP Irp, OUT PULONG_PTR Information)
+{
+    NTSTATUS    Status;
+
+    Status = HostWait (Irp, HOST_CALL_TIMEOUT);
+
+    if (Status == STATUS_PENDING) {
+        HostCancel (Irp);
+        Status = HostWait (Irp, HOST_CALL_TIMEOUT);
+        if (Status == STATUS_PENDING) {
+            HostBugCheck ("IRP %p can't be cancelled", (void *)Irp);
+        }
+    }
+
+    if (Information != NULL) {
+        *Information = Irp->IoStatus.Information;
+    }
+
+    HostFreeIrp (Irp);
+    return Status;
+}
+
+
+//---------------------------------------------------------------------------
+// HostCancel
+//
+// Description:
+//  IoCancelIrp (CancelIo): marks the IRP cancelled and calls its cancel
+//  routine, if it has one, with the cancel spin lock held.
+//
+// Arguments:
+//      Irp     - The IRP
+//
+// Return Value:
+//      TRUE if a cancel routine was called
+//
+BOOLEAN HostCancel (IN PIRP Irp)
+{
+    PDRIVER_CANCEL  CancelRoutine;
+    KIRQL           Irql;
+
+    IoAcquireCancelSpinLock (&Irql);
+
+    Irp->Cancel = TRUE;
+    CancelRoutine = IoSetCancelRoutine (Irp, NULL);
+
+    if (CancelRoutine == NULL) {
+        IoReleaseCancelSpinLock (Irql);
+        return FALSE;
+    }
+
+    Irp->CancelIrql = Irql;
+    CancelRoutine (Irp->HostStack.DeviceObject, Irp);
+    return TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// HostFreeIrp
+//
+// Description:
+//  Frees a completed IRP, its system buffer and MDL.
+//
+// Arguments:
+//      Irp     - The IRP
+//
+// Return Value:
+//      none
+//
+VOID HostFreeIrp (IN PIRP Irp)
+{
+    if (!Irp->HostCompleted) {
+        HostBugCheck ("freeing IRP %p while the driver has it", (void *)Irp);
+    }
+
+    if (Irp->MdlAddress != NULL) {
+        IoFreeMdl (Irp->MdlAddress);
+    }
+
+    free (Irp->AssociatedIrp.SystemBuffer);
+    free (Irp);
+}
+
+
+//---------------------------------------------------------------------------
+// HostAllocateIrp / HostDispatch / HostIrpDone
+//
+// Description:
+//  Builds an IRP with one stack location for the device, calls the
+//  driver's dispatch routine for it at PASSIVE_LEVEL and checks the
+//  driver kept the rules: an IRP is either completed or marked pending
+//  and STATUS_PENDING returned.
+//
+static PIRP HostAllocateIrp (IN PDEVICE_OBJECT DeviceObject, IN UCHAR MajorFunction)
+{
+    PIRP    Irp;
+
+    Irp = calloc (1, sizeof(IRP));
+    if (Irp == NULL) {
+        HostBugCheck ("out of memory");
+    }
+
+    Irp->RequestorMode = UserMode;
+    Irp->IoStatus.Status = (NTSTATUS)0xA5A5A5A5;
+    Irp->Tail.Overlay.CurrentStackLocation = &Irp->HostStack;
+    Irp->HostStack.MajorFunction = MajorFunction;
+    Irp->HostStack.DeviceObject = DeviceObject;
+    Irp->HostStack.FileObject = &HostFiles[HostHandle];
+
+    return Irp;
+}
+
+static VOID HostDispatch (IN PIRP Irp)
+{
+    PIO_STACK_LOCATION  Stack = &Irp->HostStack;
+    NTSTATUS            Status;
+
+    if (KeGetCurrentIrql () != PASSIVE_LEVEL) {
+        HostBugCheck ("I/O request at IRQL %u", KeGetCurrentIrql ());
+    }
+
+    Status = HostDriver->MajorFunction[Stack->MajorFunction] (Stack->DeviceObject, Irp);
+
+    if (KeGetCurrentIrql () != PASSIVE_LEVEL) {
+        HostBugCheck ("dispatch routine returned at IRQL %u", KeGetCurrentIrql ());
+    }
+
+    if (Status == STATUS_PENDING) {
+        if (!Irp->PendingReturned) {
+            HostBugCheck ("STATUS_PENDING without IoMarkIrpPending, IRP %p", (void *)Irp);
+        }
+    } else if (!Irp->HostCompleted) {
+        HostBugCheck ("dispatch returned %08x without completing IRP %p", Status, (void *)Irp);
+    } else if (Status != Irp->IoStatus.Status) {
+        HostBugCheck ("dispatch returned %08x, IRP %p completed with %08x", Status,
+                      (void *)Irp, Irp->IoStatus.Status);
+    }
+}
+
+static BOOLEAN HostIrpDone (IN PVOID Context)
+{
+    return ((PIRP)Context)->HostCompleted;
+}
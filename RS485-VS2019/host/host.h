@@ -0,0 +1,170 @@
+//-------------------------------------------------------------------------------------------------
+// HOST.H
+//
+// BSD 3-Clause License
+// 
+// Copyright (c) 2022, Anthony Kempka
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Description:
+// ------------
+// The simulated machine the host build runs the driver on: 16550 UARTs on
+// RS-485 buses, the registry, and calls that stand in for an application
+// opening the device and issuing reads, writes and IOCTLs.
+//
+//-------------------------------------------------------------------------------------------------
+
+#ifndef _HOST_H
+#define _HOST_H
+
+#include "uart16550.h"
+
+//
+// Host definitions
+//
+#define HOST_MAX_UARTS          16
+#define HOST_MAX_PARAMETERS     256
+#define HOST_IRQ_LINES          16
+#define HOST_MAX_PROCESSES      4
+#define HOST_MAX_HANDLES        4           // Open handles (file objects) per device
+#define HOST_VECTOR_BASE        0x30        // HalGetInterruptVector: IRQ n is vector 0x30 + n
+#define HOST_PROFILE_LEVEL      27          // ... at IRQL 27 - n
+#define HOST_CLOCK_TICK         15625000    // Default clock tick in ns (15.625ms)
+#define HOST_SERVICE_PATH       L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\Rs485nt"
+
+//
+// Simulated time. Everything the driver does takes no time, except
+// KeStallExecutionProcessor and the latencies below.
+//
+#define HOST_NS_PER_US          1000ULL
+#define HOST_NS_PER_MS          1000000ULL
+#define HOST_NS_PER_SECOND      1000000000ULL
+
+//
+// How the simulated machine behaves, see HostReset
+//
+typedef struct _HOST_CONFIG {
+    ULONGLONG   InterruptLatency;   // IRQ edge to ISR, ns
+    ULONGLONG   DpcLatency;         // DPC queued to DPC running, ns
+    ULONGLONG   ClockTick;          // Resolution of non high resolution timers, ns
+    BOOLEAN     Verbose;            // Print DbgPrint output
+    ULONG       Processors;         // Processor numbers the driver sees, 0 = 1
+    ULONGLONG   Uptime;             // Time since boot at simulated time 0, ns
+    KAFFINITY   ActiveProcessors;   // Processor numbers in use, 0 = the first Processors
+} HOST_CONFIG, *PHOST_CONFIG;
+
+//
+// Counters kept by the host. Cycle counts are the host's own time stamp
+// counter, real time spent running the driver code.
+//
+typedef struct _HOST_STATS {
+    ULONGLONG   Interrupts;         // IRQ edges delivered
+    ULONGLONG   LostInterrupts;     // Edges on a vector with no ISR connected
+    ULONGLONG   IsrCalls;
+    ULONGLONG   IsrClaimed;         // ISR calls that returned TRUE
+    ULONGLONG   IsrCycles;
+    ULONGLONG   IsrMaxCycles;
+    ULONGLONG   DpcCalls;
+    ULONGLONG   DpcCycles;
+    ULONGLONG   TimerExpirations;
+    ULONGLONG   StallTime;          // KeStallExecutionProcessor, ns
+    ULONGLONG   SynchronizeCalls;   // KeSynchronizeExecution
+    LONG        PoolOutstanding;    // Allocations not yet freed
+    LONG        UserMappings;       // MDLs mapped into a process and not yet unmapped
+    LONG        ObjectReferences;   // ObReferenceObject without ObDereferenceObject
+} HOST_STATS, *PHOST_STATS;
+
+extern HOST_STATS HostStats;
+extern PDRIVER_OBJECT HostDriver;
+
+//
+// The driver's entry point and the host's own time stamp counter
+//
+DRIVER_INITIALIZE DriverEntry;
+ULONGLONG HostCycles (VOID);
+
+//
+// Machine setup (host.c)
+//
+VOID HostReset (IN PHOST_CONFIG Config);
+PUART16550 HostAddUart (IN ULONG Base, IN ULONG Irq, IN ULONG Clock, IN PUART_BUS Bus);
+PUART16550 HostFindUart (IN ULONG Port);
+VOID HostAddStatusPort (IN ULONG Port, IN PUART16550 *Uarts, IN ULONG Count);
+VOID HostSetParameter (IN ULONG Port, IN const char *Name, IN ULONG Value);
+VOID HostSetQwordParameter (IN ULONG Port, IN const char *Name, IN ULONGLONG Value);
+BOOLEAN HostGetParameter (IN ULONG Port, IN const char *Name, OUT PULONG Value);
+BOOLEAN HostGetQwordParameter (IN ULONG Port, IN const char *Name, OUT PULONGLONG Value);
+BOOLEAN HostPortConfigured (IN ULONG Port);
+
+//
+// Driver and device I/O (host.c). The I/O calls build an IRP, hand it
+// to the driver at PASSIVE_LEVEL and return it; HostWait runs the machine
+// until it completes.
+//
+NTSTATUS HostLoadDriver (VOID);
+VOID HostUnloadDriver (VOID);
+VOID HostSetCaller (IN ULONG Process, IN ULONG Handle);
+PDEVICE_OBJECT HostOpenDevice (IN ULONG Port);
+VOID HostCloseDevice (IN PDEVICE_OBJECT DeviceObject);
+PIRP HostWrite (IN PDEVICE_OBJECT DeviceObject, IN const VOID *Buffer, IN ULONG Length);
+PIRP HostRead (IN PDEVICE_OBJECT DeviceObject, OUT PVOID Buffer, IN ULONG Length);
+PIRP HostIoctl (IN PDEVICE_OBJECT DeviceObject, IN ULONG IoControlCode,
+                IN const VOID *InputBuffer, IN ULONG InputLength,
+                OUT PVOID OutputBuffer, IN ULONG OutputLength);
+NTSTATUS HostWait (IN PIRP Irp, IN ULONGLONG Timeout);
+NTSTATUS HostCall (IN PIRP Irp, OUT PULONG_PTR Information);
+BOOLEAN HostCancel (IN PIRP Irp);
+VOID HostFreeIrp (IN PIRP Irp);
+
+//
+// Running the machine (hostddk.c)
+//
+ULONGLONG HostTime (VOID);
+VOID HostRun (IN ULONGLONG Duration);
+BOOLEAN HostRunUntil (IN ULONGLONG Deadline, IN BOOLEAN (*Done) (IN PVOID Context),
+                      IN PVOID Context);
+
+//
+// Between host.c and hostddk.c
+//
+extern HOST_CONFIG HostConfig;
+extern PUART16550 HostUarts[HOST_MAX_UARTS];
+extern ULONG HostUartCount;
+extern PUART_BUS HostBuses[HOST_MAX_UARTS];
+extern ULONG HostBusCount;
+
+VOID HostKernelReset (VOID);
+ULONG HostKernelCheck (VOID);
+VOID HostSetProcess (IN ULONG Process);
+PDEVICE_OBJECT HostFindDevice (IN PCWSTR Name);
+UCHAR HostStatusPortRead (IN ULONG Port, OUT PBOOLEAN Found);
+VOID HostCheckLines (VOID);
+VOID HostDeliver (VOID);
+
+#endif // _HOST_H
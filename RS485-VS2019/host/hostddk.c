@@ -0,0 +1,1895 @@
+//-------------------------------------------------------------------------------------------------
+// HOSTDDK.C
+//
+// BSD 3-Clause License
+// 
+// Copyright (c) 2022, Anthony Kempka
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Description:
+// ------------
+// The kernel services the driver uses (hostddk.h), on a simulated single
+// processor machine: IRQLs, spin locks, edge triggered ISA interrupts, DPCs,
+// timers, the StartIo queue, pool, the registry and port I/O to the UART
+// models. Time is simulated and only moves between driver calls, or when the
+// driver stalls.
+//
+//-------------------------------------------------------------------------------------------------
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <x86intrin.h>
+
+#include "hostddk.h"
+#include "host.h"
+
+//
+// KeQuerySystemTime at simulated time 0 (1 Jan 2020 in 100ns units since 1601)
+//
+#define HOST_SYSTEM_EPOCH       132223104000000000LL
+#define HOST_PERF_FREQUENCY     10000000LL
+#define HOST_POOL_FILL          0xA5
+#define HOST_MAX_LINKS          (2 * HOST_MAX_UARTS + 1)
+
+typedef struct _HOST_LINK {
+    WCHAR       Link[64];
+    WCHAR       Target[64];
+} HOST_LINK, *PHOST_LINK;
+
+HOST_CONFIG HostConfig;
+HOST_STATS HostStats;
+
+static ULONGLONG HostNow;
+static KIRQL HostIrql;
+static LIST_ENTRY HostDpcQueue;
+static LIST_ENTRY HostTimerList;
+static KSPIN_LOCK HostCancelLock;
+static PKINTERRUPT HostVectors[HOST_IRQ_LINES];
+static BOOLEAN HostLineLevel[HOST_IRQ_LINES];
+static BOOLEAN HostLinePending[HOST_IRQ_LINES];
+static ULONGLONG HostLineDue[HOST_IRQ_LINES];
+static HOST_LINK HostLinks[HOST_MAX_LINKS];
+static ULONG HostLinkCount;
+static ULONG HostProcesses[HOST_MAX_PROCESSES];
+static ULONG HostProcess;               // Index of the current one
+static ULONG HostProcessor;
+
+static ULONGLONG HostNextEvent (VOID);
+static VOID HostAdvanceTo (IN ULONGLONG Time);
+static VOID HostInterrupt (IN ULONG Line);
+static KAFFINITY HostActiveProcessors (VOID);
+static VOID HostRunDpc (VOID);
+static VOID HostExpireTimers (VOID);
+static VOID HostSetTimer (IN PKTIMER Timer, IN LONGLONG DueTime, IN ULONGLONG Period,
+                          IN PKDPC Dpc, IN BOOLEAN HighResolution);
+static KDEFERRED_ROUTINE HostExTimerDpc;
+static PUART16550 HostPortUart (IN PUCHAR Port, OUT PULONG Offset);
+static size_t HostWcsLen (IN PCWSTR String);
+static BOOLEAN HostWcsEqual (IN PCWSTR String1, IN PCWSTR String2);
+static VOID HostWcsCopy (OUT PWCHAR Destination, IN PCUNICODE_STRING Source, IN ULONG Size);
+
+
+//---------------------------------------------------------------------------
+// HostKernelReset
+//
+// Description:
+//  Boots the simulated kernel: time 0, PASSIVE_LEVEL, no DPCs, timers,
+//  interrupts or symbolic links. Called by HostReset.
+//
+// Arguments:
+//      none
+//
+// Return Value:
+//      none
+//
+VOID HostKernelReset (VOID)
+{
+    ULONG   i;
+
+    HostNow = 0;
+    HostIrql = PASSIVE_LEVEL;
+    HostProcess = 0;
+    HostProcessor = 0;
+    HostCancelLock = 0;
+    InitializeListHead (&HostDpcQueue);
+    InitializeListHead (&HostTimerList);
+
+    for (i = 0; i < HOST_IRQ_LINES; i++) {
+        HostVectors[i] = NULL;
+        HostLineLevel[i] = FALSE;
+        HostLinePending[i] = FALSE;
+    }
+
+    HostLinkCount = 0;
+    RtlZeroMemory (&HostStats, sizeof(HOST_STATS));
+}
+
+
+//---------------------------------------------------------------------------
+// HostKernelCheck
+//
+// Description:
+//  Looks for what a driver must not leave behind once it is unloaded:
+//  queued DPCs, running timers, connected interrupts, pool, symbolic
+//  links, a raised IRQL or a held cancel spin lock.
+//
+// Arguments:
+//      none
+//
+// Return Value:
+//      Number of problems found (and printed)
+//
+ULONG HostKernelCheck (VOID)
+{
+    ULONG   Problems = 0;
+    ULONG   i;
+
+    if (HostIrql != PASSIVE_LEVEL) {
+        fprintf (stderr, "host: IRQL left at %u\n", HostIrql);
+        Problems++;
+    }
+    if (HostCancelLock) {
+        fprintf (stderr, "host: cancel spin lock held\n");
+        Problems++;
+    }
+    if (!IsListEmpty (&HostDpcQueue)) {
+        fprintf (stderr, "host: DPC still queued\n");
+        Problems++;
+    }
+    if (!IsListEmpty (&HostTimerList)) {
+        fprintf (stderr, "host: timer still set\n");
+        Problems++;
+    }
+    for (i = 0; i < HOST_IRQ_LINES; i++) {
+        if (HostVectors[i] != NULL) {
+            fprintf (stderr, "host: interrupt still connected on IRQ %u\n", i);
+            Problems++;
+        }
+    }
+    if (HostLinkCount) {
+        fprintf (stderr, "host: %u symbolic link(s) left\n", HostLinkCount);
+        Problems++;
+    }
+    if (HostStats.PoolOutstanding) {
+        fprintf (stderr, "host: %d pool allocation(s) leaked\n", HostStats.PoolOutstanding);
+        Problems++;
+    }
+    if (HostStats.UserMappings) {
+        fprintf (stderr, "host: %d MDL(s) still mapped into a process\n", HostStats.UserMappings);
+        Problems++;
+    }
+    if (HostStats.ObjectReferences) {
+        fprintf (stderr, "host: %d object reference(s) leaked\n", HostStats.ObjectReferences);
+        Problems++;
+    }
+
+    return Problems;
+}
+
+
+//---------------------------------------------------------------------------
+// HostBugCheck
+//
+// Description:
+//  The host's blue screen: prints why and stops.
+//
+// Arguments:
+//      Format  - printf format, and its arguments
+//
+// Return Value:
+//      Doesn't return
+//
+VOID HostBugCheck (IN const char *Format, ...)
+{
+    va_list Args;
+
+    fprintf (stderr, "host: BUGCHECK at %llu ns, IRQL %u: ",
+             (unsigned long long)HostNow, HostIrql);
+
+    va_start (Args, Format);
+    vfprintf (stderr, Format, Args);
+    va_end (Args);
+
+    fputc ('\n', stderr);
+    abort ();
+}
+
+
+//---------------------------------------------------------------------------
+// DbgPrint
+//
+// Description:
+//  Kernel debugger output, printed when HostConfig.Verbose is set. The
+//  driver's %lu / %ld are 32 bit on Windows, drop the l for the host.
+//
+// Arguments:
+//      Format  - printf format, and its arguments
+//
+// Return Value:
+//      0
+//
+ULONG DbgPrint (IN const char *Format, ...)
+{
+    char    HostFormat[256];
+    ULONG   i, j;
+    va_list Args;
+
+    if (!HostConfig.Verbose) {
+        return 0;
+    }
+
+    for (i = 0, j = 0; Format[i] && (j < sizeof(HostFormat) - 1); i++) {
+        if ((Format[i] == 'l') && (i > 0) && (Format[i - 1] == '%' || isdigit ((unsigned char)Format[i - 1])) &&
+            strchr ("diuxX", Format[i + 1])) {
+            continue;
+        }
+        HostFormat[j++] = Format[i];
+    }
+    HostFormat[j] = 0;
+
+    va_start (Args, Format);
+    vprintf (HostFormat, Args);
+    va_end (Args);
+
+    return 0;
+}
+
+
+//---------------------------------------------------------------------------
+// HostCycles
+//
+// Description:
+//  The host's time stamp counter, to measure how long driver code runs.
+//
+// Arguments:
+//      none
+//
+// Return Value:
+//      Cycle count
+//
+ULONGLONG HostCycles (VOID)
+{
+    return __rdtsc ();
+}
+
+
+//---------------------------------------------------------------------------
+// Pool
+//
+// Description:
+//  Pool is the C heap. New allocations are filled with a pattern, like
+//  the checked kernel, so the driver can't rely on zeroed memory.
+//
+PVOID ExAllocatePoolWithTag (IN POOL_TYPE PoolType, IN SIZE_T NumberOfBytes, IN ULONG Tag)
+{
+    PVOID   P;
+
+    UNREFERENCED_PARAMETER(Tag);
+
+    if ((PoolType == PagedPool) && (HostIrql > APC_LEVEL)) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: paged pool at IRQL %u", HostIrql);
+    }
+    if (HostIrql > DISPATCH_LEVEL) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: pool allocation above DISPATCH_LEVEL");
+    }
+
+    P = malloc (NumberOfBytes ? NumberOfBytes : 1);
+
+    if (P != NULL) {
+        memset (P, HOST_POOL_FILL, NumberOfBytes);
+        HostStats.PoolOutstanding++;
+    }
+
+    return P;
+}
+
+VOID ExFreePool (IN PVOID P)
+{
+    if (P == NULL) {
+        HostBugCheck ("BAD_POOL_CALLER: freeing NULL");
+    }
+    if (HostIrql > DISPATCH_LEVEL) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: pool free above DISPATCH_LEVEL");
+    }
+
+    free (P);
+    HostStats.PoolOutstanding--;
+}
+
+VOID ExFreePoolWithTag (IN PVOID P, IN ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+
+    ExFreePool (P);
+}
+
+
+//---------------------------------------------------------------------------
+// IRQL and spin locks
+//
+// Description:
+//  One processor: the IRQL is a variable and a spin lock that is already
+//  held can never be released, so acquiring it again is a deadlock.
+//  Lowering the IRQL lets pending interrupts and DPCs in.
+//
+KIRQL KeGetCurrentIrql (VOID)
+{
+    return HostIrql;
+}
+
+VOID KeRaiseIrql (IN KIRQL NewIrql, OUT PKIRQL OldIrql)
+{
+    if (NewIrql < HostIrql) {
+        HostBugCheck ("IRQL_NOT_GREATER_OR_EQUAL: raising to %u", NewIrql);
+    }
+
+    *OldIrql = HostIrql;
+    HostIrql = NewIrql;
+}
+
+VOID KeLowerIrql (IN KIRQL NewIrql)
+{
+    if (NewIrql > HostIrql) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: lowering to %u", NewIrql);
+    }
+
+    HostIrql = NewIrql;
+    HostDeliver ();
+}
+
+VOID KeInitializeSpinLock (OUT PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+VOID KeAcquireSpinLockAtDpcLevel (IN PKSPIN_LOCK SpinLock)
+{
+    if (HostIrql < DISPATCH_LEVEL) {
+        HostBugCheck ("IRQL_NOT_GREATER_OR_EQUAL: spin lock at DPC level from IRQL %u", HostIrql);
+    }
+    if (*SpinLock) {
+        HostBugCheck ("spin lock %p acquired twice (deadlock)", (void *)SpinLock);
+    }
+
+    *SpinLock = 1;
+}
+
+VOID KeReleaseSpinLockFromDpcLevel (IN PKSPIN_LOCK SpinLock)
+{
+    if (!*SpinLock) {
+        HostBugCheck ("SPIN_LOCK_NOT_OWNED: %p", (void *)SpinLock);
+    }
+
+    *SpinLock = 0;
+}
+
+VOID KeAcquireSpinLock (IN PKSPIN_LOCK SpinLock, OUT PKIRQL OldIrql)
+{
+    KeRaiseIrql (DISPATCH_LEVEL, OldIrql);
+    KeAcquireSpinLockAtDpcLevel (SpinLock);
+}
+
+VOID KeReleaseSpinLock (IN PKSPIN_LOCK SpinLock, IN KIRQL NewIrql)
+{
+    KeReleaseSpinLockFromDpcLevel (SpinLock);
+    KeLowerIrql (NewIrql);
+}
+
+VOID IoAcquireCancelSpinLock (OUT PKIRQL Irql)
+{
+    KeAcquireSpinLock (&HostCancelLock, Irql);
+}
+
+VOID IoReleaseCancelSpinLock (IN KIRQL Irql)
+{
+    KeReleaseSpinLock (&HostCancelLock, Irql);
+}
+
+
+//---------------------------------------------------------------------------
+// Interrupts
+//
+// Description:
+//  ISA IRQs 0 - 15 are vectors HOST_VECTOR_BASE + n at IRQL
+//  HOST_PROFILE_LEVEL - n. The lines are edge triggered: a UART that is
+//  still interrupting when its ISR returns doesn't interrupt again.
+//
+ULONG HalGetInterruptVector (IN INTERFACE_TYPE InterfaceType, IN ULONG BusNumber,
+                             IN ULONG BusInterruptLevel, IN ULONG BusInterruptVector,
+                             OUT PKIRQL Irql, OUT KAFFINITY *Affinity)
+{
+    UNREFERENCED_PARAMETER(InterfaceType);
+    UNREFERENCED_PARAMETER(BusNumber);
+    UNREFERENCED_PARAMETER(BusInterruptVector);
+
+    if (BusInterruptLevel >= HOST_IRQ_LINES) {
+        return 0;
+    }
+
+    *Irql = (KIRQL)(HOST_PROFILE_LEVEL - BusInterruptLevel);
+    KeQueryActiveProcessorCount (Affinity);
+
+    return HOST_VECTOR_BASE + BusInterruptLevel;
+}
+
+BOOLEAN HalTranslateBusAddress (IN INTERFACE_TYPE InterfaceType, IN ULONG BusNumber,
+                                IN PHYSICAL_ADDRESS BusAddress, IN OUT PULONG AddressSpace,
+                                OUT PPHYSICAL_ADDRESS TranslatedAddress)
+{
+    UNREFERENCED_PARAMETER(InterfaceType);
+    UNREFERENCED_PARAMETER(BusNumber);
+    UNREFERENCED_PARAMETER(AddressSpace);
+
+    *TranslatedAddress = BusAddress;
+    return TRUE;
+}
+
+NTSTATUS IoConnectInterrupt (OUT PKINTERRUPT *InterruptObject, IN PKSERVICE_ROUTINE ServiceRoutine,
+                             IN PVOID ServiceContext, IN PKSPIN_LOCK SpinLock, IN ULONG Vector,
+                             IN KIRQL Irql, IN KIRQL SynchronizeIrql,
+                             IN KINTERRUPT_MODE InterruptMode, IN BOOLEAN ShareVector,
+                             IN KAFFINITY ProcessorEnableMask, IN BOOLEAN FloatingSave)
+{
+    PKINTERRUPT Interrupt, *Link;
+    KAFFINITY   Active;
+    ULONG       Line;
+
+    UNREFERENCED_PARAMETER(SpinLock);
+    UNREFERENCED_PARAMETER(FloatingSave);
+
+    Line = Vector - HOST_VECTOR_BASE;
+    KeQueryActiveProcessorCount (&Active);
+
+    if ((Line >= HOST_IRQ_LINES) || (Irql != HOST_PROFILE_LEVEL - Line) ||
+        (SynchronizeIrql < Irql) || ((ProcessorEnableMask & Active) == 0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // Everyone on a vector has to agree to share it, and on its mode
+    //
+    if ((HostVectors[Line] != NULL) &&
+        (!ShareVector || !HostVectors[Line]->ShareVector ||
+         (InterruptMode != HostVectors[Line]->Mode))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Interrupt = calloc (1, sizeof(KINTERRUPT));
+    if (Interrupt == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Interrupt->ServiceRoutine = ServiceRoutine;
+    Interrupt->ServiceContext = ServiceContext;
+    Interrupt->Vector = Vector;
+    Interrupt->Irql = SynchronizeIrql;
+    Interrupt->ShareVector = ShareVector;
+    Interrupt->Mode = InterruptMode;
+    Interrupt->Affinity = ProcessorEnableMask;
+
+    for (Link = &HostVectors[Line]; *Link != NULL; Link = &(*Link)->HostNext);
+    *Link = Interrupt;
+
+    *InterruptObject = Interrupt;
+    return STATUS_SUCCESS;
+}
+
+VOID IoDisconnectInterrupt (IN PKINTERRUPT InterruptObject)
+{
+    PKINTERRUPT *Link;
+
+    for (Link = &HostVectors[InterruptObject->Vector - HOST_VECTOR_BASE]; *Link != NULL;
+         Link = &(*Link)->HostNext) {
+        if (*Link == InterruptObject) {
+            *Link = InterruptObject->HostNext;
+            free (InterruptObject);
+            return;
+        }
+    }
+
+    HostBugCheck ("IoDisconnectInterrupt: %p isn't connected", (void *)InterruptObject);
+}
+
+BOOLEAN KeSynchronizeExecution (IN PKINTERRUPT Interrupt,
+                                IN PKSYNCHRONIZE_ROUTINE SynchronizeRoutine,
+                                IN PVOID SynchronizeContext)
+{
+    KIRQL   OldIrql;
+    BOOLEAN Result;
+
+    if (Interrupt == NULL) {
+        HostBugCheck ("KeSynchronizeExecution without an interrupt object");
+    }
+    if (HostIrql > Interrupt->Irql) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: KeSynchronizeExecution from IRQL %u", HostIrql);
+    }
+
+    HostStats.SynchronizeCalls++;
+
+    OldIrql = HostIrql;
+    HostIrql = Interrupt->Irql;
+
+    Result = SynchronizeRoutine (SynchronizeContext);
+
+    if (HostIrql != Interrupt->Irql) {
+        HostBugCheck ("synchronize routine returned at IRQL %u", HostIrql);
+    }
+
+    KeLowerIrql (OldIrql);
+    return Result;
+}
+
+
+//---------------------------------------------------------------------------
+// HostCheckLines
+//
+// Description:
+//  Recomputes the IRQ lines from the UARTs (an IRQ line is the OR of the
+//  UARTs wired to it) and latches a rising edge as a pending interrupt,
+//  due after HostConfig.InterruptLatency.
+//
+// Arguments:
+//      none
+//
+// Return Value:
+//      none
+//
+VOID HostCheckLines (VOID)
+{
+    BOOLEAN Level[HOST_IRQ_LINES] = { 0 };
+    ULONG   i;
+
+    for (i = 0; i < HostUartCount; i++) {
+        if ((HostUarts[i]->Irq < HOST_IRQ_LINES) && Uart16550Interrupt (HostUarts[i])) {
+            Level[HostUarts[i]->Irq] = TRUE;
+        }
+    }
+
+    for (i = 0; i < HOST_IRQ_LINES; i++) {
+        if (Level[i] && !HostLineLevel[i] && !HostLinePending[i]) {
+            HostLinePending[i] = TRUE;
+            HostLineDue[i] = HostNow + HostConfig.InterruptLatency;
+        }
+        HostLineLevel[i] = Level[i];
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// HostInterrupt
+//
+// Description:
+//  Runs the ISRs connected to an IRQ line at their IRQL, timing them.
+//
+// Arguments:
+//      Line    - The IRQ line
+//
+// Return Value:
+//      none
+//
+static VOID HostInterrupt (IN ULONG Line)
+{
+    PKINTERRUPT Interrupt;
+    KIRQL       OldIrql;
+    ULONG       OldProcessor;
+    ULONGLONG   Start, Cycles;
+
+    if (HostVectors[Line] == NULL) {
+        HostStats.LostInterrupts++;
+        return;
+    }
+
+    HostStats.Interrupts++;
+
+    for (Interrupt = HostVectors[Line]; Interrupt != NULL; Interrupt = Interrupt->HostNext) {
+
+        OldIrql = HostIrql;
+        HostIrql = Interrupt->Irql;
+
+        //
+        // The lowest processor in the affinity takes it
+        //
+        OldProcessor = HostProcessor;
+        for (HostProcessor = 0; !(Interrupt->Affinity & ((KAFFINITY)1 << HostProcessor));
+             HostProcessor++);
+
+        Start = HostCycles ();
+        if (Interrupt->ServiceRoutine (Interrupt, Interrupt->ServiceContext)) {
+            HostStats.IsrClaimed++;
+        }
+        Cycles = HostCycles () - Start;
+
+        HostStats.IsrCalls++;
+        HostStats.IsrCycles += Cycles;
+        if (Cycles > HostStats.IsrMaxCycles) {
+            HostStats.IsrMaxCycles = Cycles;
+        }
+
+        if (HostIrql != Interrupt->Irql) {
+            HostBugCheck ("ISR returned at IRQL %u", HostIrql);
+        }
+        HostIrql = OldIrql;
+        HostProcessor = OldProcessor;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// HostDeliver
+//
+// Description:
+//  Runs whatever may preempt the current IRQL: due interrupts, highest
+//  IRQL first, then (below DISPATCH_LEVEL) due DPCs.
+//
+// Arguments:
+//      none
+//
+// Return Value:
+//      none
+//
+VOID HostDeliver (VOID)
+{
+    PKDPC   Dpc;
+    LONG    Best;
+    ULONG   i;
+
+    for (;;) {
+        Best = -1;
+
+        for (i = 0; i < HOST_IRQ_LINES; i++) {
+            if (HostLinePending[i] && (HostLineDue[i] <= HostNow) &&
+                (HOST_PROFILE_LEVEL - i > HostIrql) && (Best < 0)) {
+                Best = i;
+            }
+        }
+
+        if (Best >= 0) {
+            HostLinePending[Best] = FALSE;
+            HostInterrupt (Best);
+            continue;
+        }
+
+        if ((HostIrql < DISPATCH_LEVEL) && !IsListEmpty (&HostDpcQueue)) {
+            Dpc = CONTAINING_RECORD (HostDpcQueue.Flink, KDPC, DpcListEntry);
+
+            if (Dpc->HostQueueTime + HostConfig.DpcLatency <= HostNow) {
+                HostRunDpc ();
+                continue;
+            }
+        }
+
+        break;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// DPCs
+//
+// Description:
+//  One DPC queue. HighImportance DPCs go to the head of it. A DPC runs
+//  on the processor it was queued on, or the one it targets.
+//
+VOID KeInitializeDpc (OUT PKDPC Dpc, IN PKDEFERRED_ROUTINE DeferredRoutine, IN PVOID DeferredContext)
+{
+    RtlZeroMemory (Dpc, sizeof(KDPC));
+
+    Dpc->DeferredRoutine = DeferredRoutine;
+    Dpc->DeferredContext = DeferredContext;
+    Dpc->Importance = MediumImportance;
+}
+
+VOID KeSetImportanceDpc (IN PKDPC Dpc, IN KDPC_IMPORTANCE Importance)
+{
+    Dpc->Importance = Importance;
+}
+
+VOID KeSetTargetProcessorDpc (IN PKDPC Dpc, IN CCHAR Number)
+{
+    if (((ULONG)Number >= sizeof(KAFFINITY) * 8) ||
+        !((HostActiveProcessors () >> Number) & 1)) {
+        HostBugCheck ("DPC targeted at inactive processor %d", Number);
+    }
+
+    Dpc->Number = Number;
+    Dpc->HostTargeted = TRUE;
+}
+
+BOOLEAN KeInsertQueueDpc (IN PKDPC Dpc, IN PVOID SystemArgument1, IN PVOID SystemArgument2)
+{
+    if (Dpc->Inserted) {
+        return FALSE;
+    }
+
+    Dpc->SystemArgument1 = SystemArgument1;
+    Dpc->SystemArgument2 = SystemArgument2;
+    Dpc->Inserted = TRUE;
+    Dpc->HostQueueTime = HostNow;
+    Dpc->HostProcessor = Dpc->HostTargeted ? (ULONG)Dpc->Number : HostProcessor;
+
+    if (Dpc->Importance == HighImportance) {
+        InsertHeadList (&HostDpcQueue, &Dpc->DpcListEntry);
+    } else {
+        InsertTailList (&HostDpcQueue, &Dpc->DpcListEntry);
+    }
+
+    HostDeliver ();
+    return TRUE;
+}
+
+BOOLEAN KeRemoveQueueDpc (IN PKDPC Dpc)
+{
+    if (!Dpc->Inserted) {
+        return FALSE;
+    }
+
+    RemoveEntryList (&Dpc->DpcListEntry);
+    Dpc->Inserted = FALSE;
+    return TRUE;
+}
+
+VOID KeFlushQueuedDpcs (VOID)
+{
+    if (HostIrql != PASSIVE_LEVEL) {
+        HostBugCheck ("KeFlushQueuedDpcs at IRQL %u", HostIrql);
+    }
+
+    while (!IsListEmpty (&HostDpcQueue)) {
+        HostRunDpc ();
+    }
+}
+
+VOID IoInitializeDpcRequest (IN PDEVICE_OBJECT DeviceObject, IN PIO_DPC_ROUTINE DpcRoutine)
+{
+    KeInitializeDpc (&DeviceObject->Dpc, (PKDEFERRED_ROUTINE)DpcRoutine, DeviceObject);
+}
+
+static VOID HostRunDpc (VOID)
+{
+    PKDPC       Dpc;
+    KIRQL       OldIrql;
+    ULONG       OldProcessor;
+    ULONGLONG   Start;
+
+    Dpc = CONTAINING_RECORD (RemoveHeadList (&HostDpcQueue), KDPC, DpcListEntry);
+    Dpc->Inserted = FALSE;
+
+    OldIrql = HostIrql;
+    HostIrql = DISPATCH_LEVEL;
+    OldProcessor = HostProcessor;
+    HostProcessor = Dpc->HostProcessor;
+
+    Start = HostCycles ();
+    Dpc->DeferredRoutine (Dpc, Dpc->DeferredContext, Dpc->SystemArgument1, Dpc->SystemArgument2);
+    HostStats.DpcCycles += HostCycles () - Start;
+    HostStats.DpcCalls++;
+
+    if (HostIrql != DISPATCH_LEVEL) {
+        HostBugCheck ("DPC %p returned at IRQL %u", (void *)Dpc->DeferredRoutine, HostIrql);
+    }
+    HostIrql = OldIrql;
+    HostProcessor = OldProcessor;
+}
+
+
+//---------------------------------------------------------------------------
+// Timers
+//
+// Description:
+//  Kernel timers expire on the clock tick (HostConfig.ClockTick), high
+//  resolution executive timers on time. Expiry queues the timer's DPC.
+//
+static VOID HostSetTimer (IN PKTIMER Timer, IN LONGLONG DueTime, IN ULONGLONG Period,
+                          IN PKDPC Dpc, IN BOOLEAN HighResolution)
+{
+    ULONGLONG   Due;
+
+    if (Timer->Inserted) {
+        RemoveEntryList (&Timer->TimerListEntry);
+    }
+
+    if (DueTime < 0) {
+        Due = HostNow + (ULONGLONG)(-DueTime) * 100;
+    } else if (DueTime > HOST_SYSTEM_EPOCH + (LONGLONG)(HostNow / 100)) {
+        Due = (ULONGLONG)(DueTime - HOST_SYSTEM_EPOCH) * 100;
+    } else {
+        Due = HostNow;
+    }
+
+    if (!HighResolution && HostConfig.ClockTick) {
+        Due = (Due + HostConfig.ClockTick - 1) / HostConfig.ClockTick * HostConfig.ClockTick;
+    }
+
+    Timer->HostDueTime = Due;
+    Timer->HostPeriod = Period;
+    Timer->HostHighResolution = HighResolution;
+    Timer->Dpc = Dpc;
+    Timer->Inserted = TRUE;
+    InsertTailList (&HostTimerList, &Timer->TimerListEntry);
+}
+
+static VOID HostExpireTimers (VOID)
+{
+    PLIST_ENTRY Entry, Next;
+    PKTIMER     Timer;
+
+    for (Entry = HostTimerList.Flink; Entry != &HostTimerList; Entry = Next) {
+        Next = Entry->Flink;
+        Timer = CONTAINING_RECORD (Entry, KTIMER, TimerListEntry);
+
+        if (Timer->HostDueTime > HostNow) {
+            continue;
+        }
+
+        HostStats.TimerExpirations++;
+        RemoveEntryList (&Timer->TimerListEntry);
+        Timer->Inserted = FALSE;
+
+        if (Timer->HostPeriod) {
+            HostSetTimer (Timer, -(LONGLONG)(Timer->HostPeriod / 100), Timer->HostPeriod,
+                          Timer->Dpc, Timer->HostHighResolution);
+            Next = HostTimerList.Flink;
+        }
+
+        if (Timer->Dpc != NULL) {
+            KeInsertQueueDpc (Timer->Dpc, NULL, NULL);
+            Next = HostTimerList.Flink;
+        }
+    }
+}
+
+VOID KeInitializeTimer (OUT PKTIMER Timer)
+{
+    RtlZeroMemory (Timer, sizeof(KTIMER));
+}
+
+BOOLEAN KeSetTimer (IN PKTIMER Timer, IN LARGE_INTEGER DueTime, IN PKDPC Dpc)
+{
+    BOOLEAN Inserted = Timer->Inserted;
+
+    HostSetTimer (Timer, DueTime.QuadPart, 0, Dpc, FALSE);
+    return Inserted;
+}
+
+BOOLEAN KeCancelTimer (IN PKTIMER Timer)
+{
+    if (!Timer->Inserted) {
+        return FALSE;
+    }
+
+    RemoveEntryList (&Timer->TimerListEntry);
+    Timer->Inserted = FALSE;
+    return TRUE;
+}
+
+static VOID HostExTimerDpc (IN PKDPC Dpc, IN PVOID DeferredContext,
+                            IN PVOID SystemArgument1, IN PVOID SystemArgument2)
+{
+    PEX_TIMER   Timer = DeferredContext;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    Timer->Callback (Timer, Timer->Context);
+}
+
+PEX_TIMER ExAllocateTimer (IN PEXT_CALLBACK Callback, IN PVOID CallbackContext, IN ULONG Attributes)
+{
+    PEX_TIMER   Timer;
+
+    Timer = ExAllocatePoolWithTag (NonPagedPool, sizeof(EX_TIMER), 'rmiT');
+    if (Timer == NULL) {
+        return NULL;
+    }
+
+    KeInitializeTimer (&Timer->Timer);
+    KeInitializeDpc (&Timer->Dpc, HostExTimerDpc, Timer);
+    Timer->Callback = Callback;
+    Timer->Context = CallbackContext;
+    Timer->Attributes = Attributes;
+
+    return Timer;
+}
+
+VOID ExInitializeSetTimerParameters (OUT PEXT_SET_PARAMETERS Parameters)
+{
+    RtlZeroMemory (Parameters, sizeof(EXT_SET_PARAMETERS));
+}
+
+BOOLEAN ExSetTimer (IN PEX_TIMER Timer, IN LONGLONG DueTime, IN LONGLONG Period,
+                    IN PEXT_SET_PARAMETERS Parameters)
+{
+    BOOLEAN Inserted = Timer->Timer.Inserted;
+
+    UNREFERENCED_PARAMETER(Parameters);
+
+    HostSetTimer (&Timer->Timer, DueTime, (ULONGLONG)Period * 100, &Timer->Dpc,
+                  (Timer->Attributes & EX_TIMER_HIGH_RESOLUTION) != 0);
+    return Inserted;
+}
+
+BOOLEAN ExCancelTimer (IN PEX_TIMER Timer, IN PVOID Parameters)
+{
+    UNREFERENCED_PARAMETER(Parameters);
+
+    return KeCancelTimer (&Timer->Timer);
+}
+
+BOOLEAN ExDeleteTimer (IN PEX_TIMER Timer, IN BOOLEAN Cancel, IN BOOLEAN Wait, IN PVOID Parameters)
+{
+    BOOLEAN Pending;
+
+    UNREFERENCED_PARAMETER(Parameters);
+
+    if (Wait && (HostIrql >= DISPATCH_LEVEL)) {
+        HostBugCheck ("ExDeleteTimer waiting at IRQL %u", HostIrql);
+    }
+
+    Pending = Timer->Timer.Inserted;
+
+    if (Cancel || !Pending) {
+        KeCancelTimer (&Timer->Timer);
+        KeRemoveQueueDpc (&Timer->Dpc);
+        ExFreePool (Timer);
+    } else {
+        HostBugCheck ("ExDeleteTimer of a set timer without cancelling it");
+    }
+
+    return Pending;
+}
+
+
+//---------------------------------------------------------------------------
+// Time
+//
+// Description:
+//  The performance counter runs at 10MHz, the interrupt time and system
+//  time count 100ns units. The performance counter and interrupt time
+//  count from boot, HostConfig.Uptime before simulated time 0. KeStallExecutionProcessor is the one place
+//  driver code takes simulated time: the machine keeps running under it,
+//  interrupts above the current IRQL included.
+//
+VOID KeQuerySystemTime (OUT PLARGE_INTEGER CurrentTime)
+{
+    CurrentTime->QuadPart = HOST_SYSTEM_EPOCH + (LONGLONG)(HostNow / 100);
+}
+
+ULONGLONG KeQueryInterruptTime (VOID)
+{
+    return (HostNow + HostConfig.Uptime) / 100;
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter (OUT PLARGE_INTEGER PerformanceFrequency)
+{
+    LARGE_INTEGER   Counter;
+
+    if (PerformanceFrequency != NULL) {
+        PerformanceFrequency->QuadPart = HOST_PERF_FREQUENCY;
+    }
+
+    Counter.QuadPart = (LONGLONG)((HostNow + HostConfig.Uptime) /
+                                  (1000000000 / HOST_PERF_FREQUENCY));
+    return Counter;
+}
+
+VOID KeStallExecutionProcessor (IN ULONG MicroSeconds)
+{
+    HostStats.StallTime += MicroSeconds * HOST_NS_PER_US;
+    HostAdvanceTo (HostNow + MicroSeconds * HOST_NS_PER_US);
+}
+
+//
+// HostConfig.Processors (or HostConfig.ActiveProcessors, which can have
+// gaps) only numbers the processors: the ISR runs on the lowest one in
+// its affinity, a DPC where it was queued or targeted, and the rest on
+// processor 0. Things still happen one at a time.
+//
+static KAFFINITY HostActiveProcessors (VOID)
+{
+    if (HostConfig.ActiveProcessors != 0) {
+        return HostConfig.ActiveProcessors;
+    }
+    if (HostConfig.Processors == 0) {
+        return 1;
+    }
+    if (HostConfig.Processors >= sizeof(KAFFINITY) * 8) {
+        return ~(KAFFINITY)0;
+    }
+    return ((KAFFINITY)1 << HostConfig.Processors) - 1;
+}
+
+ULONG KeGetCurrentProcessorNumber (VOID)
+{
+    return HostProcessor;
+}
+
+ULONG KeQueryActiveProcessorCount (OUT KAFFINITY *ActiveProcessors)
+{
+    if (ActiveProcessors != NULL) {
+        *ActiveProcessors = HostActiveProcessors ();
+    }
+    return (ULONG)__builtin_popcountll (HostActiveProcessors ());
+}
+
+KAFFINITY KeQueryActiveProcessors (VOID)
+{
+    return HostActiveProcessors ();
+}
+
+
+//---------------------------------------------------------------------------
+// Running the machine
+//
+// Description:
+//  Discrete event simulation: jump to the next thing that happens (a
+//  character done on a UART or a remote station, a character timeout, a
+//  timer, an interrupt or DPC latency running out), update the UARTs and
+//  IRQ lines and run whatever is now due.
+//
+ULONGLONG HostTime (VOID)
+{
+    return HostNow;
+}
+
+static ULONGLONG HostNextEvent (VOID)
+{
+    ULONGLONG   Next = UART_NEVER;
+    ULONGLONG   Time;
+    PLIST_ENTRY Entry;
+    PKDPC       Dpc;
+    ULONG       i;
+
+    for (i = 0; i < HostUartCount; i++) {
+        Time = Uart16550NextEvent (HostUarts[i]);
+        if (Time < Next) {
+            Next = Time;
+        }
+    }
+
+    for (i = 0; i < HostBusCount; i++) {
+        Time = UartBusNextEvent (HostBuses[i]);
+        if (Time < Next) {
+            Next = Time;
+        }
+    }
+
+    for (Entry = HostTimerList.Flink; Entry != &HostTimerList; Entry = Entry->Flink) {
+        Time = CONTAINING_RECORD (Entry, KTIMER, TimerListEntry)->HostDueTime;
+        if (Time < Next) {
+            Next = Time;
+        }
+    }
+
+    for (i = 0; i < HOST_IRQ_LINES; i++) {
+        if (HostLinePending[i] && (HOST_PROFILE_LEVEL - i > HostIrql) &&
+            (HostLineDue[i] > HostNow) && (HostLineDue[i] < Next)) {
+            Next = HostLineDue[i];
+        }
+    }
+
+    if ((HostIrql < DISPATCH_LEVEL) && !IsListEmpty (&HostDpcQueue)) {
+        Dpc = CONTAINING_RECORD (HostDpcQueue.Flink, KDPC, DpcListEntry);
+        Time = Dpc->HostQueueTime + HostConfig.DpcLatency;
+        if ((Time > HostNow) && (Time < Next)) {
+            Next = Time;
+        }
+    }
+
+    return Next;
+}
+
+static VOID HostStep (IN ULONGLONG Limit)
+{
+    ULONGLONG   Next;
+    ULONG       i;
+
+    HostDeliver ();
+
+    Next = HostNextEvent ();
+    if (Next > Limit) {
+        Next = Limit;
+    }
+    if (Next > HostNow) {
+        HostNow = Next;
+    }
+
+    for (i = 0; i < HostUartCount; i++) {
+        Uart16550Advance (HostUarts[i], HostNow);
+    }
+    for (i = 0; i < HostBusCount; i++) {
+        UartBusAdvance (HostBuses[i], HostNow);
+    }
+
+    HostExpireTimers ();
+    HostCheckLines ();
+    HostDeliver ();
+}
+
+static VOID HostAdvanceTo (IN ULONGLONG Time)
+{
+    do {
+        HostStep (Time);
+    } while (HostNow < Time);
+}
+
+VOID HostRun (IN ULONGLONG Duration)
+{
+    HostAdvanceTo (HostNow + Duration);
+}
+
+BOOLEAN HostRunUntil (IN ULONGLONG Deadline, IN BOOLEAN (*Done) (IN PVOID Context),
+                      IN PVOID Context)
+{
+    for (;;) {
+        HostDeliver ();
+
+        if (Done (Context)) {
+            return TRUE;
+        }
+        if (HostNow >= Deadline) {
+            return FALSE;
+        }
+
+        HostStep (Deadline);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// Port I/O
+//
+// Description:
+//  Port reads and writes go to the UART (or board status register) at
+//  that address; nothing there reads as 0xFF. Every access may change an
+//  IRQ line.
+//
+static PUART16550 HostPortUart (IN PUCHAR Port, OUT PULONG Offset)
+{
+    ULONG   Address = (ULONG)(ULONG_PTR)Port;
+    ULONG   i;
+
+    for (i = 0; i < HostUartCount; i++) {
+        if ((Address >= HostUarts[i]->Base) && (Address < HostUarts[i]->Base + UART_REGISTERS)) {
+            *Offset = Address - HostUarts[i]->Base;
+            return HostUarts[i];
+        }
+    }
+
+    return NULL;
+}
+
+UCHAR READ_PORT_UCHAR (IN PUCHAR Port)
+{
+    PUART16550  Uart;
+    ULONG       Offset;
+    UCHAR       Value;
+    BOOLEAN     Found;
+
+    Uart = HostPortUart (Port, &Offset);
+
+    if (Uart != NULL) {
+        Value = Uart16550Read (Uart, Offset, HostNow);
+    } else {
+        Value = HostStatusPortRead ((ULONG)(ULONG_PTR)Port, &Found);
+        if (!Found) {
+            Value = 0xFF;
+        }
+    }
+
+    HostCheckLines ();
+    HostDeliver ();
+    return Value;
+}
+
+VOID WRITE_PORT_UCHAR (IN PUCHAR Port, IN UCHAR Value)
+{
+    PUART16550  Uart;
+    ULONG       Offset;
+
+    Uart = HostPortUart (Port, &Offset);
+
+    if (Uart != NULL) {
+        Uart16550Write (Uart, Offset, Value, HostNow);
+    }
+
+    HostCheckLines ();
+    HostDeliver ();
+}
+
+
+//---------------------------------------------------------------------------
+// Strings
+//
+// Description:
+//  The Rtl counted string routines, WCHAR is 16 bit (-fshort-wchar).
+//
+static size_t HostWcsLen (IN PCWSTR String)
+{
+    size_t  Length = 0;
+
+    while (String[Length]) {
+        Length++;
+    }
+    return Length;
+}
+
+static BOOLEAN HostWcsEqual (IN PCWSTR String1, IN PCWSTR String2)
+{
+    while (*String1 && (*String1 == *String2)) {
+        String1++;
+        String2++;
+    }
+    return *String1 == *String2;
+}
+
+static VOID HostWcsCopy (OUT PWCHAR Destination, IN PCUNICODE_STRING Source, IN ULONG Size)
+{
+    ULONG   Count = Source->Length / sizeof(WCHAR);
+
+    if (Count > Size - 1) {
+        Count = Size - 1;
+    }
+
+    memcpy (Destination, Source->Buffer, Count * sizeof(WCHAR));
+    Destination[Count] = UNICODE_NULL;
+}
+
+VOID RtlInitUnicodeString (OUT PUNICODE_STRING DestinationString, IN PCWSTR SourceString)
+{
+    DestinationString->Buffer = (PWSTR)SourceString;
+
+    if (SourceString == NULL) {
+        DestinationString->Length = 0;
+        DestinationString->MaximumLength = 0;
+    } else {
+        DestinationString->Length = (USHORT)(HostWcsLen (SourceString) * sizeof(WCHAR));
+        DestinationString->MaximumLength = DestinationString->Length + sizeof(WCHAR);
+    }
+}
+
+static NTSTATUS HostAppend (IN OUT PUNICODE_STRING Destination, IN const WCHAR *Source,
+                            IN ULONG Length)
+{
+    if (Destination->Length + Length > Destination->MaximumLength) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    memcpy ((PUCHAR)Destination->Buffer + Destination->Length, Source, Length);
+    Destination->Length += (USHORT)Length;
+
+    if (Destination->Length + sizeof(WCHAR) <= Destination->MaximumLength) {
+        Destination->Buffer[Destination->Length / sizeof(WCHAR)] = UNICODE_NULL;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS RtlAppendUnicodeToString (IN OUT PUNICODE_STRING Destination, IN PCWSTR Source)
+{
+    if (Source == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    return HostAppend (Destination, Source, (ULONG)(HostWcsLen (Source) * sizeof(WCHAR)));
+}
+
+NTSTATUS RtlAppendUnicodeStringToString (IN OUT PUNICODE_STRING Destination, IN PUNICODE_STRING Source)
+{
+    return HostAppend (Destination, Source->Buffer, Source->Length);
+}
+
+NTSTATUS RtlIntegerToUnicodeString (IN ULONG Value, IN ULONG Base, IN OUT PUNICODE_STRING String)
+{
+    WCHAR   Digits[33];
+    ULONG   Count = 0;
+    ULONG   Digit;
+
+    if (Base == 0) {
+        Base = 10;
+    }
+    if ((Base != 2) && (Base != 8) && (Base != 10) && (Base != 16)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    do {
+        Digit = Value % Base;
+        Digits[32 - ++Count] = (WCHAR)((Digit < 10) ? '0' + Digit : 'A' + Digit - 10);
+        Value /= Base;
+    } while (Value);
+
+    if ((Count + 1) * sizeof(WCHAR) > String->MaximumLength) {
+        return STATUS_BUFFER_OVERFLOW;
+    }
+
+    memcpy (String->Buffer, &Digits[32 - Count], Count * sizeof(WCHAR));
+    String->Buffer[Count] = UNICODE_NULL;
+    String->Length = (USHORT)(Count * sizeof(WCHAR));
+
+    return STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// Registry
+//
+// Description:
+//  The driver's Parameters key holds nothing, Parameters\PortN holds what
+//  HostSetParameter put there. A key exists once it has a value. A direct
+//  REG_QWORD is bigger than a ULONG, so like the kernel it needs an
+//  EntryContext that starts with its negated size.
+//
+static BOOLEAN HostRegistryPort (IN PCWSTR Path, OUT PULONG Port)
+{
+    static const WCHAR Key[] = L"\\Port";
+    size_t  Length, i;
+    ULONG   Number = 0;
+
+    Length = HostWcsLen (Path);
+
+    for (i = Length; i > 0; i--) {
+        if ((Path[i - 1] < '0') || (Path[i - 1] > '9')) {
+            break;
+        }
+    }
+
+    if ((i == Length) || (i < HostWcsLen (Key)) ||
+        memcmp (&Path[i - HostWcsLen (Key)], Key, HostWcsLen (Key) * sizeof(WCHAR))) {
+        return FALSE;
+    }
+
+    for (; i < Length; i++) {
+        Number = Number * 10 + (Path[i] - '0');
+    }
+
+    *Port = Number;
+    return TRUE;
+}
+
+NTSTATUS RtlCheckRegistryKey (IN ULONG RelativeTo, IN PWSTR Path)
+{
+    ULONG   Port;
+
+    UNREFERENCED_PARAMETER(RelativeTo);
+
+    if (HostRegistryPort (Path, &Port) && HostPortConfigured (Port)) {
+        return STATUS_SUCCESS;
+    }
+
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+static NTSTATUS HostRegistryQword (IN PRTL_QUERY_REGISTRY_TABLE Entry, IN ULONGLONG Value)
+{
+    LONG    Size = *(PLONG)Entry->EntryContext;
+
+    if (Size >= 0) {
+        return STATUS_NOT_IMPLEMENTED;
+    }
+    if ((ULONG)-Size < sizeof(ULONGLONG)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    memcpy (Entry->EntryContext, &Value, sizeof(ULONGLONG));
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS RtlQueryRegistryValues (IN ULONG RelativeTo, IN PCWSTR Path,
+                                 IN PRTL_QUERY_REGISTRY_TABLE QueryTable,
+                                 IN PVOID Context, IN PVOID Environment)
+{
+    PRTL_QUERY_REGISTRY_TABLE Entry;
+    char    Name[64];
+    ULONG   Port, Value, i;
+    ULONGLONG Qword;
+    NTSTATUS Status;
+    BOOLEAN Keyed;
+
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Environment);
+
+    if (HostIrql != PASSIVE_LEVEL) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: registry query at IRQL %u", HostIrql);
+    }
+
+    Keyed = HostRegistryPort (Path, &Port);
+
+    for (Entry = QueryTable; (Entry->QueryRoutine != NULL) || (Entry->Name != NULL); Entry++) {
+
+        if (!(Entry->Flags & RTL_QUERY_REGISTRY_DIRECT) || (Entry->Name == NULL)) {
+            return STATUS_NOT_IMPLEMENTED;
+        }
+
+        for (i = 0; Entry->Name[i] && (i < sizeof(Name) - 1); i++) {
+            Name[i] = (char)Entry->Name[i];
+        }
+        Name[i] = 0;
+
+        if (Keyed && HostGetParameter (Port, Name, &Value)) {
+            *(PULONG)Entry->EntryContext = Value;
+        } else if (Keyed && HostGetQwordParameter (Port, Name, &Qword)) {
+            Status = HostRegistryQword (Entry, Qword);
+            if (!NT_SUCCESS (Status)) {
+                return Status;
+            }
+        } else if (Entry->DefaultType == REG_DWORD) {
+            memcpy (Entry->EntryContext, Entry->DefaultData, Entry->DefaultLength);
+        } else if (Entry->DefaultType == REG_QWORD) {
+            memcpy (&Qword, Entry->DefaultData, sizeof(ULONGLONG));
+            Status = HostRegistryQword (Entry, Qword);
+            if (!NT_SUCCESS (Status)) {
+                return Status;
+            }
+        } else if (!(RelativeTo & RTL_REGISTRY_OPTIONAL)) {
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// Devices and symbolic links
+//
+NTSTATUS IoCreateDevice (IN PDRIVER_OBJECT DriverObject, IN ULONG DeviceExtensionSize,
+                         IN PUNICODE_STRING DeviceName, IN ULONG DeviceType,
+                         IN ULONG DeviceCharacteristics, IN BOOLEAN Exclusive,
+                         OUT PDEVICE_OBJECT *DeviceObject)
+{
+    PDEVICE_OBJECT  Device;
+    WCHAR           Name[64];
+
+    UNREFERENCED_PARAMETER(DeviceCharacteristics);
+
+    HostWcsCopy (Name, DeviceName, 64);
+
+    if (HostFindDevice (Name) != NULL) {
+        return STATUS_OBJECT_NAME_COLLISION;
+    }
+
+    Device = calloc (1, sizeof(DEVICE_OBJECT) + DeviceExtensionSize);
+    if (Device == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Device->DriverObject = DriverObject;
+    Device->DeviceType = DeviceType;
+    Device->Exclusive = Exclusive;
+    Device->DeviceExtension = Device + 1;
+    InitializeListHead (&Device->DeviceQueue.DeviceListHead);
+    memcpy (Device->HostName, Name, sizeof(Name));
+
+    Device->NextDevice = DriverObject->DeviceObject;
+    DriverObject->DeviceObject = Device;
+
+    *DeviceObject = Device;
+    return STATUS_SUCCESS;
+}
+
+VOID IoDeleteDevice (IN PDEVICE_OBJECT DeviceObject)
+{
+    PDEVICE_OBJECT *Link;
+
+    for (Link = &DeviceObject->DriverObject->DeviceObject; *Link != NULL;
+         Link = &(*Link)->NextDevice) {
+        if (*Link == DeviceObject) {
+            *Link = DeviceObject->NextDevice;
+            break;
+        }
+    }
+
+    if (DeviceObject->Dpc.Inserted) {
+        HostBugCheck ("IoDeleteDevice with the device's DPC queued");
+    }
+
+    free (DeviceObject);
+}
+
+NTSTATUS IoCreateSymbolicLink (IN PUNICODE_STRING SymbolicLinkName, IN PUNICODE_STRING DeviceName)
+{
+    WCHAR   Name[64];
+    ULONG   i;
+
+    HostWcsCopy (Name, SymbolicLinkName, 64);
+
+    for (i = 0; i < HostLinkCount; i++) {
+        if (HostWcsEqual (HostLinks[i].Link, Name)) {
+            return STATUS_OBJECT_NAME_COLLISION;
+        }
+    }
+
+    if (HostLinkCount == HOST_MAX_LINKS) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    memcpy (HostLinks[HostLinkCount].Link, Name, sizeof(Name));
+    HostWcsCopy (HostLinks[HostLinkCount].Target, DeviceName, 64);
+    HostLinkCount++;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS IoDeleteSymbolicLink (IN PUNICODE_STRING SymbolicLinkName)
+{
+    WCHAR   Name[64];
+    ULONG   i;
+
+    HostWcsCopy (Name, SymbolicLinkName, 64);
+
+    for (i = 0; i < HostLinkCount; i++) {
+        if (HostWcsEqual (HostLinks[i].Link, Name)) {
+            HostLinks[i] = HostLinks[--HostLinkCount];
+            return STATUS_SUCCESS;
+        }
+    }
+
+    return STATUS_OBJECT_NAME_NOT_FOUND;
+}
+
+PDEVICE_OBJECT HostFindDevice (IN PCWSTR Name)
+{
+    PDEVICE_OBJECT  Device;
+    ULONG           i;
+
+    for (i = 0; i < HostLinkCount; i++) {
+        if (HostWcsEqual (HostLinks[i].Link, Name)) {
+            Name = HostLinks[i].Target;
+            break;
+        }
+    }
+
+    if (HostDriver == NULL) {
+        return NULL;
+    }
+
+    for (Device = HostDriver->DeviceObject; Device != NULL; Device = Device->NextDevice) {
+        if (HostWcsEqual (Device->HostName, Name)) {
+            return Device;
+        }
+    }
+
+    return NULL;
+}
+
+NTSTATUS IoReportResourceForDetection (IN PDRIVER_OBJECT DriverObject,
+                                       IN PCM_RESOURCE_LIST DriverList, IN ULONG DriverListSize,
+                                       IN PDEVICE_OBJECT DeviceObject,
+                                       IN PCM_RESOURCE_LIST DeviceList, IN ULONG DeviceListSize,
+                                       OUT PBOOLEAN ConflictDetected)
+{
+    UNREFERENCED_PARAMETER(DriverObject);
+    UNREFERENCED_PARAMETER(DriverList);
+    UNREFERENCED_PARAMETER(DriverListSize);
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(DeviceList);
+    UNREFERENCED_PARAMETER(DeviceListSize);
+
+    *ConflictDetected = FALSE;
+    return STATUS_SUCCESS;
+}
+
+
+//---------------------------------------------------------------------------
+// The StartIo device queue and IRP cancellation, as the I/O manager does
+// it: IoStartPacket starts the IRP right away if the device isn't busy,
+// otherwise queues it; IoStartNextPacket starts the next queued one.
+//
+static BOOLEAN HostInsertDeviceQueue (IN PKDEVICE_QUEUE Queue, IN PKDEVICE_QUEUE_ENTRY Entry)
+{
+    if (!Queue->Busy) {
+        Queue->Busy = TRUE;
+        Entry->Inserted = FALSE;
+        return FALSE;
+    }
+
+    InsertTailList (&Queue->DeviceListHead, &Entry->DeviceListEntry);
+    Entry->Inserted = TRUE;
+    return TRUE;
+}
+
+BOOLEAN KeRemoveEntryDeviceQueue (IN PKDEVICE_QUEUE DeviceQueue,
+                                  IN PKDEVICE_QUEUE_ENTRY DeviceQueueEntry)
+{
+    UNREFERENCED_PARAMETER(DeviceQueue);
+
+    if (!DeviceQueueEntry->Inserted) {
+        return FALSE;
+    }
+
+    RemoveEntryList (&DeviceQueueEntry->DeviceListEntry);
+    DeviceQueueEntry->Inserted = FALSE;
+    return TRUE;
+}
+
+VOID IoStartPacket (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN PULONG Key,
+                    IN PDRIVER_CANCEL CancelFunction)
+{
+    KIRQL   OldIrql, CancelIrql = PASSIVE_LEVEL;
+
+    UNREFERENCED_PARAMETER(Key);
+
+    KeRaiseIrql (DISPATCH_LEVEL, &OldIrql);
+
+    if (CancelFunction != NULL) {
+        IoAcquireCancelSpinLock (&CancelIrql);
+        Irp->CancelRoutine = CancelFunction;
+    }
+
+    if (!HostInsertDeviceQueue (&DeviceObject->DeviceQueue, &Irp->Tail.Overlay.DeviceQueueEntry)) {
+
+        DeviceObject->CurrentIrp = Irp;
+
+        if (CancelFunction != NULL) {
+            IoReleaseCancelSpinLock (CancelIrql);
+        }
+
+        DeviceObject->DriverObject->DriverStartIo (DeviceObject, Irp);
+
+    } else if (CancelFunction != NULL) {
+
+        if (Irp->Cancel) {
+            Irp->CancelIrql = CancelIrql;
+            Irp->CancelRoutine = NULL;
+            CancelFunction (DeviceObject, Irp);
+        } else {
+            IoReleaseCancelSpinLock (CancelIrql);
+        }
+    }
+
+    KeLowerIrql (OldIrql);
+}
+
+VOID IoStartNextPacket (IN PDEVICE_OBJECT DeviceObject, IN BOOLEAN Cancelable)
+{
+    PKDEVICE_QUEUE  Queue = &DeviceObject->DeviceQueue;
+    PIRP            Irp = NULL;
+    KIRQL           CancelIrql = PASSIVE_LEVEL;
+
+    if (Cancelable) {
+        IoAcquireCancelSpinLock (&CancelIrql);
+    }
+
+    DeviceObject->CurrentIrp = NULL;
+
+    if (IsListEmpty (&Queue->DeviceListHead)) {
+        Queue->Busy = FALSE;
+    } else {
+        Irp = CONTAINING_RECORD (RemoveHeadList (&Queue->DeviceListHead), IRP,
+                                 Tail.Overlay.DeviceQueueEntry.DeviceListEntry);
+        Irp->Tail.Overlay.DeviceQueueEntry.Inserted = FALSE;
+        DeviceObject->CurrentIrp = Irp;
+    }
+
+    if (Cancelable) {
+        IoReleaseCancelSpinLock (CancelIrql);
+    }
+
+    if (Irp != NULL) {
+        DeviceObject->DriverObject->DriverStartIo (DeviceObject, Irp);
+    }
+}
+
+PDRIVER_CANCEL IoSetCancelRoutine (IN PIRP Irp, IN PDRIVER_CANCEL CancelRoutine)
+{
+    return __atomic_exchange_n (&Irp->CancelRoutine, CancelRoutine, __ATOMIC_SEQ_CST);
+}
+
+VOID IoCompleteRequest (IN PIRP Irp, IN CCHAR PriorityBoost)
+{
+    PIO_STACK_LOCATION  Stack = IoGetCurrentIrpStackLocation (Irp);
+    ULONG               Length;
+
+    UNREFERENCED_PARAMETER(PriorityBoost);
+
+    if (Irp->HostCompleted) {
+        HostBugCheck ("MULTIPLE_IRP_COMPLETE_REQUESTS: IRP %p", (void *)Irp);
+    }
+    if (HostIrql > DISPATCH_LEVEL) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: IoCompleteRequest at IRQL %u", HostIrql);
+    }
+    if (Irp->CancelRoutine != NULL) {
+        HostBugCheck ("CANCEL_STATE_IN_COMPLETED_IRP: IRP %p", (void *)Irp);
+    }
+
+    //
+    // Buffered I/O: copy the data back to the caller
+    //
+    if ((Irp->AssociatedIrp.SystemBuffer != NULL) && (Irp->UserBuffer != NULL) &&
+        ((Stack->MajorFunction == IRP_MJ_READ) || (Stack->MajorFunction == IRP_MJ_DEVICE_CONTROL)) &&
+        NT_SUCCESS (Irp->IoStatus.Status)) {
+
+        Length = (ULONG)Irp->IoStatus.Information;
+        if (Length > Irp->HostUserLength) {
+            HostBugCheck ("IRP %p returns %u bytes into a %u byte buffer", (void *)Irp,
+                          Length, Irp->HostUserLength);
+        }
+        memcpy (Irp->UserBuffer, Irp->AssociatedIrp.SystemBuffer, Length);
+    }
+
+    Irp->HostCompleted = TRUE;
+    Irp->HostCompletionTime = HostNow;
+}
+
+
+//---------------------------------------------------------------------------
+// Memory descriptor lists. The host has one address space: the system and
+// user mappings of a buffer are the buffer.
+//
+PMDL IoAllocateMdl (IN PVOID VirtualAddress, IN ULONG Length, IN BOOLEAN SecondaryBuffer,
+                    IN BOOLEAN ChargeQuota, IN PIRP Irp)
+{
+    PMDL    Mdl;
+
+    UNREFERENCED_PARAMETER(ChargeQuota);
+
+    Mdl = ExAllocatePoolWithTag (NonPagedPool, sizeof(MDL), ' ldM');
+    if (Mdl == NULL) {
+        return NULL;
+    }
+
+    Mdl->Next = NULL;
+    Mdl->StartVa = VirtualAddress;
+    Mdl->MappedSystemVa = NULL;
+    Mdl->ByteCount = Length;
+    Mdl->HostUserProcess = NULL;
+
+    if ((Irp != NULL) && !SecondaryBuffer) {
+        Irp->MdlAddress = Mdl;
+    }
+
+    return Mdl;
+}
+
+VOID IoFreeMdl (IN PMDL Mdl)
+{
+    if (Mdl->HostUserProcess != NULL) {
+        HostBugCheck ("PROCESS_HAS_LOCKED_PAGES: MDL freed while mapped into a process");
+    }
+    ExFreePool (Mdl);
+}
+
+VOID MmBuildMdlForNonPagedPool (IN PMDL Mdl)
+{
+    Mdl->MappedSystemVa = Mdl->StartVa;
+}
+
+PVOID MmGetSystemAddressForMdlSafe (IN PMDL Mdl, IN ULONG Priority)
+{
+    UNREFERENCED_PARAMETER(Priority);
+
+    if (Mdl->MappedSystemVa == NULL) {
+        Mdl->MappedSystemVa = Mdl->StartVa;
+    }
+    return Mdl->MappedSystemVa;
+}
+
+PVOID MmMapLockedPagesSpecifyCache (IN PMDL Mdl, IN KPROCESSOR_MODE AccessMode,
+                                    IN MEMORY_CACHING_TYPE CacheType, IN PVOID RequestedAddress,
+                                    IN ULONG BugCheckOnFailure, IN ULONG Priority)
+{
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(CacheType);
+    UNREFERENCED_PARAMETER(RequestedAddress);
+    UNREFERENCED_PARAMETER(BugCheckOnFailure);
+    UNREFERENCED_PARAMETER(Priority);
+
+    if ((AccessMode == UserMode) && (HostIrql > APC_LEVEL)) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: user mapping at IRQL %u", HostIrql);
+    }
+
+    if (AccessMode == UserMode) {
+        if (Mdl->HostUserProcess != NULL) {
+            HostBugCheck ("MDL mapped into a process twice");
+        }
+        Mdl->HostUserProcess = PsGetCurrentProcess ();
+        HostStats.UserMappings++;
+    }
+
+    return Mdl->StartVa;
+}
+
+//
+// A user mapping is only in its own process's address space
+//
+VOID MmUnmapLockedPages (IN PVOID BaseAddress, IN PMDL Mdl)
+{
+    UNREFERENCED_PARAMETER(BaseAddress);
+
+    if (Mdl->HostUserProcess != NULL) {
+        if (Mdl->HostUserProcess != PsGetCurrentProcess ()) {
+            HostBugCheck ("MmUnmapLockedPages in process %u, mapped into process %u",
+                          HostProcess,
+                          (ULONG)((PULONG)Mdl->HostUserProcess - HostProcesses));
+        }
+        Mdl->HostUserProcess = NULL;
+        HostStats.UserMappings--;
+    }
+}
+
+PEPROCESS PsGetCurrentProcess (VOID)
+{
+    return &HostProcesses[HostProcess];
+}
+
+VOID KeStackAttachProcess (IN PEPROCESS Process, OUT PKAPC_STATE ApcState)
+{
+    if (HostIrql > DISPATCH_LEVEL) {
+        HostBugCheck ("IRQL_NOT_LESS_OR_EQUAL: KeStackAttachProcess at IRQL %u", HostIrql);
+    }
+
+    ApcState->HostProcess = PsGetCurrentProcess ();
+    HostProcess = (ULONG)((PULONG)Process - HostProcesses);
+}
+
+VOID KeUnstackDetachProcess (IN PKAPC_STATE ApcState)
+{
+    HostProcess = (ULONG)((PULONG)ApcState->HostProcess - HostProcesses);
+}
+
+//
+// The only objects the driver references are processes, which outlive it
+//
+VOID ObReferenceObject (IN PVOID Object)
+{
+    UNREFERENCED_PARAMETER(Object);
+    HostStats.ObjectReferences++;
+}
+
+VOID ObDereferenceObject (IN PVOID Object)
+{
+    UNREFERENCED_PARAMETER(Object);
+
+    if (--HostStats.ObjectReferences < 0) {
+        HostBugCheck ("ObDereferenceObject without a reference");
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// HostSetProcess
+//
+// Description:
+//  Switches the process the driver is called in. Called by HostSetCaller.
+//
+// Arguments:
+//      Process - 0 to HOST_MAX_PROCESSES - 1
+//
+// Return Value:
+//      none
+//
+VOID HostSetProcess (IN ULONG Process)
+{
+    if (Process >= HOST_MAX_PROCESSES) {
+        HostBugCheck ("process %u doesn't exist", Process);
+    }
+    HostProcess = Process;
+}
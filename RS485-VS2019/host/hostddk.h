@@ -0,0 +1,709 @@
+//-------------------------------------------------------------------------------------------------
+// HOSTDDK.H
+//
+// BSD 3-Clause License
+// 
+// Copyright (c) 2022, Anthony Kempka
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Description:
+// ------------
+// The part of the Windows DDK (NTDDK.H) the driver uses, implemented on the
+// host by hostddk.c. The host build includes it as NTDDK.H. Only the
+// services Rs485nt.c calls are here, with the semantics it relies on: IRQLs,
+// spin locks, DPCs, timers, the StartIo device queue, IRP cancellation and
+// port I/O, which goes to the UART models.
+//
+//-------------------------------------------------------------------------------------------------
+
+#ifndef _HOSTDDK_H
+#define _HOSTDDK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+//
+// Checked (DBG) or free build, the WDK sets it on the compiler command line
+//
+#ifndef DBG
+#define DBG 0
+#endif
+
+//
+// Annotations and calling conventions
+//
+#define IN
+#define OUT
+#define OPTIONAL
+#define VOID void
+#define NTAPI
+#define _In_
+#define _Out_
+#define _Inout_
+#define __drv_dispatchType(x)
+#define _Function_class_(x)
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define FORCEINLINE static inline
+
+//
+// Structured exception handling: nothing here raises exceptions
+//
+#define __try if (1)
+#define __except(x) else if (0)
+#define EXCEPTION_EXECUTE_HANDLER 1
+
+//
+// Basic types. The driver was written for the 32 bit x86 kernel, ULONG
+// and LONG stay 32 bit on the 64 bit host (WCHAR needs -fshort-wchar).
+//
+typedef unsigned char UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN;
+typedef char CHAR, *PCHAR, CCHAR;
+typedef unsigned short USHORT, *PUSHORT, WCHAR, *PWCHAR, *PWSTR;
+typedef const WCHAR *PCWSTR;
+typedef int32_t LONG, *PLONG, NTSTATUS;
+typedef uint32_t ULONG, *PULONG;
+typedef long long LONGLONG, *PLONGLONG;
+typedef unsigned long long ULONGLONG, *PULONGLONG;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR, KAFFINITY, SIZE_T;
+typedef intptr_t LONG_PTR;
+typedef void *PVOID;
+typedef UCHAR KIRQL, *PKIRQL;
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER, PHYSICAL_ADDRESS, *PPHYSICAL_ADDRESS;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWSTR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+#define TRUE 1
+#define FALSE 0
+#define MAXULONG 0xFFFFFFFFU
+#define MAXLONG 0x7FFFFFFF
+#define UNICODE_NULL ((WCHAR)0)
+
+//
+// Status codes
+//
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT                  ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                  ((NTSTATUS)0x00000103L)
+#define STATUS_SOME_NOT_MAPPED          ((NTSTATUS)0x00000107L)
+#define STATUS_BUFFER_OVERFLOW          ((NTSTATUS)0x80000005L)
+#define STATUS_DEVICE_BUSY              ((NTSTATUS)0x80000011L)
+#define STATUS_NO_MORE_ENTRIES          ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED          ((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_NO_SUCH_DEVICE           ((NTSTATUS)0xC000000EL)
+#define STATUS_INVALID_DEVICE_REQUEST   ((NTSTATUS)0xC0000010L)
+#define STATUS_ACCESS_DENIED            ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_NAME_NOT_FOUND    ((NTSTATUS)0xC0000034L)
+#define STATUS_OBJECT_NAME_COLLISION    ((NTSTATUS)0xC0000035L)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_IO_DEVICE_ERROR          ((NTSTATUS)0xC0000185L)
+#define STATUS_DEVICE_DATA_ERROR        ((NTSTATUS)0xC000009CL)
+#define STATUS_DEVICE_NOT_CONNECTED     ((NTSTATUS)0xC000009DL)
+#define STATUS_IO_TIMEOUT               ((NTSTATUS)0xC00000B5L)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED                ((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_DEVICE_STATE     ((NTSTATUS)0xC0000184L)
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+
+//
+// IRQLs. Device IRQLs (DIRQL) are above DISPATCH_LEVEL.
+//
+#define PASSIVE_LEVEL   0
+#define APC_LEVEL       1
+#define DISPATCH_LEVEL  2
+#define HIGH_LEVEL      31
+
+#define IO_NO_INCREMENT     0
+#define IO_SERIAL_INCREMENT 2
+
+#define FIELD_OFFSET(Type, Field) offsetof(Type, Field)
+#define CONTAINING_RECORD(Address, Type, Field) \
+    ((Type *)((PCHAR)(Address) - offsetof(Type, Field)))
+
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define RtlFillMemory(Destination, Length, Fill) memset((Destination), (Fill), (Length))
+#define RtlMoveMemory(Destination, Source, Length) memmove((Destination), (Source), (Length))
+#define RtlCopyMemory(Destination, Source, Length) memcpy((Destination), (Source), (Length))
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+ULONG DbgPrint (IN const char *Format, ...);
+#define KdPrint(x) DbgPrint x
+#define ASSERT(x) ((x) ? (void)0 : HostBugCheck ("ASSERT %s failed at %s:%d", #x, __FILE__, __LINE__))
+
+//
+// Enumerations
+//
+typedef enum _INTERFACE_TYPE { Internal, Isa, Eisa, MicroChannel, TurboChannel, PCIBus } INTERFACE_TYPE;
+typedef enum _KINTERRUPT_MODE { LevelSensitive, Latched } KINTERRUPT_MODE;
+typedef enum _POOL_TYPE { NonPagedPool, PagedPool, NonPagedPoolNx = 512 } POOL_TYPE;
+typedef enum _KPROCESSOR_MODE { KernelMode, UserMode } KPROCESSOR_MODE, MODE;
+typedef enum _KDPC_IMPORTANCE { LowImportance, MediumImportance, HighImportance, MediumHighImportance } KDPC_IMPORTANCE;
+typedef enum _MEMORY_CACHING_TYPE { MmNonCached, MmCached } MEMORY_CACHING_TYPE;
+typedef enum _MM_PAGE_PRIORITY { LowPagePriority, NormalPagePriority = 16, HighPagePriority = 32 } MM_PAGE_PRIORITY;
+
+#define MdlMappingNoExecute 0x40000000
+#define PAGE_SIZE 4096
+#define ROUND_TO_PAGES(Size) (((ULONG_PTR)(Size) + PAGE_SIZE - 1) & ~((ULONG_PTR)PAGE_SIZE - 1))
+
+//
+// DPCs and timers. Time is simulated, see host.h.
+//
+struct _KDPC;
+typedef VOID KDEFERRED_ROUTINE (IN struct _KDPC *Dpc, IN PVOID DeferredContext,
+                                IN PVOID SystemArgument1, IN PVOID SystemArgument2);
+typedef KDEFERRED_ROUTINE *PKDEFERRED_ROUTINE;
+
+typedef struct _KDPC {
+    LIST_ENTRY DpcListEntry;
+    PKDEFERRED_ROUTINE DeferredRoutine;
+    PVOID DeferredContext;
+    PVOID SystemArgument1;
+    PVOID SystemArgument2;
+    KDPC_IMPORTANCE Importance;
+    CCHAR Number;
+    BOOLEAN Inserted;
+    BOOLEAN HostTargeted;               // KeSetTargetProcessorDpc was called
+    ULONG HostProcessor;                // Where it runs once queued
+    ULONGLONG HostQueueTime;            // When it was queued
+} KDPC, *PKDPC, *PRKDPC;
+
+typedef struct _KTIMER {
+    LIST_ENTRY TimerListEntry;
+    ULONGLONG HostDueTime;              // Simulated time in ns
+    ULONGLONG HostPeriod;               // ns, 0 = one shot
+    BOOLEAN HostHighResolution;         // Not rounded to the clock tick
+    PKDPC Dpc;
+    BOOLEAN Inserted;
+} KTIMER, *PKTIMER;
+
+typedef struct _EX_TIMER *PEX_TIMER;
+typedef VOID EXT_CALLBACK (IN PEX_TIMER Timer, IN PVOID Context);
+typedef EXT_CALLBACK *PEXT_CALLBACK;
+
+typedef struct _EXT_SET_PARAMETERS {
+    ULONG Version;
+    ULONG Reserved;
+    LONGLONG NoWakeTolerance;
+} EXT_SET_PARAMETERS, *PEXT_SET_PARAMETERS;
+
+#define EX_TIMER_HIGH_RESOLUTION 4
+#define EX_TIMER_NO_WAKE 8
+
+typedef struct _EX_TIMER {
+    KTIMER Timer;
+    KDPC Dpc;
+    PEXT_CALLBACK Callback;
+    PVOID Context;
+    ULONG Attributes;
+} EX_TIMER;
+
+//
+// Interrupts
+//
+struct _KINTERRUPT;
+typedef BOOLEAN KSERVICE_ROUTINE (IN struct _KINTERRUPT *Interrupt, IN PVOID ServiceContext);
+typedef KSERVICE_ROUTINE *PKSERVICE_ROUTINE;
+typedef BOOLEAN KSYNCHRONIZE_ROUTINE (IN PVOID SynchronizeContext);
+typedef KSYNCHRONIZE_ROUTINE *PKSYNCHRONIZE_ROUTINE;
+
+typedef struct _KINTERRUPT {
+    PKSERVICE_ROUTINE ServiceRoutine;
+    PVOID ServiceContext;
+    ULONG Vector;
+    KIRQL Irql;
+    BOOLEAN ShareVector;
+    KINTERRUPT_MODE Mode;
+    KAFFINITY Affinity;
+    struct _KINTERRUPT *HostNext;       // Next interrupt object on the vector
+} KINTERRUPT, *PKINTERRUPT;
+
+//
+// Memory descriptor lists. The host has one address space, a mapping is
+// the buffer itself.
+//
+typedef struct _MDL {
+    struct _MDL *Next;
+    PVOID StartVa;
+    PVOID MappedSystemVa;
+    ULONG ByteCount;
+    PVOID HostUserProcess;              // Mapped into this process's user space, NULL = not
+} MDL, *PMDL;
+
+typedef PVOID PEPROCESS;
+
+typedef struct _KAPC_STATE {
+    PEPROCESS HostProcess;              // Where the thread ran before attaching
+} KAPC_STATE, *PKAPC_STATE;
+
+//
+// IRPs and device objects
+//
+typedef struct _KDEVICE_QUEUE_ENTRY {
+    LIST_ENTRY DeviceListEntry;
+    ULONG SortKey;
+    BOOLEAN Inserted;
+} KDEVICE_QUEUE_ENTRY, *PKDEVICE_QUEUE_ENTRY;
+
+typedef struct _KDEVICE_QUEUE {
+    LIST_ENTRY DeviceListHead;
+    BOOLEAN Busy;
+} KDEVICE_QUEUE, *PKDEVICE_QUEUE;
+
+struct _IRP;
+struct _DEVICE_OBJECT;
+struct _DRIVER_OBJECT;
+
+typedef VOID DRIVER_CANCEL (IN struct _DEVICE_OBJECT *DeviceObject, IN struct _IRP *Irp);
+typedef DRIVER_CANCEL *PDRIVER_CANCEL;
+
+typedef struct _IO_STATUS_BLOCK {
+    NTSTATUS Status;
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef struct _FILE_OBJECT {
+    PVOID FsContext;
+    PVOID FsContext2;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _IO_STACK_LOCATION {
+    UCHAR MajorFunction;
+    UCHAR MinorFunction;
+    UCHAR Flags;
+    UCHAR Control;
+    union {
+        struct {
+            ULONG Length;
+            ULONG Key;
+            LARGE_INTEGER ByteOffset;
+        } Read;
+        struct {
+            ULONG Length;
+            ULONG Key;
+            LARGE_INTEGER ByteOffset;
+        } Write;
+        struct {
+            ULONG OutputBufferLength;
+            ULONG InputBufferLength;
+            ULONG IoControlCode;
+            PVOID Type3InputBuffer;
+        } DeviceIoControl;
+    } Parameters;
+    struct _DEVICE_OBJECT *DeviceObject;
+    PFILE_OBJECT FileObject;
+} IO_STACK_LOCATION, *PIO_STACK_LOCATION;
+
+typedef struct _IRP {
+    PMDL MdlAddress;
+    union {
+        struct _IRP *MasterIrp;
+        PVOID SystemBuffer;
+    } AssociatedIrp;
+    IO_STATUS_BLOCK IoStatus;
+    KPROCESSOR_MODE RequestorMode;
+    BOOLEAN PendingReturned;
+    BOOLEAN Cancel;
+    KIRQL CancelIrql;
+    PDRIVER_CANCEL CancelRoutine;
+    PVOID UserBuffer;
+    union {
+        struct {
+            union {
+                KDEVICE_QUEUE_ENTRY DeviceQueueEntry;
+                struct {
+                    PVOID DriverContext[4];
+                };
+            };
+            PVOID Thread;
+            PCHAR AuxiliaryBuffer;
+            struct {
+                LIST_ENTRY ListEntry;
+                PIO_STACK_LOCATION CurrentStackLocation;
+            };
+            PFILE_OBJECT OriginalFileObject;
+        } Overlay;
+    } Tail;
+
+    //
+    // The I/O manager's side (host.c)
+    //
+    IO_STACK_LOCATION HostStack;
+    ULONG HostUserLength;               // Size of the caller's buffer
+    BOOLEAN HostCompleted;
+    ULONGLONG HostCompletionTime;
+} IRP, *PIRP;
+
+typedef struct _DEVICE_OBJECT {
+    struct _DRIVER_OBJECT *DriverObject;
+    struct _DEVICE_OBJECT *NextDevice;
+    PIRP CurrentIrp;
+    ULONG Flags;
+    ULONG DeviceType;
+    BOOLEAN Exclusive;
+    PVOID DeviceExtension;
+    KDEVICE_QUEUE DeviceQueue;
+    KDPC Dpc;
+    WCHAR HostName[64];                 // NT device name
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+typedef NTSTATUS DRIVER_DISPATCH (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
+typedef DRIVER_DISPATCH *PDRIVER_DISPATCH;
+typedef NTSTATUS DRIVER_INITIALIZE (IN struct _DRIVER_OBJECT *DriverObject, IN PUNICODE_STRING RegistryPath);
+typedef VOID DRIVER_UNLOAD (IN struct _DRIVER_OBJECT *DriverObject);
+typedef DRIVER_UNLOAD *PDRIVER_UNLOAD;
+typedef VOID DRIVER_STARTIO (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp);
+typedef DRIVER_STARTIO *PDRIVER_STARTIO;
+typedef VOID IO_DPC_ROUTINE (IN PKDPC Dpc, IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN PVOID Context);
+typedef IO_DPC_ROUTINE *PIO_DPC_ROUTINE;
+
+#define IRP_MJ_CREATE           0x00
+#define IRP_MJ_CLOSE            0x02
+#define IRP_MJ_READ             0x03
+#define IRP_MJ_WRITE            0x04
+#define IRP_MJ_DEVICE_CONTROL   0x0E
+#define IRP_MJ_CLEANUP          0x12
+#define IRP_MJ_MAXIMUM_FUNCTION 0x1B
+
+typedef struct _DRIVER_OBJECT {
+    PDEVICE_OBJECT DeviceObject;
+    PDRIVER_STARTIO DriverStartIo;
+    PDRIVER_UNLOAD DriverUnload;
+    PDRIVER_DISPATCH MajorFunction[IRP_MJ_MAXIMUM_FUNCTION + 1];
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+#define DO_BUFFERED_IO      0x00000004
+#define DO_EXCLUSIVE        0x00000008
+#define DO_DIRECT_IO        0x00000010
+
+#define FILE_DEVICE_UNKNOWN 0x00000022
+
+#define METHOD_BUFFERED     0
+#define METHOD_IN_DIRECT    1
+#define METHOD_OUT_DIRECT   2
+#define METHOD_NEITHER      3
+#define FILE_ANY_ACCESS     0
+#define FILE_READ_ACCESS    1
+#define FILE_WRITE_ACCESS   2
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((ULONG)(DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+//
+// Registry
+//
+#define REG_DWORD                   4
+#define REG_QWORD                   11
+#define RTL_REGISTRY_ABSOLUTE       0
+#define RTL_REGISTRY_OPTIONAL       0x80000000
+#define RTL_QUERY_REGISTRY_SUBKEY   0x00000001
+#define RTL_QUERY_REGISTRY_DIRECT   0x00000020
+
+typedef NTSTATUS RTL_QUERY_REGISTRY_ROUTINE (IN PWSTR ValueName, IN ULONG ValueType,
+                                             IN PVOID ValueData, IN ULONG ValueLength,
+                                             IN PVOID Context, IN PVOID EntryContext);
+
+typedef struct _RTL_QUERY_REGISTRY_TABLE {
+    RTL_QUERY_REGISTRY_ROUTINE *QueryRoutine;
+    ULONG Flags;
+    PWSTR Name;
+    PVOID EntryContext;
+    ULONG DefaultType;
+    PVOID DefaultData;
+    ULONG DefaultLength;
+} RTL_QUERY_REGISTRY_TABLE, *PRTL_QUERY_REGISTRY_TABLE;
+
+//
+// Resource lists (ReportUsage)
+//
+typedef struct _CM_PARTIAL_RESOURCE_DESCRIPTOR {
+    UCHAR Type;
+    UCHAR ShareDisposition;
+    USHORT Flags;
+    union {
+        struct {
+            PHYSICAL_ADDRESS Start;
+            ULONG Length;
+        } Port;
+        struct {
+            ULONG Level;
+            ULONG Vector;
+            KAFFINITY Affinity;
+        } Interrupt;
+    } u;
+} CM_PARTIAL_RESOURCE_DESCRIPTOR, *PCM_PARTIAL_RESOURCE_DESCRIPTOR;
+
+typedef struct _CM_PARTIAL_RESOURCE_LIST {
+    USHORT Version;
+    USHORT Revision;
+    ULONG Count;
+    CM_PARTIAL_RESOURCE_DESCRIPTOR PartialDescriptors[1];
+} CM_PARTIAL_RESOURCE_LIST;
+
+typedef struct _CM_FULL_RESOURCE_DESCRIPTOR {
+    INTERFACE_TYPE InterfaceType;
+    ULONG BusNumber;
+    CM_PARTIAL_RESOURCE_LIST PartialResourceList;
+} CM_FULL_RESOURCE_DESCRIPTOR, *PCM_FULL_RESOURCE_DESCRIPTOR;
+
+typedef struct _CM_RESOURCE_LIST {
+    ULONG Count;
+    CM_FULL_RESOURCE_DESCRIPTOR List[1];
+} CM_RESOURCE_LIST, *PCM_RESOURCE_LIST;
+
+#define CmResourceTypePort              1
+#define CmResourceTypeInterrupt         2
+#define CmResourceShareDriverExclusive  2
+#define CmResourceShareShared           3
+#define CM_RESOURCE_PORT_IO             1
+#define CM_RESOURCE_INTERRUPT_LATCHED   1
+
+//
+// Doubly linked lists
+//
+FORCEINLINE VOID InitializeListHead (OUT PLIST_ENTRY ListHead)
+{
+    ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+FORCEINLINE BOOLEAN IsListEmpty (IN PLIST_ENTRY ListHead)
+{
+    return ListHead->Flink == ListHead;
+}
+
+FORCEINLINE BOOLEAN RemoveEntryList (IN PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY Flink = Entry->Flink;
+    PLIST_ENTRY Blink = Entry->Blink;
+
+    Blink->Flink = Flink;
+    Flink->Blink = Blink;
+    return Flink == Blink;
+}
+
+FORCEINLINE PLIST_ENTRY RemoveHeadList (IN PLIST_ENTRY ListHead)
+{
+    PLIST_ENTRY Entry = ListHead->Flink;
+
+    RemoveEntryList (Entry);
+    return Entry;
+}
+
+FORCEINLINE VOID InsertTailList (IN PLIST_ENTRY ListHead, IN PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead;
+    Entry->Blink = ListHead->Blink;
+    ListHead->Blink->Flink = Entry;
+    ListHead->Blink = Entry;
+}
+
+FORCEINLINE VOID InsertHeadList (IN PLIST_ENTRY ListHead, IN PLIST_ENTRY Entry)
+{
+    Entry->Flink = ListHead->Flink;
+    Entry->Blink = ListHead;
+    ListHead->Flink->Blink = Entry;
+    ListHead->Flink = Entry;
+}
+
+//
+// Interlocked operations and barriers
+//
+#define InterlockedIncrement(Target) __atomic_add_fetch ((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(Target) __atomic_sub_fetch ((Target), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchange(Target, Value) __atomic_exchange_n ((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(Target, Value) __atomic_fetch_add ((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedOr(Target, Value) __atomic_fetch_or ((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedAnd(Target, Value) __atomic_fetch_and ((Target), (Value), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64 InterlockedIncrement
+#define InterlockedExchange64 InterlockedExchange
+#define InterlockedExchangeAdd64 InterlockedExchangeAdd
+
+FORCEINLINE LONG InterlockedCompareExchange (volatile LONG *Target, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n (Target, &Comparand, Exchange, FALSE,
+                                 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONGLONG InterlockedCompareExchange64 (volatile LONGLONG *Target, LONGLONG Exchange,
+                                                   LONGLONG Comparand)
+{
+    __atomic_compare_exchange_n (Target, &Comparand, Exchange, FALSE,
+                                 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+#define KeMemoryBarrier() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
+//
+// Executive, kernel, HAL, I/O manager and memory manager services the
+// driver uses (hostddk.c)
+//
+PVOID ExAllocatePoolWithTag (IN POOL_TYPE PoolType, IN SIZE_T NumberOfBytes, IN ULONG Tag);
+VOID ExFreePool (IN PVOID P);
+VOID ExFreePoolWithTag (IN PVOID P, IN ULONG Tag);
+
+PEX_TIMER ExAllocateTimer (IN PEXT_CALLBACK Callback, IN PVOID CallbackContext, IN ULONG Attributes);
+BOOLEAN ExSetTimer (IN PEX_TIMER Timer, IN LONGLONG DueTime, IN LONGLONG Period,
+                    IN PEXT_SET_PARAMETERS Parameters);
+BOOLEAN ExCancelTimer (IN PEX_TIMER Timer, IN PVOID Parameters);
+BOOLEAN ExDeleteTimer (IN PEX_TIMER Timer, IN BOOLEAN Cancel, IN BOOLEAN Wait, IN PVOID Parameters);
+VOID ExInitializeSetTimerParameters (OUT PEXT_SET_PARAMETERS Parameters);
+
+VOID RtlInitUnicodeString (OUT PUNICODE_STRING DestinationString, IN PCWSTR SourceString);
+NTSTATUS RtlAppendUnicodeToString (IN OUT PUNICODE_STRING Destination, IN PCWSTR Source);
+NTSTATUS RtlAppendUnicodeStringToString (IN OUT PUNICODE_STRING Destination, IN PUNICODE_STRING Source);
+NTSTATUS RtlIntegerToUnicodeString (IN ULONG Value, IN ULONG Base, IN OUT PUNICODE_STRING String);
+NTSTATUS RtlQueryRegistryValues (IN ULONG RelativeTo, IN PCWSTR Path,
+                                 IN PRTL_QUERY_REGISTRY_TABLE QueryTable,
+                                 IN PVOID Context, IN PVOID Environment);
+NTSTATUS RtlCheckRegistryKey (IN ULONG RelativeTo, IN PWSTR Path);
+
+KIRQL KeGetCurrentIrql (VOID);
+VOID KeRaiseIrql (IN KIRQL NewIrql, OUT PKIRQL OldIrql);
+VOID KeLowerIrql (IN KIRQL NewIrql);
+VOID KeInitializeSpinLock (OUT PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLock (IN PKSPIN_LOCK SpinLock, OUT PKIRQL OldIrql);
+VOID KeReleaseSpinLock (IN PKSPIN_LOCK SpinLock, IN KIRQL NewIrql);
+VOID KeAcquireSpinLockAtDpcLevel (IN PKSPIN_LOCK SpinLock);
+VOID KeReleaseSpinLockFromDpcLevel (IN PKSPIN_LOCK SpinLock);
+BOOLEAN KeSynchronizeExecution (IN PKINTERRUPT Interrupt,
+                                IN PKSYNCHRONIZE_ROUTINE SynchronizeRoutine,
+                                IN PVOID SynchronizeContext);
+
+VOID KeInitializeDpc (OUT PKDPC Dpc, IN PKDEFERRED_ROUTINE DeferredRoutine, IN PVOID DeferredContext);
+BOOLEAN KeInsertQueueDpc (IN PKDPC Dpc, IN PVOID SystemArgument1, IN PVOID SystemArgument2);
+BOOLEAN KeRemoveQueueDpc (IN PKDPC Dpc);
+VOID KeFlushQueuedDpcs (VOID);
+VOID KeSetImportanceDpc (IN PKDPC Dpc, IN KDPC_IMPORTANCE Importance);
+VOID KeSetTargetProcessorDpc (IN PKDPC Dpc, IN CCHAR Number);
+VOID KeInitializeTimer (OUT PKTIMER Timer);
+BOOLEAN KeSetTimer (IN PKTIMER Timer, IN LARGE_INTEGER DueTime, IN PKDPC Dpc);
+BOOLEAN KeCancelTimer (IN PKTIMER Timer);
+
+VOID KeQuerySystemTime (OUT PLARGE_INTEGER CurrentTime);
+ULONGLONG KeQueryInterruptTime (VOID);
+LARGE_INTEGER KeQueryPerformanceCounter (OUT PLARGE_INTEGER PerformanceFrequency);
+VOID KeStallExecutionProcessor (IN ULONG MicroSeconds);
+ULONG KeGetCurrentProcessorNumber (VOID);
+ULONG KeQueryActiveProcessorCount (OUT KAFFINITY *ActiveProcessors);
+KAFFINITY KeQueryActiveProcessors (VOID);
+
+ULONG HalGetInterruptVector (IN INTERFACE_TYPE InterfaceType, IN ULONG BusNumber,
+                             IN ULONG BusInterruptLevel, IN ULONG BusInterruptVector,
+                             OUT PKIRQL Irql, OUT KAFFINITY *Affinity);
+BOOLEAN HalTranslateBusAddress (IN INTERFACE_TYPE InterfaceType, IN ULONG BusNumber,
+                                IN PHYSICAL_ADDRESS BusAddress, IN OUT PULONG AddressSpace,
+                                OUT PPHYSICAL_ADDRESS TranslatedAddress);
+
+UCHAR READ_PORT_UCHAR (IN PUCHAR Port);
+VOID WRITE_PORT_UCHAR (IN PUCHAR Port, IN UCHAR Value);
+
+NTSTATUS IoCreateDevice (IN PDRIVER_OBJECT DriverObject, IN ULONG DeviceExtensionSize,
+                         IN PUNICODE_STRING DeviceName, IN ULONG DeviceType,
+                         IN ULONG DeviceCharacteristics, IN BOOLEAN Exclusive,
+                         OUT PDEVICE_OBJECT *DeviceObject);
+VOID IoDeleteDevice (IN PDEVICE_OBJECT DeviceObject);
+NTSTATUS IoCreateSymbolicLink (IN PUNICODE_STRING SymbolicLinkName, IN PUNICODE_STRING DeviceName);
+NTSTATUS IoDeleteSymbolicLink (IN PUNICODE_STRING SymbolicLinkName);
+NTSTATUS IoConnectInterrupt (OUT PKINTERRUPT *InterruptObject, IN PKSERVICE_ROUTINE ServiceRoutine,
+                             IN PVOID ServiceContext, IN PKSPIN_LOCK SpinLock, IN ULONG Vector,
+                             IN KIRQL Irql, IN KIRQL SynchronizeIrql,
+                             IN KINTERRUPT_MODE InterruptMode, IN BOOLEAN ShareVector,
+                             IN KAFFINITY ProcessorEnableMask, IN BOOLEAN FloatingSave);
+VOID IoDisconnectInterrupt (IN PKINTERRUPT InterruptObject);
+NTSTATUS IoReportResourceForDetection (IN PDRIVER_OBJECT DriverObject,
+                                       IN PCM_RESOURCE_LIST DriverList, IN ULONG DriverListSize,
+                                       IN PDEVICE_OBJECT DeviceObject,
+                                       IN PCM_RESOURCE_LIST DeviceList, IN ULONG DeviceListSize,
+                                       OUT PBOOLEAN ConflictDetected);
+
+VOID IoInitializeDpcRequest (IN PDEVICE_OBJECT DeviceObject, IN PIO_DPC_ROUTINE DpcRoutine);
+#define IoRequestDpc(DeviceObject, Irp, Context) \
+    KeInsertQueueDpc (&(DeviceObject)->Dpc, (Irp), (Context))
+
+#define IoGetCurrentIrpStackLocation(Irp) ((Irp)->Tail.Overlay.CurrentStackLocation)
+#define IoMarkIrpPending(Irp) ((Irp)->PendingReturned = TRUE)
+VOID IoCompleteRequest (IN PIRP Irp, IN CCHAR PriorityBoost);
+VOID IoStartPacket (IN PDEVICE_OBJECT DeviceObject, IN PIRP Irp, IN PULONG Key,
+                    IN PDRIVER_CANCEL CancelFunction);
+VOID IoStartNextPacket (IN PDEVICE_OBJECT DeviceObject, IN BOOLEAN Cancelable);
+PDRIVER_CANCEL IoSetCancelRoutine (IN PIRP Irp, IN PDRIVER_CANCEL CancelRoutine);
+VOID IoAcquireCancelSpinLock (OUT PKIRQL Irql);
+VOID IoReleaseCancelSpinLock (IN KIRQL Irql);
+BOOLEAN KeRemoveEntryDeviceQueue (IN PKDEVICE_QUEUE DeviceQueue,
+                                  IN PKDEVICE_QUEUE_ENTRY DeviceQueueEntry);
+
+PMDL IoAllocateMdl (IN PVOID VirtualAddress, IN ULONG Length, IN BOOLEAN SecondaryBuffer,
+                    IN BOOLEAN ChargeQuota, IN PIRP Irp);
+VOID IoFreeMdl (IN PMDL Mdl);
+VOID MmBuildMdlForNonPagedPool (IN PMDL Mdl);
+PVOID MmGetSystemAddressForMdlSafe (IN PMDL Mdl, IN ULONG Priority);
+PVOID MmMapLockedPagesSpecifyCache (IN PMDL Mdl, IN KPROCESSOR_MODE AccessMode,
+                                    IN MEMORY_CACHING_TYPE CacheType, IN PVOID RequestedAddress,
+                                    IN ULONG BugCheckOnFailure, IN ULONG Priority);
+VOID MmUnmapLockedPages (IN PVOID BaseAddress, IN PMDL Mdl);
+PEPROCESS PsGetCurrentProcess (VOID);
+VOID KeStackAttachProcess (IN PEPROCESS Process, OUT PKAPC_STATE ApcState);
+VOID KeUnstackDetachProcess (IN PKAPC_STATE ApcState);
+VOID ObReferenceObject (IN PVOID Object);
+VOID ObDereferenceObject (IN PVOID Object);
+
+//
+// Stops the simulation, the host's blue screen
+//
+VOID HostBugCheck (IN const char *Format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+#endif // _HOSTDDK_H
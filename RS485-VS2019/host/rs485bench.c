@@ -0,0 +1,475 @@
+//-------------------------------------------------------------------------------------------------
+// RS485BENCH.C
+//
+// BSD 3-Clause License
+// 
+// Copyright (c) 2022, Anthony Kempka
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Description:
+// ------------
+// Throughput and interrupt cost benchmark for the host build. Sweeps baud
+// rate, read/write size, RX FIFO trigger level and buffer size, moving data
+// in both directions through the driver on a simulated 16550, and prints one
+// CSV line (or JSON object with --json) per run: bytes/s, interrupts and ISR
+// cycles per byte, dropped bytes and RTS turnaround dead time.
+//
+// Everything but the ISR cycle counts is in simulated time, so two driver
+// revisions can be compared run for run. ISR cycles are measured on the
+// host and vary a little between runs.
+//
+//-------------------------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hostddk.h"
+#include "../Com8250.h"
+#include "../Rs485ioc.h"
+#include "host.h"
+
+#define BENCH_BYTES         4096        // Bytes moved per run
+#define BENCH_LCR_8N1       0x03
+#define BENCH_CLOCK_FAST    14745600    // Clock Rate above 115200 baud
+
+//
+// Sweep axes
+//
+static const ULONG BenchBauds[] = { 9600, 19200, 115200, 460800 };
+static const ULONG BenchFrames[] = { 16, 64, 256, 1024 };
+static const ULONG BenchTriggers[] = { 0, 1, 4, 8, 14 };
+static const ULONG BenchBuffers[] = { 256, 4096 };
+
+static const ULONG QuickBauds[] = { 19200, 115200 };
+static const ULONG QuickFrames[] = { 64 };
+static const ULONG QuickTriggers[] = { 1, 8 };
+static const ULONG QuickBuffers[] = { 2048 };
+
+typedef struct _BENCH_AXIS {
+    const ULONG *Values;
+    ULONG       Count;
+} BENCH_AXIS;
+
+#define BENCH_AXIS_OF(Array) { Array, sizeof(Array) / sizeof(Array[0]) }
+
+//
+// One run's setup and results
+//
+typedef struct _BENCH_RUN {
+    BOOLEAN     Receive;            // Peer to driver, else driver to bus
+    ULONG       BaudRate;
+    ULONG       FrameSize;          // WriteFile / ReadFile size
+    ULONG       RxTrigger;
+    ULONG       BufferSize;
+
+    const char  *Result;            // "ok" or what went wrong
+    ULONG       Bytes;              // Delivered
+    ULONG       Dropped;
+    ULONGLONG   Elapsed;            // ns
+    ULONGLONG   Interrupts;
+    ULONGLONG   IsrCycles;
+    ULONGLONG   RingFullDrops;
+    ULONGLONG   OverrunErrors;
+    ULONGLONG   RtsReleases;
+    ULONGLONG   RtsDeadTime;
+    ULONGLONG   RtsDeadMax;
+} BENCH_RUN, *PBENCH_RUN;
+
+typedef struct _BENCH_CAPTURE {
+    PUART16550  Source;
+    ULONG       Count;
+} BENCH_CAPTURE, *PBENCH_CAPTURE;
+
+static BOOLEAN BenchJson;
+static ULONGLONG BenchAppLatency = 500 * HOST_NS_PER_US;
+static ULONG BenchPollMode;             // "Rx Poll Mode"
+static HOST_CONFIG BenchConfig = {
+    10 * HOST_NS_PER_US,            // InterruptLatency
+    50 * HOST_NS_PER_US,            // DpcLatency
+    HOST_CLOCK_TICK,
+    FALSE
+};
+
+
+//---------------------------------------------------------------------------
+// BenchMonitor
+//
+// Description:
+//  Bus monitor: counts the characters the port under test drives.
+//
+static VOID BenchMonitor (IN PUART_BUS Bus, IN PUART16550 Source, IN UCHAR Data,
+                          IN UCHAR Flags, IN ULONGLONG Time, IN PVOID Context)
+{
+    PBENCH_CAPTURE Capture = Context;
+
+    if (Source == Capture->Source) {
+        Capture->Count++;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// BenchTransmit / BenchReceive
+//
+// Description:
+//  BenchTransmit writes BENCH_BYTES in FrameSize writes, one at a time,
+//  each waiting for the driver to complete it after RTS is released.
+//  BenchReceive has the other end stream BENCH_BYTES back to back while
+//  the application reads them FrameSize at a time. Both wait
+//  BenchAppLatency between calls for the application to come back.
+//
+// Arguments:
+//      Run     - Setup, and returns the results
+//      Device  - The opened port
+//      Bus     - Its bus
+//      Uart    - Its UART
+//
+// Return Value:
+//      none
+//
+static VOID BenchTransmit (IN OUT PBENCH_RUN Run, IN PDEVICE_OBJECT Device,
+                           IN PUART_BUS Bus, IN PUART16550 Uart)
+{
+    static BENCH_CAPTURE Capture;
+    UCHAR       Frame[1024];
+    ULONG_PTR   Information;
+    NTSTATUS    Status;
+    ULONGLONG   Start;
+    ULONG       Sent, i;
+
+    for (i = 0; i < Run->FrameSize; i++) {
+        Frame[i] = (UCHAR)i;
+    }
+
+    Capture.Source = Uart;
+    Capture.Count = 0;
+    Bus->Monitor = BenchMonitor;
+    Bus->MonitorContext = &Capture;
+
+    Start = HostTime ();
+
+    for (Sent = 0; Sent < BENCH_BYTES; Sent += Run->FrameSize) {
+        Status = HostCall (HostWrite (Device, Frame, Run->FrameSize), &Information);
+        if (!NT_SUCCESS (Status) || (Information != Run->FrameSize)) {
+            Run->Result = "write failed";
+            break;
+        }
+
+        Run->Elapsed = HostTime () - Start;
+        HostRun (BenchAppLatency);
+    }
+
+    Bus->Monitor = NULL;
+
+    Run->Bytes = Capture.Count - (ULONG)(Uart->Stats.Truncated + Uart->Stats.Undriven);
+    Run->Dropped = Sent - Run->Bytes;
+}
+
+static VOID BenchReceive (IN OUT PBENCH_RUN Run, IN PDEVICE_OBJECT Device,
+                          IN PUART_BUS Bus, IN PUART16550 Uart)
+{
+    static UCHAR Data[BENCH_BYTES];
+    RS485NT_TIMEOUTS Timeouts;
+    ULONG_PTR   Information;
+    NTSTATUS    Status;
+    ULONGLONG   Start;
+    ULONG       Length, i;
+
+    UNREFERENCED_PARAMETER(Uart);
+
+    //
+    // Wait for a whole frame, giving up 20ms after the last byte, or
+    // after 100ms if nothing comes
+    //
+    Timeouts.ReadIntervalTimeout = 20;
+    Timeouts.ReadTotalTimeoutMultiplier = 0;
+    Timeouts.ReadTotalTimeoutConstant = 100;
+    Status = HostCall (HostIoctl (Device, IOCTL_RS485NT_SET_TIMEOUTS, &Timeouts,
+                                  sizeof(Timeouts), NULL, 0), NULL);
+    if (!NT_SUCCESS (Status)) {
+        Run->Result = "SET_TIMEOUTS failed";
+        return;
+    }
+
+    for (i = 0; i < BENCH_BYTES; i++) {
+        Data[i] = (UCHAR)i;
+    }
+
+    Start = HostTime ();
+    UartBusSend (Bus, Data, BENCH_BYTES, Start, Run->BaudRate, BENCH_LCR_8N1);
+
+    //
+    // The last read asks for just what's left, so it completes on the
+    // last byte unless bytes were lost
+    //
+    while (Run->Bytes < BENCH_BYTES) {
+        Length = BENCH_BYTES - Run->Bytes;
+        if (Length > Run->FrameSize) {
+            Length = Run->FrameSize;
+        }
+
+        Status = HostCall (HostRead (Device, Data, Length), &Information);
+        if (!NT_SUCCESS (Status)) {
+            Run->Result = "read failed";
+            break;
+        }
+        if (Information == 0) {
+            break;
+        }
+
+        Run->Bytes += (ULONG)Information;
+        Run->Elapsed = HostTime () - Start;
+        HostRun (BenchAppLatency);
+    }
+
+    Run->Dropped = BENCH_BYTES - Run->Bytes;
+}
+
+
+//---------------------------------------------------------------------------
+// BenchRun
+//
+// Description:
+//  Loads the driver on a fresh machine with one port set up for the run,
+//  moves the data and collects the counters.
+//
+// Arguments:
+//      Run     - Setup, and returns the results
+//
+// Return Value:
+//      none
+//
+static VOID BenchRun (IN OUT PBENCH_RUN Run)
+{
+    static UART_BUS Bus;
+    RS485NT_STATS   Stats;
+    HOST_STATS      Before;
+    PDEVICE_OBJECT  Device;
+    PUART16550      Uart;
+    ULONG           Clock;
+    NTSTATUS        Status;
+
+    Run->Result = "ok";
+
+    Clock = (Run->BaudRate > 115200) ? BENCH_CLOCK_FAST : UART_CLOCK_1_8432_MHZ;
+
+    HostReset (&BenchConfig);
+    UartBusInitialize (&Bus);
+    Uart = HostAddUart (0x3F8, 4, Clock, &Bus);
+
+    HostSetParameter (0, "Port Address", 0x3F8);
+    HostSetParameter (0, "IRQ Line", 4);
+    HostSetParameter (0, "Clock Rate", Clock);
+    HostSetParameter (0, "Baud Rate", Run->BaudRate);
+    HostSetParameter (0, "Rx Trigger Level", Run->RxTrigger);
+    HostSetParameter (0, "Buffer Size", Run->BufferSize);
+    HostSetParameter (0, "Rx Poll Mode", BenchPollMode);
+
+    Status = HostLoadDriver ();
+    if (!NT_SUCCESS (Status)) {
+        Run->Result = "load failed";
+        return;
+    }
+
+    Device = HostOpenDevice (0);
+    if (Device == NULL) {
+        Run->Result = "open failed";
+        HostUnloadDriver ();
+        return;
+    }
+
+    //
+    // Count from here, not from loading and opening
+    //
+    Before = HostStats;
+
+    if (Run->Receive) {
+        BenchReceive (Run, Device, &Bus, Uart);
+    } else {
+        BenchTransmit (Run, Device, &Bus, Uart);
+    }
+
+    Run->Interrupts = HostStats.Interrupts - Before.Interrupts;
+    Run->IsrCycles = HostStats.IsrCycles - Before.IsrCycles;
+    Run->RtsReleases = Uart->Stats.RtsReleases;
+    Run->RtsDeadTime = Uart->Stats.RtsDeadTime;
+    Run->RtsDeadMax = Uart->Stats.RtsDeadMax;
+
+    Status = HostCall (HostIoctl (Device, IOCTL_RS485NT_GET_STATS, NULL, 0,
+                                  &Stats, sizeof(Stats)), NULL);
+    if (NT_SUCCESS (Status)) {
+        Run->RingFullDrops = Stats.RingFullDrops;
+        Run->OverrunErrors = Stats.OverrunErrors;
+    }
+
+    HostCloseDevice (Device);
+    HostUnloadDriver ();
+
+    if (HostKernelCheck () != 0) {
+        Run->Result = "driver left the kernel dirty";
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// BenchPrint
+//
+// Description:
+//  Prints one run as a CSV line, or a JSON object in an array.
+//
+// Arguments:
+//      Run     - The run
+//      First   - It's the first run
+//
+// Return Value:
+//      none
+//
+static VOID BenchPrint (IN PBENCH_RUN Run, IN BOOLEAN First)
+{
+    double  Seconds = (double)Run->Elapsed / HOST_NS_PER_SECOND;
+    double  Bytes = Run->Bytes ? (double)Run->Bytes : 1.0;
+    double  DeadAverage = Run->RtsReleases ? (double)Run->RtsDeadTime / Run->RtsReleases : 0.0;
+
+    if (!BenchJson) {
+        if (First) {
+            printf ("direction,baud,frame,rx_trigger,buffer,result,bytes,seconds,bytes_per_sec,"
+                    "line_utilization,interrupts,interrupts_per_byte,isr_cycles_per_byte,"
+                    "dropped,ring_full_drops,overruns,rts_dead_avg_ns,rts_dead_max_ns\n");
+        }
+
+        printf ("%s,%u,%u,%u,%u,%s,%u,%.6f,%.1f,%.4f,%llu,%.4f,%.1f,%u,%llu,%llu,%.0f,%llu\n",
+                Run->Receive ? "rx" : "tx", Run->BaudRate, Run->FrameSize, Run->RxTrigger,
+                Run->BufferSize, Run->Result, Run->Bytes, Seconds,
+                Seconds > 0 ? Run->Bytes / Seconds : 0.0,
+                Seconds > 0 ? (Run->Bytes * 10.0) / (Seconds * Run->BaudRate) : 0.0,
+                Run->Interrupts, Run->Interrupts / Bytes, Run->IsrCycles / Bytes,
+                Run->Dropped, Run->RingFullDrops, Run->OverrunErrors,
+                DeadAverage, Run->RtsDeadMax);
+        return;
+    }
+
+    printf ("%s\n  {\"direction\": \"%s\", \"baud\": %u, \"frame\": %u, \"rx_trigger\": %u, "
+            "\"buffer\": %u, \"result\": \"%s\", \"bytes\": %u, \"seconds\": %.6f, "
+            "\"bytes_per_sec\": %.1f, \"line_utilization\": %.4f, \"interrupts\": %llu, "
+            "\"interrupts_per_byte\": %.4f, \"isr_cycles_per_byte\": %.1f, \"dropped\": %u, "
+            "\"ring_full_drops\": %llu, \"overruns\": %llu, \"rts_dead_avg_ns\": %.0f, "
+            "\"rts_dead_max_ns\": %llu}",
+            First ? "[" : ",",
+            Run->Receive ? "rx" : "tx", Run->BaudRate, Run->FrameSize, Run->RxTrigger,
+            Run->BufferSize, Run->Result, Run->Bytes, Seconds,
+            Seconds > 0 ? Run->Bytes / Seconds : 0.0,
+            Seconds > 0 ? (Run->Bytes * 10.0) / (Seconds * Run->BaudRate) : 0.0,
+            Run->Interrupts, Run->Interrupts / Bytes, Run->IsrCycles / Bytes,
+            Run->Dropped, Run->RingFullDrops, Run->OverrunErrors,
+            DeadAverage, Run->RtsDeadMax);
+}
+
+
+static VOID BenchUsage (VOID)
+{
+    fprintf (stderr,
+             "usage: rs485bench [--json] [--quick] [--interrupt-latency us]\n"
+             "                  [--dpc-latency us] [--app-latency us] [--poll-mode n]\n");
+    exit (2);
+}
+
+
+int main (int argc, char *argv[])
+{
+    BENCH_AXIS  Bauds = BENCH_AXIS_OF(BenchBauds);
+    BENCH_AXIS  Frames = BENCH_AXIS_OF(BenchFrames);
+    BENCH_AXIS  Triggers = BENCH_AXIS_OF(BenchTriggers);
+    BENCH_AXIS  Buffers = BENCH_AXIS_OF(BenchBuffers);
+    BENCH_AXIS  Quick[4] = { BENCH_AXIS_OF(QuickBauds), BENCH_AXIS_OF(QuickFrames),
+                             BENCH_AXIS_OF(QuickTriggers), BENCH_AXIS_OF(QuickBuffers) };
+    BENCH_RUN   Run;
+    BOOLEAN     First = TRUE;
+    ULONG       Failures = 0;
+    ULONG       Direction, Baud, Trigger, Buffer, Frame;
+    int         i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp (argv[i], "--json")) {
+            BenchJson = TRUE;
+        } else if (!strcmp (argv[i], "--quick")) {
+            Bauds = Quick[0];
+            Frames = Quick[1];
+            Triggers = Quick[2];
+            Buffers = Quick[3];
+        } else if ((i + 1 < argc) && !strcmp (argv[i], "--interrupt-latency")) {
+            BenchConfig.InterruptLatency = strtoull (argv[++i], NULL, 0) * HOST_NS_PER_US;
+        } else if ((i + 1 < argc) && !strcmp (argv[i], "--dpc-latency")) {
+            BenchConfig.DpcLatency = strtoull (argv[++i], NULL, 0) * HOST_NS_PER_US;
+        } else if ((i + 1 < argc) && !strcmp (argv[i], "--app-latency")) {
+            BenchAppLatency = strtoull (argv[++i], NULL, 0) * HOST_NS_PER_US;
+        } else if ((i + 1 < argc) && !strcmp (argv[i], "--poll-mode")) {
+            BenchPollMode = strtoul (argv[++i], NULL, 0);
+        } else {
+            BenchUsage ();
+        }
+    }
+
+    for (Direction = 0; Direction < 2; Direction++) {
+        for (Baud = 0; Baud < Bauds.Count; Baud++) {
+            for (Trigger = 0; Trigger < Triggers.Count; Trigger++) {
+                for (Buffer = 0; Buffer < Buffers.Count; Buffer++) {
+                    for (Frame = 0; Frame < Frames.Count; Frame++) {
+                        RtlZeroMemory (&Run, sizeof(Run));
+                        Run.Receive = (BOOLEAN)Direction;
+                        Run.BaudRate = Bauds.Values[Baud];
+                        Run.RxTrigger = Triggers.Values[Trigger];
+                        Run.BufferSize = Buffers.Values[Buffer];
+                        Run.FrameSize = Frames.Values[Frame];
+
+                        //
+                        // Buffered writes must be smaller than the buffer
+                        //
+                        if (!Run.Receive && (Run.FrameSize >= Run.BufferSize)) {
+                            continue;
+                        }
+
+                        BenchRun (&Run);
+                        BenchPrint (&Run, First);
+                        First = FALSE;
+
+                        if (strcmp (Run.Result, "ok")) {
+                            Failures++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    if (BenchJson) {
+        printf ("%s\n", First ? "[]" : "\n]");
+    }
+
+    return Failures ? 1 : 0;
+}
@@ -0,0 +1,691 @@
+//-------------------------------------------------------------------------------------------------
+// RS485SIM.C
+//
+// BSD 3-Clause License
+// 
+// Copyright (c) 2022, Anthony Kempka
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Description:
+// ------------
+// Smoke test for the host build: loads the driver on the simulated
+// machine, writes a frame and reads a reply on a few port setups, and checks
+// what went over the bus and that the driver cleaned up after itself.
+//
+//-------------------------------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hostddk.h"
+#include "../Com8250.h"
+#include "../Rs485ioc.h"
+#include "../Rs485nt.h"
+#include "host.h"
+
+#define SIM_FRAME_SIZE      64
+#define SIM_LCR_8N1         0x03
+#define SIM_BUSY_BYTES      2048            // The bus queues 4096 remote characters
+#define SIM_BUSY_CHUNKS     16              // Over 2.5 seconds at 115200 baud
+#define SIM_IDLE_HOURS      26              // Scaled to 100ns, the ticks overflow
+#define SIM_LOAD_TEST_BYTES 32              // "Self Test"
+
+//
+// One run of the smoke test
+//
+typedef struct _SIM_SCENARIO {
+    const char  *Name;
+    ULONG       BaudRate;
+    ULONG       RxTrigger;          // "Rx Trigger Level", 0 = FIFO off
+    ULONG       Irq;
+    BOOLEAN     TwoPorts;           // Port 1 shares the IRQ and bus, and reads
+    ULONG       EchoMode;           // "Echo Mode", ECHO_MODE_xxx
+    ULONG       BusIdleChars;       // "Bus Idle Chars", 0 = transmit right away
+    ULONG       PollMode;           // "Rx Poll Mode", POLL_MODE_xxx
+    BOOLEAN     Pinned;             // ISR on processor 1, DPC on processor 3
+    ULONG       UptimeHours;        // Since boot when the driver loads
+} SIM_SCENARIO, *PSIM_SCENARIO;
+
+//
+// What the bus monitor saw
+//
+typedef struct _SIM_CAPTURE {
+    PUART16550  Source;
+    UCHAR       Data[SIM_FRAME_SIZE * 4];
+    ULONG       Count;
+} SIM_CAPTURE, *PSIM_CAPTURE;
+
+static const SIM_SCENARIO SimScenarios[] = {
+    { "fifo-115200",    115200, 8, 4, FALSE, ECHO_MODE_BUFFER, 0, POLL_MODE_OFF,      FALSE, 0  },
+    { "nofifo-19200",   19200,  0, 3, FALSE, ECHO_MODE_BUFFER, 0, POLL_MODE_OFF,      FALSE, 0  },
+    { "shared-irq",     38400,  8, 3, TRUE,  ECHO_MODE_BUFFER, 0, POLL_MODE_OFF,      FALSE, 0  },
+    { "echo-gate",      115200, 8, 4, FALSE, ECHO_MODE_GATE,   0, POLL_MODE_OFF,      FALSE, 0  },
+    { "echo-verify",    115200, 8, 4, FALSE, ECHO_MODE_VERIFY, 0, POLL_MODE_OFF,      FALSE, 0  },
+    { "listen-first",   115200, 8, 4, FALSE, ECHO_MODE_VERIFY, 4, POLL_MODE_OFF,      FALSE, 0  },
+    { "poll-adaptive",  115200, 1, 4, FALSE, ECHO_MODE_BUFFER, 0, POLL_MODE_ADAPTIVE, FALSE, 0  },
+    { "poll-only",      115200, 8, 4, FALSE, ECHO_MODE_BUFFER, 0, POLL_MODE_ALWAYS,   FALSE, 0  },
+    { "pinned",         115200, 8, 4, FALSE, ECHO_MODE_BUFFER, 0, POLL_MODE_OFF,      TRUE,  0  },
+    { "listen-40h",     115200, 8, 4, FALSE, ECHO_MODE_VERIFY, 4, POLL_MODE_OFF,      FALSE, 40 },
+    { "poll-40h",       115200, 1, 4, FALSE, ECHO_MODE_BUFFER, 0, POLL_MODE_ADAPTIVE, FALSE, 40 },
+};
+
+//
+// The machine has four processors, by default everything runs on 0.
+// Pinned, they are numbered 0, 1, 3 and 4: processor 2 doesn't exist.
+//
+#define SIM_PROCESSORS      4
+#define SIM_PINNED_ACTIVE   0x1BU
+#define SIM_MISSING_CPU     2
+
+static HOST_CONFIG SimConfig = {
+    0,                              // InterruptLatency
+    0,                              // DpcLatency
+    HOST_CLOCK_TICK,
+    FALSE,
+    SIM_PROCESSORS
+};
+
+static ULONG SimFailures;
+
+#define SIM_CHECK(Condition, ...)                                   \
+    do {                                                            \
+        if (!(Condition)) {                                         \
+            printf ("  FAIL: ");                                    \
+            printf (__VA_ARGS__);                                   \
+            printf ("\n");                                          \
+            SimFailures++;                                          \
+        }                                                           \
+    } while (0)
+
+
+//---------------------------------------------------------------------------
+// SimMonitor
+//
+// Description:
+//  Bus monitor: records the characters a given UART drives.
+//
+static VOID SimMonitor (IN PUART_BUS Bus, IN PUART16550 Source, IN UCHAR Data,
+                        IN UCHAR Flags, IN ULONGLONG Time, IN PVOID Context)
+{
+    PSIM_CAPTURE Capture = Context;
+
+    if ((Source == Capture->Source) && (Capture->Count < sizeof(Capture->Data))) {
+        Capture->Data[Capture->Count++] = Data;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// SimForeignIsr
+//
+// Description:
+//  Another driver's device on the shared IRQ line, never the one asking.
+//
+static BOOLEAN SimForeignIsr (IN PKINTERRUPT Interrupt, IN PVOID Context)
+{
+    UNREFERENCED_PARAMETER(Interrupt);
+    UNREFERENCED_PARAMETER(Context);
+
+    return FALSE;
+}
+
+
+//---------------------------------------------------------------------------
+// SimRun
+//
+// Description:
+//  Loads the driver on a fresh machine, writes a frame and checks it went
+//  out on the bus intact, then has the other end reply and reads the
+//  reply back.
+//
+// Arguments:
+//      Scenario    - Port setup
+//
+// Return Value:
+//      none
+//
+static VOID SimRun (IN const SIM_SCENARIO *Scenario)
+{
+    static UART_BUS Bus;
+    static SIM_CAPTURE Capture;
+    static UCHAR    Busy[SIM_BUSY_BYTES];
+    RS485NT_TIMEOUTS Timeouts;
+    RS485NT_STATS   Stats;
+    RS485NT_SELF_TEST Test;
+    RS485NT_SELF_TEST_RESULT Result;
+    RS485NT_PROCESSORS Processors;
+    RS485NT_LINE_SETTINGS Line;
+    RS485NT_MAP_RINGS MapRings;
+    RS485NT_RING_MAPPING Mapping;
+    PDEVICE_OBJECT  Writer, Reader, Other;
+    PUART16550      Uart;
+    UCHAR           Frame[SIM_FRAME_SIZE];
+    UCHAR           Reply[SIM_FRAME_SIZE];
+    ULONG_PTR       Information;
+    NTSTATUS        Status;
+    PIRP            ReadIrp, WriteIrp;
+    PKINTERRUPT     Foreign;
+    ULONGLONG       BusyEnd;
+    LONGLONG        Idle;
+    ULONG           Port, Seen, Cpu, i;
+
+    printf ("%s\n", Scenario->Name);
+
+    SimConfig.Uptime = Scenario->UptimeHours * 3600 * HOST_NS_PER_SECOND;
+    SimConfig.ActiveProcessors = Scenario->Pinned ? SIM_PINNED_ACTIVE : 0;
+    HostReset (&SimConfig);
+    UartBusInitialize (&Bus);
+    RtlZeroMemory (&Capture, sizeof(Capture));
+
+    Uart = HostAddUart (0x3F8, Scenario->Irq, UART_CLOCK_1_8432_MHZ, &Bus);
+    if (Scenario->TwoPorts) {
+        HostAddUart (0x2F8, Scenario->Irq, UART_CLOCK_1_8432_MHZ, &Bus);
+    }
+
+    for (Port = 0; Port < (Scenario->TwoPorts ? 2UL : 1UL); Port++) {
+        HostSetParameter (Port, "Port Address", Port ? 0x2F8 : 0x3F8);
+        HostSetParameter (Port, "IRQ Line", Scenario->Irq);
+        HostSetParameter (Port, "Baud Rate", Scenario->BaudRate);
+        HostSetParameter (Port, "Rx Trigger Level", Scenario->RxTrigger);
+        HostSetParameter (Port, "Share Interrupt", Scenario->TwoPorts);
+        HostSetParameter (Port, "Self Test", SIM_LOAD_TEST_BYTES);
+        HostSetParameter (Port, "Echo Mode", Scenario->EchoMode);
+        HostSetParameter (Port, "Bus Idle Chars", Scenario->BusIdleChars);
+        HostSetParameter (Port, "Rx Poll Mode", Scenario->PollMode);
+        HostSetParameter (Port, "Rx Poll Threshold", 2000);
+
+        //
+        // Too big to round up to a power of two, the second port gets the
+        // largest buffer
+        //
+        if (Port == 1) {
+            HostSetParameter (Port, "Buffer Size", 0x80000001);
+        }
+
+        if (Scenario->Pinned) {
+            HostSetQwordParameter (Port, "Interrupt Affinity", 0x100000002ULL);
+            HostSetParameter (Port, "Dpc Processor", 3);
+            HostSetParameter (Port, "Dpc Importance", RS485NT_DPC_IMPORTANCE_HIGH);
+        }
+    }
+
+    Capture.Source = Uart;
+    Bus.Monitor = SimMonitor;
+    Bus.MonitorContext = &Capture;
+
+    //
+    // Sharing, the line already has a level triggered device on it
+    //
+    Foreign = NULL;
+    if (Scenario->TwoPorts) {
+        Status = IoConnectInterrupt (&Foreign, SimForeignIsr, NULL, NULL,
+                                     HOST_VECTOR_BASE + Scenario->Irq,
+                                     HOST_PROFILE_LEVEL - Scenario->Irq,
+                                     HOST_PROFILE_LEVEL - Scenario->Irq,
+                                     LevelSensitive, TRUE, 1, FALSE);
+        SIM_CHECK (NT_SUCCESS (Status), "foreign interrupt returned %08x", Status);
+    }
+
+    Status = HostLoadDriver ();
+    SIM_CHECK (NT_SUCCESS (Status), "DriverEntry returned %08x", Status);
+    if (!NT_SUCCESS (Status)) {
+        if (Foreign != NULL) {
+            IoDisconnectInterrupt (Foreign);
+        }
+        return;
+    }
+
+    Writer = HostOpenDevice (0);
+    Reader = Scenario->TwoPorts ? HostOpenDevice (1) : Writer;
+    SIM_CHECK ((Writer != NULL) && (Reader != NULL), "can't open the devices");
+    if ((Writer == NULL) || (Reader == NULL)) {
+        HostUnloadDriver ();
+        if (Foreign != NULL) {
+            IoDisconnectInterrupt (Foreign);
+        }
+        return;
+    }
+
+    //
+    // The self test run at load is kept for the application
+    //
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_LOAD_SELF_TEST, NULL, 0,
+                                  &Result, sizeof(Result)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status) && (Information == sizeof(Result)) &&
+               (Result.BytesSent == SIM_LOAD_TEST_BYTES) &&
+               (Result.BytesReceived == SIM_LOAD_TEST_BYTES) && (Result.BytesCorrupt == 0),
+               "GET_LOAD_SELF_TEST returned %08x, %u sent, %u received, %u corrupt",
+               Status, Result.BytesSent, Result.BytesReceived, Result.BytesCorrupt);
+
+    if (Scenario->TwoPorts) {
+        Status = HostCall (HostIoctl (Reader, IOCTL_RS485NT_GET_LINE_SETTINGS, NULL, 0,
+                                      &Line, sizeof(Line)), NULL);
+        SIM_CHECK (NT_SUCCESS (Status) && (Line.BufferSize == RS485_MAX_BUFFER_SIZE),
+                   "GET_LINE_SETTINGS returned %08x, a %u byte buffer", Status, Line.BufferSize);
+    }
+
+    //
+    // Reads wait up to 200ms, or 20ms between characters
+    //
+    Timeouts.ReadIntervalTimeout = 20;
+    Timeouts.ReadTotalTimeoutMultiplier = 0;
+    Timeouts.ReadTotalTimeoutConstant = 200;
+    Status = HostCall (HostIoctl (Reader, IOCTL_RS485NT_SET_TIMEOUTS, &Timeouts,
+                                  sizeof(Timeouts), NULL, 0), NULL);
+    SIM_CHECK (NT_SUCCESS (Status), "SET_TIMEOUTS returned %08x", Status);
+
+    for (i = 0; i < SIM_FRAME_SIZE; i++) {
+        Frame[i] = (UCHAR)(i * 7 + 1);
+    }
+
+    //
+    // With two ports the second one listens while the first talks
+    //
+    ReadIrp = NULL;
+    if (Scenario->TwoPorts) {
+        RtlZeroMemory (Reply, sizeof(Reply));
+        ReadIrp = HostRead (Reader, Reply, SIM_FRAME_SIZE);
+    }
+
+    Status = HostCall (HostWrite (Writer, Frame, SIM_FRAME_SIZE), &Information);
+    SIM_CHECK (NT_SUCCESS (Status), "write returned %08x", Status);
+    SIM_CHECK (Information == SIM_FRAME_SIZE, "wrote %lu of %u bytes",
+               (unsigned long)Information, SIM_FRAME_SIZE);
+    SIM_CHECK ((Capture.Count == SIM_FRAME_SIZE) && !memcmp (Capture.Data, Frame, SIM_FRAME_SIZE),
+               "bus saw %u bytes, not the frame", Capture.Count);
+    SIM_CHECK (Uart->Stats.Truncated == 0, "%llu characters cut off by RTS",
+               Uart->Stats.Truncated);
+    SIM_CHECK (Uart->Stats.Undriven == 0, "%llu characters sent with RTS off",
+               Uart->Stats.Undriven);
+
+    if (Scenario->TwoPorts) {
+        Status = HostCall (ReadIrp, &Information);
+        SIM_CHECK (NT_SUCCESS (Status) && (Information == SIM_FRAME_SIZE),
+                   "port 1 read returned %08x, %lu bytes", Status, (unsigned long)Information);
+        SIM_CHECK (!memcmp (Reply, Frame, SIM_FRAME_SIZE), "port 1 read the wrong data");
+    } else {
+        //
+        // The other end replies 1ms after the request, bytes reversed
+        //
+        for (i = 0; i < SIM_FRAME_SIZE; i++) {
+            Frame[i] = (UCHAR)~Frame[i];
+        }
+        UartBusSend (&Bus, Frame, SIM_FRAME_SIZE, HostTime () + HOST_NS_PER_MS,
+                     Scenario->BaudRate, SIM_LCR_8N1);
+
+        RtlZeroMemory (Reply, sizeof(Reply));
+        Status = HostCall (HostRead (Reader, Reply, SIM_FRAME_SIZE), &Information);
+        SIM_CHECK (NT_SUCCESS (Status) && (Information == SIM_FRAME_SIZE),
+                   "read returned %08x, %lu bytes", Status, (unsigned long)Information);
+        SIM_CHECK (!memcmp (Reply, Frame, SIM_FRAME_SIZE), "read the wrong data");
+    }
+
+    Status = HostCall (HostIoctl (Reader, IOCTL_RS485NT_GET_STATS, NULL, 0,
+                                  &Stats, sizeof(Stats)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status) && (Information == sizeof(Stats)),
+               "GET_STATS returned %08x", Status);
+
+    //
+    // A single port also hears its own request. Gated, the RX FIFO
+    // overruns on it and only what's left is read back.
+    //
+    switch (Scenario->EchoMode) {
+        case ECHO_MODE_GATE:
+            SIM_CHECK ((Stats.EchoBytes > 0) && (Stats.EchoBytes < SIM_FRAME_SIZE) &&
+                       (Stats.RxBytes == SIM_FRAME_SIZE + Stats.EchoBytes),
+                       "driver counted %llu bytes in, %llu echoed", Stats.RxBytes, Stats.EchoBytes);
+            break;
+
+        case ECHO_MODE_VERIFY:
+            SIM_CHECK ((Stats.EchoBytes == SIM_FRAME_SIZE) && (Stats.EchoMismatches == 0) &&
+                       (Stats.EchoMissing == 0) && (Stats.Collisions == 0),
+                       "echo %llu bytes, %llu mismatched, %llu missing, %llu collisions",
+                       Stats.EchoBytes, Stats.EchoMismatches, Stats.EchoMissing, Stats.Collisions);
+            SIM_CHECK (Stats.RxBytes == 2 * SIM_FRAME_SIZE, "driver counted %llu bytes in",
+                       Stats.RxBytes);
+            break;
+
+        default:
+            SIM_CHECK (Stats.RxBytes == (Scenario->TwoPorts ? 1 : 2) * SIM_FRAME_SIZE,
+                       "driver counted %llu bytes in", Stats.RxBytes);
+            break;
+    }
+
+    //
+    // Polling, bytes come in without receive interrupts. With no
+    // interrupts at all, the transmitter is polled too.
+    //
+    switch (Scenario->PollMode) {
+        case POLL_MODE_ADAPTIVE:
+            SIM_CHECK ((Stats.PollEntries > 0) && (Stats.PolledBytes > 0) &&
+                       (Stats.InterruptsSaved > 0) &&
+                       (Stats.RxDataInterrupts + Stats.RxTimeoutInterrupts < 2 * SIM_FRAME_SIZE),
+                       "%llu switches to polling, %llu bytes polled, %llu RX interrupts",
+                       Stats.PollEntries, Stats.PolledBytes,
+                       Stats.RxDataInterrupts + Stats.RxTimeoutInterrupts);
+            break;
+
+        case POLL_MODE_ALWAYS:
+            SIM_CHECK ((Stats.Interrupts == 0) && (HostStats.Interrupts == 0) &&
+                       (Stats.PolledBytes == Stats.RxBytes),
+                       "%llu interrupts, %llu of %llu bytes polled",
+                       Stats.Interrupts, Stats.PolledBytes, Stats.RxBytes);
+            break;
+    }
+
+    if (Scenario->PollMode != POLL_MODE_OFF) {
+        printf ("  %llu polls, %llu interrupts saved, delay %llu us max\n",
+                Stats.Polls, Stats.InterruptsSaved, Stats.PollDelayMax);
+    }
+
+    printf ("  rx %llu bytes, %llu interrupts (%llu data, %llu timeout), %llu DPCs, "
+            "host %llu IRQs, %llu ISR calls, RTS dead time max %llu ns\n",
+            Stats.RxBytes, Stats.Interrupts, Stats.RxDataInterrupts, Stats.RxTimeoutInterrupts,
+            Stats.DpcRuns, HostStats.Interrupts, HostStats.IsrCalls, Uart->Stats.RtsDeadMax);
+
+    //
+    // Every DPC ran where it was sent: with the ISR on processor 0, or
+    // pinned to processor 3
+    //
+    Status = HostCall (HostIoctl (Reader, IOCTL_RS485NT_GET_PROCESSORS, NULL, 0,
+                                  &Processors, sizeof(Processors)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status) && (Information == sizeof(Processors)),
+               "GET_PROCESSORS returned %08x", Status);
+
+    Cpu = Scenario->Pinned ? 3 : 0;
+    Seen = 0;
+    for (i = 0; i < RS485NT_MAX_PROCESSORS; i++) {
+        if ((i != Cpu) && Processors.DpcRuns[i]) {
+            Seen++;
+        }
+    }
+    SIM_CHECK ((Processors.ActiveProcessors == SIM_PROCESSORS) &&
+               (Processors.InterruptAffinity == (Scenario->Pinned ? 0x02ULL : 0x0FULL)) &&
+               (Processors.DpcRuns[Cpu] > 0) && (Seen == 0),
+               "interrupt affinity %llx, %llu DPCs on processor %u, %u other processors",
+               Processors.InterruptAffinity, Processors.DpcRuns[Cpu], Cpu, Seen);
+
+    if (Scenario->Pinned) {
+        Processors.DpcProcessor = SIM_MISSING_CPU;
+        Status = HostCall (HostIoctl (Reader, IOCTL_RS485NT_SET_PROCESSORS, &Processors,
+                                      sizeof(Processors), NULL, 0), NULL);
+        SIM_CHECK (Status == STATUS_INVALID_PARAMETER,
+                   "SET_PROCESSORS took processor %u, returned %08x", SIM_MISSING_CPU, Status);
+
+        Processors.DpcProcessor = RS485NT_DPC_ANY_PROCESSOR;
+        Processors.DpcImportance = RS485NT_DPC_IMPORTANCE_MEDIUM;
+        Status = HostCall (HostIoctl (Reader, IOCTL_RS485NT_SET_PROCESSORS, &Processors,
+                                      sizeof(Processors), &Processors, sizeof(Processors)), NULL);
+        SIM_CHECK (NT_SUCCESS (Status) && (Processors.DpcProcessor == RS485NT_DPC_ANY_PROCESSOR),
+                   "SET_PROCESSORS returned %08x", Status);
+
+        //
+        // Back on any processor, the DPCs follow the ISR to processor 1
+        //
+        Status = HostCall (HostWrite (Writer, Frame, SIM_FRAME_SIZE), &Information);
+        SIM_CHECK (NT_SUCCESS (Status), "write returned %08x", Status);
+
+        Status = HostCall (HostIoctl (Reader, IOCTL_RS485NT_GET_PROCESSORS, NULL, 0,
+                                      &Processors, sizeof(Processors)), &Information);
+        SIM_CHECK (NT_SUCCESS (Status) && (Processors.DpcRuns[1] > 0),
+                   "%llu DPCs on processor 1 after SET_PROCESSORS, returned %08x",
+                   Processors.DpcRuns[1], Status);
+    }
+
+    //
+    // The loopback self test gets everything back and stays off the bus
+    //
+    Seen = Capture.Count;
+    Test.ByteCount = 4 * SIM_FRAME_SIZE;
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_SELF_TEST, &Test, sizeof(Test),
+                                  &Result, sizeof(Result)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status) && (Information == sizeof(Result)),
+               "SELF_TEST returned %08x", Status);
+    SIM_CHECK ((Result.BytesSent == Test.ByteCount) && (Result.BytesReceived == Test.ByteCount) &&
+               (Result.BytesLost == 0) && (Result.BytesCorrupt == 0) && (Result.OverrunErrors == 0),
+               "self test sent %u, received %u, lost %u, corrupt %u, %u overruns",
+               Result.BytesSent, Result.BytesReceived, Result.BytesLost, Result.BytesCorrupt,
+               Result.OverrunErrors);
+    SIM_CHECK (Capture.Count == Seen, "self test put %u bytes on the bus", Capture.Count - Seen);
+
+    printf ("  self test %u of %u bytes/s, latency %u/%u/%u us\n",
+            Result.BytesPerSecond, Result.LineBytesPerSecond,
+            Result.LatencyMin, Result.LatencyAverage, Result.LatencyMax);
+
+    //
+    // Verifying the echo, another station talking over us is a collision.
+    // Listening first, the frame goes out again intact after a backoff.
+    //
+    if (Scenario->EchoMode == ECHO_MODE_VERIFY) {
+        UartBusSend (&Bus, Frame, 8, HostTime () + 20 * HOST_NS_PER_US,
+                     Scenario->BaudRate, SIM_LCR_8N1);
+
+        Capture.Count = 0;
+        Status = HostCall (HostWrite (Writer, Frame, SIM_FRAME_SIZE), &Information);
+        SIM_CHECK (NT_SUCCESS (Status), "write returned %08x", Status);
+
+        Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_STATS, NULL, 0,
+                                      &Stats, sizeof(Stats)), &Information);
+        SIM_CHECK (NT_SUCCESS (Status) && (Stats.Collisions == 1) && (Stats.EchoMismatches > 0),
+                   "%llu collisions, %llu mismatched", Stats.Collisions, Stats.EchoMismatches);
+
+        if (Scenario->BusIdleChars) {
+            SIM_CHECK ((Stats.BackoffRetries == 1) && (Capture.Count == 2 * SIM_FRAME_SIZE) &&
+                       !memcmp (Capture.Data + SIM_FRAME_SIZE, Frame, SIM_FRAME_SIZE),
+                       "%llu retries, bus saw %u bytes", Stats.BackoffRetries, Capture.Count);
+        }
+    }
+
+    //
+    // Listening first, a write waits for the other end to finish
+    //
+    if (Scenario->BusIdleChars) {
+        Seen = (ULONG)Bus.Collisions;
+        UartBusSend (&Bus, Frame, 16, HostTime (), Scenario->BaudRate, SIM_LCR_8N1);
+        HostRun (200 * HOST_NS_PER_US);
+
+        Status = HostCall (HostWrite (Writer, Frame, SIM_FRAME_SIZE), &Information);
+        SIM_CHECK (NT_SUCCESS (Status), "write returned %08x", Status);
+
+        Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_STATS, NULL, 0,
+                                      &Stats, sizeof(Stats)), &Information);
+        SIM_CHECK (NT_SUCCESS (Status) && (Stats.BusDeferrals > 0) &&
+                   (Stats.Collisions == 1) && (Bus.Collisions == Seen),
+                   "%llu deferrals, %llu collisions", Stats.BusDeferrals, Stats.Collisions);
+
+        //
+        // A bus that never goes idle fails the write, it isn't held forever
+        //
+        memset (Busy, 0x55, sizeof(Busy));
+        BusyEnd = UartBusSend (&Bus, Busy, sizeof(Busy), HostTime (),
+                               Scenario->BaudRate, SIM_LCR_8N1);
+        HostRun (200 * HOST_NS_PER_US);
+
+        WriteIrp = HostWrite (Writer, Frame, SIM_FRAME_SIZE);
+        for (i = 1; i < SIM_BUSY_CHUNKS; i++) {
+            HostRun (BusyEnd - HostTime () - HOST_NS_PER_MS);
+            BusyEnd = UartBusSend (&Bus, Busy, sizeof(Busy), BusyEnd,
+                                   Scenario->BaudRate, SIM_LCR_8N1);
+        }
+
+        Status = HostCall (WriteIrp, &Information);
+        SIM_CHECK (Status == STATUS_IO_TIMEOUT, "write on a busy bus returned %08x", Status);
+
+        HostRun (BusyEnd - HostTime () + HOST_NS_PER_MS);
+
+        Status = HostCall (HostWrite (Writer, Frame, SIM_FRAME_SIZE), &Information);
+        SIM_CHECK (NT_SUCCESS (Status), "write after the busy bus returned %08x", Status);
+
+        Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_STATS, NULL, 0,
+                                      &Stats, sizeof(Stats)), &Information);
+        SIM_CHECK (NT_SUCCESS (Status) && (Stats.BusTimeouts == 1),
+                   "%llu bus timeouts", Stats.BusTimeouts);
+    }
+
+    //
+    // A receive buffer too big to round up to a power of two is refused
+    //
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_LINE_SETTINGS, NULL, 0,
+                                  &Line, sizeof(Line)), NULL);
+    SIM_CHECK (NT_SUCCESS (Status), "GET_LINE_SETTINGS returned %08x", Status);
+
+    Line.BufferSize = 0x80000001;
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_SET_LINE_SETTINGS, &Line,
+                                  sizeof(Line), NULL, 0), NULL);
+    SIM_CHECK (Status == STATUS_INVALID_PARAMETER,
+               "SET_LINE_SETTINGS took a %08x byte buffer, returned %08x", Line.BufferSize, Status);
+
+    //
+    // With 7 data bits the pattern comes back without its top bit
+    //
+    Line.DataBits = 7;
+    Line.BufferSize = 0;
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_SET_LINE_SETTINGS, &Line,
+                                  sizeof(Line), NULL, 0), NULL);
+    SIM_CHECK (NT_SUCCESS (Status), "SET_LINE_SETTINGS returned %08x", Status);
+
+    Test.ByteCount = SIM_FRAME_SIZE;
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_SELF_TEST, &Test, sizeof(Test),
+                                  &Result, sizeof(Result)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status) && (Result.BytesReceived == Test.ByteCount) &&
+               (Result.BytesCorrupt == 0),
+               "7 bit self test returned %08x, received %u, corrupt %u",
+               Status, Result.BytesReceived, Result.BytesCorrupt);
+
+    //
+    // ... and so does the echo, that's no collision
+    //
+    if (Scenario->EchoMode == ECHO_MODE_VERIFY) {
+        Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_STATS, NULL, 0,
+                                      &Stats, sizeof(Stats)), &Information);
+        Seen = (ULONG)Stats.EchoMismatches;
+
+        Status = HostCall (HostWrite (Writer, Frame, SIM_FRAME_SIZE), &Information);
+        SIM_CHECK (NT_SUCCESS (Status), "7 bit write returned %08x", Status);
+
+        Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_STATS, NULL, 0,
+                                      &Stats, sizeof(Stats)), &Information);
+        SIM_CHECK (NT_SUCCESS (Status) && (Stats.EchoMismatches == Seen),
+                   "7 bit echo, %llu bytes mismatched", Stats.EchoMismatches - Seen);
+    }
+
+    //
+    // Over a day without traffic, LAST_RCVD_TIME still counts it
+    //
+    if (Scenario->UptimeHours) {
+        HostRun (SIM_IDLE_HOURS * 3600 * HOST_NS_PER_SECOND);
+
+        Status = HostCall (HostIoctl (Reader, IOCTL_RS485NT_LAST_RCVD_TIME, NULL, 0,
+                                      &Idle, sizeof(Idle)), &Information);
+        SIM_CHECK (NT_SUCCESS (Status) && (Information == sizeof(Idle)) &&
+                   (Idle >= SIM_IDLE_HOURS * 3600000LL) &&
+                   (Idle < (SIM_IDLE_HOURS * 3600 + 60) * 1000LL),
+                   "LAST_RCVD_TIME returned %08x, %lld ms after %u hours idle",
+                   Status, Idle, SIM_IDLE_HOURS);
+    }
+
+    //
+    // A reset hands back the IRP and DPC counts kept outside the interrupt
+    // lock, then clears them with the rest
+    //
+    Port = RS485NT_STATS_RESET;
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_STATS, &Port, sizeof(Port),
+                                  &Stats, sizeof(Stats)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status) && (Stats.WriteIrps > 0) && (Stats.DpcRuns > 0),
+               "GET_STATS reset returned %08x, %llu writes, %llu DPCs",
+               Status, Stats.WriteIrps, Stats.DpcRuns);
+
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_GET_STATS, NULL, 0,
+                                  &Stats, sizeof(Stats)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status) && (Stats.WriteIrps == 0) && (Stats.ReadIrps == 0) &&
+               (Stats.TransactIrps == 0),
+               "after a reset, %llu writes, %llu reads, %llu transactions",
+               Stats.WriteIrps, Stats.ReadIrps, Stats.TransactIrps);
+
+    //
+    // The rings belong to the handle that mapped them: another handle
+    // can't unmap them, and closing it leaves them alone
+    //
+    MapRings.RxSize = 0;
+    MapRings.TxSize = 0;
+    Status = HostCall (HostIoctl (Writer, IOCTL_RS485NT_MAP_RINGS, &MapRings, sizeof(MapRings),
+                                  &Mapping, sizeof(Mapping)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status) && (HostStats.UserMappings == 1),
+               "MAP_RINGS returned %08x, %d mappings", Status, HostStats.UserMappings);
+
+    HostSetCaller (0, 1);
+    Other = HostOpenDevice (0);
+    Status = HostCall (HostIoctl (Other, IOCTL_RS485NT_UNMAP_RINGS, NULL, 0, NULL, 0), NULL);
+    SIM_CHECK (Status == STATUS_ACCESS_DENIED, "UNMAP_RINGS from another handle returned %08x",
+               Status);
+    HostCloseDevice (Other);
+    SIM_CHECK (HostStats.UserMappings == 1, "closing another handle unmapped the rings");
+
+    //
+    // The last close of the mapping handle can come from another process
+    // (an inherited handle), the rings are unmapped from the first one
+    //
+    HostSetCaller (1, 0);
+    HostCloseDevice (Writer);
+    SIM_CHECK (HostStats.UserMappings == 0, "closing the mapping handle left the rings mapped");
+
+    //
+    // Rings still mapped when the port goes are freed with it
+    //
+    HostSetCaller (1, 2);
+    Other = HostOpenDevice (0);
+    Status = HostCall (HostIoctl (Other, IOCTL_RS485NT_MAP_RINGS, &MapRings, sizeof(MapRings),
+                                  &Mapping, sizeof(Mapping)), &Information);
+    SIM_CHECK (NT_SUCCESS (Status), "MAP_RINGS after the unmap returned %08x", Status);
+    HostSetCaller (0, 0);
+
+    if (Reader != Writer) {
+        HostCloseDevice (Reader);
+    }
+    HostUnloadDriver ();
+
+    if (Foreign != NULL) {
+        IoDisconnectInterrupt (Foreign);
+    }
+
+    SIM_CHECK (HostKernelCheck () == 0, "driver left the kernel dirty");
+}
+
+
+int main (int argc, char *argv[])
+{
+    ULONG   i;
+
+    for (i = 0; i < sizeof(SimScenarios) / sizeof(SimScenarios[0]); i++) {
+        SimRun (&SimScenarios[i]);
+    }
+
+    printf ("%s\n", SimFailures ? "FAILED" : "passed");
+    return SimFailures ? 1 : 0;
+}
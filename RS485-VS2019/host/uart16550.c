@@ -0,0 +1,996 @@
+//-------------------------------------------------------------------------------------------------
+// UART16550.C
+//
+// BSD 3-Clause License
+// 
+// Copyright (c) 2022, Anthony Kempka
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Description:
+// ------------
+// 16550A UART and RS-485 bus model, see uart16550.h.
+//
+//-------------------------------------------------------------------------------------------------
+
+#include "hostddk.h"
+#include "uart16550.h"
+
+static ULONG UartBits (IN UCHAR Lcr);
+static UCHAR UartRxErrors (IN PUART16550 Uart);
+static VOID UartStartShift (IN PUART16550 Uart, IN ULONGLONG Now);
+static VOID UartShiftDone (IN PUART16550 Uart);
+static VOID UartModemInputs (IN PUART16550 Uart);
+static VOID UartResetRx (IN PUART16550 Uart);
+static VOID UartResetTx (IN PUART16550 Uart);
+
+
+//---------------------------------------------------------------------------
+// Uart16550Initialize
+//
+// Description:
+//  Power on reset: interrupts off, 8250 mode (FIFOs off), transmitter
+//  empty, all modem control outputs off.
+//
+// Arguments:
+//      Uart    - The UART
+//      Base    - First I/O address
+//      Irq     - ISA IRQ line
+//      Clock   - Input clock in Hz
+//
+// Return Value:
+//      none
+//
+VOID Uart16550Initialize (OUT PUART16550 Uart, IN ULONG Base, IN ULONG Irq, IN ULONG Clock)
+{
+    RtlZeroMemory (Uart, sizeof(UART16550));
+
+    Uart->Base = Base;
+    Uart->Irq = Irq;
+    Uart->Clock = Clock;
+
+    //
+    // The divisor latch isn't reset, start out at 9600 baud off 1.8432MHz
+    //
+    Uart->Dll = BAUD_RATE_DIVISOR_9600;
+    Uart->Lcr = LCR_EIGHT_BITS_PER_WORD;
+    Uart->RxTrigger = 1;
+
+    //
+    // A half duplex transceiver with the receiver always enabled hears
+    // its own transmission
+    //
+    Uart->Echo = TRUE;
+}
+
+
+//---------------------------------------------------------------------------
+// UartBits
+//
+// Description:
+//  Bits per character (start, data, parity and stop bits) for an LCR value.
+//
+// Arguments:
+//      Lcr     - Line Control Register
+//
+// Return Value:
+//      Bits per character
+//
+static ULONG UartBits (IN UCHAR Lcr)
+{
+    return 1 + 5 + (Lcr & LCR_EIGHT_BITS_PER_WORD) +
+           ((Lcr & LCR_ODD_PARITY) ? 1 : 0) +
+           ((Lcr & LCR_TWO_STOP_BITS) ? 2 : 1);
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550CharTime
+//
+// Description:
+//  Time one character takes on the wire at the programmed divisor and
+//  data format: 16 clocks per bit, the divisor latch divides the clock.
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      Character time in ns
+//
+ULONGLONG Uart16550CharTime (IN PUART16550 Uart)
+{
+    ULONGLONG   Divisor;
+
+    Divisor = Uart->Dll | ((ULONG)Uart->Dlm << 8);
+
+    if (Divisor == 0) {
+        Divisor = 0x10000;
+    }
+
+    return (UartBits (Uart->Lcr) * UART_CLOCK_DIVIDE * Divisor * 1000000000ULL +
+            Uart->Clock - 1) / Uart->Clock;
+}
+
+
+//---------------------------------------------------------------------------
+// UartRxErrors
+//
+// Description:
+//  The LSR error bits: overrun, plus the errors of the character at the
+//  top of the RX FIFO (the only one in 8250 mode).
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      LSR_RX_ERROR_MASK bits
+//
+static UCHAR UartRxErrors (IN PUART16550 Uart)
+{
+    UCHAR   Errors = 0;
+
+    if (Uart->RxOverrun) {
+        Errors |= LSR_RX_OVERRUN_ERROR;
+    }
+
+    if (Uart->RxCount) {
+        Errors |= Uart->RxFlags[Uart->RxHead];
+    }
+
+    return Errors;
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550Lsr
+//
+// Description:
+//  The Line Status Register, without the side effects of reading it.
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      LSR value
+//
+UCHAR Uart16550Lsr (IN PUART16550 Uart)
+{
+    UCHAR   Lsr;
+    ULONG   i;
+
+    Lsr = UartRxErrors (Uart);
+
+    if (Uart->RxCount) {
+        Lsr |= LSR_RX_DATA_READY;
+    }
+
+    if (Uart->TxCount == 0) {
+        Lsr |= LSR_TX_BUFFER_EMPTY;
+
+        if (!Uart->Shifting) {
+            Lsr |= LSR_TX_BOTH_EMPTY;
+        }
+    }
+
+    //
+    // FIFO mode: some character in the RX FIFO has an error
+    //
+    if (Uart->FifoEnabled) {
+        for (i = 0; i < Uart->RxCount; i++) {
+            if (Uart->RxFlags[(Uart->RxHead + i) % UART_FIFO_SIZE]) {
+                Lsr |= 0x80;
+                break;
+            }
+        }
+    }
+
+    return Lsr;
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550Iir
+//
+// Description:
+//  The Interrupt Identification Register, without the side effects of
+//  reading it. The highest priority enabled source wins: receiver line
+//  status, receive data (trigger level reached) or character timeout,
+//  THR empty, modem status.
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      IIR value
+//
+UCHAR Uart16550Iir (IN PUART16550 Uart)
+{
+    UCHAR   Iir;
+
+    if ((Uart->Ier & IER_ENABLE_RX_ERROR_IRQ) && UartRxErrors (Uart)) {
+        Iir = IIR_RX_ERROR_IRQ_PENDING;
+    } else if ((Uart->Ier & IER_ENABLE_RX_DATA_READY_IRQ) && Uart->RxCount &&
+               (!Uart->FifoEnabled || (Uart->RxCount >= Uart->RxTrigger))) {
+        Iir = IIR_RX_DATA_READY_IRQ_PENDING;
+    } else if ((Uart->Ier & IER_ENABLE_RX_DATA_READY_IRQ) && Uart->RxTimeout) {
+        Iir = IIR_RX_TIMEOUT_IRQ_PENDING;
+    } else if ((Uart->Ier & IER_ENABLE_TX_BE_IRQ) && Uart->ThrePending) {
+        Iir = IIR_TX_HBE_IRQ_PENDING;
+    } else if ((Uart->Ier & IER_ENABLE_MODEM_STATUS_IRQ) && (Uart->Msr & 0x0F)) {
+        Iir = IIR_MODEM_STATUS_IRQ_PENDING;
+    } else {
+        Iir = IIR_NO_INTERRUPT_PENDING;
+    }
+
+    if (Uart->FifoEnabled) {
+        Iir |= IIR_FIFO_ENABLED;
+    }
+
+    return Iir;
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550Interrupt
+//
+// Description:
+//  State of the IRQ line driven by the UART. On a PC the interrupt output
+//  goes through a buffer enabled by OUT2, and loopback disconnects OUT2.
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      TRUE    - The IRQ line is asserted
+//
+BOOLEAN Uart16550Interrupt (IN PUART16550 Uart)
+{
+    if (!(Uart->Mcr & UART_MCR_OUT2) || (Uart->Mcr & UART_MCR_LOOPBACK)) {
+        return FALSE;
+    }
+
+    return (Uart16550Iir (Uart) & IIR_INTERRUPT_MASK) != IIR_NO_INTERRUPT_PENDING;
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550Read
+//
+// Description:
+//  An I/O port read. Reading the RBR pops the RX FIFO, reading the IIR
+//  clears a THR empty interrupt it reports, reading the LSR clears the
+//  error bits and reading the MSR clears the deltas.
+//
+// Arguments:
+//      Uart    - The UART
+//      Offset  - Register offset from the base address
+//      Now     - Simulated time in ns
+//
+// Return Value:
+//      Register value
+//
+UCHAR Uart16550Read (IN PUART16550 Uart, IN ULONG Offset, IN ULONGLONG Now)
+{
+    UCHAR   Value = 0xFF;
+
+    Uart->Stats.RegisterReads++;
+
+    switch (Offset) {
+        case RX_REGISTER_8250:
+            if (Uart->Lcr & LCR_ENABLE_DIVISOR_LATCH) {
+                Value = Uart->Dll;
+                break;
+            }
+
+            Value = 0;
+            if (Uart->RxCount) {
+                Value = Uart->RxData[Uart->RxHead];
+                Uart->RxHead = (Uart->RxHead + 1) % UART_FIFO_SIZE;
+                Uart->RxCount--;
+            }
+
+            //
+            // A read restarts the character timeout
+            //
+            Uart->RxTimeout = FALSE;
+            Uart->RxTimeoutAt = (Uart->FifoEnabled && Uart->RxCount) ?
+                                Now + UART_TIMEOUT_CHARS * Uart16550CharTime (Uart) : 0;
+            break;
+
+        case IER_8250:
+            Value = (Uart->Lcr & LCR_ENABLE_DIVISOR_LATCH) ? Uart->Dlm : Uart->Ier;
+            break;
+
+        case IIR_8250:
+            Value = Uart16550Iir (Uart);
+            if ((Value & IIR_INTERRUPT_MASK) == IIR_TX_HBE_IRQ_PENDING) {
+                Uart->ThrePending = FALSE;
+            }
+            break;
+
+        case LCR_8250:
+            Value = Uart->Lcr;
+            break;
+
+        case MCR_8250:
+            Value = Uart->Mcr;
+            break;
+
+        case LSR_8250:
+            Value = Uart16550Lsr (Uart);
+            Uart->RxOverrun = FALSE;
+            if (Uart->RxCount) {
+                Uart->RxFlags[Uart->RxHead] = 0;
+            }
+            break;
+
+        case MSR_8250:
+            Value = Uart->Msr;
+            Uart->Msr &= 0xF0;
+            break;
+
+        default:
+            Value = Uart->Scr;
+            break;
+    }
+
+    return Value;
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550Write
+//
+// Description:
+//  An I/O port write. THR writes beyond the FIFO (or the holding register
+//  in 8250 mode) are lost and counted.
+//
+// Arguments:
+//      Uart    - The UART
+//      Offset  - Register offset from the base address
+//      Value   - Value written
+//      Now     - Simulated time in ns
+//
+// Return Value:
+//      none
+//
+VOID Uart16550Write (IN PUART16550 Uart, IN ULONG Offset, IN UCHAR Value, IN ULONGLONG Now)
+{
+    static const ULONG Trigger[4] = { 1, 4, 8, 14 };
+    UCHAR   Old;
+
+    Uart->Stats.RegisterWrites++;
+
+    switch (Offset) {
+        case TX_REGISTER_8250:
+            if (Uart->Lcr & LCR_ENABLE_DIVISOR_LATCH) {
+                Uart->Dll = Value;
+                break;
+            }
+
+            if (Uart->TxCount < (Uart->FifoEnabled ? UART_FIFO_SIZE : 1)) {
+                Uart->TxData[(Uart->TxHead + Uart->TxCount) % UART_FIFO_SIZE] = Value;
+                Uart->TxCount++;
+            } else {
+                Uart->Stats.TxOverruns++;
+            }
+
+            Uart->ThrePending = FALSE;
+
+            if (!Uart->Shifting) {
+                UartStartShift (Uart, Now);
+            }
+            break;
+
+        case IER_8250:
+            if (Uart->Lcr & LCR_ENABLE_DIVISOR_LATCH) {
+                Uart->Dlm = Value;
+                break;
+            }
+
+            //
+            // Enabling the THR empty interrupt with the THR empty raises it
+            //
+            Old = Uart->Ier;
+            Uart->Ier = Value & 0x0F;
+
+            if (!(Old & IER_ENABLE_TX_BE_IRQ) && (Value & IER_ENABLE_TX_BE_IRQ) &&
+                (Uart->TxCount == 0)) {
+                Uart->ThrePending = TRUE;
+            }
+            break;
+
+        case FCR_8250:
+            //
+            // Switching the FIFOs on or off empties them. Bit 5 (the 16750
+            // 64 byte FIFO) doesn't exist on a 16550.
+            //
+            if (((Value & FCR_ENABLE_FIFO) != 0) != Uart->FifoEnabled) {
+                Uart->FifoEnabled = (Value & FCR_ENABLE_FIFO) != 0;
+                UartResetRx (Uart);
+                UartResetTx (Uart);
+            }
+
+            if (Uart->FifoEnabled) {
+                if (Value & FCR_CLEAR_RX_FIFO) {
+                    UartResetRx (Uart);
+                }
+                if (Value & FCR_CLEAR_TX_FIFO) {
+                    UartResetTx (Uart);
+                }
+                Uart->RxTrigger = Trigger[Value >> 6];
+            } else {
+                Uart->RxTrigger = 1;
+            }
+            break;
+
+        case LCR_8250:
+            Uart->Lcr = Value;
+            break;
+
+        case MCR_8250:
+            Old = Uart->Mcr;
+            Uart->Mcr = Value & UART_MCR_MASK;
+
+            if ((Old & UART_MCR_RTS) && !(Uart->Mcr & UART_MCR_RTS)) {
+                //
+                // RTS released: too early if the character is still going
+                // out, otherwise time how long the line sat idle with the
+                // transmitter enabled
+                //
+                if (Uart->Shifting) {
+                    Uart->ShiftTruncated = TRUE;
+                } else if (Uart->EmptySince) {
+                    Uart->Stats.RtsReleases++;
+                    Uart->Stats.RtsDeadTime += Now - Uart->EmptySince;
+                    if (Now - Uart->EmptySince > Uart->Stats.RtsDeadMax) {
+                        Uart->Stats.RtsDeadMax = Now - Uart->EmptySince;
+                    }
+                }
+                Uart->EmptySince = 0;
+
+            } else if (!(Old & UART_MCR_RTS) && (Uart->Mcr & UART_MCR_RTS) &&
+                       !Uart->Shifting && (Uart->TxCount == 0)) {
+                Uart->EmptySince = Now;
+            }
+
+            UartModemInputs (Uart);
+            break;
+
+        case LSR_8250:
+        case MSR_8250:
+            //
+            // Factory test only
+            //
+            break;
+
+        default:
+            Uart->Scr = Value;
+            break;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// UartModemInputs
+//
+// Description:
+//  Updates the MSR from the modem inputs, in loopback from the MCR
+//  outputs (RTS to CTS, DTR to DSR, OUT1 to RI, OUT2 to DCD), and sets the
+//  deltas. The RI delta is only set by the trailing edge.
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      none
+//
+static VOID UartModemInputs (IN PUART16550 Uart)
+{
+    UCHAR   Inputs, Changed;
+
+    if (Uart->Mcr & UART_MCR_LOOPBACK) {
+        Inputs = 0;
+        if (Uart->Mcr & MCR_ACTIVATE_RTS) {
+            Inputs |= MSR_CURRENT_CTS;
+        }
+        if (Uart->Mcr & MCR_ACTIVATE_DTR) {
+            Inputs |= MSR_CURRENT_DSR;
+        }
+        if (Uart->Mcr & MCR_ACTIVATE_GP01) {
+            Inputs |= MSR_CURRENT_RI;
+        }
+        if (Uart->Mcr & MCR_ACTIVATE_GP02) {
+            Inputs |= MSR_CURRENT_DCD;
+        }
+    } else {
+        Inputs = Uart->MsrInputs & 0xF0;
+    }
+
+    Changed = (Inputs ^ Uart->Msr) & 0xF0;
+
+    if (Changed & MSR_CURRENT_CTS) {
+        Uart->Msr |= MSR_DELTA_CTS;
+    }
+    if (Changed & MSR_CURRENT_DSR) {
+        Uart->Msr |= MSR_DELTA_DSR;
+    }
+    if ((Changed & MSR_CURRENT_RI) && !(Inputs & MSR_CURRENT_RI)) {
+        Uart->Msr |= MSR_DELTA_RI;
+    }
+    if (Changed & MSR_CURRENT_DCD) {
+        Uart->Msr |= MSR_DELTA_DCD;
+    }
+
+    Uart->Msr = (Uart->Msr & 0x0F) | Inputs;
+}
+
+
+//---------------------------------------------------------------------------
+// UartResetRx / UartResetTx
+//
+// Description:
+//  Empty the RX FIFO or the TX FIFO. The shift registers aren't touched.
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      none
+//
+static VOID UartResetRx (IN PUART16550 Uart)
+{
+    Uart->RxHead = 0;
+    Uart->RxCount = 0;
+    Uart->RxTimeout = FALSE;
+    Uart->RxTimeoutAt = 0;
+}
+
+static VOID UartResetTx (IN PUART16550 Uart)
+{
+    if (Uart->TxCount) {
+        Uart->ThrePending = TRUE;
+    }
+
+    Uart->TxHead = 0;
+    Uart->TxCount = 0;
+}
+
+
+//---------------------------------------------------------------------------
+// UartStartShift
+//
+// Description:
+//  Moves the next character from the THR (TX FIFO) into the shift
+//  register. The THR empty interrupt is raised once the last one moves.
+//
+// Arguments:
+//      Uart    - The UART
+//      Now     - Simulated time in ns, the start bit goes out now
+//
+// Return Value:
+//      none
+//
+static VOID UartStartShift (IN PUART16550 Uart, IN ULONGLONG Now)
+{
+    if (Uart->TxCount == 0) {
+        return;
+    }
+
+    Uart->ShiftData = Uart->TxData[Uart->TxHead];
+    Uart->TxHead = (Uart->TxHead + 1) % UART_FIFO_SIZE;
+    Uart->TxCount--;
+
+    Uart->Shifting = TRUE;
+    Uart->ShiftStart = Now;
+    Uart->ShiftEnd = Now + Uart16550CharTime (Uart);
+    Uart->ShiftDriven = (Uart->Mcr & UART_MCR_RTS) != 0;
+    Uart->ShiftTruncated = FALSE;
+    Uart->EmptySince = 0;
+
+    if (Uart->TxCount == 0) {
+        Uart->ThrePending = TRUE;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// UartShiftDone
+//
+// Description:
+//  The stop bit of the character in the shift register is out. Hands it
+//  to the bus (or back to the receiver in loopback) and starts the next.
+//  A character sent with RTS off never reaches the wire, one whose RTS
+//  went off early arrives with a framing error.
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      none
+//
+static VOID UartShiftDone (IN PUART16550 Uart)
+{
+    ULONGLONG   End = Uart->ShiftEnd;
+    UCHAR       Flags = 0;
+
+    Uart->Stats.TxChars++;
+    Uart->Shifting = FALSE;
+
+    if (Uart->Mcr & UART_MCR_LOOPBACK) {
+        Uart16550Receive (Uart, Uart->ShiftData, 0, End);
+
+    } else if (!Uart->ShiftDriven) {
+        Uart->Stats.Undriven++;
+
+    } else {
+        if (Uart->ShiftTruncated) {
+            Uart->Stats.Truncated++;
+            Flags = LSR_RX_FRAMING_ERROR;
+        }
+
+        if (Uart->Bus != NULL) {
+            UartBusDeliver (Uart->Bus, Uart, Uart->ShiftData, Flags,
+                            Uart->ShiftStart, End, End - Uart->ShiftStart,
+                            (UCHAR)(Uart->Lcr & UART_LCR_FORMAT));
+        }
+    }
+
+    if (Uart->TxCount) {
+        UartStartShift (Uart, End);
+    } else if (Uart->Mcr & UART_MCR_RTS) {
+        Uart->EmptySince = End;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550Receive
+//
+// Description:
+//  A character has arrived at the receiver (its stop bit is in). A full
+//  RX FIFO loses it, in 8250 mode it overwrites the unread one; either
+//  way the overrun bit is set.
+//
+// Arguments:
+//      Uart    - The UART
+//      Data    - The character
+//      Flags   - LSR error bits that go with it
+//      Now     - Simulated time in ns
+//
+// Return Value:
+//      none
+//
+VOID Uart16550Receive (IN PUART16550 Uart, IN UCHAR Data, IN UCHAR Flags, IN ULONGLONG Now)
+{
+    ULONG   Index;
+
+    Data &= (UCHAR)((1 << (5 + (Uart->Lcr & LCR_EIGHT_BITS_PER_WORD))) - 1);
+    Uart->Stats.RxChars++;
+
+    if (Uart->RxCount < (Uart->FifoEnabled ? UART_FIFO_SIZE : 1)) {
+        Index = (Uart->RxHead + Uart->RxCount) % UART_FIFO_SIZE;
+        Uart->RxCount++;
+    } else {
+        Uart->RxOverrun = TRUE;
+        Uart->Stats.RxOverruns++;
+
+        if (Uart->FifoEnabled) {
+            return;
+        }
+        Index = Uart->RxHead;
+    }
+
+    Uart->RxData[Index] = Data;
+    Uart->RxFlags[Index] = Flags & LSR_RX_ERROR_MASK;
+
+    //
+    // Each character restarts the character timeout
+    //
+    if (Uart->FifoEnabled) {
+        Uart->RxTimeoutAt = Now + UART_TIMEOUT_CHARS * Uart16550CharTime (Uart);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550NextEvent
+//
+// Description:
+//  When the UART changes state by itself next: the character in the shift
+//  register is done, or the RX FIFO character timeout expires.
+//
+// Arguments:
+//      Uart    - The UART
+//
+// Return Value:
+//      Simulated time in ns, UART_NEVER if nothing is going on
+//
+ULONGLONG Uart16550NextEvent (IN PUART16550 Uart)
+{
+    ULONGLONG   Next = UART_NEVER;
+
+    if (Uart->Shifting) {
+        Next = Uart->ShiftEnd;
+    }
+
+    if (Uart->FifoEnabled && Uart->RxCount && !Uart->RxTimeout &&
+        Uart->RxTimeoutAt && (Uart->RxTimeoutAt < Next)) {
+        Next = Uart->RxTimeoutAt;
+    }
+
+    return Next;
+}
+
+
+//---------------------------------------------------------------------------
+// Uart16550Advance
+//
+// Description:
+//  Runs the UART up to Now: finishes characters in the shift register and
+//  raises the character timeout.
+//
+// Arguments:
+//      Uart    - The UART
+//      Now     - Simulated time in ns
+//
+// Return Value:
+//      none
+//
+VOID Uart16550Advance (IN PUART16550 Uart, IN ULONGLONG Now)
+{
+    for (;;) {
+        if (Uart->Shifting && (Uart->ShiftEnd <= Now)) {
+            UartShiftDone (Uart);
+        } else if (Uart->FifoEnabled && Uart->RxCount && !Uart->RxTimeout &&
+                   Uart->RxTimeoutAt && (Uart->RxTimeoutAt <= Now)) {
+            Uart->RxTimeout = TRUE;
+        } else {
+            break;
+        }
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// UartBusInitialize / UartBusAttach
+//
+// Description:
+//  Sets up an idle bus, and connects a UART (its transceiver) to it.
+//
+// Arguments:
+//      Bus     - The bus
+//      Uart    - The UART
+//
+// Return Value:
+//      none
+//
+VOID UartBusInitialize (OUT PUART_BUS Bus)
+{
+    RtlZeroMemory (Bus, sizeof(UART_BUS));
+}
+
+VOID UartBusAttach (IN PUART_BUS Bus, IN PUART16550 Uart)
+{
+    if (Bus->NodeCount < UART_MAX_NODES) {
+        Bus->Nodes[Bus->NodeCount++] = Uart;
+        Uart->Bus = Bus;
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// UartBusCharTime
+//
+// Description:
+//  Character time of a remote station.
+//
+// Arguments:
+//      BaudRate    - Line speed
+//      Format      - LCR format bits
+//
+// Return Value:
+//      Character time in ns
+//
+ULONGLONG UartBusCharTime (IN ULONG BaudRate, IN UCHAR Format)
+{
+    return (UartBits (Format) * 1000000000ULL + BaudRate - 1) / BaudRate;
+}
+
+
+//---------------------------------------------------------------------------
+// UartBusSendChar
+//
+// Description:
+//  Queues a character from a remote station, in time order.
+//
+// Arguments:
+//      Bus     - The bus
+//      Char    - The character and when it's done
+//
+// Return Value:
+//      none
+//
+VOID UartBusSendChar (IN PUART_BUS Bus, IN PUART_BUS_CHAR Char)
+{
+    ULONG   i;
+
+    if (Bus->QueueCount == UART_BUS_QUEUE) {
+        Bus->Dropped++;
+        return;
+    }
+
+    i = Bus->QueueCount++;
+
+    while (i && (Bus->Queue[(Bus->QueueHead + i - 1) % UART_BUS_QUEUE].Time > Char->Time)) {
+        Bus->Queue[(Bus->QueueHead + i) % UART_BUS_QUEUE] =
+            Bus->Queue[(Bus->QueueHead + i - 1) % UART_BUS_QUEUE];
+        i--;
+    }
+
+    Bus->Queue[(Bus->QueueHead + i) % UART_BUS_QUEUE] = *Char;
+}
+
+
+//---------------------------------------------------------------------------
+// UartBusSend
+//
+// Description:
+//  Queues a back to back burst of characters from a remote station.
+//
+// Arguments:
+//      Bus         - The bus
+//      Data        - The characters
+//      Length      - How many
+//      Start       - Simulated time of the first start bit, in ns
+//      BaudRate    - Line speed
+//      Format      - LCR format bits
+//
+// Return Value:
+//      Simulated time the last stop bit is done
+//
+ULONGLONG UartBusSend (IN PUART_BUS Bus, IN const UCHAR *Data, IN ULONG Length,
+                       IN ULONGLONG Start, IN ULONG BaudRate, IN UCHAR Format)
+{
+    UART_BUS_CHAR Char;
+    ULONG   i;
+
+    Char.CharTime = UartBusCharTime (BaudRate, Format);
+    Char.Flags = 0;
+    Char.Format = Format & UART_LCR_FORMAT;
+    Char.Time = Start;
+
+    for (i = 0; i < Length; i++) {
+        Char.Time += Char.CharTime;
+        Char.Data = Data[i];
+        UartBusSendChar (Bus, &Char);
+    }
+
+    return Char.Time;
+}
+
+
+//---------------------------------------------------------------------------
+// UartBusNextEvent / UartBusAdvance
+//
+// Description:
+//  When the next remote character is done, and delivering the remote
+//  characters that are done by Now.
+//
+// Arguments:
+//      Bus     - The bus
+//      Now     - Simulated time in ns
+//
+// Return Value:
+//      Simulated time in ns, UART_NEVER if nothing is queued
+//
+ULONGLONG UartBusNextEvent (IN PUART_BUS Bus)
+{
+    return Bus->QueueCount ? Bus->Queue[Bus->QueueHead].Time : UART_NEVER;
+}
+
+VOID UartBusAdvance (IN PUART_BUS Bus, IN ULONGLONG Now)
+{
+    UART_BUS_CHAR Char;
+
+    while (Bus->QueueCount && (Bus->Queue[Bus->QueueHead].Time <= Now)) {
+        Char = Bus->Queue[Bus->QueueHead];
+        Bus->QueueHead = (Bus->QueueHead + 1) % UART_BUS_QUEUE;
+        Bus->QueueCount--;
+
+        UartBusDeliver (Bus, NULL, Char.Data, Char.Flags, Char.Time - Char.CharTime,
+                        Char.Time, Char.CharTime, Char.Format);
+    }
+}
+
+
+//---------------------------------------------------------------------------
+// UartBusDeliver
+//
+// Description:
+//  A character is done on the wire. Every receiver on the bus gets it
+//  (the sender too, if it hears its echo). A character that overlaps one
+//  from another station is garbled, and a receiver set to another speed
+//  (beyond UART_BAUD_TOLERANCE) or data format sees a framing error.
+//
+// Arguments:
+//      Bus         - The bus
+//      Source      - Sending UART, NULL for a remote station
+//      Data        - The character
+//      Flags       - LSR error bits that go with it
+//      Start       - Simulated time of the start bit, in ns
+//      End         - Simulated time the stop bit is done
+//      CharTime    - The sender's character time
+//      Format      - The sender's LCR format bits
+//
+// Return Value:
+//      none
+//
+VOID UartBusDeliver (IN PUART_BUS Bus, IN PVOID Source, IN UCHAR Data, IN UCHAR Flags,
+                     IN ULONGLONG Start, IN ULONGLONG End, IN ULONGLONG CharTime,
+                     IN UCHAR Format)
+{
+    PUART16550  Node;
+    ULONGLONG   NodeTime;
+    UCHAR       NodeFlags;
+    ULONG       i;
+
+    if (Bus->Characters && (Start < Bus->LastEnd) && (Source != Bus->LastSource)) {
+        Bus->Collisions++;
+        Flags |= LSR_RX_FRAMING_ERROR;
+    }
+
+    Bus->Characters++;
+    Bus->LastSource = Source;
+    if (End > Bus->LastEnd) {
+        Bus->LastEnd = End;
+    }
+
+    for (i = 0; i < Bus->NodeCount; i++) {
+        Node = Bus->Nodes[i];
+
+        if (((Node == Source) && !Node->Echo) || (Node->Mcr & UART_MCR_LOOPBACK)) {
+            continue;
+        }
+
+        NodeFlags = Flags;
+        NodeTime = Uart16550CharTime (Node);
+
+        if (((Node->Lcr & UART_LCR_FORMAT) != Format) ||
+            (((NodeTime > CharTime) ? NodeTime - CharTime : CharTime - NodeTime) *
+             UART_BAUD_TOLERANCE > CharTime)) {
+            NodeFlags |= LSR_RX_FRAMING_ERROR;
+        }
+
+        Uart16550Receive (Node, Data, NodeFlags, End);
+    }
+
+    if (Bus->Monitor != NULL) {
+        Bus->Monitor (Bus, Source, Data, Flags, End, Bus->MonitorContext);
+    }
+}
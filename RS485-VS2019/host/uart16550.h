@@ -0,0 +1,219 @@
+//-------------------------------------------------------------------------------------------------
+// UART16550.H
+//
+// BSD 3-Clause License
+// 
+// Copyright (c) 2022, Anthony Kempka
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// 1. Redistributions of source code must retain the above copyright notice, this
+//    list of conditions and the following disclaimer.
+// 
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+// 
+// 3. Neither the name of the copyright holder nor the names of its
+//    contributors may be used to endorse or promote products derived from
+//    this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+//
+// Description:
+// ------------
+// Register level model of a 16550A UART and of the RS-485 bus between UARTs,
+// for running the driver on a development host instead of Windows.
+//
+// The model covers the interrupt identification priorities, the line status
+// bits, the 16 byte RX and TX FIFOs with trigger levels and the character
+// timeout, character timing from the divisor latch and data format, and the
+// modem control outputs: RTS enables the RS-485 driver, OUT2 gates the IRQ
+// and loopback wires the transmitter to the receiver. Time is simulated, in
+// nanoseconds.
+//
+//-------------------------------------------------------------------------------------------------
+
+#ifndef _UART16550_H
+#define _UART16550_H
+
+#include "../Com8250.h"
+
+//
+// Model definitions
+//
+#define UART_FIFO_SIZE          FIFO_DEPTH_16550
+#define UART_REGISTERS          8           // I/O addresses per UART
+#define UART_TIMEOUT_CHARS      4           // RX FIFO character timeout
+#define UART_MAX_NODES          8           // UARTs on one bus
+#define UART_BUS_QUEUE          4096        // Characters a remote station can queue
+#define UART_NEVER              ((ULONGLONG)-1)
+
+//
+// The sender and receiver character times may differ this much (1/20,
+// 5%) before the receiver loses the stop bit
+//
+#define UART_BAUD_TOLERANCE     20
+
+//
+// MCR bits the model looks at that Com8250.h only has as set/clear pairs
+//
+#define UART_MCR_RTS            MCR_ACTIVATE_RTS
+#define UART_MCR_OUT2           MCR_ACTIVATE_GP02
+#define UART_MCR_LOOPBACK       MCR_ACTIVATE_LOOPBACK
+#define UART_MCR_MASK           0x1F
+
+//
+// LCR bits that describe the character on the wire (word length, stop
+// bits and parity)
+//
+#define UART_LCR_FORMAT         0x3F
+
+typedef struct _UART_BUS UART_BUS, *PUART_BUS;
+
+//
+// Counters kept by the model. Times are in nanoseconds.
+//
+typedef struct _UART_STATS {
+    ULONGLONG   RegisterReads;      // I/O port reads
+    ULONGLONG   RegisterWrites;     // I/O port writes
+    ULONGLONG   TxChars;            // Characters shifted out
+    ULONGLONG   RxChars;            // Characters into the receiver
+    ULONGLONG   RxOverruns;         // Characters lost to a full receiver
+    ULONGLONG   TxOverruns;         // THR writes with the transmitter full
+    ULONGLONG   Undriven;           // Characters shifted out with RTS off
+    ULONGLONG   Truncated;          // RTS dropped before the stop bit was out
+    ULONGLONG   RtsReleases;        // RTS dropped with the transmitter empty
+    ULONGLONG   RtsDeadTime;        // Transmitter empty to RTS dropped, total
+    ULONGLONG   RtsDeadMax;         // ... longest
+} UART_STATS, *PUART_STATS;
+
+//
+// One 16550A. The registers hold what was written, the rest of the state
+// is derived when read.
+//
+typedef struct _UART16550 {
+    ULONG       Base;               // First I/O address
+    ULONG       Irq;                // ISA IRQ line
+    ULONG       Clock;              // Input clock in Hz
+
+    UCHAR       Ier;
+    UCHAR       Lcr;
+    UCHAR       Mcr;
+    UCHAR       Msr;                // Deltas and current inputs
+    UCHAR       MsrInputs;          // CTS/DSR/RI/DCD pins outside loopback
+    UCHAR       Scr;
+    UCHAR       Dll;
+    UCHAR       Dlm;
+
+    BOOLEAN     FifoEnabled;
+    ULONG       RxTrigger;          // RX FIFO interrupt level
+
+    UCHAR       RxData[UART_FIFO_SIZE];
+    UCHAR       RxFlags[UART_FIFO_SIZE];    // LSR error bits per character
+    ULONG       RxHead;
+    ULONG       RxCount;
+    BOOLEAN     RxOverrun;          // Sticky until the LSR is read
+    ULONGLONG   RxTimeoutAt;        // Character timeout deadline (FIFO mode)
+    BOOLEAN     RxTimeout;          // Character timeout interrupt pending
+
+    UCHAR       TxData[UART_FIFO_SIZE];
+    ULONG       TxHead;
+    ULONG       TxCount;
+    BOOLEAN     ThrePending;        // THR empty interrupt pending
+
+    BOOLEAN     Shifting;           // A character is in the shift register
+    UCHAR       ShiftData;
+    BOOLEAN     ShiftDriven;        // RTS was on when it started
+    BOOLEAN     ShiftTruncated;     // RTS went off before it finished
+    ULONGLONG   ShiftStart;
+    ULONGLONG   ShiftEnd;
+    ULONGLONG   EmptySince;         // Transmitter empty with RTS on, 0 = no
+
+    BOOLEAN     Echo;               // Hears its own transmissions on the bus
+    PUART_BUS   Bus;
+    UART_STATS  Stats;
+} UART16550, *PUART16550;
+
+//
+// Called for every character that goes over the bus
+//
+typedef VOID UART_BUS_MONITOR (IN PUART_BUS Bus, IN PUART16550 Source,
+                               IN UCHAR Data, IN UCHAR Flags, IN ULONGLONG Time,
+                               IN PVOID Context);
+
+//
+// A character queued by a remote station (a node without a UART model)
+//
+typedef struct _UART_BUS_CHAR {
+    ULONGLONG   Time;               // When its stop bit is done
+    ULONGLONG   CharTime;
+    UCHAR       Data;
+    UCHAR       Flags;              // LSR error bits to force (parity, break)
+    UCHAR       Format;             // LCR format bits
+} UART_BUS_CHAR, *PUART_BUS_CHAR;
+
+//
+// An RS-485 bus: every node hears every character a node drives
+//
+struct _UART_BUS {
+    PUART16550  Nodes[UART_MAX_NODES];
+    ULONG       NodeCount;
+
+    UART_BUS_CHAR Queue[UART_BUS_QUEUE];    // Remote characters, in time order
+    ULONG       QueueHead;
+    ULONG       QueueCount;
+
+    PVOID       LastSource;         // Last character on the wire
+    ULONGLONG   LastEnd;
+
+    ULONGLONG   Characters;         // Characters on the wire
+    ULONGLONG   Collisions;         // Characters that overlapped another
+    ULONGLONG   Dropped;            // Remote characters that didn't fit the queue
+
+    UART_BUS_MONITOR *Monitor;
+    PVOID       MonitorContext;
+};
+
+//
+// The UART
+//
+VOID Uart16550Initialize (OUT PUART16550 Uart, IN ULONG Base, IN ULONG Irq, IN ULONG Clock);
+UCHAR Uart16550Read (IN PUART16550 Uart, IN ULONG Offset, IN ULONGLONG Now);
+VOID Uart16550Write (IN PUART16550 Uart, IN ULONG Offset, IN UCHAR Value, IN ULONGLONG Now);
+UCHAR Uart16550Iir (IN PUART16550 Uart);
+UCHAR Uart16550Lsr (IN PUART16550 Uart);
+BOOLEAN Uart16550Interrupt (IN PUART16550 Uart);
+ULONGLONG Uart16550CharTime (IN PUART16550 Uart);
+ULONGLONG Uart16550NextEvent (IN PUART16550 Uart);
+VOID Uart16550Advance (IN PUART16550 Uart, IN ULONGLONG Now);
+VOID Uart16550Receive (IN PUART16550 Uart, IN UCHAR Data, IN UCHAR Flags, IN ULONGLONG Now);
+
+//
+// The bus
+//
+VOID UartBusInitialize (OUT PUART_BUS Bus);
+VOID UartBusAttach (IN PUART_BUS Bus, IN PUART16550 Uart);
+ULONGLONG UartBusCharTime (IN ULONG BaudRate, IN UCHAR Format);
+ULONGLONG UartBusSend (IN PUART_BUS Bus, IN const UCHAR *Data, IN ULONG Length,
+                       IN ULONGLONG Start, IN ULONG BaudRate, IN UCHAR Format);
+VOID UartBusSendChar (IN PUART_BUS Bus, IN PUART_BUS_CHAR Char);
+ULONGLONG UartBusNextEvent (IN PUART_BUS Bus);
+VOID UartBusAdvance (IN PUART_BUS Bus, IN ULONGLONG Now);
+VOID UartBusDeliver (IN PUART_BUS Bus, IN PVOID Source, IN UCHAR Data, IN UCHAR Flags,
+                     IN ULONGLONG Start, IN ULONGLONG End, IN ULONGLONG CharTime,
+                     IN UCHAR Format);
+
+#endif // _UART16550_H